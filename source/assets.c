@@ -2,6 +2,18 @@
  * Asset manager
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #include "assets.h"
 #include "common.h"
 #include "util/error.h"
@@ -21,6 +33,12 @@ DgError AssetManagerInit(AssetManager *this) {
 		return DG_ERROR_FAILED;
 	}
 	
+	this->dir = NULL;
+	this->watch = -1;
+	this->watch_ids = NULL;
+	this->watch_dirs = NULL;
+	this->watch_count = 0;
+	
 	return DG_ERROR_SUCCESS;
 }
 
@@ -29,6 +47,17 @@ void AssetManagerFree(AssetManager *this) {
 	DgTableFree(&this->loaders, true);
 	DgTableFree(&this->assets, true);
 	DgMemoryFree(this->dir);
+	
+	if (this->watch >= 0) {
+		close(this->watch);
+	}
+	
+	for (size_t i = 0; i < this->watch_count; i++) {
+		DgMemoryFree(this->watch_dirs[i]);
+	}
+	
+	DgMemoryFree(this->watch_ids);
+	DgMemoryFree(this->watch_dirs);
 }
 
 DgError AssetManagerSetSource(AssetManager *this, int source_type, const char *path) {
@@ -233,3 +262,289 @@ void AssetManagerRelease(AssetManager *this, Asset asset) {
 	 * Decrement the reference count on the asset
 	 */
 }
+
+static char *AssetManager_GetPath(AssetManager *this, const char *name) {
+	return DgStringConcatinateL(DgStringConcatinate(this->dir, "/"), name);
+}
+
+void *AssetManagerMapFile(AssetManager *this, const char *name, size_t *size) {
+	/**
+	 * Map a file from the asset directory into memory instead of reading it.
+	 * The mapping is private and writable, but changes are never written
+	 * back to the file.
+	 * 
+	 * @param this Asset manager
+	 * @param name Name of the file
+	 * @param size Set to the size of the file
+	 * @return Mapped data, or NULL if the file couldn't be mapped
+	 */
+	
+	static uint8_t empty[1];
+	
+	char *path = AssetManager_GetPath(this, name);
+	
+	if (!path) {
+		return NULL;
+	}
+	
+	int fd = open(path, O_RDONLY);
+	
+	DgMemoryFree(path);
+	
+	if (fd < 0) {
+		return NULL;
+	}
+	
+	struct stat info;
+	void *data = NULL;
+	
+	if (fstat(fd, &info) == 0) {
+		*size = info.st_size;
+		
+		if (info.st_size == 0) {
+			// Zero length mappings aren't allowed
+			data = empty;
+		}
+		else {
+			data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			data = (data == MAP_FAILED) ? NULL : data;
+		}
+	}
+	
+	close(fd);
+	
+	return data;
+}
+
+void AssetManagerUnmapFile(AssetManager *this, void *data, size_t size) {
+	/**
+	 * Unmap a file mapped with AssetManagerMapFile
+	 */
+	
+	if (data && size) {
+		munmap(data, size);
+	}
+}
+
+DgError AssetManagerWriteFile(AssetManager *this, const char *name, const void *data, size_t size) {
+	/**
+	 * Write a file to the asset directory. The file is written under a
+	 * temporary name and renamed over the old one, so anything that has the
+	 * old file mapped keeps seeing the old contents.
+	 */
+	
+	char *path = AssetManager_GetPath(this, name);
+	char *temp = path ? DgStringConcatinate(path, ".tmp") : NULL;
+	DgError status = DG_ERROR_FAILED;
+	
+	if (!temp) {
+		goto done;
+	}
+	
+	FILE *file = fopen(temp, "wb");
+	
+	if (!file) {
+		goto done;
+	}
+	
+	size_t written = fwrite(data, 1, size, file);
+	
+	if (fclose(file) || written != size || rename(temp, path)) {
+		remove(temp);
+		goto done;
+	}
+	
+	status = DG_ERROR_SUCCESS;
+
+done:
+	DgMemoryFree(temp);
+	DgMemoryFree(path);
+	
+	return status;
+}
+
+#ifdef __linux__
+static DgError AssetManager_WatchDirectory(AssetManager *this, const char *name) {
+	/**
+	 * Watch a directory in the asset directory ("" for the asset directory
+	 * itself) and the directories in it, since inotify only watches the files
+	 * directly in a directory.
+	 */
+	
+	char *path = name[0] ? AssetManager_GetPath(this, name) : DgStringDuplicate(this->dir);
+	
+	if (!path) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	int id = inotify_add_watch(this->watch, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+	
+	if (id < 0) {
+		DgMemoryFree(path);
+		return DG_ERROR_FAILED;
+	}
+	
+	int *ids = DgMemoryReallocate(this->watch_ids, sizeof *ids * (this->watch_count + 1));
+	this->watch_ids = ids ? ids : this->watch_ids;
+	
+	char **dirs = DgMemoryReallocate(this->watch_dirs, sizeof *dirs * (this->watch_count + 1));
+	this->watch_dirs = dirs ? dirs : this->watch_dirs;
+	
+	char *dir = DgStringDuplicate(name);
+	
+	if (!ids || !dirs || !dir) {
+		DgMemoryFree(dir);
+		DgMemoryFree(path);
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	this->watch_ids[this->watch_count] = id;
+	this->watch_dirs[this->watch_count] = dir;
+	this->watch_count++;
+	
+	DIR *listing = opendir(path);
+	
+	DgMemoryFree(path);
+	
+	if (!listing) {
+		return DG_ERROR_SUCCESS;
+	}
+	
+	struct dirent *entry;
+	
+	while ((entry = readdir(listing))) {
+		if (entry->d_name[0] == '.' || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+			continue;
+		}
+		
+		char *child = name[0] ? DgStringConcatinateL(DgStringConcatinate(name, "/"), entry->d_name) : DgStringDuplicate(entry->d_name);
+		
+		if (child) {
+			// Fails harmlessly for files when the type wasn't known
+			AssetManager_WatchDirectory(this, child);
+			DgMemoryFree(child);
+		}
+	}
+	
+	closedir(listing);
+	
+	return DG_ERROR_SUCCESS;
+}
+#endif
+
+DgError AssetManagerWatch(AssetManager *this) {
+	/**
+	 * Start watching the asset directory for files that are written, so that
+	 * AssetManagerPollChanges() can report them. This is only supported on
+	 * Linux for now.
+	 */
+
+#ifdef __linux__
+	if (!this->dir) {
+		return DG_ERROR_FAILED;
+	}
+	
+	if (this->watch >= 0) {
+		return DG_ERROR_SUCCESS;
+	}
+	
+	this->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	
+	if (this->watch < 0) {
+		return DG_ERROR_FAILED;
+	}
+	
+	return AssetManager_WatchDirectory(this, "");
+#else
+	return DG_ERROR_FAILED;
+#endif
+}
+
+void AssetManagerPollChanges(AssetManager *this, void (*changed)(void *context, const char *name), void *context) {
+	/**
+	 * Report files in the asset directory that were written since the last
+	 * poll. A file that was written several times is only reported once.
+	 * This never blocks, and does nothing if the directory isn't watched.
+	 *
+	 * @param this Asset manager
+	 * @param changed Called with the name of each file that changed
+	 * @param context Passed to `changed`
+	 */
+
+#ifdef __linux__
+	if (this->watch < 0) {
+		return;
+	}
+	
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char *names[32];
+	size_t name_count = 0;
+	ssize_t length;
+	
+	while ((length = read(this->watch, buffer, sizeof buffer)) > 0) {
+		const struct inotify_event *event;
+		
+		for (char *at = buffer; at < buffer + length; at += sizeof *event + event->len) {
+			event = (const struct inotify_event *) at;
+			
+			if (!event->len) {
+				continue;
+			}
+			
+			const char *dir = NULL;
+			
+			for (size_t i = 0; i < this->watch_count; i++) {
+				if (this->watch_ids[i] == event->wd) {
+					dir = this->watch_dirs[i];
+					break;
+				}
+			}
+			
+			if (!dir) {
+				continue;
+			}
+			
+			char *name = dir[0] ? DgStringConcatinateL(DgStringConcatinate(dir, "/"), event->name) : DgStringDuplicate(event->name);
+			
+			if (!name) {
+				continue;
+			}
+			
+			if (event->mask & IN_ISDIR) {
+				// New directories are watched too, but they aren't changes
+				AssetManager_WatchDirectory(this, name);
+				DgMemoryFree(name);
+				continue;
+			}
+			
+			if (event->mask & IN_CREATE) {
+				// Wait until whoever made the file has finished writing it
+				DgMemoryFree(name);
+				continue;
+			}
+			
+			bool seen = false;
+			
+			for (size_t i = 0; i < name_count && !seen; i++) {
+				seen = !strcmp(names[i], name);
+			}
+			
+			if (seen) {
+				DgMemoryFree(name);
+			}
+			else if (name_count < sizeof names / sizeof *names) {
+				names[name_count++] = name;
+			}
+			else {
+				changed(context, name);
+				DgMemoryFree(name);
+			}
+		}
+	}
+	
+	for (size_t i = 0; i < name_count; i++) {
+		changed(context, names[i]);
+		DgMemoryFree(names[i]);
+	}
+#endif
+}
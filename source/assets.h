@@ -72,6 +72,12 @@ typedef struct AssetManager {
 	DgTable loaders;
 	DgTable assets;
 	const char *dir;
+	
+	// Watching the asset directory for changes, see AssetManagerWatch
+	int watch;
+	int *watch_ids;
+	char **watch_dirs;
+	size_t watch_count;
 } AssetManager;
 
 enum {
@@ -84,3 +90,8 @@ DgError AssetManagerSetSource(AssetManager *this, int source_type, const char *p
 DgError AssetManagerAddType(AssetManager *this, AssetType *type);
 DgError AssetManagerAddLoader(AssetManager *this, const char *ext, AssetLoader *loader);
 Asset AssetManagerLoad(AssetManager *this, AssetTypeName type, const char *name);
+void *AssetManagerMapFile(AssetManager *this, const char *name, size_t *size);
+void AssetManagerUnmapFile(AssetManager *this, void *data, size_t size);
+DgError AssetManagerWriteFile(AssetManager *this, const char *name, const void *data, size_t size);
+DgError AssetManagerWatch(AssetManager *this);
+void AssetManagerPollChanges(AssetManager *this, void (*changed)(void *context, const char *name), void *context);
@@ -0,0 +1,595 @@
+/**
+ * Compressed bitmaps of 32-bit values (roaring bitmaps)
+ */
+
+#include <string.h>
+
+#include "common.h"
+
+#include "bitmap.h"
+
+// Containers
+
+static void BitmapContainerFree(BitmapContainer *this) {
+	if (this->dense) {
+		DgMemoryFree(this->words);
+	}
+	else {
+		DgMemoryFree(this->values);
+	}
+}
+
+static size_t BitmapContainerFind(const BitmapContainer *this, uint16_t low) {
+	/**
+	 * Find where a value is, or would go, in an array container
+	 */
+	
+	size_t start = 0;
+	size_t end = this->cardinality;
+	
+	while (start < end) {
+		size_t middle = (start + end) / 2;
+		
+		if (this->values[middle] < low) {
+			start = middle + 1;
+		}
+		else {
+			end = middle;
+		}
+	}
+	
+	return start;
+}
+
+static bool BitmapContainerToDense(BitmapContainer *this) {
+	uint64_t *words = DgMemoryAllocate(sizeof *words * BITMAP_WORDS);
+	
+	if (!words) {
+		return false;
+	}
+	
+	memset(words, 0, sizeof *words * BITMAP_WORDS);
+	
+	for (uint32_t i = 0; i < this->cardinality; i++) {
+		words[this->values[i] >> 6] |= 1ull << (this->values[i] & 63);
+	}
+	
+	DgMemoryFree(this->values);
+	this->words = words;
+	this->dense = true;
+	this->capacity = 0;
+	
+	return true;
+}
+
+static bool BitmapContainerToArray(BitmapContainer *this) {
+	uint16_t *values = DgMemoryAllocate(sizeof *values * (this->cardinality ? this->cardinality : 1));
+	
+	if (!values) {
+		return false;
+	}
+	
+	uint32_t count = 0;
+	
+	for (uint32_t i = 0; i < BITMAP_WORDS; i++) {
+		for (uint64_t word = this->words[i]; word; word &= word - 1) {
+			values[count++] = (i << 6) | __builtin_ctzll(word);
+		}
+	}
+	
+	DgMemoryFree(this->words);
+	this->values = values;
+	this->dense = false;
+	this->capacity = this->cardinality;
+	
+	return true;
+}
+
+static bool BitmapContainerAdd(BitmapContainer *this, uint16_t low) {
+	if (!this->dense) {
+		size_t at = BitmapContainerFind(this, low);
+		
+		if (at < this->cardinality && this->values[at] == low) {
+			return true;
+		}
+		
+		if (this->cardinality < BITMAP_ARRAY_MAX) {
+			if (this->cardinality >= this->capacity) {
+				uint32_t new_capacity = this->capacity ? 2 * this->capacity : 4;
+				uint16_t *new_values = DgMemoryReallocate(this->values, sizeof *new_values * new_capacity);
+				
+				if (!new_values) {
+					return false;
+				}
+				
+				this->values = new_values;
+				this->capacity = new_capacity;
+			}
+			
+			memmove(this->values + at + 1, this->values + at, sizeof *this->values * (this->cardinality - at));
+			this->values[at] = low;
+			this->cardinality++;
+			
+			return true;
+		}
+		
+		if (!BitmapContainerToDense(this)) {
+			return false;
+		}
+	}
+	
+	uint64_t bit = 1ull << (low & 63);
+	
+	if (!(this->words[low >> 6] & bit)) {
+		this->words[low >> 6] |= bit;
+		this->cardinality++;
+	}
+	
+	return true;
+}
+
+static void BitmapContainerRemove(BitmapContainer *this, uint16_t low) {
+	if (!this->dense) {
+		size_t at = BitmapContainerFind(this, low);
+		
+		if (at < this->cardinality && this->values[at] == low) {
+			memmove(this->values + at, this->values + at + 1, sizeof *this->values * (this->cardinality - at - 1));
+			this->cardinality--;
+		}
+		
+		return;
+	}
+	
+	uint64_t bit = 1ull << (low & 63);
+	
+	if (this->words[low >> 6] & bit) {
+		this->words[low >> 6] &= ~bit;
+		this->cardinality--;
+	}
+	
+	// Only go back to an array well under the limit, so that a container at
+	// the limit doesn't convert back and forth
+	if (this->cardinality <= BITMAP_ARRAY_MAX / 2) {
+		BitmapContainerToArray(this);
+	}
+}
+
+static bool BitmapContainerContains(const BitmapContainer *this, uint16_t low) {
+	if (this->dense) {
+		return (this->words[low >> 6] >> (low & 63)) & 1;
+	}
+	
+	size_t at = BitmapContainerFind(this, low);
+	
+	return at < this->cardinality && this->values[at] == low;
+}
+
+static bool BitmapContainerCopy(BitmapContainer *this, const BitmapContainer *other) {
+	*this = *other;
+	
+	size_t size = other->dense ? sizeof(uint64_t) * BITMAP_WORDS : sizeof(uint16_t) * other->cardinality;
+	void *data = DgMemoryAllocate(size ? size : 1);
+	
+	if (!data) {
+		return false;
+	}
+	
+	memcpy(data, other->dense ? (void *) other->words : (void *) other->values, size);
+	
+	if (other->dense) {
+		this->words = data;
+	}
+	else {
+		this->values = data;
+		this->capacity = other->cardinality;
+	}
+	
+	return true;
+}
+
+static bool BitmapContainerFilter(BitmapContainer *this, const BitmapContainer *array, const BitmapContainer *dense, bool keep) {
+	/**
+	 * Make an array container of the values in `array` that are (or with
+	 * `keep` false, aren't) in the dense container
+	 */
+	
+	this->values = DgMemoryAllocate(sizeof *this->values * (array->cardinality ? array->cardinality : 1));
+	
+	if (!this->values) {
+		return false;
+	}
+	
+	this->capacity = array->cardinality;
+	
+	for (uint32_t i = 0; i < array->cardinality; i++) {
+		uint16_t low = array->values[i];
+		
+		if (((dense->words[low >> 6] >> (low & 63)) & 1) == keep) {
+			this->values[this->cardinality++] = low;
+		}
+	}
+	
+	return true;
+}
+
+static bool BitmapContainerMerge(BitmapContainer *this, const BitmapContainer *a, const BitmapContainer *b, bool intersect) {
+	/**
+	 * Intersect two array containers, or subtract the second from the first
+	 */
+	
+	uint32_t capacity = intersect && b->cardinality < a->cardinality ? b->cardinality : a->cardinality;
+	
+	this->values = DgMemoryAllocate(sizeof *this->values * (capacity ? capacity : 1));
+	
+	if (!this->values) {
+		return false;
+	}
+	
+	this->capacity = capacity;
+	
+	uint32_t i = 0, j = 0;
+	
+	while (i < a->cardinality) {
+		if (j >= b->cardinality || a->values[i] < b->values[j]) {
+			if (!intersect) {
+				this->values[this->cardinality++] = a->values[i];
+			}
+			
+			i++;
+		}
+		else if (a->values[i] > b->values[j]) {
+			j++;
+		}
+		else {
+			if (intersect) {
+				this->values[this->cardinality++] = a->values[i];
+			}
+			
+			i++;
+			j++;
+		}
+	}
+	
+	return true;
+}
+
+static bool BitmapContainerWords(BitmapContainer *this, const BitmapContainer *a, const BitmapContainer *b, bool intersect) {
+	/**
+	 * Intersect two dense containers, or subtract the second from the first.
+	 * These loops are plain enough for the compiler to vectorise.
+	 */
+	
+	this->words = DgMemoryAllocate(sizeof *this->words * BITMAP_WORDS);
+	
+	if (!this->words) {
+		return false;
+	}
+	
+	this->dense = true;
+	
+	uint32_t cardinality = 0;
+	
+	if (intersect) {
+		for (uint32_t i = 0; i < BITMAP_WORDS; i++) {
+			this->words[i] = a->words[i] & b->words[i];
+			cardinality += __builtin_popcountll(this->words[i]);
+		}
+	}
+	else {
+		for (uint32_t i = 0; i < BITMAP_WORDS; i++) {
+			this->words[i] = a->words[i] & ~b->words[i];
+			cardinality += __builtin_popcountll(this->words[i]);
+		}
+	}
+	
+	this->cardinality = cardinality;
+	
+	return cardinality > BITMAP_ARRAY_MAX || BitmapContainerToArray(this);
+}
+
+static bool BitmapContainerCombine(BitmapContainer *this, const BitmapContainer *a, const BitmapContainer *b, bool intersect) {
+	memset(this, 0, sizeof *this);
+	this->key = a->key;
+	
+	if (a->dense && b->dense) {
+		return BitmapContainerWords(this, a, b, intersect);
+	}
+	else if (!a->dense && !b->dense) {
+		return BitmapContainerMerge(this, a, b, intersect);
+	}
+	else if (!a->dense) {
+		return BitmapContainerFilter(this, a, b, intersect);
+	}
+	else if (intersect) {
+		return BitmapContainerFilter(this, b, a, true);
+	}
+	
+	// Dense minus an array
+	if (!BitmapContainerCopy(this, a)) {
+		return false;
+	}
+	
+	for (uint32_t i = 0; i < b->cardinality; i++) {
+		BitmapContainerRemove(this, b->values[i]);
+	}
+	
+	return true;
+}
+
+// Bitmaps
+
+static size_t BitmapFind(const Bitmap *this, uint32_t key) {
+	size_t start = 0;
+	size_t end = this->count;
+	
+	while (start < end) {
+		size_t middle = (start + end) / 2;
+		
+		if (this->containers[middle].key < key) {
+			start = middle + 1;
+		}
+		else {
+			end = middle;
+		}
+	}
+	
+	return start;
+}
+
+static BitmapContainer *BitmapInsert(Bitmap *this, size_t at, uint32_t key) {
+	/**
+	 * Insert an empty container before the container at `at`
+	 */
+	
+	if (this->count >= this->capacity) {
+		size_t new_capacity = this->capacity ? 2 * this->capacity : 4;
+		BitmapContainer *new_containers = DgMemoryReallocate(this->containers, sizeof *new_containers * new_capacity);
+		
+		if (!new_containers) {
+			return NULL;
+		}
+		
+		this->containers = new_containers;
+		this->capacity = new_capacity;
+	}
+	
+	memmove(this->containers + at + 1, this->containers + at, sizeof *this->containers * (this->count - at));
+	this->count++;
+	
+	BitmapContainer *container = &this->containers[at];
+	memset(container, 0, sizeof *container);
+	container->key = key;
+	
+	return container;
+}
+
+static bool BitmapAppend(Bitmap *this, BitmapContainer *container) {
+	/**
+	 * Take ownership of a container with a key after all the others. Empty
+	 * containers are freed instead.
+	 */
+	
+	if (!container->cardinality) {
+		BitmapContainerFree(container);
+		return true;
+	}
+	
+	BitmapContainer *end = BitmapInsert(this, this->count, container->key);
+	
+	if (!end) {
+		BitmapContainerFree(container);
+		return false;
+	}
+	
+	*end = *container;
+	
+	return true;
+}
+
+void BitmapInit(Bitmap *this) {
+	this->containers = NULL;
+	this->count = 0;
+	this->capacity = 0;
+}
+
+void BitmapFree(Bitmap *this) {
+	BitmapClear(this);
+	DgMemoryFree(this->containers);
+	BitmapInit(this);
+}
+
+void BitmapClear(Bitmap *this) {
+	/**
+	 * Remove every value, keeping the container list's memory
+	 */
+	
+	for (size_t i = 0; i < this->count; i++) {
+		BitmapContainerFree(&this->containers[i]);
+	}
+	
+	this->count = 0;
+}
+
+bool BitmapAdd(Bitmap *this, uint32_t value) {
+	/**
+	 * Add a value to a bitmap
+	 *
+	 * @return If it could be added, which only fails when out of memory
+	 */
+	
+	uint32_t key = value >> 16;
+	size_t at = BitmapFind(this, key);
+	BitmapContainer *container;
+	
+	if (at < this->count && this->containers[at].key == key) {
+		container = &this->containers[at];
+	}
+	else if (!(container = BitmapInsert(this, at, key))) {
+		return false;
+	}
+	
+	if (!BitmapContainerAdd(container, value & 0xffff)) {
+		if (!container->cardinality) {
+			BitmapContainerFree(container);
+			memmove(container, container + 1, sizeof *container * (this->count - at - 1));
+			this->count--;
+		}
+		
+		return false;
+	}
+	
+	return true;
+}
+
+void BitmapRemove(Bitmap *this, uint32_t value) {
+	uint32_t key = value >> 16;
+	size_t at = BitmapFind(this, key);
+	
+	if (at >= this->count || this->containers[at].key != key) {
+		return;
+	}
+	
+	BitmapContainer *container = &this->containers[at];
+	BitmapContainerRemove(container, value & 0xffff);
+	
+	if (!container->cardinality) {
+		BitmapContainerFree(container);
+		memmove(container, container + 1, sizeof *container * (this->count - at - 1));
+		this->count--;
+	}
+}
+
+bool BitmapContains(const Bitmap *this, uint32_t value) {
+	uint32_t key = value >> 16;
+	size_t at = BitmapFind(this, key);
+	
+	return at < this->count && this->containers[at].key == key && BitmapContainerContains(&this->containers[at], value & 0xffff);
+}
+
+size_t BitmapCardinality(const Bitmap *this) {
+	size_t cardinality = 0;
+	
+	for (size_t i = 0; i < this->count; i++) {
+		cardinality += this->containers[i].cardinality;
+	}
+	
+	return cardinality;
+}
+
+bool BitmapCopy(Bitmap *this, const Bitmap *other) {
+	/**
+	 * Replace the values of a bitmap with the values of another one
+	 */
+	
+	BitmapClear(this);
+	
+	for (size_t i = 0; i < other->count; i++) {
+		BitmapContainer copy;
+		
+		if (!BitmapContainerCopy(&copy, &other->containers[i]) || !BitmapAppend(this, &copy)) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool BitmapAnd(Bitmap *this, const Bitmap *a, const Bitmap *b) {
+	/**
+	 * Set a bitmap to the values in both `a` and `b`. It can't be either of
+	 * them.
+	 *
+	 * @return If there was enough memory
+	 */
+	
+	BitmapClear(this);
+	
+	size_t i = 0, j = 0;
+	
+	while (i < a->count && j < b->count) {
+		if (a->containers[i].key < b->containers[j].key) {
+			i++;
+		}
+		else if (a->containers[i].key > b->containers[j].key) {
+			j++;
+		}
+		else {
+			BitmapContainer result;
+			
+			if (!BitmapContainerCombine(&result, &a->containers[i], &b->containers[j], true) || !BitmapAppend(this, &result)) {
+				return false;
+			}
+			
+			i++;
+			j++;
+		}
+	}
+	
+	return true;
+}
+
+bool BitmapAndNot(Bitmap *this, const Bitmap *a, const Bitmap *b) {
+	/**
+	 * Set a bitmap to the values in `a` that aren't in `b`. It can't be
+	 * either of them.
+	 *
+	 * @return If there was enough memory
+	 */
+	
+	BitmapClear(this);
+	
+	size_t j = 0;
+	
+	for (size_t i = 0; i < a->count; i++) {
+		while (j < b->count && b->containers[j].key < a->containers[i].key) {
+			j++;
+		}
+		
+		BitmapContainer result;
+		bool ok;
+		
+		if (j < b->count && b->containers[j].key == a->containers[i].key) {
+			ok = BitmapContainerCombine(&result, &a->containers[i], &b->containers[j], false);
+		}
+		else {
+			ok = BitmapContainerCopy(&result, &a->containers[i]);
+		}
+		
+		if (!ok || !BitmapAppend(this, &result)) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+size_t BitmapValues(const Bitmap *this, uint32_t *values) {
+	/**
+	 * Write every value of a bitmap in order. There must be room for
+	 * BitmapCardinality() values.
+	 *
+	 * @return Number of values written
+	 */
+	
+	size_t count = 0;
+	
+	for (size_t i = 0; i < this->count; i++) {
+		const BitmapContainer *container = &this->containers[i];
+		uint32_t high = container->key << 16;
+		
+		if (container->dense) {
+			for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+				for (uint64_t word = container->words[w]; word; word &= word - 1) {
+					values[count++] = high | (w << 6) | __builtin_ctzll(word);
+				}
+			}
+		}
+		else {
+			for (uint32_t k = 0; k < container->cardinality; k++) {
+				values[count++] = high | container->values[k];
+			}
+		}
+	}
+	
+	return count;
+}
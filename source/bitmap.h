@@ -0,0 +1,51 @@
+/**
+ * Compressed bitmaps of 32-bit values (roaring bitmaps)
+ */
+
+#pragma once
+
+#include "common.h"
+
+// Containers switch between a sorted array and a plain bitmap at this many
+// values, which is where both take 8 KiB
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS 1024
+
+typedef struct BitmapContainer {
+	/**
+	 * The values in a bitmap that share their upper 16 bits
+	 */
+	
+	uint32_t key;         // Upper 16 bits of the values
+	uint32_t cardinality; // Number of values
+	uint32_t capacity;    // Of the array, if it's not dense
+	bool dense;           // Is a plain bitmap of BITMAP_WORDS words
+	union {
+		uint16_t *values; // Sorted lower 16 bits
+		uint64_t *words;
+	};
+} BitmapContainer;
+
+typedef struct Bitmap {
+	/**
+	 * A set of 32-bit values, split by their upper 16 bits into containers.
+	 * Sparse containers are sorted arrays and dense ones are plain bitmaps,
+	 * so operations on dense parts run over whole words.
+	 */
+	
+	BitmapContainer *containers; // Sorted by key
+	size_t count;
+	size_t capacity;
+} Bitmap;
+
+void BitmapInit(Bitmap *this);
+void BitmapFree(Bitmap *this);
+void BitmapClear(Bitmap *this);
+bool BitmapAdd(Bitmap *this, uint32_t value);
+void BitmapRemove(Bitmap *this, uint32_t value);
+bool BitmapContains(const Bitmap *this, uint32_t value);
+size_t BitmapCardinality(const Bitmap *this);
+bool BitmapCopy(Bitmap *this, const Bitmap *other);
+bool BitmapAnd(Bitmap *this, const Bitmap *a, const Bitmap *b);
+bool BitmapAndNot(Bitmap *this, const Bitmap *a, const Bitmap *b);
+size_t BitmapValues(const Bitmap *this, uint32_t *values);
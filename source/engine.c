@@ -1,13 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "util/error.h"
 #include "util/melon.h"
 // #include "util/storage_filesystem.h"
 #include "assets.h"
 #include "asset_text.h"
+#include "script.h"
 
 #include "engine.h"
 
 Engine *gEngine;
 
+// Shapes recorded by each job while gathering
+#define ENGINE_DRAW_CHUNK 512
+
+static void EngineLoadProperties(Engine *this) {
+	/**
+	 * Read Engine.properties from the asset directory. Each line is a
+	 * `key = value` pair, and lines starting with # are comments. Properties
+	 * that were already set are replaced.
+	 */
+	
+	size_t size;
+	char *data = AssetManagerMapFile(&this->assman, "Engine.properties", &size);
+	
+	if (!data) {
+		return;
+	}
+	
+	const char *end = data + size;
+	
+	for (const char *line = data, *next; line < end; line = next + 1) {
+		next = memchr(line, '\n', end - line);
+		next = next ? next : end;
+		
+		const char *equals = memchr(line, '=', next - line);
+		
+		if (line[0] == '#' || !equals) {
+			continue;
+		}
+		
+		const char *key = line, *key_end = equals, *value = equals + 1, *value_end = next;
+		
+		for (; key < key_end && (*key == ' ' || *key == '\t'); key++);
+		for (; key_end > key && (key_end[-1] == ' ' || key_end[-1] == '\t'); key_end--);
+		for (; value < value_end && (*value == ' ' || *value == '\t'); value++);
+		for (; value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t' || value_end[-1] == '\r'); value_end--);
+		
+		char key_buf[128], value_buf[512];
+		snprintf(key_buf, sizeof key_buf, "%.*s", (int) (key_end - key), key);
+		snprintf(value_buf, sizeof value_buf, "%.*s", (int) (value_end - value), value);
+		
+		DgValue k = DgMakeString(key_buf);
+		DgValue v = DgMakeString(value_buf);
+		
+		DgTablePut(&this->properties, &k, &v);
+	}
+	
+	AssetManagerUnmapFile(&this->assman, data, size);
+}
+
+const char *EngineGetProperty(Engine *this, const char *key, const char *fallback) {
+	/**
+	 * Get a property from Engine.properties, or `fallback` if it isn't set
+	 */
+	
+	DgValue k = DgMakeStaticString(key);
+	DgValue *v = DgTableAt(&this->properties, &k);
+	
+	return v ? v->data.asString : fallback;
+}
+
+static void EngineUpdateProfiler(Engine *this) {
+	/**
+	 * Start or stop the script profiler to match the `profile` property. The
+	 * samples are written to `profile.output` when it stops, as collapsed
+	 * stacks for flame graph tools.
+	 */
+	
+	bool wanted = !strcmp(EngineGetProperty(this, "profile", "off"), "on");
+	
+	if (wanted && !this->profiling) {
+		unsigned rate = strtoul(EngineGetProperty(this, "profile.rate", "997"), NULL, 10);
+		
+		if (!vm_profile_start(this->vm, rate)) {
+			DgLog(DG_LOG_ERROR, "Failed to start the script profiler");
+			return;
+		}
+		
+		DgLog(DG_LOG_INFO, "Started profiling scripts at %u samples per second", rate);
+		this->profiling = true;
+	}
+	else if (!wanted && this->profiling) {
+		vm_profile_stop(this->vm, EngineGetProperty(this, "profile.output", "profile.folded"));
+		this->profiling = false;
+	}
+}
+
+static void EngineStartHistory(Engine *this) {
+	/**
+	 * Keep the last `history.frames` frames of the Universe for rolling back
+	 * to, if it's set
+	 */
+	
+	size_t frames = strtoul(EngineGetProperty(this, "history.frames", "0"), NULL, 10);
+	
+	memset(&this->history, 0, sizeof this->history);
+	
+	if (frames && HistoryInit(&this->history, &this->universe, frames)) {
+		DgLog(DG_LOG_WARNING, "Can't keep %zu frames of history", frames);
+	}
+}
+
+static void EngineStartLockstep(Engine *this) {
+	/**
+	 * With `lockstep = on`, run so that the same inputs always give the same
+	 * frames: objects are ticked in slot order, scripts are told that
+	 * 1 / `lockstep.rate` seconds pass each frame instead of the real time,
+	 * and scripts aren't reloaded. If `lockstep.checksums` is set, the
+	 * checksum of the Universe after every frame is written to that file,
+	 * so runs can be compared to find the first frame they differ in.
+	 */
+	
+	const char *checksums = EngineGetProperty(this, "lockstep.checksums", NULL);
+	double rate = strtod(EngineGetProperty(this, "lockstep.rate", "60"), NULL);
+	
+	this->lockstep = !strcmp(EngineGetProperty(this, "lockstep", "off"), "on");
+	this->step = (rate > 0.0) ? 1.0 / rate : 1.0 / 60.0;
+	this->checksums = NULL;
+	
+	if (this->lockstep && checksums && !(this->checksums = fopen(checksums, "w"))) {
+		DgLog(DG_LOG_WARNING, "Can't write checksums to %s", checksums);
+	}
+	
+	UniverseSetOrdered(&this->universe, this->lockstep);
+}
+
 DgError EngineInit(Engine *this, DgArgs *args) {
 	DgInitTime();
 	
@@ -17,12 +148,53 @@ DgError EngineInit(Engine *this, DgArgs *args) {
 	AssetManagerSetSource(&this->assman, ASSET_SOURCE_FOLDER, "assets");
 	RegisterTextAssetTypeAndLoader(&this->assman);
 	
+	if (AssetManagerWatch(&this->assman)) {
+		DgLog(DG_LOG_WARNING, "Can't watch assets for changes, scripts won't be reloaded");
+	}
+	
 	DgTableInit(&this->properties);
+	EngineLoadProperties(this);
+	
+	this->vm = vm_create();
+	
+	if (!this->vm) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	// Nothing else may be made in the VM first, see UniverseInstall()
+	if (UniverseInit(&this->universe, this->vm)) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	EngineStartHistory(this);
+	EngineStartLockstep(this);
+	
+	this->profiling = false;
+	EngineUpdateProfiler(this);
+	
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = strtoul(EngineGetProperty(this, "jobs.threads", "-1"), NULL, 10);
+	
+	// By default there is a worker for each core but the main thread's
+	if (threads == (size_t) -1) {
+		threads = (cores > 1) ? cores - 1 : 0;
+	}
+	
+	if (JobsInit(&this->jobs, threads)) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	SchedulerInit(&this->scheduler, &this->jobs);
+	this->closing = false;
+	this->drawn = false;
+	this->draw_chunks = NULL;
+	this->draw_chunk_count = 0;
 	
 	DgWindowInit(&this->window, "New Engine", (DgVec2I) {1280, 720});
 	
 	RoContextCreateDW(&this->roc, DgWindowGetNativeDisplayHandle(&this->window), DgWindowGetNativeWindowHandle(&this->window));
 	
+	this->main = OID_NIL;
 	this->frames = 0;
 	
 	return DG_ERROR_SUCCESS;
@@ -30,48 +202,430 @@ DgError EngineInit(Engine *this, DgArgs *args) {
 
 const char *gMainScriptPath = "main.script";
 
+DgError EngineSaveImage(Engine *this, const char *name) {
+	/**
+	 * Write the whole script heap and the Universe to an image in the asset
+	 * directory, which EngineLoadImage() can restore. This must be called
+	 * between frames, and fails while a tick is suspended.
+	 */
+	
+	size_t size, universe_size;
+	void *universe = UniverseSave(&this->universe, &universe_size);
+	void *image = universe ? vm_image_save(this->vm, universe, universe_size, &size) : NULL;
+	
+	DgMemoryFree(universe);
+	
+	if (!image) {
+		DgLog(DG_LOG_ERROR, "Can't save an image while a script is running");
+		return DG_ERROR_FAILED;
+	}
+	
+	DgError err = AssetManagerWriteFile(&this->assman, name, image, size);
+	
+	DgMemoryFree(image);
+	
+	if (err) {
+		DgLog(DG_LOG_ERROR, "Failed to write image: %s", name);
+	}
+	
+	return err;
+}
+
+DgError EngineLoadImage(Engine *this, const char *name) {
+	/**
+	 * Replace the script heap with one saved by EngineSaveImage(). The main
+	 * script's prototype is looked up again in the new heap. Nothing changes
+	 * if the image is missing or can't be loaded.
+	 */
+	
+	size_t size;
+	void *image = AssetManagerMapFile(&this->assman, name, &size);
+	
+	if (!image) {
+		return DG_ERROR_FAILED;
+	}
+	
+	const void *universe;
+	size_t universe_size;
+	vm_context vm = vm_image_load(image, size, UniverseInstall, &universe, &universe_size);
+	
+	if (!vm) {
+		AssetManagerUnmapFile(&this->assman, image, size);
+		DgLog(DG_LOG_WARNING, "Image %s can't be loaded by this build", name);
+		return DG_ERROR_FAILED;
+	}
+	
+	// The profiler belongs to the old VM
+	if (this->profiling) {
+		vm_profile_stop(this->vm, NULL);
+		this->profiling = false;
+	}
+	
+	// Gathering reads the old Universe, and what it gathered may point into
+	// the old script heap
+	SchedulerWait(&this->scheduler);
+	this->drawn = false;
+	
+	HistoryFree(&this->history);
+	UniverseFree(&this->universe);
+	vm_release(this->vm, this->main);
+	vm_destroy(this->vm);
+	this->vm = vm;
+	this->main = vm_accquire(this->vm, ScriptPrototype(this->vm, gMainScriptPath));
+	
+	if (UniverseLoad(&this->universe, this->vm, universe, universe_size)) {
+		DgLog(DG_LOG_WARNING, "Image %s has no Universe", name);
+	}
+	
+	// Shapes aren't kept in images, and neither are frames
+	UniverseSetDrawer(&this->universe, vm_intern(this->vm, "getDrawShape"));
+	UniverseSetOrdered(&this->universe, this->lockstep);
+	EngineStartHistory(this);
+	
+	AssetManagerUnmapFile(&this->assman, image, size);
+	
+	EngineUpdateProfiler(this);
+	
+	return DG_ERROR_SUCCESS;
+}
+
 void EngineLoadMainScene(Engine *this) {
-	Text mainScriptText = LoadText(&this->assman, gMainScriptPath);
+	/**
+	 * Load the main script and run its init, or boot from `boot.image` if
+	 * it's set and the image exists. Without an image to boot from, one is
+	 * written once init is done.
+	 */
+	
+	const char *image = EngineGetProperty(this, "boot.image", NULL);
+	
+	if (image && !EngineLoadImage(this, image)) {
+		DgLog(DG_LOG_INFO, "Booted from image: %s", image);
+		return;
+	}
+	
+	this->main = vm_accquire(this->vm, ScriptLoad(&this->assman, this->vm, gMainScriptPath));
+	
+	if (this->main == OID_NIL) {
+		return;
+	}
+	
+	DgLog(DG_LOG_INFO, "Loaded main script: %s", gMainScriptPath);
 	
-	DgLog(DG_LOG_INFO, "Loaded main text asset: %s (size = %d)", gMainScriptPath, mainScriptText->size);
+	if (vm_responds_to(this->vm, this->main, vm_intern(this->vm, "init"))) {
+		vm_msg_send(this->vm, this->main, vm_intern(this->vm, "init"), 0, NULL);
+	}
+	
+	UniverseSetDrawer(&this->universe, vm_intern(this->vm, "getDrawShape"));
+	
+	if (image && !EngineSaveImage(this, image)) {
+		DgLog(DG_LOG_INFO, "Saved image: %s", image);
+	}
 }
 
-DgError EngineRun(Engine *this) {
+static void EngineAssetChanged(void *context, const char *name) {
+	/**
+	 * Reload scripts and properties when they are saved
+	 */
+	
+	Engine *this = context;
+	const char *ext = strrchr(name, '.');
+	
+	if (ext && !strcmp(ext, ".script")) {
+		ScriptReload(&this->assman, this->vm, name);
+	}
+	else if (!strcmp(name, "Engine.properties")) {
+		EngineLoadProperties(this);
+		EngineUpdateProfiler(this);
+	}
+}
+
+static void EnginePhaseInput(void *context) {
+	Engine *this = context;
+	
+	if (DgWindowUpdate(&this->window, NULL) == DG_WINDOW_SHOULD_CLOSE) {
+		this->closing = true;
+	}
+}
+
+static void EnginePhaseTick(void *context) {
+	Engine *this = context;
+	
+	// Only ticks can be suspended, since nothing waits for what they answer.
+	// Other sends that run out of budget are stopped.
+	vm_set_suspend(this->vm, true);
+	
+	// A tick that was suspended last frame finishes before another starts
+	if (!vm_resume(this->vm)) {
+		object_id time = OBJ_DOUBLE2ID(this->lockstep ? this->frames * this->step : DgTime());
+		
+		if (vm_responds_to(this->vm, this->main, this->tick)) {
+			vm_msg_send(this->vm, this->main, this->tick, 1, &time);
+		}
+		
+		UniverseTick(&this->universe, this->tick, time);
+	}
+	
+	vm_set_suspend(this->vm, false);
+}
+
+static void EnginePhaseDeliver(void *context) {
+	Engine *this = context;
+	
+	UniverseDeliver(&this->universe);
+}
+
+static void EnginePhaseUpdate(void *context) {
+	Engine *this = context;
+	
+	UniverseUpdate(&this->universe);
+}
+
+static void EnginePhaseRecord(void *context) {
+	Engine *this = context;
+	
+	if (this->history.universe) {
+		HistoryRecord(&this->history);
+	}
+}
+
+static void EnginePhaseChecksum(void *context) {
+	Engine *this = context;
+	
+	if (this->checksums) {
+		fprintf(this->checksums, "%zu %016llx\n", this->frames, (unsigned long long) UniverseChecksum(&this->universe));
+	}
+}
+
+static void EnginePhasePresent(void *context) {
+	/**
+	 * Draw what was gathered last. After that nothing points into the
+	 * shapes replaced since it was gathered, so their PackedArrays can be
+	 * unpinned, which has to happen here on the main thread.
+	 */
+	
+	Engine *this = context;
 	DgError err;
 	
-	EngineLoadMainScene(this);
+	if (this->drawn && (err = RoDrawEnd(&this->roc))) {
+		DgLog(DG_LOG_ERROR, "Error while finishing draw: %s.", DgErrorString(err));
+	}
 	
-	char pixels[] = {255, 255, 255, 0, 0, 0, 0, 0, 0, 255, 255, 255};
+	this->drawn = false;
+	UniverseReleaseShapes(&this->universe);
+}
+
+static bool EngineSameTexture(const char *a, const char *b) {
+	return (a && b) ? !strcmp(a, b) : (a == b);
+}
+
+static void EngineGatherChunk(void *context, size_t index) {
+	/**
+	 * Record the visible shapes of one chunk into its own command buffer.
+	 * Shapes in a row with the same texture are drawn together, except
+	 * shapes in PackedArrays, which are drawn from where they are.
+	 */
 	
-	RoUploadTexture(&this->roc, "swaping", RO_FORMAT_RGB, 2, 2, &pixels, 0);
+	Engine *this = context;
+	EngineDrawChunk *chunk = &this->draw_chunks[index];
+	UniverseShape **shapes = this->universe.shapes;
+	size_t start = index * ENGINE_DRAW_CHUNK;
+	size_t end = (start + ENGINE_DRAW_CHUNK < this->draw_count) ? start + ENGINE_DRAW_CHUNK : this->draw_count;
+	const char *texture = NULL;
+	size_t count = 0;
+	DgError err;
 	
-	while (!DgWindowShouldClose(&this->window)) {
-		double start = DgTime();
+	// There is no camera yet, so the view is clip space
+	SpatialBox view = {-1.0f, -1.0f, 1.0f, 1.0f};
+	
+	RoCommandBufferBegin(&chunk->buffer);
+	
+	for (size_t i = start; i <= end; i++) {
+		const UniverseShape *shape = (i < end) ? shapes[this->draw_slots[i]] : NULL;
 		
-		RoDrawBegin(&this->roc);
+		if (shape && shape->located && (shape->box.max_x < view.min_x || shape->box.min_x > view.max_x || shape->box.max_y < view.min_y || shape->box.min_y > view.max_y)) {
+			continue;
+		}
 		
-		float t = 2.0 * DgSin(0.25 * start);
+		const char *shape_texture = (shape && shape->texture[0]) ? shape->texture : NULL;
 		
-		RoVertex verts[] = {
-			(RoVertex) {-0.5 * t,  0.5 * t, 1.0, 0.0, 0.0, 255, 0, 0, 255},
-			(RoVertex) { 0.5 * t,  0.5 * t, 1.0, 0.0, 1.0, 0, 255, 0, 255},
-			(RoVertex) { 0.0 * t, -0.5 * t, 1.0, 1.0, 0.0, 0, 0, 255, 255},
-		};
+		if (count && (!shape || shape->packed != OID_NIL || !EngineSameTexture(texture, shape_texture))) {
+			if ((err = RoCommandBufferVerts(&chunk->buffer, &this->roc, count, chunk->vertices, texture))) {
+				DgLog(DG_LOG_ERROR, "Error while adding verts: %s.", DgErrorString(err));
+			}
+			
+			count = 0;
+		}
 		
-		if ((err = RoDrawVerts(&this->roc, 3, verts, "swaping"))) {
-			DgLog(DG_LOG_ERROR, "Error while adding verts: %s.", DgErrorString(err));
+		if (!shape) {
+			break;
 		}
 		
-		if ((err = RoDrawEnd(&this->roc))) {
-			DgLog(DG_LOG_ERROR, "Error while finishing draw: %s.", DgErrorString(err));
+		if (shape->packed != OID_NIL) {
+			if ((err = RoCommandBufferVertsRef(&chunk->buffer, &this->roc, shape->count, (const RoVertex *) shape->vertices, shape_texture))) {
+				DgLog(DG_LOG_ERROR, "Error while adding verts: %s.", DgErrorString(err));
+			}
+			
+			continue;
 		}
 		
-		DgWindowStatus status = DgWindowUpdate(&this->window, NULL);
+		if (count + shape->count > chunk->vertex_capacity) {
+			size_t capacity = (2 * chunk->vertex_capacity > count + shape->count) ? 2 * chunk->vertex_capacity : count + shape->count;
+			RoVertex *vertices = DgMemoryReallocate(chunk->vertices, sizeof *vertices * capacity);
+			
+			if (!vertices) {
+				continue;
+			}
+			
+			chunk->vertices = vertices;
+			chunk->vertex_capacity = capacity;
+		}
 		
-		if (status == DG_WINDOW_SHOULD_CLOSE) {
-			break;
+		for (size_t j = 0; j < shape->count; j++) {
+			const UniverseVertex *v = &shape->vertices[j];
+			chunk->vertices[count + j] = (RoVertex) {v->x, v->y, v->z, v->u, v->v, v->r, v->g, v->b, v->a};
 		}
 		
+		count += shape->count;
+		texture = shape_texture;
+	}
+}
+
+static bool EngineReserveChunks(Engine *this, size_t count) {
+	if (count <= this->draw_chunk_count) {
+		return true;
+	}
+	
+	EngineDrawChunk *chunks = DgMemoryReallocate(this->draw_chunks, sizeof *chunks * count);
+	
+	if (!chunks) {
+		return false;
+	}
+	
+	this->draw_chunks = chunks;
+	
+	for (; this->draw_chunk_count < count; this->draw_chunk_count++) {
+		EngineDrawChunk *chunk = &chunks[this->draw_chunk_count];
+		
+		chunk->vertices = NULL;
+		chunk->vertex_capacity = 0;
+		
+		if (RoCommandBufferInit(&chunk->buffer)) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void EnginePhaseGather(void *context) {
+	/**
+	 * Record the commands for drawing a frame from the shapes objects gave
+	 * in the last update. Chunks of shapes are recorded in parallel, and
+	 * their buffers are drawn in order, so shapes are drawn in slot order.
+	 * This runs on a worker while the next frame ticks, so it mustn't touch
+	 * the script heap.
+	 */
+	
+	Engine *this = context;
+	JobGroup group = {0};
+	DgError err;
+	
+	this->draw_slots = UniverseShaped(&this->universe, &this->draw_count);
+	
+	size_t chunks = (this->draw_count + ENGINE_DRAW_CHUNK - 1) / ENGINE_DRAW_CHUNK;
+	
+	if (!EngineReserveChunks(this, chunks)) {
+		DgLog(DG_LOG_ERROR, "Out of memory for drawing");
+		return;
+	}
+	
+	for (size_t i = 0; i < chunks; i++) {
+		if (!JobsPush(&this->jobs, &group, EngineGatherChunk, this, i)) {
+			EngineGatherChunk(this, i);
+		}
+	}
+	
+	JobsWait(&this->jobs, &group);
+	
+	RoDrawBegin(&this->roc);
+	
+	for (size_t i = 0; i < chunks; i++) {
+		if ((err = RoDrawCommandBuffer(&this->roc, &this->draw_chunks[i].buffer))) {
+			DgLog(DG_LOG_ERROR, "Error while adding draw commands: %s.", DgErrorString(err));
+		}
+	}
+	
+	this->drawn = true;
+}
+
+static void EnginePhaseCollect(void *context) {
+	/**
+	 * Nothing is running at the end of the frame, so it's safe to free
+	 * unreferenced objects and swap in methods from changed scripts. The
+	 * profiler has to name its samples before their methods can be freed.
+	 */
+	
+	Engine *this = context;
+	
+	vm_profile_collect(this->vm);
+	UniverseSweep(&this->universe);
+	vm_collect(this->vm);
+	
+	// Peers in lockstep would each pick changes up in a different frame
+	if (!this->lockstep) {
+		AssetManagerPollChanges(&this->assman, EngineAssetChanged, this);
+	}
+}
+
+static void EngineAddPhases(Engine *this) {
+	/**
+	 * Set up the phases of a frame, in the order they would run one after
+	 * another. Scripts can touch anything in the Universe and there is only
+	 * one script heap, so phases that run scripts run one at a time. The
+	 * draw commands for a frame are gathered while the next one ticks, and
+	 * presented in the next one. Shapes are only asked for in the update,
+	 * so ticking can overlap gathering. Messages posted while ticking are
+	 * delivered together right after it, before the update. The frame is
+	 * recorded once the update is done, and then checksummed if running in
+	 * lockstep. Recording doesn't touch shapes, since objects a rollback
+	 * changes are only asked for them again at the next update.
+	 */
+	
+	Scheduler *s = &this->scheduler;
+	uint64_t scripts = ENGINE_SCRIPTS | (UNIVERSE_ALL_COLUMNS & ~UNIVERSE_SHAPES);
+	
+	SchedulerAdd(s, "input", EnginePhaseInput, this, 0, ENGINE_WINDOW, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "tick", EnginePhaseTick, this, scripts, scripts, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "deliver", EnginePhaseDeliver, this, scripts, scripts, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "update", EnginePhaseUpdate, this, scripts | UNIVERSE_SHAPES, scripts | UNIVERSE_SHAPES, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "record", EnginePhaseRecord, this, scripts, scripts, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "checksum", EnginePhaseChecksum, this, scripts, scripts, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "present", EnginePhasePresent, this, ENGINE_DRAW, ENGINE_WINDOW | ENGINE_SCRIPTS, SCHEDULER_MAIN_THREAD);
+	SchedulerAdd(s, "gather", EnginePhaseGather, this, UNIVERSE_SHAPES, ENGINE_DRAW, SCHEDULER_OVERLAP);
+	SchedulerAdd(s, "collect", EnginePhaseCollect, this, scripts, scripts, SCHEDULER_MAIN_THREAD);
+}
+
+DgError EngineRun(Engine *this) {
+	// Booting from an image replaces the VM
+	EngineLoadMainScene(this);
+	
+	this->tick = vm_intern(this->vm, "tick:");
+	
+	char pixels[] = {255, 255, 255, 0, 0, 0, 0, 0, 0, 255, 255, 255};
+	
+	RoUploadTexture(&this->roc, "swaping", RO_FORMAT_RGB, 2, 2, &pixels, 0);
+	
+	EngineAddPhases(this);
+	
+	// Loading is allowed to take as long as it needs, but a tick that runs
+	// away is spread over the next frames instead of hanging the engine
+	vm_set_budget(this->vm, strtoul(EngineGetProperty(this, "script.budget", "5000000"), NULL, 10));
+	
+	while (!this->closing && !DgWindowShouldClose(&this->window)) {
+		double start = DgTime();
+		
+		SchedulerFrame(&this->scheduler);
+		
 		this->frames++;
 		
 		double delta = (DgTime() - start);
@@ -82,12 +636,39 @@ DgError EngineRun(Engine *this) {
 		DgSleep(sleeptime);
 	}
 	
+	SchedulerWait(&this->scheduler);
+	
+	if (this->profiling) {
+		vm_profile_stop(this->vm, EngineGetProperty(this, "profile.output", "profile.folded"));
+		this->profiling = false;
+	}
+	
+	vm_release(this->vm, this->main);
+	
 	return DG_ERROR_SUCCESS;
 }
 
 int EngineFree(Engine *this) {
+	SchedulerFree(&this->scheduler);
+	JobsFree(&this->jobs);
+	
+	for (size_t i = 0; i < this->draw_chunk_count; i++) {
+		RoCommandBufferFree(&this->draw_chunks[i].buffer);
+		DgMemoryFree(this->draw_chunks[i].vertices);
+	}
+	
+	DgMemoryFree(this->draw_chunks);
 	RoContextDestroy(&this->roc);
 	DgWindowFree(&this->window);
+	HistoryFree(&this->history);
+	UniverseFree(&this->universe);
+	vm_destroy(this->vm);
+	
+	if (this->checksums) {
+		fclose(this->checksums);
+	}
+	
+	DgTableFree(&this->properties, true);
 	
 	return 0;
 }
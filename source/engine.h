@@ -1,11 +1,32 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "common.h"
 #include "assets.h"
+#include "vm.h"
+#include "universe.h"
+#include "history.h"
+#include "jobs.h"
+#include "scheduler.h"
 #include "util/table.h"
 #include "util/args.h"
 #include "rendroar/rendroar.h"
 
+// Resources the phases of a frame read and write, besides the columns of
+// the Universe
+enum {
+	ENGINE_SCRIPTS = (1 << 16), // The script heap, which one thread uses at a time
+	ENGINE_WINDOW = (1 << 17),  // The window and the GL context
+	ENGINE_DRAW = (1 << 18),    // The renderer's command buffer
+};
+
+typedef struct EngineDrawChunk {
+	RoCommandBuffer buffer;
+	RoVertex *vertices; // Vertices of shapes drawn together
+	size_t vertex_capacity;
+} EngineDrawChunk;
+
 typedef struct Engine {
 	DgTable properties;
 	
@@ -14,7 +35,32 @@ typedef struct Engine {
 	
 	AssetManager assman;
 	
+	vm_context vm;
+	object_id main; // Prototype of the main script
+	object_id tick; // Interned tick: selector
+	
+	Universe universe;
+	History history; // Recent frames, if history.frames is set
+	
+	Jobs jobs;
+	Scheduler scheduler;
+	bool closing; // The window was asked to close
+	bool drawn;   // A frame was gathered and not presented yet
+	
+	// Shapes are gathered in chunks, each recorded into a command buffer of
+	// its own by whichever worker takes it
+	EngineDrawChunk *draw_chunks;
+	size_t draw_chunk_count;
+	const UniverseSlot *draw_slots;
+	size_t draw_count;
+	
 	size_t frames;
+	bool profiling; // Sampling scripts, see the profile property
+	
+	// Running deterministically, see the lockstep property
+	bool lockstep;
+	double step;     // Seconds each frame counts as
+	FILE *checksums; // Where the checksum of every frame is written, or NULL
 } Engine;
 
 extern Engine *gEngine;
@@ -22,3 +68,6 @@ extern Engine *gEngine;
 DgError EngineInit(Engine *this, DgArgs *args);
 DgError EngineRun(Engine *this);
 int EngineFree(Engine *this);
+const char *EngineGetProperty(Engine *this, const char *key, const char *fallback);
+DgError EngineSaveImage(Engine *this, const char *name);
+DgError EngineLoadImage(Engine *this, const char *name);
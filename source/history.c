@@ -0,0 +1,762 @@
+/**
+ * Recent frames of the Universe
+ */
+
+#include <string.h>
+
+#include "common.h"
+#include "vm.h"
+
+#include "universe.h"
+#include "history.h"
+
+#define HISTORY_NO_ENTRY UINT32_MAX
+
+// Zeros in a delta shorter than this don't end a run of other bytes, since
+// starting a new run takes about as much
+#define HISTORY_MIN_ZEROS 3
+
+// Entries
+
+static uint32_t HistoryNumber(History *this, object_id object) {
+	object_id *number = vm_map_find(&this->numbers, object);
+	
+	return number ? GET_OBJID_VAL(*number) : HISTORY_NO_ENTRY;
+}
+
+static uint32_t HistorySlotEntry(History *this, UniverseSlot slot) {
+	/**
+	 * Find the entry of the object in a slot of the Universe. Slots are
+	 * reused, so the entry remembered for one is only taken if it's still
+	 * the object's.
+	 */
+	
+	object_id object = this->universe->objects[slot];
+	uint32_t number = (slot < this->slot_capacity) ? this->slots[slot] : HISTORY_NO_ENTRY;
+	
+	if (number < this->entry_count && this->entries[number].object == object) {
+		return number;
+	}
+	
+	number = HistoryNumber(this, object);
+	
+	if (slot < this->slot_capacity) {
+		this->slots[slot] = number;
+	}
+	
+	return number;
+}
+
+static uint32_t HistoryAddEntry(History *this, object_id object) {
+	/**
+	 * Find an object's entry, or make a new one for it
+	 *
+	 * @return The entry number, or HISTORY_NO_ENTRY if there isn't enough
+	 * memory
+	 */
+	
+	uint32_t number = HistoryNumber(this, object);
+	
+	if (number != HISTORY_NO_ENTRY) {
+		return number;
+	}
+	
+	bool reused = this->free_count != 0;
+	
+	if (reused) {
+		number = this->free[--this->free_count];
+	}
+	else {
+		if (this->entry_count >= this->entry_capacity) {
+			size_t capacity = this->entry_capacity ? 2 * this->entry_capacity : 64;
+			HistoryEntry *entries = DgMemoryReallocate(this->entries, sizeof *entries * capacity);
+			
+			if (!entries) {
+				return HISTORY_NO_ENTRY;
+			}
+			
+			this->entries = entries;
+			this->entry_capacity = capacity;
+		}
+		
+		number = this->entry_count++;
+	}
+	
+	HistoryEntry *entry = &this->entries[number];
+	
+	memset(entry, 0, sizeof *entry);
+	entry->object = object;
+	entry->name = OID_NIL;
+	
+	// The map keeps the object alive for as long as it has the entry
+	if (!vm_map_put(this->vm, &this->numbers, object, MAKE_OBJID(OCLS_SINT, number))) {
+		entry->object = OID_NIL;
+		
+		if (reused) {
+			this->free_count++;
+		}
+		else {
+			this->entry_count--;
+		}
+		
+		return HISTORY_NO_ENTRY;
+	}
+	
+	return number;
+}
+
+static void HistoryRemoveEntry(History *this, uint32_t number) {
+	HistoryEntry *entry = &this->entries[number];
+	
+	if (this->free_count >= this->free_capacity) {
+		size_t capacity = this->free_capacity ? 2 * this->free_capacity : 64;
+		uint32_t *free = DgMemoryReallocate(this->free, sizeof *free * capacity);
+		
+		if (free) {
+			this->free = free;
+			this->free_capacity = capacity;
+		}
+	}
+	
+	// If there's no room the entry is leaked, but the object is still
+	// released
+	if (this->free_count < this->free_capacity) {
+		this->free[this->free_count++] = number;
+	}
+	
+	vm_map_remove(this->vm, &this->numbers, entry->object);
+	DgMemoryFree(entry->record);
+	entry->object = OID_NIL;
+	entry->record = NULL;
+	entry->size = 0;
+}
+
+static bool HistoryPackExternal(void *context, object_id object, uint64_t *number) {
+	/**
+	 * Objects in the Universe are packed as their entry numbers, and every
+	 * one has an entry before anything is packed. Collections are packed as
+	 * their bits. Entries are even numbers and collections odd ones.
+	 */
+	
+	History *this = context;
+	Universe *universe = this->universe;
+	
+	UniverseSlot slot = UniverseFind(universe, object);
+	
+	if (slot != UNIVERSE_NO_SLOT) {
+		uint32_t entry = HistorySlotEntry(this, slot);
+		
+		*number = 2 * (uint64_t) entry;
+		
+		return entry != HISTORY_NO_ENTRY;
+	}
+	
+	for (size_t i = 0; i < universe->collection_count; i++) {
+		if (universe->collection_list[i].object == object) {
+			*number = 2 * i + 1;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static object_id HistoryUnpackExternal(void *context, uint64_t number) {
+	History *this = context;
+	Universe *universe = this->universe;
+	uint64_t index = number / 2;
+	
+	if (number % 2) {
+		return (index < universe->collection_count) ? universe->collection_list[index].object : OID_NIL;
+	}
+	
+	return (index < this->entry_count) ? this->entries[index].object : OID_NIL;
+}
+
+static uint8_t *HistoryTake(History *this, size_t *size) {
+	/**
+	 * Copy out what was written to the stream since it was last rewound, and
+	 * rewind it
+	 */
+	
+	const uint8_t *end = DgMemoryStreamGetHeadPointer(this->stream);
+	DgMemoryStreamRewind(this->stream);
+	const uint8_t *start = DgMemoryStreamGetHeadPointer(this->stream);
+	
+	*size = end - start;
+	uint8_t *bytes = DgMemoryAllocate(*size ? *size : 1);
+	
+	if (bytes) {
+		memcpy(bytes, start, *size);
+	}
+	
+	return bytes;
+}
+
+// Deltas
+
+static uint8_t HistoryXor(const uint8_t *a, size_t a_size, const uint8_t *b, size_t b_size, size_t i) {
+	return ((i < a_size) ? a[i] : 0) ^ ((i < b_size) ? b[i] : 0);
+}
+
+static bool HistoryDiff(History *this, const uint8_t *before, size_t before_size, const uint8_t *after, size_t after_size, HistoryChange *change) {
+	/**
+	 * Make the delta between two records (see HistoryChange)
+	 */
+	
+	size_t size = (before_size > after_size) ? before_size : after_size;
+	size_t i = 0;
+	
+	DgMemoryStreamRewind(this->stream);
+	
+	while (i < size) {
+		size_t zeros = i;
+		
+		while (i < size && !HistoryXor(before, before_size, after, after_size, i)) {
+			i++;
+		}
+		
+		zeros = i - zeros;
+		size_t start = i;
+		
+		// The run of other bytes goes on over short runs of zeros
+		while (i < size) {
+			size_t end = i;
+			
+			while (end < size && !HistoryXor(before, before_size, after, after_size, end) && end - i < HISTORY_MIN_ZEROS) {
+				end++;
+			}
+			
+			if (end == size || end - i >= HISTORY_MIN_ZEROS) {
+				break;
+			}
+			
+			i = end + 1;
+		}
+		
+		vm_pack_uint(&this->packer, zeros);
+		vm_pack_uint(&this->packer, i - start);
+		
+		for (size_t j = start; j < i; j++) {
+			uint8_t byte = HistoryXor(before, before_size, after, after_size, j);
+			DgMemoryStreamWrite(this->stream, 1, &byte);
+		}
+	}
+	
+	change->delta = HistoryTake(this, &change->delta_size);
+	change->size = before_size;
+	
+	return change->delta != NULL;
+}
+
+static uint8_t *HistoryUndo(History *this, const uint8_t *after, size_t after_size, const HistoryChange *change) {
+	/**
+	 * Get the record from before a change back from the one after it
+	 *
+	 * @return The record, or NULL if there isn't enough memory
+	 */
+	
+	uint8_t *before = DgMemoryAllocate(change->size ? change->size : 1);
+	
+	if (!before) {
+		return NULL;
+	}
+	
+	size_t kept = (after_size < change->size) ? after_size : change->size;
+	
+	memset(before, 0, change->size);
+	
+	if (kept) {
+		memcpy(before, after, kept);
+	}
+	
+	vm_unpacker delta;
+	size_t at = 0;
+	
+	vm_unpacker_init(&delta, this->vm, change->delta, change->delta_size);
+	
+	while (delta.at < delta.end && !delta.error) {
+		at += vm_unpack_uint(&delta);
+		size_t count = vm_unpack_uint(&delta);
+		
+		if (count > (size_t) (delta.end - delta.at)) {
+			break;
+		}
+		
+		for (size_t i = 0; i < count; i++, at++) {
+			if (at < change->size) {
+				before[at] ^= delta.at[i];
+			}
+		}
+		
+		delta.at += count;
+	}
+	
+	vm_unpacker_free(&delta);
+	
+	return before;
+}
+
+static bool HistoryChanged(History *this, uint32_t number, uint8_t *record, size_t size) {
+	/**
+	 * Give an entry a new record, or none if the object left the Universe,
+	 * logging the change for the frame being recorded. The entry takes the
+	 * record.
+	 */
+	
+	HistoryEntry *entry = &this->entries[number];
+	
+	if (this->change_count >= this->change_capacity) {
+		size_t capacity = this->change_capacity ? 2 * this->change_capacity : 64;
+		HistoryChange *changes = DgMemoryReallocate(this->changes, sizeof *changes * capacity);
+		
+		if (!changes) {
+			DgMemoryFree(record);
+			return false;
+		}
+		
+		this->changes = changes;
+		this->change_capacity = capacity;
+	}
+	
+	HistoryChange *change = &this->changes[this->change_count];
+	
+	change->entry = number;
+	change->present = entry->record != NULL;
+	
+	if (!HistoryDiff(this, entry->record, entry->size, record, size, change)) {
+		DgMemoryFree(record);
+		return false;
+	}
+	
+	this->change_count++;
+	DgMemoryFree(entry->record);
+	entry->record = record;
+	entry->size = size;
+	
+	return true;
+}
+
+// Frames
+
+static HistoryFrame *HistoryFrameAt(History *this, size_t index) {
+	/**
+	 * Get a kept frame, where 0 is the oldest
+	 */
+	
+	return &this->frames[(this->first + index) % this->frame_capacity];
+}
+
+static void HistoryFreeFrame(HistoryFrame *frame) {
+	for (size_t i = 0; i < frame->change_count; i++) {
+		DgMemoryFree(frame->changes[i].delta);
+	}
+	
+	DgMemoryFree(frame->changes);
+	memset(frame, 0, sizeof *frame);
+}
+
+// History
+
+DgError HistoryInit(History *this, Universe *universe, size_t frames) {
+	/**
+	 * Start keeping the last `frames` frames of a Universe. Nothing is kept
+	 * until the first one is recorded.
+	 */
+	
+	memset(this, 0, sizeof *this);
+	this->universe = universe;
+	this->vm = universe->vm;
+	vm_map_init(&this->numbers);
+	
+	this->frame_capacity = frames ? frames : 1;
+	this->frames = DgMemoryAllocate(sizeof *this->frames * this->frame_capacity);
+	this->stream = DgMemoryStreamCreate();
+	
+	if (!this->frames || !this->stream) {
+		DgMemoryFree(this->frames);
+		
+		if (this->stream) {
+			DgMemoryStreamFree(this->stream);
+		}
+		
+		memset(this, 0, sizeof *this);
+		
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	vm_packer_init(&this->packer, this->vm, this->stream);
+	this->packer.external = HistoryPackExternal;
+	this->packer.context = this;
+	
+	universe->history = this;
+	
+	return DG_ERROR_SUCCESS;
+}
+
+void HistoryFree(History *this) {
+	for (size_t i = 0; i < this->frame_count; i++) {
+		HistoryFreeFrame(HistoryFrameAt(this, i));
+	}
+	
+	for (size_t i = 0; i < this->entry_count; i++) {
+		DgMemoryFree(this->entries[i].record);
+	}
+	
+	if (this->universe && this->universe->history == this) {
+		this->universe->history = NULL;
+	}
+	
+	if (this->stream) {
+		vm_packer_free(&this->packer);
+		vm_map_free(this->vm, &this->numbers);
+		DgMemoryStreamFree(this->stream);
+	}
+	
+	DgMemoryFree(this->frames);
+	DgMemoryFree(this->entries);
+	DgMemoryFree(this->slots);
+	DgMemoryFree(this->free);
+	DgMemoryFree(this->changes);
+	memset(this, 0, sizeof *this);
+}
+
+static bool HistoryStale(History *this, HistoryEntry *entry, UniverseSlot slot) {
+	/**
+	 * Check if an object in the Universe might not match its record
+	 */
+	
+	Universe *universe = this->universe;
+	
+	return (!entry->record && !entry->failed)
+		|| entry->slot != slot
+		|| entry->writes != vm_writes(this->vm, entry->object)
+		|| entry->name != universe->names[slot]
+		|| entry->tags != universe->tags[slot]
+		|| entry->collections != universe->collections[slot];
+}
+
+static void HistoryMade(History *this, HistoryEntry *entry, UniverseSlot slot) {
+	/**
+	 * Note what an entry's record was made from
+	 */
+	
+	Universe *universe = this->universe;
+	
+	entry->slot = slot;
+	entry->writes = vm_writes(this->vm, entry->object);
+	entry->failed = false;
+	entry->name = universe->names[slot];
+	entry->tags = universe->tags[slot];
+	entry->collections = universe->collections[slot];
+}
+
+uint64_t HistoryRecord(History *this) {
+	/**
+	 * Record the Universe as the next frame, or go back to the frame asked
+	 * for by rollbackTo: if there is one. Objects are only packed again if
+	 * they might have changed, which misses arrays and other objects changed
+	 * in place unless the Universe is told with UniverseChanged().
+	 *
+	 * @return The number of the frame the Universe is at now, the first
+	 * being 1
+	 */
+	
+	if (this->pending) {
+		uint64_t frame = this->pending;
+		
+		this->pending = 0;
+		HistoryRestore(this, frame);
+		
+		return this->number;
+	}
+	
+	Universe *universe = this->universe;
+	uint64_t number = this->number + 1;
+	
+	this->change_count = 0;
+	
+	// Without room to remember entries by slot, they're looked up by object
+	if (this->slot_capacity < universe->count) {
+		uint32_t *slots = DgMemoryReallocate(this->slots, sizeof *slots * universe->capacity);
+		
+		if (slots) {
+			memset(slots + this->slot_capacity, 0xff, sizeof *slots * (universe->capacity - this->slot_capacity));
+			this->slots = slots;
+			this->slot_capacity = universe->capacity;
+		}
+	}
+	
+	// Objects refer to each other by entry, so they all need one first
+	for (size_t i = 0; i < universe->count; i++) {
+		if (!universe->alive[i]) {
+			continue;
+		}
+		
+		uint32_t entry = HistorySlotEntry(this, i);
+		
+		if (entry == HISTORY_NO_ENTRY) {
+			entry = HistoryAddEntry(this, universe->objects[i]);
+			
+			if (entry != HISTORY_NO_ENTRY && i < this->slot_capacity) {
+				this->slots[i] = entry;
+			}
+		}
+		
+		if (entry == HISTORY_NO_ENTRY) {
+			DgLog(DG_LOG_ERROR, "Out of memory recording frame %lu", (unsigned long) number);
+			return this->number;
+		}
+		
+		this->entries[entry].seen = number;
+	}
+	
+	for (size_t i = 0; i < universe->count; i++) {
+		if (!universe->alive[i]) {
+			continue;
+		}
+		
+		uint32_t index = HistorySlotEntry(this, i);
+		HistoryEntry *entry = &this->entries[index];
+		
+		if (!HistoryStale(this, entry, i)) {
+			continue;
+		}
+		
+		HistoryMade(this, entry, i);
+		vm_packer_reset(&this->packer);
+		vm_pack_uint(&this->packer, i);
+		
+		// It's tried again once it changes
+		if (!UniversePackSlot(universe, &this->packer, i)) {
+			DgLog(DG_LOG_WARNING, "Object in slot %u can't be recorded: %s", (unsigned) i, this->packer.error);
+			DgMemoryStreamRewind(this->stream);
+			entry->failed = true;
+			continue;
+		}
+		
+		size_t size;
+		uint8_t *record = HistoryTake(this, &size);
+		
+		if (!record) {
+			continue;
+		}
+		
+		// Setting a field to what it was still makes it look changed
+		if (entry->record && entry->size == size && !memcmp(entry->record, record, size)) {
+			DgMemoryFree(record);
+			continue;
+		}
+		
+		HistoryChanged(this, index, record, size);
+	}
+	
+	for (size_t i = 0; i < this->entry_count; i++) {
+		if (this->entries[i].object != OID_NIL && this->entries[i].record && this->entries[i].seen != number) {
+			HistoryChanged(this, i, NULL, 0);
+		}
+	}
+	
+	if (this->frame_count == this->frame_capacity) {
+		HistoryFreeFrame(HistoryFrameAt(this, 0));
+		this->first = (this->first + 1) % this->frame_capacity;
+		this->frame_count--;
+	}
+	
+	HistoryFrame *frame = HistoryFrameAt(this, this->frame_count++);
+	
+	frame->number = number;
+	frame->change_count = this->change_count;
+	frame->changes = DgMemoryAllocate(sizeof *frame->changes * (this->change_count ? this->change_count : 1));
+	frame->bytes = 0;
+	
+	if (frame->changes) {
+		if (this->change_count) {
+			memcpy(frame->changes, this->changes, sizeof *frame->changes * this->change_count);
+		}
+	}
+	else {
+		// Without its changes the frames before this one can't be gone back
+		// to, so only this one is kept
+		for (size_t i = 0; i < this->change_count; i++) {
+			DgMemoryFree(this->changes[i].delta);
+		}
+		
+		frame->change_count = 0;
+		
+		while (this->frame_count > 1) {
+			HistoryFreeFrame(HistoryFrameAt(this, 0));
+			this->first = (this->first + 1) % this->frame_capacity;
+			this->frame_count--;
+		}
+	}
+	
+	for (size_t i = 0; i < frame->change_count; i++) {
+		frame->bytes += frame->changes[i].delta_size;
+	}
+	
+	this->number = number;
+	
+	// Objects that weren't in the Universe in any kept frame are let go
+	uint64_t oldest = HistoryOldest(this);
+	
+	for (size_t i = 0; i < this->entry_count; i++) {
+		if (this->entries[i].object != OID_NIL && !this->entries[i].record && this->entries[i].seen < oldest) {
+			HistoryRemoveEntry(this, i);
+		}
+	}
+	
+	return number;
+}
+
+static UniverseSlot HistoryRecordSlot(History *this, HistoryEntry *entry) {
+	/**
+	 * Read the slot an entry's object was in from its record
+	 */
+	
+	vm_unpacker unpacker;
+	
+	vm_unpacker_init(&unpacker, this->vm, entry->record, entry->size);
+	
+	uint64_t slot = vm_unpack_uint(&unpacker);
+	UniverseSlot result = (!unpacker.error && slot < UNIVERSE_NO_SLOT) ? slot : UNIVERSE_NO_SLOT;
+	
+	vm_unpacker_free(&unpacker);
+	
+	return result;
+}
+
+DgError HistoryRestore(History *this, uint64_t frame) {
+	/**
+	 * Put the Universe back the way it was in a kept frame, and drop the
+	 * frames after it. Objects are put back into the same objects, so
+	 * references to them from outside the Universe stay good, and into the
+	 * same slots, so they're in the same order. Only objects that changed
+	 * since the frame are unpacked. Slots are freed on the way, so this
+	 * must only be called when nothing is going over the Universe.
+	 *
+	 * @return DG_ERROR_FAILED if the frame isn't kept
+	 */
+	
+	Universe *universe = this->universe;
+	
+	if (!this->frame_count || frame < HistoryOldest(this) || frame > this->number) {
+		DgLog(DG_LOG_ERROR, "Frame %lu isn't kept", (unsigned long) frame);
+		return DG_ERROR_FAILED;
+	}
+	
+	// Undo the frames after it, the latest first
+	while (this->number > frame) {
+		HistoryFrame *latest = HistoryFrameAt(this, this->frame_count - 1);
+		
+		for (size_t i = 0; i < latest->change_count; i++) {
+			HistoryChange *change = &latest->changes[i];
+			HistoryEntry *entry = &this->entries[change->entry];
+			uint8_t *before = NULL;
+			
+			if (change->present && !(before = HistoryUndo(this, entry->record, entry->size, change))) {
+				return DG_ERROR_ALLOCATION_FAILED;
+			}
+			
+			DgMemoryFree(entry->record);
+			entry->record = before;
+			entry->size = change->size;
+			entry->touched = true;
+		}
+		
+		HistoryFreeFrame(latest);
+		this->frame_count--;
+		this->number--;
+	}
+	
+	// Whatever changed since the latest frame was recorded is undone too,
+	// and objects added since are taken out
+	for (size_t i = 0; i < universe->count; i++) {
+		if (!universe->alive[i]) {
+			continue;
+		}
+		
+		uint32_t index = HistorySlotEntry(this, i);
+		
+		if (index == HISTORY_NO_ENTRY) {
+			UniverseRemove(universe, universe->objects[i]);
+		}
+		else if (HistoryStale(this, &this->entries[index], i)) {
+			this->entries[index].touched = true;
+		}
+	}
+	
+	// Objects that aren't where they should be are taken out or marked to
+	// be put back. Names are unique, so they're cleared before any are
+	// given back.
+	for (size_t i = 0; i < this->entry_count; i++) {
+		HistoryEntry *entry = &this->entries[i];
+		
+		if (entry->object == OID_NIL) {
+			continue;
+		}
+		
+		UniverseSlot slot = UniverseFind(universe, entry->object);
+		
+		if (!entry->record) {
+			UniverseRemove(universe, entry->object);
+			entry->touched = false;
+		}
+		else if (slot == UNIVERSE_NO_SLOT) {
+			entry->touched = true;
+		}
+		else if (slot != HistoryRecordSlot(this, entry)) {
+			UniverseRemove(universe, entry->object);
+			entry->touched = true;
+		}
+		else if (entry->touched) {
+			UniverseSetName(universe, slot, OID_NIL);
+		}
+	}
+	
+	// The slots of objects taken out have to be free to put others back in
+	UniverseSweep(universe);
+	
+	for (size_t i = 0; i < this->entry_count; i++) {
+		HistoryEntry *entry = &this->entries[i];
+		
+		if (!entry->touched) {
+			continue;
+		}
+		
+		entry->touched = false;
+		
+		vm_unpacker unpacker;
+		
+		vm_unpacker_init(&unpacker, this->vm, entry->record, entry->size);
+		unpacker.external = HistoryUnpackExternal;
+		unpacker.context = this;
+		
+		UniverseSlot slot = UniverseAddAt(universe, entry->object, vm_unpack_uint(&unpacker));
+		
+		if (slot == UNIVERSE_NO_SLOT || !UniverseUnpackSlot(universe, &unpacker, slot)) {
+			DgLog(DG_LOG_ERROR, "Failed to restore an object: %s", unpacker.error ? unpacker.error : "Out of memory");
+		}
+		else {
+			HistoryMade(this, entry, slot);
+			entry->seen = frame;
+		}
+		
+		vm_unpacker_free(&unpacker);
+	}
+	
+	return DG_ERROR_SUCCESS;
+}
+
+uint64_t HistoryOldest(History *this) {
+	/**
+	 * Get the number of the oldest frame that can be gone back to, or 0 if
+	 * none are kept
+	 */
+	
+	return this->frame_count ? HistoryFrameAt(this, 0)->number : 0;
+}
+
+uint64_t HistoryLatest(History *this) {
+	return this->frame_count ? this->number : 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * Recent frames of the Universe, kept as deltas for rolling back to
+ */
+
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+#include "universe.h"
+
+typedef struct HistoryEntry {
+	/**
+	 * An object that was in the Universe in one of the kept frames, with
+	 * what it was packed as in the latest one. Entries are numbered, and
+	 * references between objects in the Universe are packed as entry
+	 * numbers, so that objects keep their records when their slots change.
+	 */
+	
+	object_id object; // Kept alive by the numbers map, or nil if the entry is free
+	uint8_t *record;  // Slot, name, tags, collections and object, packed. NULL if it wasn't in the Universe.
+	size_t size;
+	
+	// What the record was made from, for telling cheaply if it's stale
+	UniverseSlot slot;
+	uint32_t writes;
+	object_id name;
+	uint64_t tags;
+	uint64_t collections;
+	
+	uint64_t seen;    // Latest frame it was in the Universe in
+	bool failed;      // Couldn't be packed as it is now
+	bool touched;     // Has to be unpacked again by the restore going on
+} HistoryEntry;
+
+typedef struct HistoryChange {
+	/**
+	 * How an entry's record changed in a frame. The delta is the record from
+	 * before XORed with the one after, where the shorter one counts as
+	 * padded with zeros, and runs of zeros are squeezed out:
+	 *
+	 *     for each run: number of zero bytes, number of other bytes, the
+	 *     other bytes
+	 *
+	 * The record after is kept in the entry, or undone from later frames,
+	 * so XORing the delta back into it gives the record from before.
+	 */
+	
+	uint32_t entry;
+	bool present;     // The object was in the Universe before
+	size_t size;      // Of the record from before
+	uint8_t *delta;
+	size_t delta_size;
+} HistoryChange;
+
+typedef struct HistoryFrame {
+	uint64_t number;
+	HistoryChange *changes;
+	size_t change_count;
+	size_t bytes;     // Of all the deltas, which is what it would take to send
+} HistoryFrame;
+
+typedef struct History {
+	/**
+	 * The last few frames of the Universe. Only objects whose fields, name,
+	 * tags or collections changed since the last frame are packed again,
+	 * and a frame keeps just the deltas of the records that came out
+	 * different, so recording a frame costs about as much as what changed
+	 * in it. Going back to a frame undoes the deltas of the frames after it
+	 * and unpacks only the objects they touched.
+	 */
+	
+	Universe *universe;
+	vm_context vm;
+	
+	HistoryEntry *entries;
+	size_t entry_count;
+	size_t entry_capacity;
+	uint32_t *free;   // Entries that can be used again
+	size_t free_count;
+	size_t free_capacity;
+	vm_map numbers;   // Objects to their entry numbers
+	uint32_t *slots;  // Entry of the object in each slot, if it's still that object's
+	size_t slot_capacity;
+	
+	// Ring of the kept frames, the oldest first
+	HistoryFrame *frames;
+	size_t frame_capacity;
+	size_t first;
+	size_t frame_count;
+	uint64_t number;  // Of the latest frame recorded
+	uint64_t pending; // Frame to go back to at the next record, or 0
+	
+	vm_packer packer;
+	DgMemoryStream *stream;
+	HistoryChange *changes; // Being made for the next frame
+	size_t change_count;
+	size_t change_capacity;
+} History;
+
+DgError HistoryInit(History *this, Universe *universe, size_t frames);
+void HistoryFree(History *this);
+uint64_t HistoryRecord(History *this);
+DgError HistoryRestore(History *this, uint64_t frame);
+uint64_t HistoryOldest(History *this);
+uint64_t HistoryLatest(History *this);
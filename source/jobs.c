@@ -0,0 +1,226 @@
+/**
+ * Pool of worker threads
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "jobs.h"
+
+// Number of the thread running, where 0 is any thread that isn't a worker
+static _Thread_local size_t gJobsWorker;
+
+static bool JobsTake(Jobs *this, Job *job) {
+	/**
+	 * Take the oldest job off the queue. The lock must be held.
+	 */
+	
+	if (!this->count) {
+		return false;
+	}
+	
+	*job = this->queue[this->head];
+	this->head = (this->head + 1) % this->capacity;
+	this->count--;
+	
+	return true;
+}
+
+static void JobsRun(Jobs *this, Job *job) {
+	job->function(job->context, job->index);
+	
+	if (job->group) {
+		pthread_mutex_lock(&this->lock);
+		
+		if (!--job->group->left) {
+			pthread_cond_broadcast(&this->changed);
+		}
+		
+		pthread_mutex_unlock(&this->lock);
+	}
+}
+
+static void *JobsThreadMain(void *context) {
+	JobThread *thread = context;
+	Jobs *this = thread->jobs;
+	Job job;
+	
+	gJobsWorker = thread->index;
+	
+	pthread_mutex_lock(&this->lock);
+	
+	while (true) {
+		while (!this->quit && !this->count) {
+			pthread_cond_wait(&this->work, &this->lock);
+		}
+		
+		// Jobs already pushed are still run before quitting
+		if (!JobsTake(this, &job)) {
+			break;
+		}
+		
+		pthread_mutex_unlock(&this->lock);
+		JobsRun(this, &job);
+		pthread_mutex_lock(&this->lock);
+	}
+	
+	pthread_mutex_unlock(&this->lock);
+	
+	return NULL;
+}
+
+DgError JobsInit(Jobs *this, size_t threads) {
+	/**
+	 * Start a pool with some number of workers. With no workers at all, jobs
+	 * are only run by threads waiting for them.
+	 */
+	
+	memset(this, 0, sizeof *this);
+	
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->work, NULL);
+	pthread_cond_init(&this->changed, NULL);
+	
+	this->threads = DgMemoryAllocate(sizeof *this->threads * (threads ? threads : 1));
+	
+	if (!this->threads) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	for (size_t i = 0; i < threads; i++) {
+		this->threads[i].jobs = this;
+		this->threads[i].index = i + 1;
+		
+		if (pthread_create(&this->threads[i].thread, NULL, JobsThreadMain, &this->threads[i])) {
+			DgLog(DG_LOG_WARNING, "Only started %zu of %zu worker threads", i, threads);
+			break;
+		}
+		
+		this->thread_count++;
+	}
+	
+	return DG_ERROR_SUCCESS;
+}
+
+void JobsFree(Jobs *this) {
+	/**
+	 * Finish the jobs that were pushed and stop the workers
+	 */
+	
+	pthread_mutex_lock(&this->lock);
+	this->quit = true;
+	pthread_cond_broadcast(&this->work);
+	pthread_mutex_unlock(&this->lock);
+	
+	for (size_t i = 0; i < this->thread_count; i++) {
+		pthread_join(this->threads[i].thread, NULL);
+	}
+	
+	// Without workers, nothing has run them yet
+	while (JobsHelp(this));
+	
+	pthread_cond_destroy(&this->changed);
+	pthread_cond_destroy(&this->work);
+	pthread_mutex_destroy(&this->lock);
+	DgMemoryFree(this->threads);
+	DgMemoryFree(this->queue);
+}
+
+bool JobsPush(Jobs *this, JobGroup *group, JobFunction function, void *context, size_t index) {
+	/**
+	 * Queue a job calling `function(context, index)`, as part of `group` if
+	 * it isn't NULL
+	 *
+	 * @return false if there isn't enough memory
+	 */
+	
+	pthread_mutex_lock(&this->lock);
+	
+	if (this->count == this->capacity) {
+		size_t new_capacity = this->capacity ? 2 * this->capacity : 64;
+		Job *new_queue = DgMemoryAllocate(sizeof *new_queue * new_capacity);
+		
+		if (!new_queue) {
+			pthread_mutex_unlock(&this->lock);
+			return false;
+		}
+		
+		// Unwrap the ring
+		for (size_t i = 0; i < this->count; i++) {
+			new_queue[i] = this->queue[(this->head + i) % this->capacity];
+		}
+		
+		DgMemoryFree(this->queue);
+		this->queue = new_queue;
+		this->capacity = new_capacity;
+		this->head = 0;
+	}
+	
+	this->queue[(this->head + this->count) % this->capacity] = (Job) {function, context, index, group};
+	this->count++;
+	
+	if (group) {
+		group->left++;
+	}
+	
+	pthread_cond_signal(&this->work);
+	pthread_cond_broadcast(&this->changed);
+	pthread_mutex_unlock(&this->lock);
+	
+	return true;
+}
+
+bool JobsHelp(Jobs *this) {
+	/**
+	 * Run one queued job on this thread, if there is one
+	 *
+	 * @return If a job was run
+	 */
+	
+	Job job;
+	
+	pthread_mutex_lock(&this->lock);
+	bool found = JobsTake(this, &job);
+	pthread_mutex_unlock(&this->lock);
+	
+	if (found) {
+		JobsRun(this, &job);
+	}
+	
+	return found;
+}
+
+void JobsWait(Jobs *this, JobGroup *group) {
+	/**
+	 * Wait until every job of a group is finished, running queued jobs (of
+	 * any group) meanwhile. Jobs may wait for other jobs this way.
+	 */
+	
+	Job job;
+	
+	pthread_mutex_lock(&this->lock);
+	
+	while (group->left) {
+		if (JobsTake(this, &job)) {
+			pthread_mutex_unlock(&this->lock);
+			JobsRun(this, &job);
+			pthread_mutex_lock(&this->lock);
+		}
+		else {
+			pthread_cond_wait(&this->changed, &this->lock);
+		}
+	}
+	
+	pthread_mutex_unlock(&this->lock);
+}
+
+size_t JobsWorker(void) {
+	/**
+	 * Get the number of the worker running, from 1 up to the number of
+	 * workers, or 0 on other threads
+	 */
+	
+	return gJobsWorker;
+}
@@ -0,0 +1,61 @@
+/**
+ * Pool of worker threads running small jobs
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "common.h"
+
+typedef void (*JobFunction)(void *context, size_t index);
+
+typedef struct JobGroup {
+	/**
+	 * Jobs that can be waited for together. Zero it before pushing jobs.
+	 */
+	
+	size_t left; // Jobs not finished yet
+} JobGroup;
+
+typedef struct Job {
+	JobFunction function;
+	void *context;
+	size_t index;
+	JobGroup *group; // Or NULL
+} Job;
+
+typedef struct JobThread {
+	pthread_t thread;
+	struct Jobs *jobs;
+	size_t index;
+} JobThread;
+
+typedef struct Jobs {
+	/**
+	 * Jobs are taken first in, first out by whichever thread is free,
+	 * including threads waiting for a group, which run jobs instead of
+	 * sleeping while there are any
+	 */
+	
+	JobThread *threads;
+	size_t thread_count;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t work;    // Jobs were pushed, or the workers should quit
+	pthread_cond_t changed; // Jobs were pushed or a group finished
+	bool quit;
+	
+	// Ring of jobs not started yet
+	Job *queue;
+	size_t head;
+	size_t count;
+	size_t capacity;
+} Jobs;
+
+DgError JobsInit(Jobs *this, size_t threads);
+void JobsFree(Jobs *this);
+bool JobsPush(Jobs *this, JobGroup *group, JobFunction function, void *context, size_t index);
+bool JobsHelp(Jobs *this);
+void JobsWait(Jobs *this, JobGroup *group);
+size_t JobsWorker(void);
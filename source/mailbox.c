@@ -0,0 +1,130 @@
+/**
+ * Lock-free multi-producer, single-consumer message queue
+ */
+
+#include <string.h>
+
+#include "common.h"
+
+#include "mailbox.h"
+
+DgError MailboxInit(Mailbox *this, size_t capacity) {
+	/**
+	 * Make an empty mailbox holding at least `capacity` messages
+	 */
+	
+	memset(this, 0, sizeof *this);
+	
+	size_t size = 2;
+	
+	while (size < capacity) {
+		size *= 2;
+	}
+	
+	this->cells = DgMemoryAllocate(sizeof *this->cells * size);
+	
+	if (!this->cells) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	this->mask = size - 1;
+	
+	// Every cell starts free for the first lap
+	for (size_t i = 0; i < size; i++) {
+		this->cells[i].sequence = i;
+	}
+	
+	return DG_ERROR_SUCCESS;
+}
+
+void MailboxFree(Mailbox *this) {
+	DgMemoryFree(this->cells);
+	memset(this, 0, sizeof *this);
+}
+
+bool MailboxPost(Mailbox *this, const MailboxMessage *message) {
+	/**
+	 * Queue a message. This can be called from any thread.
+	 *
+	 * @return false if the mailbox is full
+	 */
+	
+	size_t position = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+	
+	while (true) {
+		MailboxCell *cell = &this->cells[position & this->mask];
+		size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t lap = (intptr_t) (sequence - position);
+		
+		if (lap == 0) {
+			// On failure this reloads the tail for another try
+			if (__atomic_compare_exchange_n(&this->tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				cell->message = *message;
+				__atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		}
+		else if (lap < 0) {
+			// The cell still holds a message from the last lap
+			return false;
+		}
+		else {
+			// Another poster took the cell first
+			position = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+bool MailboxTake(Mailbox *this, MailboxMessage *message) {
+	/**
+	 * Take out the oldest message. Only one thread may do this at a time.
+	 *
+	 * @return false if there is no message, or the oldest one is still being
+	 * posted
+	 */
+	
+	MailboxCell *cell = &this->cells[this->head & this->mask];
+	
+	if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != this->head + 1) {
+		return false;
+	}
+	
+	*message = cell->message;
+	
+	// Free the cell for the next lap
+	__atomic_store_n(&cell->sequence, this->head + this->mask + 1, __ATOMIC_RELEASE);
+	this->head++;
+	
+	return true;
+}
+
+size_t MailboxCount(Mailbox *this) {
+	/**
+	 * Get how many messages have been posted and not taken, including ones
+	 * still being posted. Only the reader may call this.
+	 */
+	
+	return __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE) - this->head;
+}
+
+const MailboxMessage *MailboxPeek(Mailbox *this, size_t index) {
+	/**
+	 * Look at a message without taking it out, where 0 is the oldest. Only
+	 * the reader may call this.
+	 *
+	 * @return The message, or NULL if it isn't there or is still being posted
+	 */
+	
+	if (index >= MailboxCount(this)) {
+		return NULL;
+	}
+	
+	size_t position = this->head + index;
+	MailboxCell *cell = &this->cells[position & this->mask];
+	
+	if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+		return NULL;
+	}
+	
+	return &cell->message;
+}
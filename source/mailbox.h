@@ -0,0 +1,47 @@
+/**
+ * Bounded queue of messages that any thread can post to without locking
+ */
+
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+typedef struct MailboxMessage {
+	object_id receiver;
+	object_id selector;
+	object_id argument; // nil if there is none
+	uint64_t args;      // 0 or 1
+} MailboxMessage;
+
+typedef struct MailboxCell {
+	size_t sequence; // Which lap of the ring the cell is ready for
+	MailboxMessage message;
+} MailboxCell;
+
+typedef struct Mailbox {
+	/**
+	 * A ring of cells, each with a sequence number saying whether it's free
+	 * for the lap a poster is on or holds a message for the lap the reader
+	 * is on. Posters claim a cell by moving the tail on with compare and
+	 * swap, fill it in, then publish it by moving its sequence on, so any
+	 * number of threads can post at once. Only one thread may take messages
+	 * out, and it owns the head.
+	 */
+	
+	MailboxCell *cells;
+	size_t mask; // Capacity - 1, the capacity being a power of two
+	
+	// Kept a cache line apart, since posters and the reader each write one
+	// of them
+	size_t tail;
+	uint8_t gap[64 - sizeof(size_t)];
+	size_t head;
+} Mailbox;
+
+DgError MailboxInit(Mailbox *this, size_t capacity);
+void MailboxFree(Mailbox *this);
+bool MailboxPost(Mailbox *this, const MailboxMessage *message);
+bool MailboxTake(Mailbox *this, MailboxMessage *message);
+size_t MailboxCount(Mailbox *this);
+const MailboxMessage *MailboxPeek(Mailbox *this, size_t index);
@@ -0,0 +1,69 @@
+/**
+ * Bump allocator for compiler data, like ASTs
+ */
+
+#include "nut_arena.h"
+
+void nut_arena_init(nut_arena *this, size_t chunk_size) {
+	this->head = NULL;
+	this->chunk_size = chunk_size ? chunk_size : (64 * 1024);
+}
+
+void nut_arena_free(nut_arena *this) {
+	/**
+	 * Free everything that was allocated from the arena
+	 */
+	
+	nut_arena_chunk *chunk = this->head;
+	
+	while (chunk) {
+		nut_arena_chunk *next = chunk->next;
+		DgMemoryFree(chunk);
+		chunk = next;
+	}
+	
+	this->head = NULL;
+}
+
+void *nut_arena_alloc_slow(nut_arena *this, size_t size) {
+	/**
+	 * Start a new chunk because the current one is full. Allocations bigger
+	 * than a chunk get a chunk of their own.
+	 */
+	
+	size_t chunk_size = (size > this->chunk_size) ? size : this->chunk_size;
+	nut_arena_chunk *chunk = DgMemoryAllocate(sizeof(nut_arena_chunk) + chunk_size);
+	
+	if (!chunk) {
+		return NULL;
+	}
+	
+	chunk->size = chunk_size;
+	chunk->used = size;
+	
+	// Keep the chunk with the most free space at the head so an oversized
+	// allocation doesn't waste what is left of the current chunk
+	if (this->head && chunk_size - size < this->head->size - this->head->used) {
+		chunk->next = this->head->next;
+		this->head->next = chunk;
+	}
+	else {
+		chunk->next = this->head;
+		this->head = chunk;
+	}
+	
+	return chunk->data;
+}
+
+char *nut_arena_strndup(nut_arena *this, const char *string, size_t length) {
+	char *copy = nut_arena_alloc(this, length + 1);
+	
+	if (!copy) {
+		return NULL;
+	}
+	
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	
+	return copy;
+}
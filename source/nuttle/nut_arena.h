@@ -0,0 +1,45 @@
+/**
+ * Bump allocator for compiler data, like ASTs
+ */
+
+#pragma once
+
+#include "common.h"
+
+typedef struct nut_arena_chunk {
+	struct nut_arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[0];
+} nut_arena_chunk;
+
+// An arena hands out memory by bumping a pointer and frees everything it ever
+// allocated in one go. Individual allocations can't be freed.
+typedef struct {
+	nut_arena_chunk *head;
+	size_t chunk_size;
+} nut_arena;
+
+#define NUT_ARENA_ALIGN 8
+
+void nut_arena_init(nut_arena *this, size_t chunk_size);
+void nut_arena_free(nut_arena *this);
+void *nut_arena_alloc_slow(nut_arena *this, size_t size);
+char *nut_arena_strndup(nut_arena *this, const char *string, size_t length);
+
+static inline void *nut_arena_alloc(nut_arena *this, size_t size) {
+	/**
+	 * Allocate `size` bytes from the arena, or NULL if out of memory
+	 */
+	
+	size = (size + (NUT_ARENA_ALIGN - 1)) & ~((size_t) NUT_ARENA_ALIGN - 1);
+	nut_arena_chunk *chunk = this->head;
+	
+	if (chunk && chunk->size - chunk->used >= size) {
+		void *ptr = chunk->data + chunk->used;
+		chunk->used += size;
+		return ptr;
+	}
+	
+	return nut_arena_alloc_slow(this, size);
+}
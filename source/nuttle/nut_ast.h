@@ -0,0 +1,113 @@
+/**
+ * Nuttle abstract syntax tree
+ */
+
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+// Names point straight into the source text (or into the arena when they had
+// to be built, like keyword selectors). They are not zero terminated.
+typedef struct {
+	const char *data;
+	uint32_t length;
+} nut_name;
+
+typedef enum {
+	NUT_AST_LITERAL,  // Constant value, like an integer, float or interned string
+	NUT_AST_STRING,   // String literal (already unescaped)
+	NUT_AST_VARIABLE, // Variable reference
+	NUT_AST_ASSIGN,   // name := value
+	NUT_AST_SEND,     // receiver selector: args
+	NUT_AST_BLOCK,    // [:params | | temps | body]
+	NUT_AST_RETURN,   // ^value
+	NUT_AST_SYNTAX,   // global syntax name := pattern => ops ;
+} nut_ast_kind;
+
+typedef struct nut_ast nut_ast;
+
+typedef enum {
+	NUT_CAPTURE_EXPR,  // <expr: name> matches any expression
+	NUT_CAPTURE_BLOCK, // <block: name> only matches a literal block without arguments
+} nut_capture_kind;
+
+typedef enum {
+	NUT_SYNTAX_COMPARE_IN_SET,      // compare_in_set(capture, {0, false, nil})
+	NUT_SYNTAX_GOTO_WHEN_EQUAL,     // goto_when_equal(:label)
+	NUT_SYNTAX_GOTO_WHEN_NOT_EQUAL, // goto_when_not_equal(:label)
+	NUT_SYNTAX_GOTO,                // goto(:label)
+	NUT_SYNTAX_LABEL,               // label(:label)
+	NUT_SYNTAX_DO_BLOCK,            // do_block(capture)
+	NUT_SYNTAX_PUSH,                // push(capture or constant)
+	NUT_SYNTAX_POP,                 // pop()
+} nut_syntax_op_kind;
+
+#define NUT_SYNTAX_NONE 0xffffffff
+#define NUT_SYNTAX_MAX_LABELS 16
+
+typedef struct {
+	nut_syntax_op_kind kind;
+	uint32_t line;
+	uint32_t label;     // Label index, for jumps and labels
+	uint32_t capture;   // Capture index, or NUT_SYNTAX_NONE to use value
+	object_id value;    // Constant for push()
+} nut_syntax_op;
+
+typedef struct {
+	nut_name name;
+	nut_name selector;
+	nut_capture_kind *captures; // The receiver followed by the arguments
+	nut_syntax_op *ops;
+	uint32_t capture_count;
+	uint32_t label_count;
+	uint32_t op_count;
+} nut_syntax;
+
+typedef struct {
+	nut_name selector; // Empty unless the block was written as a method
+	nut_name *params;
+	nut_name *temps;
+	nut_ast **body;
+	uint32_t param_count;
+	uint32_t temp_count;
+	uint32_t body_count;
+	
+	// Filled in by the compiler
+	uint32_t env_size; // Variables declared here that inner blocks use
+	bool has_env;      // Frame needs an environment for itself or inner blocks
+	object_id method;  // Compiled method, unless the block was inlined
+} nut_block;
+
+struct nut_ast {
+	nut_ast_kind kind;
+	uint32_t line;
+	
+	union {
+		object_id literal;
+		nut_name string;
+		nut_name variable;
+		
+		struct {
+			nut_name name;
+			nut_ast *value;
+		} assign;
+		
+		struct {
+			nut_ast *receiver;
+			nut_name selector;
+			nut_ast **args;
+			uint32_t arg_count;
+			nut_syntax *syntax; // Set when the send was matched by a syntax
+		} send;
+		
+		nut_block block;
+		
+		nut_ast *ret;
+		nut_syntax *syntax;
+	};
+};
+
+static inline bool nut_name_equal(nut_name a, const char *b, size_t length) {
+	return a.length == length && memcmp(a.data, b, length) == 0;
+}
@@ -0,0 +1,508 @@
+/**
+ * Nuttle bytecode cache (.nutc)
+ */
+
+#include <string.h>
+
+#include "nut_cache.h"
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} nut_buffer;
+
+typedef struct {
+	vm_context vm;
+	bool failed;
+	
+	// Map object ids to their index in each table
+	vm_map string_ids;
+	vm_map constant_ids;
+	vm_map method_ids;
+	
+	object_id *strings;
+	nutc_constant *constants;
+	object_id *methods;
+	uint32_t string_count;
+	uint32_t constant_count;
+	uint32_t method_count;
+	uint32_t string_capacity;
+	uint32_t constant_capacity;
+	uint32_t method_capacity;
+} nut_cache_writer;
+
+static bool nut_grow(void **array, uint32_t *capacity, uint32_t needed, size_t element) {
+	if (needed <= *capacity) {
+		return true;
+	}
+	
+	uint32_t new_capacity = *capacity ? 2 * *capacity : 32;
+	void *new_array = DgMemoryReallocate(*array, new_capacity * element);
+	
+	if (!new_array) {
+		return false;
+	}
+	
+	*array = new_array;
+	*capacity = new_capacity;
+	
+	return true;
+}
+
+static uint32_t nut_cache_index(nut_cache_writer *this, vm_map *map, object_id id) {
+	object_id *index = vm_map_find(map, id);
+	return index ? OBJID_SEXT(*index) : NUTC_NONE;
+}
+
+static uint32_t nut_cache_add_method(nut_cache_writer *this, object_id id);
+
+static uint32_t nut_cache_add_string(nut_cache_writer *this, object_id id) {
+	uint32_t index = nut_cache_index(this, &this->string_ids, id);
+	
+	if (index != NUTC_NONE) {
+		return index;
+	}
+	
+	if (!nut_grow((void **) &this->strings, &this->string_capacity, this->string_count + 1, sizeof *this->strings)) {
+		this->failed = true;
+		return 0;
+	}
+	
+	index = this->string_count++;
+	this->strings[index] = id;
+	vm_map_put(this->vm, &this->string_ids, id, MAKE_OBJID(OCLS_SINT, index));
+	
+	return index;
+}
+
+static uint32_t nut_cache_add_constant(nut_cache_writer *this, object_id id) {
+	uint32_t index = nut_cache_index(this, &this->constant_ids, id);
+	
+	if (index != NUTC_NONE) {
+		return index;
+	}
+	
+	nutc_constant constant = {NUTC_CONST_IMMEDIATE, 0, id};
+	object_hd *header = GET_OBJID_CLS(id) == OCLS_ID ? vm_lookup(this->vm, id) : NULL;
+	
+	if (header && header->type == OID_LONG_STRING) {
+		constant.kind = NUTC_CONST_STRING;
+		constant.value = nut_cache_add_string(this, id);
+	}
+	else if (header && header->type == OID_METHOD) {
+		constant.kind = NUTC_CONST_METHOD;
+		constant.value = nut_cache_add_method(this, id);
+	}
+	else if (header || (id != OID_NIL && GET_OBJID_CLS(id) == OCLS_ID)) {
+		// Only the constants the compiler makes can be written
+		this->failed = true;
+		return 0;
+	}
+	
+	if (!nut_grow((void **) &this->constants, &this->constant_capacity, this->constant_count + 1, sizeof *this->constants)) {
+		this->failed = true;
+		return 0;
+	}
+	
+	index = this->constant_count++;
+	this->constants[index] = constant;
+	vm_map_put(this->vm, &this->constant_ids, id, MAKE_OBJID(OCLS_SINT, index));
+	
+	return index;
+}
+
+static uint32_t nut_cache_add_method(nut_cache_writer *this, object_id id) {
+	/**
+	 * Add a method after the methods in its literals
+	 */
+	
+	uint32_t index = nut_cache_index(this, &this->method_ids, id);
+	
+	if (index != NUTC_NONE) {
+		return index;
+	}
+	
+	objt_method *method = (objt_method *) vm_lookup(this->vm, id);
+	
+	for (size_t i = 0; i < method->literal_count; i++) {
+		nut_cache_add_constant(this, method->literals[i]);
+	}
+	
+	if (method->selector != OID_NIL) {
+		nut_cache_add_constant(this, method->selector);
+	}
+	
+	if (!nut_grow((void **) &this->methods, &this->method_capacity, this->method_count + 1, sizeof *this->methods)) {
+		this->failed = true;
+		return 0;
+	}
+	
+	index = this->method_count++;
+	this->methods[index] = id;
+	vm_map_put(this->vm, &this->method_ids, id, MAKE_OBJID(OCLS_SINT, index));
+	
+	return index;
+}
+
+static size_t nut_align(size_t offset) {
+	return (offset + 7) & ~(size_t) 7;
+}
+
+void *nut_cache_write(vm_context vm, object_id method, uint64_t source_hash, uint64_t source_size, size_t *size) {
+	/**
+	 * Serialise a compiled script to the .nutc format
+	 * 
+	 * @param vm VM the script was compiled in
+	 * @param method The script's top level method from nut_compile()
+	 * @param source_hash vm_hash_bytes() of the script's source
+	 * @param source_size Size of the script's source
+	 * @param size Set to the size of the returned data
+	 * @return Data to write, to be freed with DgMemoryFree, or NULL on error
+	 */
+	
+	nut_cache_writer writer;
+	nut_cache_writer *this = &writer;
+	uint8_t *data = NULL;
+	
+	memset(this, 0, sizeof *this);
+	this->vm = vm;
+	vm_map_init(&this->string_ids);
+	vm_map_init(&this->constant_ids);
+	vm_map_init(&this->method_ids);
+	
+	nut_cache_add_method(this, method);
+	
+	if (this->failed) {
+		goto done;
+	}
+	
+	// Lay out the file
+	size_t offset = nut_align(sizeof(nutc_header));
+	size_t string_table = offset;
+	offset += sizeof(nutc_string) * this->string_count;
+	
+	for (uint32_t i = 0; i < this->string_count; i++) {
+		size_t length;
+		vm_tolcstring(vm, this->strings[i], NULL, &length);
+		offset += length;
+	}
+	
+	offset = nut_align(offset);
+	size_t constant_table = offset;
+	offset += sizeof(nutc_constant) * this->constant_count;
+	size_t method_table = offset;
+	offset += sizeof(nutc_method) * this->method_count;
+	
+	for (uint32_t i = 0; i < this->method_count; i++) {
+		objt_method *m = (objt_method *) vm_lookup(vm, this->methods[i]);
+		offset = nut_align(offset) + sizeof(uint32_t) * m->literal_count + m->code_size;
+	}
+	
+	if (offset > UINT32_MAX) {
+		goto done;
+	}
+	
+	data = DgMemoryAllocate(offset);
+	
+	if (!data) {
+		goto done;
+	}
+	
+	memset(data, 0, offset);
+	
+	nutc_header *header = (nutc_header *) data;
+	header->magic = NUTC_MAGIC;
+	header->version = NUTC_VERSION;
+	header->opcode_count = VM_OP_COUNT;
+	header->source_hash = source_hash;
+	header->source_size = source_size;
+	header->file_size = offset;
+	header->string_count = this->string_count;
+	header->string_table = string_table;
+	header->constant_count = this->constant_count;
+	header->constant_table = constant_table;
+	header->method_count = this->method_count;
+	header->method_table = method_table;
+	
+	// Strings
+	nutc_string *strings = (nutc_string *) (data + string_table);
+	size_t head = string_table + sizeof(nutc_string) * this->string_count;
+	
+	for (uint32_t i = 0; i < this->string_count; i++) {
+		size_t length;
+		const char *chars = vm_tolcstring(vm, this->strings[i], NULL, &length);
+		
+		strings[i].offset = head;
+		strings[i].length = length;
+		memcpy(data + head, chars, length);
+		head += length;
+	}
+	
+	// Constants
+	memcpy(data + constant_table, this->constants, sizeof(nutc_constant) * this->constant_count);
+	
+	// Methods
+	nutc_method *methods = (nutc_method *) (data + method_table);
+	head = method_table + sizeof(nutc_method) * this->method_count;
+	
+	for (uint32_t i = 0; i < this->method_count; i++) {
+		objt_method *m = (objt_method *) vm_lookup(vm, this->methods[i]);
+		nutc_method *out = &methods[i];
+		
+		head = nut_align(head);
+		
+		out->selector = m->selector != OID_NIL ? nut_cache_index(this, &this->constant_ids, m->selector) : NUTC_NONE;
+		out->literals = head;
+		out->literal_count = m->literal_count;
+		out->cache_count = m->cache_count;
+		out->arg_count = m->arg_count;
+		out->temp_count = m->temp_count;
+		out->stack_size = m->stack_size;
+		out->line = m->line;
+		out->env_slot = m->env_slot;
+		out->env_size = m->env_size;
+		
+		uint32_t *literals = (uint32_t *) (data + head);
+		
+		for (size_t j = 0; j < m->literal_count; j++) {
+			literals[j] = nut_cache_index(this, &this->constant_ids, m->literals[j]);
+		}
+		
+		head += sizeof(uint32_t) * m->literal_count;
+		
+		out->code = head;
+		out->code_size = m->code_size;
+		memcpy(data + head, m->code, m->code_size);
+		vm_unquicken(data + head, m->code_size); // In case any of it has run
+		head += m->code_size;
+	}
+	
+	*size = offset;
+	
+done:
+	vm_map_free(vm, &this->string_ids);
+	vm_map_free(vm, &this->constant_ids);
+	vm_map_free(vm, &this->method_ids);
+	DgMemoryFree(this->strings);
+	DgMemoryFree(this->constants);
+	DgMemoryFree(this->methods);
+	
+	return data;
+}
+
+static bool nut_cache_in_bounds(size_t size, uint64_t offset, uint64_t length) {
+	return offset <= size && length <= size - offset;
+}
+
+object_id nut_cache_load(vm_context vm, const void *data, size_t size, uint64_t source_hash, uint64_t source_size, object_id source) {
+	/**
+	 * Load a script from a .nutc file, normally mapped straight from disk.
+	 * Nothing is kept pointing into the data once this returns.
+	 * 
+	 * @param vm VM to load into
+	 * @param data Contents of the .nutc file
+	 * @param size Size of the file
+	 * @param source_hash vm_hash_bytes() of the current script source
+	 * @param source_size Size of the current script source
+	 * @param source Name of the script
+	 * @return The script's top level method, or nil if the cache can't be used
+	 */
+	
+	const uint8_t *bytes = data;
+	const nutc_header *header = data;
+	
+	if (size < sizeof *header
+		|| header->magic != NUTC_MAGIC
+		|| header->version != NUTC_VERSION
+		|| header->opcode_count != VM_OP_COUNT
+		|| header->source_hash != source_hash
+		|| header->source_size != source_size
+		|| header->file_size != size
+		|| header->method_count == 0
+		|| !nut_cache_in_bounds(size, header->string_table, (uint64_t) header->string_count * sizeof(nutc_string))
+		|| !nut_cache_in_bounds(size, header->constant_table, (uint64_t) header->constant_count * sizeof(nutc_constant))
+		|| !nut_cache_in_bounds(size, header->method_table, (uint64_t) header->method_count * sizeof(nutc_method))) {
+		return OID_NIL;
+	}
+	
+	const nutc_string *strings = (const nutc_string *) (bytes + header->string_table);
+	const nutc_constant *constants = (const nutc_constant *) (bytes + header->constant_table);
+	const nutc_method *methods = (const nutc_method *) (bytes + header->method_table);
+	
+	// Constants are resolved as they are first used. Methods are kept with
+	// the methods their blocks are made in.
+	object_id *values = DgMemoryAllocate(sizeof *values * header->constant_count + (2 * sizeof *values + sizeof(uint32_t)) * header->method_count);
+	
+	if (!values) {
+		return OID_NIL;
+	}
+	
+	object_id *loaded = values + header->constant_count;
+	object_id *outer = loaded + header->method_count;
+	uint32_t *parents = (uint32_t *) (outer + header->method_count);
+	object_id method = OID_NIL;
+	
+	memset(values, 0, sizeof *values * header->constant_count);
+	
+	for (uint32_t i = 0; i < header->method_count; i++) {
+		const nutc_method *m = &methods[i];
+		
+		if ((m->literals & 3)
+			|| !nut_cache_in_bounds(size, m->literals, (uint64_t) m->literal_count * sizeof(uint32_t))
+			|| !nut_cache_in_bounds(size, m->code, m->code_size)
+			|| m->literal_count > 65536 || m->cache_count > 65536) {
+			goto fail;
+		}
+		
+		method = vm_method_new(vm, m->code_size, m->literal_count, m->cache_count);
+		objt_method *out = (objt_method *) vm_lookup(vm, method);
+		
+		if (!out) {
+			goto fail;
+		}
+		
+		loaded[i] = method;
+		
+		const uint32_t *literals = (const uint32_t *) (bytes + m->literals);
+		
+		for (uint32_t j = 0; j <= m->literal_count; j++) {
+			uint32_t index = (j < m->literal_count) ? literals[j] : m->selector;
+			
+			if (j == m->literal_count && index == NUTC_NONE) {
+				break;
+			}
+			
+			if (index >= header->constant_count) {
+				goto fail;
+			}
+			
+			const nutc_constant *constant = &constants[index];
+			object_id value = values[index];
+			
+			if (value == OID_NIL) {
+				switch (constant->kind) {
+					case NUTC_CONST_IMMEDIATE: {
+						// Only values that are whole in their ID can be
+						// written, anything else would be a forged reference
+						uint64_t cls = GET_OBJID_CLS(constant->value);
+						
+						if (constant->value != OID_NIL && cls != OCLS_SINT && cls != OCLS_SSTR && cls != OCLS_FLOAT && cls != OCLS_BOOL) {
+							goto fail;
+						}
+						
+						value = constant->value;
+						break;
+					}
+					
+					case NUTC_CONST_STRING: {
+						if (constant->value >= header->string_count) {
+							goto fail;
+						}
+						
+						const nutc_string *string = &strings[constant->value];
+						
+						if (!nut_cache_in_bounds(size, string->offset, string->length)) {
+							goto fail;
+						}
+						
+						value = vm_tolstring(vm, (const char *) bytes + string->offset, string->length);
+						break;
+					}
+					
+					case NUTC_CONST_METHOD: {
+						if (constant->value >= i) {
+							goto fail;
+						}
+						
+						value = loaded[constant->value];
+						break;
+					}
+					
+					default: {
+						goto fail;
+					}
+				}
+				
+				values[index] = value;
+			}
+			
+			if (j < m->literal_count) {
+				out->literals[j] = vm_accquire(vm, value);
+			}
+			else {
+				out->selector = vm_accquire(vm, value);
+			}
+		}
+		
+		memcpy((uint8_t *) out->code, bytes + m->code, m->code_size);
+		out->source = vm_accquire(vm, source);
+		out->arg_count = m->arg_count;
+		out->temp_count = m->temp_count;
+		out->stack_size = m->stack_size;
+		out->line = m->line;
+		out->env_slot = m->env_slot;
+		out->env_size = m->env_size;
+		
+		// The environment has to fit in the frame
+		if (m->env_slot && (m->env_slot <= m->arg_count || m->env_slot + VM_ENV_HEADER + m->env_size > 1 + m->arg_count + m->temp_count)) {
+			goto fail;
+		}
+	}
+	
+	// The bytecode is checked from the top level method down, since blocks
+	// come before the methods they're made in and their captured variables
+	// are checked against those
+	for (uint32_t i = 0; i < header->method_count; i++) {
+		parents[i] = NUTC_NONE;
+	}
+	
+	for (uint32_t i = header->method_count; i-- > 0;) {
+		const nutc_method *m = &methods[i];
+		const uint32_t *literals = (const uint32_t *) (bytes + m->literals);
+		size_t outer_count = 0;
+		
+		// Methods with a header are run with no environment around them
+		if (m->selector == NUTC_NONE) {
+			for (uint32_t parent = parents[i]; parent != NUTC_NONE; parent = parents[parent]) {
+				outer[outer_count++] = loaded[parent];
+				
+				if (methods[parent].selector != NUTC_NONE) {
+					break;
+				}
+			}
+		}
+		
+		if (!vm_method_verify(vm, loaded[i], outer, outer_count)) {
+			goto fail;
+		}
+		
+		// A block is only made in one method
+		for (uint32_t j = 0; j < m->literal_count; j++) {
+			const nutc_constant *constant = &constants[literals[j]];
+			
+			if (constant->kind != NUTC_CONST_METHOD) {
+				continue;
+			}
+			
+			if (parents[constant->value] != NUTC_NONE && parents[constant->value] != i) {
+				goto fail;
+			}
+			
+			parents[constant->value] = i;
+		}
+		
+		vm_method_link(vm, loaded[i]);
+	}
+	
+	DgMemoryFree(values);
+	
+	return method;
+	
+fail:
+	// Anything that was made is unreferenced and goes away at the next
+	// collection
+	DgMemoryFree(values);
+	
+	return OID_NIL;
+}
@@ -0,0 +1,78 @@
+/**
+ * Nuttle bytecode cache (.nutc)
+ * 
+ * A .nutc file holds the compiled methods of one script so that it can be
+ * loaded without parsing. All offsets are from the start of the file and all
+ * values are little endian. Sections are 8 byte aligned.
+ * 
+ *     nutc_header
+ *     nutc_string[string_count], then the bytes of the strings
+ *     nutc_constant[constant_count]
+ *     nutc_method[method_count], then literal indexes and code
+ * 
+ * Methods only refer to methods before them, so the last one is the script's
+ * top level method.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+
+#define NUTC_MAGIC 0x4354554e // "NUTC"
+
+// Bump whenever the format or the bytecode changes
+#define NUTC_VERSION 3
+
+#define NUTC_NONE 0xffffffff
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t opcode_count;
+	uint64_t source_hash;
+	uint64_t source_size;
+	uint32_t file_size;
+	uint32_t string_count;
+	uint32_t string_table;
+	uint32_t constant_count;
+	uint32_t constant_table;
+	uint32_t method_count;
+	uint32_t method_table;
+	uint32_t reserved;
+} nutc_header;
+
+typedef struct {
+	uint32_t offset;
+	uint32_t length;
+} nutc_string;
+
+enum {
+	NUTC_CONST_IMMEDIATE, // value is the object id
+	NUTC_CONST_STRING,    // value is an index into the string table
+	NUTC_CONST_METHOD,    // value is an index into the method table
+};
+
+typedef struct {
+	uint32_t kind;
+	uint32_t reserved;
+	uint64_t value;
+} nutc_constant;
+
+typedef struct {
+	uint32_t selector; // Constant index, or NUTC_NONE
+	uint32_t code;
+	uint32_t code_size;
+	uint32_t literals; // Offset of uint32_t constant indexes
+	uint32_t literal_count;
+	uint32_t cache_count;
+	uint16_t arg_count;
+	uint16_t temp_count;
+	uint16_t stack_size;
+	uint16_t line;
+	uint16_t env_slot;
+	uint16_t env_size;
+} nutc_method;
+
+void *nut_cache_write(vm_context vm, object_id method, uint64_t source_hash, uint64_t source_size, size_t *size);
+object_id nut_cache_load(vm_context vm, const void *data, size_t size, uint64_t source_hash, uint64_t source_size, object_id source);
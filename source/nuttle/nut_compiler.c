@@ -0,0 +1,1219 @@
+/**
+ * Nuttle bytecode compiler
+ * 
+ * Turns the AST of a script into VM methods. Before any code is generated the
+ * tree is folded: literals become VM values (strings are interned) and binary
+ * messages between constants are evaluated with the same code the VM uses at
+ * runtime. Arguments and temporaries live in fixed frame slots. Names that
+ * aren't slots are globals if they start with a capital letter and fields of
+ * self otherwise.
+ * 
+ * Sends that were matched by syntax (see nut_macro.c) are compiled from the
+ * syntax's operations. Blocks they inline share their method's frame, with
+ * their temporaries in extra slots.
+ * 
+ * Variables that are used by inner blocks are found by a scan before code is
+ * generated. They are kept in an environment in the frame of the block that
+ * declares them instead of in a slot, and inner blocks reach them by walking
+ * up the environments of the blocks that created them (see vm_promote()).
+ */
+
+#include <setjmp.h>
+
+#include "nut_compiler.h"
+#include "nut_macro.h"
+
+typedef struct {
+	nut_name name;
+	uint32_t slot;
+	int32_t env; // Index in the environment if inner blocks use it, else -1
+} nut_local;
+
+// A declaration that is used by inner blocks. Names point into the source, so
+// their data pointer identifies the declaration.
+typedef struct {
+	const char *name;
+	nut_block *owner;
+	uint32_t index;
+} nut_capture;
+
+// A name in scope while scanning and the block whose frame it lives in
+typedef struct {
+	nut_name name;
+	nut_block *owner;
+} nut_scope_entry;
+
+// Blocks being scanned, innermost first
+typedef struct nut_scan_frame {
+	struct nut_scan_frame *outer;
+	nut_block *block;
+} nut_scan_frame;
+
+typedef struct nut_builder {
+	struct nut_builder *outer;
+	nut_block *block;
+	
+	// Names in scope, innermost last
+	nut_local *locals;
+	size_t local_count;
+	size_t local_capacity;
+	uint32_t slot_count;
+	uint32_t max_slots;
+	
+	uint8_t *code;
+	size_t code_size;
+	size_t code_capacity;
+	
+	object_id *literals;
+	size_t literal_count;
+	size_t literal_capacity;
+	
+	size_t cache_count;
+	uint32_t env_slot;
+	
+	// Where the record operands of PUSH_BLOCK are. They hold the index of the
+	// record until the number of slots is known.
+	size_t *records;
+	size_t record_sites;
+	size_t record_capacity;
+	
+	// Records that could still be in use, see nut_drop_records()
+	uint32_t record_count;
+	uint32_t max_records;
+	size_t stores;
+	
+	int depth;
+	int max_depth;
+} nut_builder;
+
+typedef struct {
+	vm_context vm;
+	nut_error *error;
+	jmp_buf bail;
+	object_id source;
+	nut_builder *current;
+	nut_macros macros;
+	uint32_t line;
+	
+	// Names in scope while scanning, innermost last
+	nut_scope_entry *scope;
+	size_t scope_count;
+	size_t scope_capacity;
+	
+	nut_capture *captures;
+	size_t capture_count;
+	size_t capture_capacity;
+} nut_compiler;
+
+#define NUT_MAX_SLOTS 256
+#define NUT_MAX_LITERALS 65536
+
+static void nut_compiler_fail(nut_compiler *this, const char *message) {
+	this->error->message = message;
+	this->error->line = this->line;
+	longjmp(this->bail, 1);
+}
+
+static void nut_reserve(nut_compiler *this, void **buffer, size_t *capacity, size_t needed, size_t element) {
+	if (needed <= *capacity) {
+		return;
+	}
+	
+	size_t new_capacity = *capacity ? *capacity : 64;
+	
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+	
+	void *new_buffer = DgMemoryReallocate(*buffer, new_capacity * element);
+	
+	if (!new_buffer) {
+		nut_compiler_fail(this, "out of memory");
+	}
+	
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+}
+
+static void nut_emit_byte(nut_compiler *this, uint8_t byte) {
+	nut_builder *b = this->current;
+	nut_reserve(this, (void **) &b->code, &b->code_capacity, b->code_size + 1, 1);
+	b->code[b->code_size++] = byte;
+}
+
+static void nut_emit16(nut_compiler *this, uint16_t value) {
+	nut_emit_byte(this, value & 0xff);
+	nut_emit_byte(this, value >> 8);
+}
+
+static void nut_stack(nut_compiler *this, int delta) {
+	nut_builder *b = this->current;
+	
+	b->depth += delta;
+	
+	if (b->depth > b->max_depth) {
+		b->max_depth = b->depth;
+	}
+}
+
+static void nut_emit_op(nut_compiler *this, uint8_t op, int delta) {
+	nut_emit_byte(this, op);
+	nut_stack(this, delta);
+}
+
+static uint16_t nut_literal(nut_compiler *this, object_id value) {
+	/**
+	 * Get the index of a literal in the current method, adding it if needed
+	 */
+	
+	nut_builder *b = this->current;
+	
+	for (size_t i = 0; i < b->literal_count; i++) {
+		if (b->literals[i] == value) {
+			return i;
+		}
+	}
+	
+	if (b->literal_count >= NUT_MAX_LITERALS) {
+		nut_compiler_fail(this, "too many literals in one method");
+	}
+	
+	nut_reserve(this, (void **) &b->literals, &b->literal_capacity, b->literal_count + 1, sizeof *b->literals);
+	b->literals[b->literal_count] = value;
+	
+	return b->literal_count++;
+}
+
+static object_id nut_intern_name(nut_compiler *this, nut_name name) {
+	object_id id = vm_tolstring(this->vm, name.data, name.length);
+	
+	if (id == OID_NIL) {
+		nut_compiler_fail(this, "out of memory");
+	}
+	
+	return id;
+}
+
+static void nut_emit_send(nut_compiler *this, nut_name selector, uint32_t argc) {
+	nut_builder *b = this->current;
+	
+	if (b->cache_count >= 65536) {
+		nut_compiler_fail(this, "too many sends in one method");
+	}
+	
+	if (argc > 255) {
+		nut_compiler_fail(this, "too many arguments");
+	}
+	
+	nut_emit_op(this, VM_OP_SEND, -(int) argc);
+	nut_emit16(this, nut_literal(this, nut_intern_name(this, selector)));
+	nut_emit_byte(this, argc);
+	nut_emit16(this, b->cache_count++);
+}
+
+static void nut_emit_env(nut_compiler *this, uint8_t op, uint32_t depth, uint32_t index) {
+	if (depth > 255) {
+		nut_compiler_fail(this, "blocks are nested too deeply");
+	}
+	
+	nut_emit_op(this, op, (op == VM_OP_PUSH_ENV) ? 1 : 0);
+	nut_emit_byte(this, depth);
+	nut_emit_byte(this, index);
+}
+
+static void nut_emit_constant(nut_compiler *this, object_id value) {
+	if (value == OID_NIL) {
+		nut_emit_op(this, VM_OP_PUSH_NIL, 1);
+	}
+	else if (value == OID_TRUE) {
+		nut_emit_op(this, VM_OP_PUSH_TRUE, 1);
+	}
+	else if (value == OID_FALSE) {
+		nut_emit_op(this, VM_OP_PUSH_FALSE, 1);
+	}
+	else {
+		nut_emit_op(this, VM_OP_PUSH_LITERAL, 1);
+		nut_emit16(this, nut_literal(this, value));
+	}
+}
+
+static bool nut_pseudo_variable(nut_name name, object_id *value) {
+	/**
+	 * Check for names with a fixed meaning, other than self
+	 */
+	
+	if (nut_name_equal(name, "nil", 3)) {
+		*value = OID_NIL;
+	}
+	else if (nut_name_equal(name, "true", 4) || nut_name_equal(name, "yes", 3)) {
+		*value = OID_TRUE;
+	}
+	else if (nut_name_equal(name, "false", 5) || nut_name_equal(name, "no", 2)) {
+		*value = OID_FALSE;
+	}
+	else {
+		return false;
+	}
+	
+	return true;
+}
+
+static nut_local *nut_find_local(nut_builder *b, nut_name name) {
+	/**
+	 * Find an argument or temporary of a method by name. Inner names shadow
+	 * outer ones.
+	 */
+	
+	for (size_t i = b->local_count; i > 0; i--) {
+		if (nut_name_equal(b->locals[i - 1].name, name.data, name.length)) {
+			return &b->locals[i - 1];
+		}
+	}
+	
+	return NULL;
+}
+
+static nut_capture *nut_find_capture(nut_compiler *this, const char *name, nut_block *owner) {
+	for (size_t i = 0; i < this->capture_count; i++) {
+		if (this->captures[i].name == name && this->captures[i].owner == owner) {
+			return &this->captures[i];
+		}
+	}
+	
+	return NULL;
+}
+
+static uint32_t nut_reserve_slots(nut_compiler *this, uint32_t count) {
+	/**
+	 * Get `count` consecutive slots in the current method
+	 */
+	
+	nut_builder *b = this->current;
+	
+	if (b->slot_count + count > NUT_MAX_SLOTS) {
+		nut_compiler_fail(this, "too many arguments and temporaries");
+	}
+	
+	uint32_t slot = b->slot_count;
+	b->slot_count += count;
+	
+	if (b->slot_count > b->max_slots) {
+		b->max_slots = b->slot_count;
+	}
+	
+	return slot;
+}
+
+static nut_local *nut_add_local(nut_compiler *this, nut_name name, bool param) {
+	/**
+	 * Declare a name in the current method. Arguments always get a slot since
+	 * that's where the caller puts them, but captured temporaries only exist
+	 * in the environment.
+	 */
+	
+	nut_builder *b = this->current;
+	nut_capture *capture = nut_find_capture(this, name.data, b->block);
+	
+	nut_reserve(this, (void **) &b->locals, &b->local_capacity, b->local_count + 1, sizeof *b->locals);
+	nut_local *local = &b->locals[b->local_count++];
+	local->name = name;
+	local->slot = (param || !capture) ? nut_reserve_slots(this, 1) : 0;
+	local->env = capture ? (int32_t) capture->index : -1;
+	
+	return local;
+}
+
+typedef enum {
+	NUT_VAR_SELF,
+	NUT_VAR_CONSTANT,
+	NUT_VAR_SLOT,
+	NUT_VAR_ENV,
+	NUT_VAR_GLOBAL,
+	NUT_VAR_FIELD,
+} nut_var_kind;
+
+typedef struct {
+	object_id value; // Constant, or the name of a global or field
+	uint32_t slot;
+	uint32_t depth;  // Environments to go up for a captured variable
+	uint32_t index;
+} nut_var;
+
+static nut_var_kind nut_resolve(nut_compiler *this, nut_name name, nut_var *var) {
+	if (nut_name_equal(name, "self", 4)) {
+		return NUT_VAR_SELF;
+	}
+	
+	if (nut_pseudo_variable(name, &var->value)) {
+		return NUT_VAR_CONSTANT;
+	}
+	
+	var->depth = 0;
+	
+	for (nut_builder *b = this->current; b; b = b->outer, var->depth++) {
+		nut_local *local = nut_find_local(b, name);
+		
+		if (!local) {
+			continue;
+		}
+		
+		if (local->env >= 0) {
+			var->index = local->env;
+			return NUT_VAR_ENV;
+		}
+		
+		if (b != this->current) {
+			nut_compiler_fail(this, "internal error: outer variable wasn't captured");
+		}
+		
+		var->slot = local->slot;
+		return NUT_VAR_SLOT;
+	}
+	
+	var->value = nut_intern_name(this, name);
+	
+	return (name.data[0] >= 'A' && name.data[0] <= 'Z') ? NUT_VAR_GLOBAL : NUT_VAR_FIELD;
+}
+
+static void nut_scan_declare(nut_compiler *this, nut_name name, nut_block *owner) {
+	nut_reserve(this, (void **) &this->scope, &this->scope_capacity, this->scope_count + 1, sizeof *this->scope);
+	this->scope[this->scope_count++] = (nut_scope_entry) {name, owner};
+}
+
+static void nut_scan_use(nut_compiler *this, nut_name name, nut_scan_frame *frame) {
+	/**
+	 * Note a use of a name. If it was declared by an outer block, the
+	 * declaration is captured and every block in between needs an
+	 * environment to reach it through.
+	 */
+	
+	nut_scope_entry *decl = NULL;
+	
+	for (size_t i = this->scope_count; i > 0; i--) {
+		if (nut_name_equal(this->scope[i - 1].name, name.data, name.length)) {
+			decl = &this->scope[i - 1];
+			break;
+		}
+	}
+	
+	if (!decl || decl->owner == frame->block) {
+		return;
+	}
+	
+	for (; frame->block != decl->owner; frame = frame->outer) {
+		if (frame->block->selector.length) {
+			nut_compiler_fail(this, "methods can't use arguments or temporaries of the code around them");
+		}
+		
+		frame->block->has_env = true;
+	}
+	
+	if (nut_find_capture(this, decl->name.data, decl->owner)) {
+		return;
+	}
+	
+	nut_reserve(this, (void **) &this->captures, &this->capture_capacity, this->capture_count + 1, sizeof *this->captures);
+	this->captures[this->capture_count++] = (nut_capture) {decl->name.data, decl->owner, decl->owner->env_size++};
+	decl->owner->has_env = true;
+}
+
+static void nut_scan(nut_compiler *this, nut_ast *node, nut_scan_frame *frame);
+
+static void nut_scan_block(nut_compiler *this, nut_block *block, nut_scan_frame *frame, bool inlined) {
+	/**
+	 * Scan a block that gets its own frame, or one that is inlined into the
+	 * frame it is in
+	 */
+	
+	size_t scope_count = this->scope_count;
+	nut_scan_frame inner = {frame, block};
+	
+	if (!inlined) {
+		frame = &inner;
+		
+		for (uint32_t i = 0; i < block->param_count; i++) {
+			nut_scan_declare(this, block->params[i], block);
+		}
+	}
+	
+	for (uint32_t i = 0; i < block->temp_count; i++) {
+		nut_scan_declare(this, block->temps[i], frame->block);
+	}
+	
+	for (uint32_t i = 0; i < block->body_count; i++) {
+		nut_scan(this, block->body[i], frame);
+	}
+	
+	this->scope_count = scope_count;
+}
+
+static void nut_scan_expansion(nut_compiler *this, nut_ast *node, nut_scan_frame *frame) {
+	/**
+	 * Scan the captures of a send matched by syntax the same way that
+	 * nut_compile_expansion() will compile them
+	 */
+	
+	nut_syntax *syntax = node->send.syntax;
+	
+	for (uint32_t i = 0; i < syntax->capture_count; i++) {
+		nut_ast *capture = i ? node->send.args[i - 1] : node->send.receiver;
+		bool called = false, pushed = false;
+		
+		for (uint32_t j = 0; j < syntax->op_count; j++) {
+			nut_syntax_op *op = &syntax->ops[j];
+			
+			if (op->capture != i) {
+				continue;
+			}
+			
+			if (op->kind == NUT_SYNTAX_DO_BLOCK || (op->kind == NUT_SYNTAX_COMPARE_IN_SET && syntax->captures[i] == NUT_CAPTURE_BLOCK)) {
+				called = true;
+			}
+			else if (op->kind == NUT_SYNTAX_PUSH || op->kind == NUT_SYNTAX_COMPARE_IN_SET) {
+				pushed = true;
+			}
+		}
+		
+		if (called && capture->kind == NUT_AST_BLOCK && capture->block.param_count == 0 && capture->block.selector.length == 0) {
+			nut_scan_block(this, &capture->block, frame, true);
+		}
+		else if (called) {
+			pushed = true;
+		}
+		
+		if (pushed) {
+			nut_scan(this, capture, frame);
+		}
+	}
+}
+
+static void nut_scan(nut_compiler *this, nut_ast *node, nut_scan_frame *frame) {
+	/**
+	 * Find the variables that inner blocks use
+	 */
+	
+	this->line = node->line;
+	
+	switch (node->kind) {
+		case NUT_AST_VARIABLE: {
+			nut_scan_use(this, node->variable, frame);
+			break;
+		}
+		
+		case NUT_AST_ASSIGN: {
+			nut_scan(this, node->assign.value, frame);
+			this->line = node->line;
+			nut_scan_use(this, node->assign.name, frame);
+			break;
+		}
+		
+		case NUT_AST_RETURN: {
+			nut_scan(this, node->ret, frame);
+			break;
+		}
+		
+		case NUT_AST_BLOCK: {
+			nut_scan_block(this, &node->block, frame, false);
+			break;
+		}
+		
+		case NUT_AST_SEND: {
+			if (node->send.syntax) {
+				nut_scan_expansion(this, node, frame);
+				break;
+			}
+			
+			nut_scan(this, node->send.receiver, frame);
+			
+			for (uint32_t i = 0; i < node->send.arg_count; i++) {
+				nut_scan(this, node->send.args[i], frame);
+			}
+			
+			break;
+		}
+		
+		default: {
+			break;
+		}
+	}
+}
+
+static void nut_fold(nut_compiler *this, nut_ast *node) {
+	/**
+	 * Turn literals into VM values and evaluate messages between constants
+	 */
+	
+	this->line = node->line;
+	
+	switch (node->kind) {
+		case NUT_AST_STRING: {
+			object_id value = nut_intern_name(this, node->string);
+			node->kind = NUT_AST_LITERAL;
+			node->literal = value;
+			break;
+		}
+		
+		case NUT_AST_ASSIGN: {
+			nut_fold(this, node->assign.value);
+			break;
+		}
+		
+		case NUT_AST_RETURN: {
+			nut_fold(this, node->ret);
+			break;
+		}
+		
+		case NUT_AST_BLOCK: {
+			for (uint32_t i = 0; i < node->block.body_count; i++) {
+				nut_fold(this, node->block.body[i]);
+			}
+			
+			break;
+		}
+		
+		case NUT_AST_SEND: {
+			nut_ast *receiver = node->send.receiver;
+			
+			nut_fold(this, receiver);
+			
+			for (uint32_t i = 0; i < node->send.arg_count; i++) {
+				nut_fold(this, node->send.args[i]);
+			}
+			
+			if (receiver->kind != NUT_AST_LITERAL || node->send.selector.length > 2 || node->send.syntax) {
+				break;
+			}
+			
+			object_id result;
+			object_id selector = nut_intern_name(this, node->send.selector);
+			
+			if (node->send.arg_count == 1 && node->send.args[0]->kind == NUT_AST_LITERAL) {
+				if (vm_fold_binary(this->vm, receiver->literal, selector, node->send.args[0]->literal, &result)) {
+					node->kind = NUT_AST_LITERAL;
+					node->literal = result;
+				}
+			}
+			
+			break;
+		}
+		
+		default: {
+			break;
+		}
+	}
+}
+
+static void nut_compile_block(nut_compiler *this, nut_ast *node, bool is_method);
+static void nut_compile_expansion(nut_compiler *this, nut_ast *node);
+
+static void nut_compile_expression(nut_compiler *this, nut_ast *node) {
+	this->line = node->line;
+	
+	switch (node->kind) {
+		case NUT_AST_LITERAL: {
+			nut_emit_constant(this, node->literal);
+			break;
+		}
+		
+		case NUT_AST_VARIABLE: {
+			nut_var var;
+			
+			switch (nut_resolve(this, node->variable, &var)) {
+				case NUT_VAR_SELF: {
+					nut_emit_op(this, VM_OP_PUSH_SELF, 1);
+					break;
+				}
+				
+				case NUT_VAR_CONSTANT: {
+					nut_emit_constant(this, var.value);
+					break;
+				}
+				
+				case NUT_VAR_SLOT: {
+					nut_emit_op(this, VM_OP_PUSH_SLOT, 1);
+					nut_emit_byte(this, var.slot);
+					break;
+				}
+				
+				case NUT_VAR_ENV: {
+					nut_emit_env(this, VM_OP_PUSH_ENV, var.depth, var.index);
+					break;
+				}
+				
+				case NUT_VAR_GLOBAL: {
+					nut_emit_op(this, VM_OP_PUSH_GLOBAL, 1);
+					nut_emit16(this, nut_literal(this, var.value));
+					break;
+				}
+				
+				case NUT_VAR_FIELD: {
+					nut_emit_op(this, VM_OP_PUSH_FIELD, 1);
+					nut_emit16(this, nut_literal(this, var.value));
+					break;
+				}
+			}
+			
+			break;
+		}
+		
+		case NUT_AST_ASSIGN: {
+			nut_var var;
+			nut_var_kind kind = nut_resolve(this, node->assign.name, &var);
+			
+			nut_compile_expression(this, node->assign.value);
+			this->line = node->line;
+			
+			switch (kind) {
+				case NUT_VAR_SELF:
+				case NUT_VAR_CONSTANT: {
+					nut_compiler_fail(this, "can't assign to a pseudo variable");
+					break;
+				}
+				
+				case NUT_VAR_SLOT: {
+					nut_emit_op(this, VM_OP_STORE_SLOT, 0);
+					nut_emit_byte(this, var.slot);
+					this->current->stores++;
+					break;
+				}
+				
+				case NUT_VAR_ENV: {
+					nut_emit_env(this, VM_OP_STORE_ENV, var.depth, var.index);
+					this->current->stores += (var.depth == 0);
+					break;
+				}
+				
+				case NUT_VAR_GLOBAL: {
+					nut_emit_op(this, VM_OP_STORE_GLOBAL, 0);
+					nut_emit16(this, nut_literal(this, var.value));
+					break;
+				}
+				
+				case NUT_VAR_FIELD: {
+					nut_emit_op(this, VM_OP_STORE_FIELD, 0);
+					nut_emit16(this, nut_literal(this, var.value));
+					break;
+				}
+			}
+			
+			break;
+		}
+		
+		case NUT_AST_SEND: {
+			if (node->send.syntax) {
+				nut_compile_expansion(this, node);
+				break;
+			}
+			
+			nut_compile_expression(this, node->send.receiver);
+			
+			for (uint32_t i = 0; i < node->send.arg_count; i++) {
+				nut_compile_expression(this, node->send.args[i]);
+			}
+			
+			this->line = node->line;
+			nut_emit_send(this, node->send.selector, node->send.arg_count);
+			break;
+		}
+		
+		case NUT_AST_BLOCK: {
+			nut_compile_block(this, node, node->block.selector.length != 0);
+			break;
+		}
+		
+		default: {
+			nut_compiler_fail(this, "unexpected return");
+			break;
+		}
+	}
+}
+
+static void nut_drop_records(nut_compiler *this, uint32_t records, size_t stores) {
+	/**
+	 * Let the following statements reuse the block records of a statement
+	 * whose value was dropped. Its blocks can't be used any more unless it
+	 * stored one in an argument or temporary, since everything else promotes
+	 * them.
+	 */
+	
+	nut_builder *b = this->current;
+	
+	if (b->stores == stores) {
+		b->record_count = records;
+	}
+}
+
+static void nut_compile_body(nut_compiler *this, nut_block *block, bool is_method) {
+	/**
+	 * Compile the statements of a block. Methods answer self unless they
+	 * return something else, while plain blocks answer their last statement.
+	 * Nothing after a return is compiled since it can never run.
+	 */
+	
+	nut_builder *b = this->current;
+	nut_ast *last = NULL;
+	uint32_t records = 0;
+	size_t stores = 0;
+	
+	for (uint32_t i = 0; i < block->body_count; i++) {
+		nut_ast *statement = block->body[i];
+		
+		if (statement->kind == NUT_AST_SYNTAX) {
+			continue;
+		}
+		
+		if (last) {
+			nut_emit_op(this, VM_OP_POP, -1);
+			nut_drop_records(this, records, stores);
+		}
+		
+		records = b->record_count;
+		stores = b->stores;
+		
+		if (statement->kind == NUT_AST_RETURN) {
+			nut_compile_expression(this, statement->ret);
+			nut_emit_op(this, VM_OP_RETURN, -1);
+			return;
+		}
+		
+		nut_compile_expression(this, statement);
+		last = statement;
+	}
+	
+	if (last && !is_method) {
+		nut_emit_op(this, VM_OP_RETURN, -1);
+		return;
+	}
+	
+	if (last) {
+		nut_emit_op(this, VM_OP_POP, -1);
+	}
+	
+	nut_emit_op(this, is_method ? VM_OP_PUSH_SELF : VM_OP_PUSH_NIL, 1);
+	nut_emit_op(this, VM_OP_RETURN, -1);
+}
+
+static void nut_compile_inline(nut_compiler *this, nut_block *block) {
+	/**
+	 * Compile a block without arguments straight into the current method,
+	 * leaving its value on the stack. Its temporaries get slots of their own
+	 * (or places in the environment) which are cleared each time the block is
+	 * entered, and ^ returns from the method.
+	 */
+	
+	nut_builder *b = this->current;
+	size_t local_count = b->local_count;
+	uint32_t slot_count = b->slot_count;
+	
+	for (uint32_t i = 0; i < block->temp_count; i++) {
+		nut_local *local = nut_add_local(this, block->temps[i], false);
+		nut_emit_op(this, VM_OP_PUSH_NIL, 1);
+		
+		if (local->env >= 0) {
+			nut_emit_env(this, VM_OP_STORE_ENV, 0, local->env);
+		}
+		else {
+			nut_emit_op(this, VM_OP_STORE_SLOT, 0);
+			nut_emit_byte(this, local->slot);
+		}
+		
+		nut_emit_op(this, VM_OP_POP, -1);
+	}
+	
+	bool value = false;
+	uint32_t records = 0;
+	size_t stores = 0;
+	
+	for (uint32_t i = 0; i < block->body_count; i++) {
+		nut_ast *statement = block->body[i];
+		
+		if (value) {
+			nut_emit_op(this, VM_OP_POP, -1);
+			nut_drop_records(this, records, stores);
+		}
+		
+		records = b->record_count;
+		stores = b->stores;
+		
+		if (statement->kind == NUT_AST_RETURN) {
+			nut_compile_expression(this, statement->ret);
+			nut_emit_op(this, VM_OP_RETURN, -1);
+			
+			// Whatever comes next can't be reached, but expects a value
+			nut_stack(this, 1);
+			value = true;
+			break;
+		}
+		
+		nut_compile_expression(this, statement);
+		value = true;
+	}
+	
+	if (!value) {
+		nut_emit_op(this, VM_OP_PUSH_NIL, 1);
+	}
+	
+	b->local_count = local_count;
+	b->slot_count = slot_count;
+}
+
+static void nut_compile_capture(nut_compiler *this, nut_ast *node, bool call) {
+	/**
+	 * Compile a captured expression. If `call` is set, the value of the block
+	 * it is is wanted rather than the block itself.
+	 */
+	
+	if (!call) {
+		nut_compile_expression(this, node);
+	}
+	else if (node->kind == NUT_AST_BLOCK && node->block.param_count == 0 && node->block.selector.length == 0) {
+		nut_compile_inline(this, &node->block);
+	}
+	else {
+		nut_compile_expression(this, node);
+		nut_emit_send(this, (nut_name) {"value", 5}, 0);
+	}
+}
+
+static void nut_emit_jump(nut_compiler *this, uint8_t op, int32_t target, size_t *fixup) {
+	/**
+	 * Emit a jump to `target`, or if that isn't known yet leave the offset to
+	 * be patched and store where it is in `fixup`
+	 */
+	
+	nut_emit_op(this, op, (op == VM_OP_JUMP) ? 0 : -1);
+	
+	if (target < 0) {
+		*fixup = this->current->code_size;
+		nut_emit16(this, 0);
+		return;
+	}
+	
+	int64_t offset = (int64_t) target - (int64_t) (this->current->code_size + 2);
+	
+	if (offset < INT16_MIN) {
+		nut_compiler_fail(this, "jump is too far");
+	}
+	
+	nut_emit16(this, offset);
+}
+
+static void nut_patch_jump(nut_compiler *this, size_t fixup) {
+	nut_builder *b = this->current;
+	int64_t offset = (int64_t) b->code_size - (int64_t) (fixup + 2);
+	
+	if (offset > INT16_MAX) {
+		nut_compiler_fail(this, "jump is too far");
+	}
+	
+	b->code[fixup] = offset & 0xff;
+	b->code[fixup + 1] = (offset >> 8) & 0xff;
+}
+
+static void nut_compile_expansion(nut_compiler *this, nut_ast *node) {
+	/**
+	 * Compile a send using the operations of the syntax it matched. Captures
+	 * are the receiver followed by the arguments.
+	 */
+	
+	nut_syntax *syntax = node->send.syntax;
+	nut_builder *b = this->current;
+	
+	int32_t positions[NUT_SYNTAX_MAX_LABELS];
+	int depths[NUT_SYNTAX_MAX_LABELS];
+	size_t fixups[NUT_SYNTAX_MAX_LABELS][8];
+	uint32_t fixup_counts[NUT_SYNTAX_MAX_LABELS];
+	
+	for (uint32_t i = 0; i < syntax->label_count; i++) {
+		positions[i] = -1;
+		depths[i] = -1;
+		fixup_counts[i] = 0;
+	}
+	
+	int base = b->depth;
+	bool reachable = true;
+	bool compared = false;
+	
+	for (uint32_t i = 0; i < syntax->op_count; i++) {
+		nut_syntax_op *op = &syntax->ops[i];
+		nut_ast *capture = NULL;
+		
+		if (op->capture != NUT_SYNTAX_NONE) {
+			capture = op->capture ? node->send.args[op->capture - 1] : node->send.receiver;
+		}
+		
+		this->line = node->line;
+		
+		switch (op->kind) {
+			case NUT_SYNTAX_COMPARE_IN_SET: {
+				nut_compile_capture(this, capture, syntax->captures[op->capture] == NUT_CAPTURE_BLOCK);
+				compared = true;
+				continue;
+			}
+			
+			case NUT_SYNTAX_GOTO_WHEN_EQUAL:
+			case NUT_SYNTAX_GOTO_WHEN_NOT_EQUAL:
+			case NUT_SYNTAX_GOTO: {
+				uint8_t jump = VM_OP_JUMP;
+				
+				if (op->kind != NUT_SYNTAX_GOTO) {
+					if (!compared) {
+						nut_compiler_fail(this, "conditional goto in syntax must follow compare_in_set");
+					}
+					
+					jump = (op->kind == NUT_SYNTAX_GOTO_WHEN_EQUAL) ? VM_OP_JUMP_IF_FALSE : VM_OP_JUMP_IF_TRUE;
+				}
+				
+				if (positions[op->label] < 0 && fixup_counts[op->label] == 8) {
+					nut_compiler_fail(this, "too many jumps to one label in syntax");
+				}
+				
+				nut_emit_jump(this, jump, positions[op->label], &fixups[op->label][fixup_counts[op->label]]);
+				
+				if (positions[op->label] < 0) {
+					fixup_counts[op->label]++;
+				}
+				
+				if (depths[op->label] < 0) {
+					depths[op->label] = b->depth;
+				}
+				else if (depths[op->label] != b->depth) {
+					nut_compiler_fail(this, "syntax leaves the stack unbalanced");
+				}
+				
+				reachable = (op->kind != NUT_SYNTAX_GOTO);
+				break;
+			}
+			
+			case NUT_SYNTAX_LABEL: {
+				if (!reachable) {
+					b->depth = depths[op->label] < 0 ? b->depth : depths[op->label];
+				}
+				else if (depths[op->label] >= 0 && depths[op->label] != b->depth) {
+					nut_compiler_fail(this, "syntax leaves the stack unbalanced");
+				}
+				
+				depths[op->label] = b->depth;
+				positions[op->label] = b->code_size;
+				
+				for (uint32_t j = 0; j < fixup_counts[op->label]; j++) {
+					nut_patch_jump(this, fixups[op->label][j]);
+				}
+				
+				reachable = true;
+				break;
+			}
+			
+			case NUT_SYNTAX_DO_BLOCK: {
+				nut_compile_capture(this, capture, true);
+				break;
+			}
+			
+			case NUT_SYNTAX_PUSH: {
+				if (capture) {
+					nut_compile_capture(this, capture, false);
+				}
+				else {
+					nut_emit_constant(this, op->value);
+				}
+				
+				break;
+			}
+			
+			case NUT_SYNTAX_POP: {
+				nut_emit_op(this, VM_OP_POP, -1);
+				break;
+			}
+		}
+		
+		compared = false;
+	}
+	
+	if (b->depth != base + 1) {
+		nut_compiler_fail(this, "syntax must leave exactly one value");
+	}
+}
+
+static object_id nut_finish_method(nut_compiler *this, nut_builder *b, object_id selector, uint32_t line) {
+	/**
+	 * Copy everything that was built into a new VM method
+	 */
+	
+	vm_context vm = this->vm;
+	
+	if (b->max_slots + VM_SBLOCK_SIZE * b->max_records > UINT16_MAX) {
+		nut_compiler_fail(this, "too many blocks in one statement");
+	}
+	
+	// Records go after the temporaries
+	for (size_t i = 0; i < b->record_sites; i++) {
+		uint8_t *operand = &b->code[b->records[i]];
+		size_t slot = b->max_slots + VM_SBLOCK_SIZE * (operand[0] | (operand[1] << 8));
+		operand[0] = slot & 0xff;
+		operand[1] = slot >> 8;
+	}
+	
+	object_id method = vm_method_new(vm, b->code_size, b->literal_count, b->cache_count);
+	objt_method *header = (objt_method *) vm_lookup(vm, method);
+	
+	if (!header) {
+		nut_compiler_fail(this, "out of memory");
+	}
+	
+	memcpy((uint8_t *) header->code, b->code, b->code_size);
+	
+	for (size_t i = 0; i < b->literal_count; i++) {
+		header->literals[i] = vm_accquire(vm, b->literals[i]);
+	}
+	
+	header->selector = vm_accquire(vm, selector);
+	header->source = vm_accquire(vm, this->source);
+	header->arg_count = b->block->param_count;
+	header->temp_count = b->max_slots + VM_SBLOCK_SIZE * b->max_records - 1 - b->block->param_count;
+	header->stack_size = b->max_depth;
+	header->line = line;
+	header->env_slot = b->env_slot;
+	header->env_size = b->block->env_size;
+	
+	vm_method_link(vm, method);
+	
+	return method;
+}
+
+static void nut_free_builder(nut_builder *b) {
+	DgMemoryFree(b->locals);
+	DgMemoryFree(b->code);
+	DgMemoryFree(b->literals);
+	DgMemoryFree(b->records);
+	DgMemoryFree(b);
+}
+
+static object_id nut_compile_method(nut_compiler *this, nut_ast *node, bool is_method) {
+	/**
+	 * Compile a block into its own method. Builders are on the heap so that
+	 * the chain can still be freed after bailing out of a compile error.
+	 */
+	
+	nut_block *block = &node->block;
+	nut_builder *builder = DgMemoryAllocate(sizeof *builder);
+	
+	if (!builder) {
+		nut_compiler_fail(this, "out of memory");
+	}
+	
+	memset(builder, 0, sizeof *builder);
+	builder->outer = this->current;
+	builder->block = block;
+	builder->slot_count = 1;
+	builder->max_slots = 1;
+	this->current = builder;
+	
+	for (uint32_t i = 0; i < block->param_count; i++) {
+		nut_add_local(this, block->params[i], true);
+	}
+	
+	if (block->has_env) {
+		builder->env_slot = nut_reserve_slots(this, VM_ENV_HEADER + block->env_size);
+	}
+	
+	for (uint32_t i = 0; i < block->temp_count; i++) {
+		nut_add_local(this, block->temps[i], false);
+	}
+	
+	// Captured arguments are moved into the environment
+	for (uint32_t i = 0; i < block->param_count; i++) {
+		nut_local *local = &builder->locals[i];
+		
+		if (local->env >= 0) {
+			nut_emit_op(this, VM_OP_PUSH_SLOT, 1);
+			nut_emit_byte(this, local->slot);
+			nut_emit_env(this, VM_OP_STORE_ENV, 0, local->env);
+			nut_emit_op(this, VM_OP_POP, -1);
+		}
+	}
+	
+	nut_compile_body(this, block, is_method);
+	
+	object_id selector = block->selector.length ? nut_intern_name(this, block->selector) : OID_NIL;
+	object_id method = nut_finish_method(this, builder, selector, node->line);
+	block->method = method;
+	
+	this->current = builder->outer;
+	nut_free_builder(builder);
+	
+	return method;
+}
+
+static void nut_compile_block(nut_compiler *this, nut_ast *node, bool is_method) {
+	/**
+	 * Compile a block and the code to make it at runtime. It is made in a
+	 * record after the temporaries of the current frame, and only moved to
+	 * the heap if needed.
+	 */
+	
+	object_id method = nut_compile_method(this, node, is_method);
+	
+	this->line = node->line;
+	nut_emit_op(this, VM_OP_PUSH_BLOCK, 1);
+	nut_emit16(this, nut_literal(this, method));
+	
+	nut_builder *b = this->current;
+	nut_reserve(this, (void **) &b->records, &b->record_capacity, b->record_sites + 1, sizeof *b->records);
+	b->records[b->record_sites++] = b->code_size;
+	nut_emit16(this, b->record_count++);
+	
+	if (b->record_count > b->max_records) {
+		b->max_records = b->record_count;
+	}
+}
+
+object_id nut_compile(vm_context vm, nut_ast *script, object_id source, nut_error *error) {
+	/**
+	 * Compile a parsed script into a method which runs its top level
+	 * statements with the script's prototype as self.
+	 * 
+	 * @param vm VM to create the methods in
+	 * @param script Script block from nut_parse()
+	 * @param source Name of the script, used in error messages
+	 * @param error Filled in with the first error if compiling fails
+	 * @return The script's method, or nil on failure
+	 */
+	
+	nut_compiler compiler;
+	nut_compiler *this = &compiler;
+	object_id volatile method = OID_NIL;
+	
+	memset(this, 0, sizeof *this);
+	this->vm = vm;
+	this->error = error;
+	this->source = source;
+	
+	if (!nut_macros_init(&this->macros, error)) {
+		nut_macros_free(&this->macros);
+		return OID_NIL;
+	}
+	
+	if (!setjmp(this->bail)) {
+		if (!nut_expand(&this->macros, script, error)) {
+			longjmp(this->bail, 1);
+		}
+		
+		nut_fold(this, script);
+		nut_scan_block(this, &script->block, NULL, false);
+		method = nut_compile_method(this, script, true);
+	}
+	else {
+		// Free the buffers of the methods that were being built
+		while (this->current) {
+			nut_builder *outer = this->current->outer;
+			nut_free_builder(this->current);
+			this->current = outer;
+		}
+	}
+	
+	nut_macros_free(&this->macros);
+	DgMemoryFree(this->scope);
+	DgMemoryFree(this->captures);
+	
+	return method;
+}
@@ -0,0 +1,12 @@
+/**
+ * Nuttle bytecode compiler
+ */
+
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+#include "nut_ast.h"
+#include "nut_parser.h"
+
+object_id nut_compile(vm_context vm, nut_ast *script, object_id source, nut_error *error);
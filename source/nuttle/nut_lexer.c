@@ -0,0 +1,371 @@
+/**
+ * Nuttle lexer
+ * 
+ * Tokens are produced on demand in a single pass over the source. Everything
+ * is driven by a character class table so each byte costs one load and one
+ * branch in the common case.
+ */
+
+#include <stdlib.h>
+
+#include "nut_lexer.h"
+
+enum {
+	NUT_CC_OTHER = 0,
+	NUT_CC_SPACE,
+	NUT_CC_NEWLINE,
+	NUT_CC_ALPHA,
+	NUT_CC_DIGIT,
+	NUT_CC_SQUOTE,
+	NUT_CC_DQUOTE,
+	NUT_CC_OPERATOR,
+	NUT_CC_COLON,
+	NUT_CC_SINGLE, // Single character token, see gNutSingleTokens
+};
+
+// Flags for identifier and number continuation
+enum {
+	NUT_CF_IDENT = (1 << 0),
+	NUT_CF_DIGIT = (1 << 1),
+	NUT_CF_HEX = (1 << 2),
+	NUT_CF_OPERATOR = (1 << 3),
+};
+
+static const uint8_t gNutCharClass[256] = {
+	[' '] = NUT_CC_SPACE, ['\t'] = NUT_CC_SPACE, ['\r'] = NUT_CC_SPACE, ['\v'] = NUT_CC_SPACE, ['\f'] = NUT_CC_SPACE,
+	['\n'] = NUT_CC_NEWLINE,
+	['_'] = NUT_CC_ALPHA,
+	['a' ... 'z'] = NUT_CC_ALPHA,
+	['A' ... 'Z'] = NUT_CC_ALPHA,
+	['0' ... '9'] = NUT_CC_DIGIT,
+	['\''] = NUT_CC_SQUOTE,
+	['"'] = NUT_CC_DQUOTE,
+	['+'] = NUT_CC_OPERATOR, ['-'] = NUT_CC_OPERATOR, ['*'] = NUT_CC_OPERATOR, ['/'] = NUT_CC_OPERATOR,
+	['\\'] = NUT_CC_OPERATOR, ['%'] = NUT_CC_OPERATOR, ['<'] = NUT_CC_OPERATOR, ['>'] = NUT_CC_OPERATOR,
+	['='] = NUT_CC_OPERATOR, ['~'] = NUT_CC_OPERATOR, ['!'] = NUT_CC_OPERATOR, ['@'] = NUT_CC_OPERATOR,
+	['&'] = NUT_CC_OPERATOR, ['?'] = NUT_CC_OPERATOR, [','] = NUT_CC_OPERATOR,
+	[':'] = NUT_CC_COLON,
+	['^'] = NUT_CC_SINGLE, ['.'] = NUT_CC_SINGLE, [';'] = NUT_CC_SINGLE, ['|'] = NUT_CC_SINGLE,
+	['('] = NUT_CC_SINGLE, [')'] = NUT_CC_SINGLE, ['['] = NUT_CC_SINGLE, [']'] = NUT_CC_SINGLE,
+	['{'] = NUT_CC_SINGLE, ['}'] = NUT_CC_SINGLE, ['#'] = NUT_CC_SINGLE,
+};
+
+static const uint8_t gNutCharFlags[256] = {
+	['_'] = NUT_CF_IDENT,
+	['a' ... 'f'] = NUT_CF_IDENT | NUT_CF_HEX,
+	['g' ... 'z'] = NUT_CF_IDENT,
+	['A' ... 'F'] = NUT_CF_IDENT | NUT_CF_HEX,
+	['G' ... 'Z'] = NUT_CF_IDENT,
+	['0' ... '9'] = NUT_CF_IDENT | NUT_CF_DIGIT | NUT_CF_HEX,
+	['+'] = NUT_CF_OPERATOR, ['-'] = NUT_CF_OPERATOR, ['*'] = NUT_CF_OPERATOR, ['/'] = NUT_CF_OPERATOR,
+	['\\'] = NUT_CF_OPERATOR, ['%'] = NUT_CF_OPERATOR, ['<'] = NUT_CF_OPERATOR, ['>'] = NUT_CF_OPERATOR,
+	['='] = NUT_CF_OPERATOR, ['~'] = NUT_CF_OPERATOR, ['!'] = NUT_CF_OPERATOR, ['@'] = NUT_CF_OPERATOR,
+	['&'] = NUT_CF_OPERATOR, ['?'] = NUT_CF_OPERATOR, [','] = NUT_CF_OPERATOR,
+};
+
+static const uint8_t gNutSingleTokens[256] = {
+	['^'] = NUT_TOK_CARET,
+	['.'] = NUT_TOK_PERIOD,
+	[';'] = NUT_TOK_SEMICOLON,
+	['|'] = NUT_TOK_BAR,
+	['('] = NUT_TOK_LPAREN,
+	[')'] = NUT_TOK_RPAREN,
+	['['] = NUT_TOK_LBRACKET,
+	[']'] = NUT_TOK_RBRACKET,
+	['{'] = NUT_TOK_LBRACE,
+	['}'] = NUT_TOK_RBRACE,
+	['#'] = NUT_TOK_HASH,
+};
+
+// Largest magnitude that fits in a small integer object
+#define NUT_SINT_MAX ((1ull << 60) - 1)
+
+void nut_lexer_init(nut_lexer *this, const char *source, size_t length) {
+	this->start = source;
+	this->head = source;
+	this->end = source + length;
+	this->line = 1;
+}
+
+static void nut_lexer_error(nut_lexer *this, nut_token *token, const char *message) {
+	token->type = NUT_TOK_ERROR;
+	token->error = message;
+}
+
+static void nut_lexer_number(nut_lexer *this, nut_token *token) {
+	/**
+	 * Lex a decimal, binary or hex number. Integers too big for a small
+	 * integer become floats.
+	 */
+	
+	const char *p = this->head;
+	const char *end = this->end;
+	uint64_t value = 0;
+	bool overflow = false;
+	
+	// Binary and hexadecimal
+	if (p[0] == '0' && p + 1 < end && ((p[1] | 0x20) == 'b' || (p[1] | 0x20) == 'x')) {
+		int shift = ((p[1] | 0x20) == 'b') ? 1 : 4;
+		uint8_t mask = (shift == 1) ? NUT_CF_DIGIT : NUT_CF_HEX;
+		const char *digits = p + 2;
+		
+		p = digits;
+		
+		while (p < end && (gNutCharFlags[(uint8_t) *p] & mask)) {
+			uint8_t c = *p;
+			uint64_t digit = (c <= '9') ? (c - '0') : ((c | 0x20) - 'a' + 10);
+			
+			if (digit >> shift) {
+				break;
+			}
+			
+			if (value > (NUT_SINT_MAX >> shift)) {
+				overflow = true;
+			}
+			
+			value = (value << shift) | digit;
+			p++;
+		}
+		
+		if (p == digits || (p < end && (gNutCharFlags[(uint8_t) *p] & NUT_CF_IDENT))) {
+			this->head = p;
+			nut_lexer_error(this, token, "malformed number");
+			return;
+		}
+		
+		if (overflow) {
+			this->head = p;
+			nut_lexer_error(this, token, "number is too large");
+			return;
+		}
+		
+		token->type = NUT_TOK_INTEGER;
+		token->integer = value;
+		this->head = p;
+		return;
+	}
+	
+	// Decimal integer part
+	while (p < end && (gNutCharFlags[(uint8_t) *p] & NUT_CF_DIGIT)) {
+		uint64_t digit = *p - '0';
+		
+		if (value > (NUT_SINT_MAX - digit) / 10) {
+			overflow = true;
+		}
+		
+		value = value * 10 + digit;
+		p++;
+	}
+	
+	// Fraction part, only when a digit follows the period since a period on
+	// its own ends a statement
+	bool fraction = (p + 1 < end && *p == '.' && (gNutCharFlags[(uint8_t) p[1]] & NUT_CF_DIGIT));
+	
+	if (fraction) {
+		p++;
+		
+		while (p < end && (gNutCharFlags[(uint8_t) *p] & NUT_CF_DIGIT)) {
+			p++;
+		}
+	}
+	
+	if (p < end && (gNutCharFlags[(uint8_t) *p] & NUT_CF_IDENT)) {
+		this->head = p;
+		nut_lexer_error(this, token, "malformed number");
+		return;
+	}
+	
+	if (fraction || overflow) {
+		char buffer[64];
+		size_t length = p - this->head;
+		
+		if (length >= sizeof buffer) {
+			length = sizeof buffer - 1;
+		}
+		
+		memcpy(buffer, this->head, length);
+		buffer[length] = '\0';
+		
+		token->type = NUT_TOK_FLOAT;
+		token->number = strtod(buffer, NULL);
+	}
+	else {
+		token->type = NUT_TOK_INTEGER;
+		token->integer = value;
+	}
+	
+	this->head = p;
+}
+
+static void nut_lexer_string(nut_lexer *this, nut_token *token, char quote) {
+	/**
+	 * Lex a quoted string. The token covers the contents without the quotes.
+	 */
+	
+	const char *p = this->head + 1;
+	const char *end = this->end;
+	bool escaped = false;
+	
+	token->start = p;
+	
+	while (p < end && *p != quote) {
+		if (*p == '\\') {
+			escaped = true;
+			p++;
+			
+			if (p >= end) {
+				break;
+			}
+		}
+		
+		if (*p == '\n') {
+			this->line++;
+		}
+		
+		p++;
+	}
+	
+	if (p >= end) {
+		this->head = end;
+		nut_lexer_error(this, token, "unterminated string");
+		return;
+	}
+	
+	token->type = (quote == '"') ? NUT_TOK_DSTRING : NUT_TOK_STRING;
+	token->length = p - token->start;
+	token->escaped = escaped;
+	this->head = p + 1;
+}
+
+void nut_lexer_next(nut_lexer *this, nut_token *token) {
+	/**
+	 * Read the next token from the source
+	 */
+	
+	const char *p = this->head;
+	const char *end = this->end;
+	
+	// Skip whitespace
+	for (; p < end; p++) {
+		uint8_t cls = gNutCharClass[(uint8_t) *p];
+		
+		if (cls == NUT_CC_NEWLINE) {
+			this->line++;
+		}
+		else if (cls != NUT_CC_SPACE) {
+			break;
+		}
+	}
+	
+	this->head = p;
+	token->start = p;
+	token->line = this->line;
+	token->margin = (p == this->start || p[-1] == '\n');
+	
+	if (p >= end) {
+		token->type = NUT_TOK_EOF;
+		token->length = 0;
+		return;
+	}
+	
+	switch (gNutCharClass[(uint8_t) *p]) {
+		case NUT_CC_ALPHA: {
+			do {
+				p++;
+			} while (p < end && (gNutCharFlags[(uint8_t) *p] & NUT_CF_IDENT));
+			
+			// A colon straight after makes it a keyword, unless it's :=
+			if (p < end && *p == ':' && (p + 1 >= end || p[1] != '=')) {
+				p++;
+				token->type = NUT_TOK_KEYWORD;
+			}
+			else {
+				token->type = NUT_TOK_IDENT;
+			}
+			
+			this->head = p;
+			break;
+		}
+		
+		case NUT_CC_DIGIT: {
+			nut_lexer_number(this, token);
+			break;
+		}
+		
+		case NUT_CC_SQUOTE: {
+			nut_lexer_string(this, token, '\'');
+			return;
+		}
+		
+		case NUT_CC_DQUOTE: {
+			nut_lexer_string(this, token, '"');
+			return;
+		}
+		
+		case NUT_CC_OPERATOR: {
+			do {
+				p++;
+			} while (p < end && (gNutCharFlags[(uint8_t) *p] & NUT_CF_OPERATOR));
+			
+			token->type = NUT_TOK_BINARY;
+			this->head = p;
+			break;
+		}
+		
+		case NUT_CC_COLON: {
+			if (p + 1 < end && p[1] == '=') {
+				token->type = NUT_TOK_ASSIGN;
+				this->head = p + 2;
+			}
+			else {
+				token->type = NUT_TOK_COLON;
+				this->head = p + 1;
+			}
+			
+			break;
+		}
+		
+		case NUT_CC_SINGLE: {
+			token->type = gNutSingleTokens[(uint8_t) *p];
+			this->head = p + 1;
+			break;
+		}
+		
+		default: {
+			this->head = p + 1;
+			nut_lexer_error(this, token, "unexpected character");
+			break;
+		}
+	}
+	
+	token->length = this->head - token->start;
+}
+
+size_t nut_unescape(char *out, const char *string, size_t length) {
+	/**
+	 * Process backslash escapes in the contents of a string token. `out` must
+	 * have space for at least `length` bytes. Returns the unescaped length.
+	 */
+	
+	size_t j = 0;
+	
+	for (size_t i = 0; i < length; i++) {
+		char c = string[i];
+		
+		if (c == '\\' && i + 1 < length) {
+			c = string[++i];
+			
+			switch (c) {
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case 'r': c = '\r'; break;
+				case '0': c = '\0'; break;
+				default: break;
+			}
+		}
+		
+		out[j++] = c;
+	}
+	
+	return j;
+}
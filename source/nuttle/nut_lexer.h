@@ -0,0 +1,58 @@
+/**
+ * Nuttle lexer
+ */
+
+#pragma once
+
+#include "common.h"
+
+typedef enum {
+	NUT_TOK_EOF,
+	NUT_TOK_ERROR,
+	NUT_TOK_IDENT,     // foo
+	NUT_TOK_KEYWORD,   // foo:
+	NUT_TOK_INTEGER,   // 123, 0b101, 0x7f
+	NUT_TOK_FLOAT,     // 1.5
+	NUT_TOK_STRING,    // 'text'
+	NUT_TOK_DSTRING,   // "text"
+	NUT_TOK_BINARY,    // + - * / // , < <= etc.
+	NUT_TOK_ASSIGN,    // :=
+	NUT_TOK_COLON,     // :
+	NUT_TOK_CARET,     // ^
+	NUT_TOK_PERIOD,    // .
+	NUT_TOK_SEMICOLON, // ;
+	NUT_TOK_BAR,       // |
+	NUT_TOK_LPAREN,    // (
+	NUT_TOK_RPAREN,    // )
+	NUT_TOK_LBRACKET,  // [
+	NUT_TOK_RBRACKET,  // ]
+	NUT_TOK_LBRACE,    // {
+	NUT_TOK_RBRACE,    // }
+	NUT_TOK_HASH,      // #
+} nut_token_type;
+
+typedef struct {
+	nut_token_type type;
+	uint32_t line;
+	uint32_t length;
+	bool margin; // Token starts a line with no indentation
+	const char *start;
+	
+	union {
+		int64_t integer; // NUT_TOK_INTEGER
+		double number;   // NUT_TOK_FLOAT
+		bool escaped;    // Strings: true if there are escapes to process
+		const char *error; // NUT_TOK_ERROR
+	};
+} nut_token;
+
+typedef struct {
+	const char *start;
+	const char *head;
+	const char *end;
+	uint32_t line;
+} nut_lexer;
+
+void nut_lexer_init(nut_lexer *this, const char *source, size_t length);
+void nut_lexer_next(nut_lexer *this, nut_token *token);
+size_t nut_unescape(char *out, const char *string, size_t length);
@@ -0,0 +1,256 @@
+/**
+ * Nuttle macro expander
+ * 
+ * Runs between parsing and code generation. Sends that match the pattern of a
+ * syntax definition are marked with that syntax, and the compiler then emits
+ * the syntax's primitive operations in place of the send. Syntax can't bind
+ * any names, so captured expressions always mean what they meant where they
+ * were written, and labels are local to each use of the syntax.
+ * 
+ * Control structures are built in syntax, so they compile into jumps rather
+ * than sends to blocks. A block is only inlined when it is written literally
+ * without arguments; anything else is left as an ordinary send.
+ */
+
+#include "nut_macro.h"
+
+static const char gNutPrelude[] =
+	"global syntax ifTrue :=\n"
+	"	<expr: cond> ifTrue: <block: then>\n"
+	"	=>\n"
+	"	compare_in_set(cond, {0, false, nil}) \\;\n"
+	"	goto_when_equal(:else) \\;\n"
+	"	do_block(then) \\;\n"
+	"	goto(:end) \\;\n"
+	"	label(:else) \\;\n"
+	"	push(nil) \\;\n"
+	"	label(:end) \\;\n"
+	";\n"
+	"global syntax ifFalse :=\n"
+	"	<expr: cond> ifFalse: <block: else>\n"
+	"	=>\n"
+	"	compare_in_set(cond, {0, false, nil}) \\;\n"
+	"	goto_when_not_equal(:else) \\;\n"
+	"	do_block(else) \\;\n"
+	"	goto(:end) \\;\n"
+	"	label(:else) \\;\n"
+	"	push(nil) \\;\n"
+	"	label(:end) \\;\n"
+	";\n"
+	"global syntax ifTrueIfFalse :=\n"
+	"	<expr: cond> ifTrue: <block: then> ifFalse: <block: else>\n"
+	"	=>\n"
+	"	compare_in_set(cond, {0, false, nil}) \\;\n"
+	"	goto_when_equal(:else) \\;\n"
+	"	do_block(then) \\;\n"
+	"	goto(:end) \\;\n"
+	"	label(:else) \\;\n"
+	"	do_block(else) \\;\n"
+	"	label(:end) \\;\n"
+	";\n"
+	"global syntax ifFalseIfTrue :=\n"
+	"	<expr: cond> ifFalse: <block: else> ifTrue: <block: then>\n"
+	"	=>\n"
+	"	compare_in_set(cond, {0, false, nil}) \\;\n"
+	"	goto_when_equal(:else) \\;\n"
+	"	do_block(then) \\;\n"
+	"	goto(:end) \\;\n"
+	"	label(:else) \\;\n"
+	"	do_block(else) \\;\n"
+	"	label(:end) \\;\n"
+	";\n"
+	"global syntax and :=\n"
+	"	<expr: a> and: <block: b>\n"
+	"	=>\n"
+	"	compare_in_set(a, {0, false, nil}) \\;\n"
+	"	goto_when_equal(:no) \\;\n"
+	"	do_block(b) \\;\n"
+	"	goto(:end) \\;\n"
+	"	label(:no) \\;\n"
+	"	push(false) \\;\n"
+	"	label(:end) \\;\n"
+	";\n"
+	"global syntax or :=\n"
+	"	<expr: a> or: <block: b>\n"
+	"	=>\n"
+	"	compare_in_set(a, {0, false, nil}) \\;\n"
+	"	goto_when_not_equal(:yes) \\;\n"
+	"	do_block(b) \\;\n"
+	"	goto(:end) \\;\n"
+	"	label(:yes) \\;\n"
+	"	push(true) \\;\n"
+	"	label(:end) \\;\n"
+	";\n"
+	"global syntax whileTrue :=\n"
+	"	<block: test> whileTrue: <block: body>\n"
+	"	=>\n"
+	"	label(:loop) \\;\n"
+	"	compare_in_set(test, {0, false, nil}) \\;\n"
+	"	goto_when_equal(:end) \\;\n"
+	"	do_block(body) \\;\n"
+	"	pop() \\;\n"
+	"	goto(:loop) \\;\n"
+	"	label(:end) \\;\n"
+	"	push(nil) \\;\n"
+	";\n"
+	"global syntax whileFalse :=\n"
+	"	<block: test> whileFalse: <block: body>\n"
+	"	=>\n"
+	"	label(:loop) \\;\n"
+	"	compare_in_set(test, {0, false, nil}) \\;\n"
+	"	goto_when_not_equal(:end) \\;\n"
+	"	do_block(body) \\;\n"
+	"	pop() \\;\n"
+	"	goto(:loop) \\;\n"
+	"	label(:end) \\;\n"
+	"	push(nil) \\;\n"
+	";\n";
+
+bool nut_macros_init(nut_macros *this, nut_error *error) {
+	/**
+	 * Set up a macro table with the built in syntax
+	 */
+	
+	memset(this, 0, sizeof *this);
+	nut_arena_init(&this->arena, 4096);
+	
+	nut_ast *prelude = nut_parse(&this->arena, gNutPrelude, sizeof gNutPrelude - 1, error);
+	
+	if (!prelude) {
+		return false;
+	}
+	
+	for (uint32_t i = 0; i < prelude->block.body_count; i++) {
+		if (!nut_macros_add(this, prelude->block.body[i]->syntax)) {
+			error->message = "out of memory";
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+void nut_macros_free(nut_macros *this) {
+	DgMemoryFree(this->syntaxes);
+	nut_arena_free(&this->arena);
+}
+
+bool nut_macros_add(nut_macros *this, nut_syntax *syntax) {
+	if (this->count == this->capacity) {
+		uint32_t new_capacity = this->capacity ? 2 * this->capacity : 16;
+		nut_syntax **new_syntaxes = DgMemoryReallocate(this->syntaxes, sizeof *new_syntaxes * new_capacity);
+		
+		if (!new_syntaxes) {
+			return false;
+		}
+		
+		this->syntaxes = new_syntaxes;
+		this->capacity = new_capacity;
+	}
+	
+	this->syntaxes[this->count++] = syntax;
+	
+	return true;
+}
+
+static bool nut_macro_capture_matches(nut_capture_kind kind, nut_ast *node) {
+	if (kind == NUT_CAPTURE_BLOCK) {
+		return node->kind == NUT_AST_BLOCK && node->block.param_count == 0 && node->block.selector.length == 0;
+	}
+	
+	return true;
+}
+
+static nut_syntax *nut_macro_match(nut_macros *this, nut_ast *node) {
+	/**
+	 * Find the syntax for a send, with later definitions taking priority
+	 */
+	
+	for (uint32_t i = this->count; i > 0; i--) {
+		nut_syntax *syntax = this->syntaxes[i - 1];
+		
+		if (syntax->capture_count != node->send.arg_count + 1
+			|| !nut_name_equal(syntax->selector, node->send.selector.data, node->send.selector.length)
+			|| !nut_macro_capture_matches(syntax->captures[0], node->send.receiver)) {
+			continue;
+		}
+		
+		bool matches = true;
+		
+		for (uint32_t j = 0; j < node->send.arg_count && matches; j++) {
+			matches = nut_macro_capture_matches(syntax->captures[j + 1], node->send.args[j]);
+		}
+		
+		if (matches) {
+			return syntax;
+		}
+	}
+	
+	return NULL;
+}
+
+static void nut_macro_expand_node(nut_macros *this, nut_ast *node) {
+	switch (node->kind) {
+		case NUT_AST_ASSIGN: {
+			nut_macro_expand_node(this, node->assign.value);
+			break;
+		}
+		
+		case NUT_AST_RETURN: {
+			nut_macro_expand_node(this, node->ret);
+			break;
+		}
+		
+		case NUT_AST_BLOCK: {
+			for (uint32_t i = 0; i < node->block.body_count; i++) {
+				nut_macro_expand_node(this, node->block.body[i]);
+			}
+			
+			break;
+		}
+		
+		case NUT_AST_SEND: {
+			nut_macro_expand_node(this, node->send.receiver);
+			
+			for (uint32_t i = 0; i < node->send.arg_count; i++) {
+				nut_macro_expand_node(this, node->send.args[i]);
+			}
+			
+			node->send.syntax = nut_macro_match(this, node);
+			break;
+		}
+		
+		default: {
+			break;
+		}
+	}
+}
+
+bool nut_expand(nut_macros *this, nut_ast *script, nut_error *error) {
+	/**
+	 * Expand the syntax used in a script. Syntax defined in the script applies
+	 * from its definition to the end of the script.
+	 * 
+	 * @param this Macro table, which gets the script's definitions added
+	 * @param script Script block from nut_parse()
+	 * @param error Filled in if expanding fails
+	 * @return True on success
+	 */
+	
+	for (uint32_t i = 0; i < script->block.body_count; i++) {
+		nut_ast *statement = script->block.body[i];
+		
+		if (statement->kind == NUT_AST_SYNTAX) {
+			if (!nut_macros_add(this, statement->syntax)) {
+				error->message = "out of memory";
+				error->line = statement->line;
+				return false;
+			}
+		}
+		else {
+			nut_macro_expand_node(this, statement);
+		}
+	}
+	
+	return true;
+}
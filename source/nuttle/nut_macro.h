@@ -0,0 +1,24 @@
+/**
+ * Nuttle macro expander
+ */
+
+#pragma once
+
+#include "common.h"
+#include "nut_arena.h"
+#include "nut_ast.h"
+#include "nut_parser.h"
+
+typedef struct {
+	nut_syntax **syntaxes;
+	uint32_t count;
+	uint32_t capacity;
+	
+	// Holds the AST of the built in syntax
+	nut_arena arena;
+} nut_macros;
+
+bool nut_macros_init(nut_macros *this, nut_error *error);
+void nut_macros_free(nut_macros *this);
+bool nut_macros_add(nut_macros *this, nut_syntax *syntax);
+bool nut_expand(nut_macros *this, nut_ast *script, nut_error *error);
@@ -0,0 +1,948 @@
+/**
+ * Nuttle parser
+ * 
+ * Recursive descent parser for the message syntax described in docs/objects.md.
+ * The whole AST is allocated from an arena, and the names in it point into the
+ * source text, so the source must outlive the AST. Errors unwind straight back
+ * to nut_parse() since everything can be freed with the arena anyway.
+ * 
+ * Double quoted strings at statement boundaries are comments, anywhere else
+ * they are string literals just like single quoted strings. A line that starts
+ * without any indentation always begins a new statement, so top level
+ * definitions don't need to be separated with periods.
+ * 
+ * At the top level of a script, `global syntax` starts a syntax definition
+ * for the macro expander (see nut_macro.c) rather than a statement.
+ */
+
+#include <setjmp.h>
+
+#include "nut_lexer.h"
+#include "nut_parser.h"
+
+// Expressions nested deeper than this are rejected, since parsing and
+// compiling them recurses on the native stack
+#define NUT_PARSER_MAX_NESTING 256
+
+typedef struct {
+	nut_lexer lexer;
+	nut_token cur;
+	nut_token next;
+	
+	nut_arena *arena;
+	nut_error *error;
+	jmp_buf bail;
+	
+	// Scratch stacks used to collect lists before they are copied into the
+	// arena at their final size
+	nut_ast **nodes;
+	size_t node_top;
+	size_t node_capacity;
+	
+	nut_name *names;
+	size_t name_top;
+	size_t name_capacity;
+	
+	// Number of blocks the parser is inside of
+	uint32_t depth;
+	
+	// Number of expressions the parser is inside of
+	uint32_t nesting;
+} nut_parser;
+
+static void nut_parser_fail(nut_parser *this, const char *message, uint32_t line) {
+	this->error->message = message;
+	this->error->line = line;
+	longjmp(this->bail, 1);
+}
+
+static void nut_parser_advance(nut_parser *this) {
+	this->cur = this->next;
+	
+	if (this->cur.type == NUT_TOK_ERROR) {
+		nut_parser_fail(this, this->cur.error, this->cur.line);
+	}
+	
+	if (this->cur.type != NUT_TOK_EOF) {
+		nut_lexer_next(&this->lexer, &this->next);
+	}
+}
+
+static void nut_parser_expect(nut_parser *this, nut_token_type type, const char *message) {
+	if (this->cur.type != type) {
+		nut_parser_fail(this, message, this->cur.line);
+	}
+	
+	nut_parser_advance(this);
+}
+
+static void *nut_parser_alloc(nut_parser *this, size_t size) {
+	void *ptr = nut_arena_alloc(this->arena, size);
+	
+	if (!ptr) {
+		nut_parser_fail(this, "out of memory", this->cur.line);
+	}
+	
+	return ptr;
+}
+
+static nut_ast *nut_parser_node(nut_parser *this, nut_ast_kind kind, uint32_t line) {
+	nut_ast *node = nut_parser_alloc(this, sizeof *node);
+	memset(node, 0, sizeof *node);
+	node->kind = kind;
+	node->line = line;
+	return node;
+}
+
+static nut_name nut_parser_name(nut_token *token) {
+	return (nut_name) {token->start, token->length};
+}
+
+static void nut_parser_push_node(nut_parser *this, nut_ast *node) {
+	if (this->node_top >= this->node_capacity) {
+		size_t new_capacity = this->node_capacity ? (2 * this->node_capacity) : 64;
+		nut_ast **new_nodes = DgMemoryReallocate(this->nodes, sizeof *new_nodes * new_capacity);
+		
+		if (!new_nodes) {
+			nut_parser_fail(this, "out of memory", this->cur.line);
+		}
+		
+		this->nodes = new_nodes;
+		this->node_capacity = new_capacity;
+	}
+	
+	this->nodes[this->node_top++] = node;
+}
+
+static nut_ast **nut_parser_pop_nodes(nut_parser *this, size_t base) {
+	/**
+	 * Move the nodes pushed since `base` into the arena
+	 */
+	
+	size_t count = this->node_top - base;
+	
+	if (!count) {
+		return NULL;
+	}
+	
+	nut_ast **list = nut_parser_alloc(this, sizeof *list * count);
+	memcpy(list, this->nodes + base, sizeof *list * count);
+	this->node_top = base;
+	
+	return list;
+}
+
+static void nut_parser_push_name(nut_parser *this, nut_name name) {
+	if (this->name_top >= this->name_capacity) {
+		size_t new_capacity = this->name_capacity ? (2 * this->name_capacity) : 32;
+		nut_name *new_names = DgMemoryReallocate(this->names, sizeof *new_names * new_capacity);
+		
+		if (!new_names) {
+			nut_parser_fail(this, "out of memory", this->cur.line);
+		}
+		
+		this->names = new_names;
+		this->name_capacity = new_capacity;
+	}
+	
+	this->names[this->name_top++] = name;
+}
+
+static nut_name *nut_parser_pop_names(nut_parser *this, size_t base) {
+	size_t count = this->name_top - base;
+	
+	if (!count) {
+		return NULL;
+	}
+	
+	nut_name *list = nut_parser_alloc(this, sizeof *list * count);
+	memcpy(list, this->names + base, sizeof *list * count);
+	this->name_top = base;
+	
+	return list;
+}
+
+static nut_name nut_parser_join_names(nut_parser *this, size_t base) {
+	/**
+	 * Concatenate the names pushed since `base` into one, for building keyword
+	 * selectors out of their parts
+	 */
+	
+	if (this->name_top - base == 1) {
+		this->name_top = base;
+		return this->names[base];
+	}
+	
+	size_t length = 0;
+	
+	for (size_t i = base; i < this->name_top; i++) {
+		length += this->names[i].length;
+	}
+	
+	char *data = nut_parser_alloc(this, length);
+	char *p = data;
+	
+	for (size_t i = base; i < this->name_top; i++) {
+		memcpy(p, this->names[i].data, this->names[i].length);
+		p += this->names[i].length;
+	}
+	
+	this->name_top = base;
+	
+	return (nut_name) {data, length};
+}
+
+static nut_ast *nut_parse_expression(nut_parser *this);
+static void nut_parse_body(nut_parser *this, nut_block *block, nut_token_type terminator);
+
+static nut_ast *nut_parse_string(nut_parser *this) {
+	nut_ast *node = nut_parser_node(this, NUT_AST_STRING, this->cur.line);
+	
+	if (this->cur.escaped) {
+		char *data = nut_parser_alloc(this, this->cur.length);
+		node->string.data = data;
+		node->string.length = nut_unescape(data, this->cur.start, this->cur.length);
+	}
+	else {
+		node->string = nut_parser_name(&this->cur);
+	}
+	
+	nut_parser_advance(this);
+	
+	return node;
+}
+
+static nut_ast *nut_parse_number(nut_parser *this, bool negative) {
+	nut_ast *node = nut_parser_node(this, NUT_AST_LITERAL, this->cur.line);
+	
+	if (this->cur.type == NUT_TOK_INTEGER) {
+		int64_t value = negative ? -this->cur.integer : this->cur.integer;
+		node->literal = MAKE_OBJID(OCLS_SINT, value);
+	}
+	else {
+		node->literal = OBJ_DOUBLE2ID(negative ? -this->cur.number : this->cur.number);
+	}
+	
+	nut_parser_advance(this);
+	
+	return node;
+}
+
+static nut_ast *nut_parse_block(nut_parser *this) {
+	/**
+	 * Parse a block, which can optionally have a selector to be used as a
+	 * method:
+	 * 
+	 *     [:a :b | ...]
+	 *     [name | ...]
+	 *     [+ other | ...]
+	 *     [at: index put: value | ...]
+	 */
+	
+	nut_ast *node = nut_parser_node(this, NUT_AST_BLOCK, this->cur.line);
+	nut_block *block = &node->block;
+	
+	nut_parser_advance(this);
+	
+	size_t name_base = this->name_top;
+	
+	switch (this->cur.type) {
+		case NUT_TOK_COLON: {
+			while (this->cur.type == NUT_TOK_COLON) {
+				nut_parser_advance(this);
+				
+				if (this->cur.type != NUT_TOK_IDENT) {
+					nut_parser_fail(this, "expected a parameter name after ':'", this->cur.line);
+				}
+				
+				nut_parser_push_name(this, nut_parser_name(&this->cur));
+				nut_parser_advance(this);
+			}
+			
+			block->param_count = this->name_top - name_base;
+			block->params = nut_parser_pop_names(this, name_base);
+			
+			if (this->cur.type != NUT_TOK_RBRACKET) {
+				nut_parser_expect(this, NUT_TOK_BAR, "expected '|' after block parameters");
+			}
+			
+			break;
+		}
+		
+		case NUT_TOK_IDENT: {
+			if (this->next.type == NUT_TOK_BAR) {
+				block->selector = nut_parser_name(&this->cur);
+				nut_parser_advance(this);
+				nut_parser_advance(this);
+			}
+			
+			break;
+		}
+		
+		case NUT_TOK_BINARY: {
+			if (this->next.type == NUT_TOK_IDENT) {
+				block->selector = nut_parser_name(&this->cur);
+				nut_parser_advance(this);
+				nut_parser_push_name(this, nut_parser_name(&this->cur));
+				nut_parser_advance(this);
+				
+				block->param_count = 1;
+				block->params = nut_parser_pop_names(this, name_base);
+				
+				nut_parser_expect(this, NUT_TOK_BAR, "expected '|' after method header");
+			}
+			
+			break;
+		}
+		
+		case NUT_TOK_KEYWORD: {
+			// Keywords and parameter names are pushed as pairs then split
+			while (this->cur.type == NUT_TOK_KEYWORD) {
+				nut_parser_push_name(this, nut_parser_name(&this->cur));
+				nut_parser_advance(this);
+				
+				if (this->cur.type != NUT_TOK_IDENT) {
+					nut_parser_fail(this, "expected a parameter name in method header", this->cur.line);
+				}
+				
+				nut_parser_push_name(this, nut_parser_name(&this->cur));
+				nut_parser_advance(this);
+			}
+			
+			size_t count = (this->name_top - name_base) / 2;
+			size_t length = 0;
+			
+			for (size_t i = 0; i < count; i++) {
+				length += this->names[name_base + 2 * i].length;
+			}
+			
+			char *selector = nut_parser_alloc(this, length);
+			nut_name *params = nut_parser_alloc(this, sizeof *params * count);
+			char *p = selector;
+			
+			for (size_t i = 0; i < count; i++) {
+				nut_name part = this->names[name_base + 2 * i];
+				memcpy(p, part.data, part.length);
+				p += part.length;
+				params[i] = this->names[name_base + 2 * i + 1];
+			}
+			
+			this->name_top = name_base;
+			
+			block->selector = (nut_name) {selector, length};
+			block->params = params;
+			block->param_count = count;
+			
+			nut_parser_expect(this, NUT_TOK_BAR, "expected '|' after method header");
+			break;
+		}
+		
+		default: {
+			break;
+		}
+	}
+	
+	this->depth++;
+	nut_parse_body(this, block, NUT_TOK_RBRACKET);
+	nut_parser_expect(this, NUT_TOK_RBRACKET, "expected ']' to close block");
+	this->depth--;
+	
+	return node;
+}
+
+static nut_ast *nut_parse_primary(nut_parser *this) {
+	switch (this->cur.type) {
+		case NUT_TOK_IDENT: {
+			nut_ast *node = nut_parser_node(this, NUT_AST_VARIABLE, this->cur.line);
+			node->variable = nut_parser_name(&this->cur);
+			nut_parser_advance(this);
+			return node;
+		}
+		
+		case NUT_TOK_INTEGER:
+		case NUT_TOK_FLOAT: {
+			return nut_parse_number(this, false);
+		}
+		
+		case NUT_TOK_STRING:
+		case NUT_TOK_DSTRING: {
+			return nut_parse_string(this);
+		}
+		
+		case NUT_TOK_LPAREN: {
+			nut_parser_advance(this);
+			nut_ast *node = nut_parse_expression(this);
+			nut_parser_expect(this, NUT_TOK_RPAREN, "expected ')'");
+			return node;
+		}
+		
+		case NUT_TOK_LBRACKET: {
+			return nut_parse_block(this);
+		}
+		
+		case NUT_TOK_BINARY: {
+			// Negative number literal, only when the minus is right next to it
+			if (this->cur.length == 1 && this->cur.start[0] == '-'
+				&& (this->next.type == NUT_TOK_INTEGER || this->next.type == NUT_TOK_FLOAT)
+				&& this->next.start == this->cur.start + 1) {
+				nut_parser_advance(this);
+				return nut_parse_number(this, true);
+			}
+			
+			break;
+		}
+		
+		default: {
+			break;
+		}
+	}
+	
+	nut_parser_fail(this, "expected an expression", this->cur.line);
+	
+	return NULL;
+}
+
+static nut_ast *nut_parser_send(nut_parser *this, nut_ast *receiver, nut_name selector, size_t arg_base, uint32_t line) {
+	nut_ast *node = nut_parser_node(this, NUT_AST_SEND, line);
+	node->send.receiver = receiver;
+	node->send.selector = selector;
+	node->send.arg_count = this->node_top - arg_base;
+	node->send.args = nut_parser_pop_nodes(this, arg_base);
+	return node;
+}
+
+static nut_ast *nut_parse_unary(nut_parser *this) {
+	nut_ast *node = nut_parse_primary(this);
+	
+	while (this->cur.type == NUT_TOK_IDENT && !this->cur.margin) {
+		node = nut_parser_send(this, node, nut_parser_name(&this->cur), this->node_top, this->cur.line);
+		nut_parser_advance(this);
+	}
+	
+	return node;
+}
+
+static nut_ast *nut_parse_binary(nut_parser *this) {
+	nut_ast *node = nut_parse_unary(this);
+	
+	while ((this->cur.type == NUT_TOK_BINARY || this->cur.type == NUT_TOK_BAR) && !this->cur.margin) {
+		nut_name selector = nut_parser_name(&this->cur);
+		uint32_t line = this->cur.line;
+		size_t arg_base = this->node_top;
+		
+		nut_parser_advance(this);
+		nut_parser_push_node(this, nut_parse_unary(this));
+		
+		node = nut_parser_send(this, node, selector, arg_base, line);
+	}
+	
+	return node;
+}
+
+static nut_ast *nut_parse_keyword(nut_parser *this) {
+	nut_ast *node = nut_parse_binary(this);
+	
+	if (this->cur.type != NUT_TOK_KEYWORD || this->cur.margin) {
+		return node;
+	}
+	
+	uint32_t line = this->cur.line;
+	size_t arg_base = this->node_top;
+	size_t name_base = this->name_top;
+	
+	while (this->cur.type == NUT_TOK_KEYWORD && !this->cur.margin) {
+		nut_parser_push_name(this, nut_parser_name(&this->cur));
+		nut_parser_advance(this);
+		nut_parser_push_node(this, nut_parse_binary(this));
+	}
+	
+	return nut_parser_send(this, node, nut_parser_join_names(this, name_base), arg_base, line);
+}
+
+static nut_ast *nut_parse_expression(nut_parser *this) {
+	if (this->nesting >= NUT_PARSER_MAX_NESTING) {
+		nut_parser_fail(this, "expressions are nested too deeply", this->cur.line);
+	}
+	
+	nut_ast *node;
+	
+	this->nesting++;
+	
+	if (this->cur.type == NUT_TOK_IDENT && this->next.type == NUT_TOK_ASSIGN) {
+		node = nut_parser_node(this, NUT_AST_ASSIGN, this->cur.line);
+		node->assign.name = nut_parser_name(&this->cur);
+		nut_parser_advance(this);
+		nut_parser_advance(this);
+		node->assign.value = nut_parse_expression(this);
+	}
+	else {
+		node = nut_parse_keyword(this);
+	}
+	
+	this->nesting--;
+	
+	return node;
+}
+
+static bool nut_parser_is(nut_token *token, nut_token_type type, const char *text) {
+	return token->type == type && token->length == strlen(text) && memcmp(token->start, text, token->length) == 0;
+}
+
+static void nut_parser_expect_text(nut_parser *this, nut_token_type type, const char *text, const char *message) {
+	if (!nut_parser_is(&this->cur, type, text)) {
+		nut_parser_fail(this, message, this->cur.line);
+	}
+	
+	nut_parser_advance(this);
+}
+
+static nut_capture_kind nut_parse_capture(nut_parser *this) {
+	/**
+	 * Parse a capture in a syntax pattern, like <expr: name>, pushing its name
+	 */
+	
+	nut_capture_kind kind;
+	
+	nut_parser_expect_text(this, NUT_TOK_BINARY, "<", "expected a capture like '<expr: name>'");
+	
+	if (nut_parser_is(&this->cur, NUT_TOK_KEYWORD, "expr:")) {
+		kind = NUT_CAPTURE_EXPR;
+	}
+	else if (nut_parser_is(&this->cur, NUT_TOK_KEYWORD, "block:")) {
+		kind = NUT_CAPTURE_BLOCK;
+	}
+	else {
+		nut_parser_fail(this, "captures must be 'expr:' or 'block:'", this->cur.line);
+	}
+	
+	nut_parser_advance(this);
+	
+	if (this->cur.type != NUT_TOK_IDENT) {
+		nut_parser_fail(this, "expected a name for the capture", this->cur.line);
+	}
+	
+	nut_parser_push_name(this, nut_parser_name(&this->cur));
+	nut_parser_advance(this);
+	nut_parser_expect_text(this, NUT_TOK_BINARY, ">", "expected '>' to close capture");
+	
+	return kind;
+}
+
+static uint32_t nut_parse_syntax_label(nut_parser *this, size_t label_base) {
+	/**
+	 * Parse a label like :end or :end-of-block, returning its index
+	 */
+	
+	nut_parser_expect(this, NUT_TOK_COLON, "expected a label like ':end'");
+	
+	if (this->cur.type != NUT_TOK_IDENT) {
+		nut_parser_fail(this, "expected a label name", this->cur.line);
+	}
+	
+	const char *start = this->cur.start;
+	const char *end = start + this->cur.length;
+	
+	nut_parser_advance(this);
+	
+	while (nut_parser_is(&this->cur, NUT_TOK_BINARY, "-") && this->cur.start == end && this->next.type == NUT_TOK_IDENT) {
+		nut_parser_advance(this);
+		end = this->cur.start + this->cur.length;
+		nut_parser_advance(this);
+	}
+	
+	nut_name name = {start, end - start};
+	
+	for (size_t i = label_base; i < this->name_top; i++) {
+		if (nut_name_equal(this->names[i], name.data, name.length)) {
+			return i - label_base;
+		}
+	}
+	
+	if (this->name_top - label_base >= NUT_SYNTAX_MAX_LABELS) {
+		nut_parser_fail(this, "too many labels in syntax", this->cur.line);
+	}
+	
+	nut_parser_push_name(this, name);
+	
+	return this->name_top - label_base - 1;
+}
+
+static uint32_t nut_parse_syntax_capture_ref(nut_parser *this, nut_name *captures, uint32_t count) {
+	if (this->cur.type == NUT_TOK_IDENT) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (nut_name_equal(captures[i], this->cur.start, this->cur.length)) {
+				nut_parser_advance(this);
+				return i;
+			}
+		}
+	}
+	
+	nut_parser_fail(this, "expected the name of a capture", this->cur.line);
+	
+	return 0;
+}
+
+static object_id nut_parse_syntax_constant(nut_parser *this) {
+	object_id value;
+	
+	if (nut_parser_is(&this->cur, NUT_TOK_IDENT, "nil")) {
+		value = OID_NIL;
+	}
+	else if (nut_parser_is(&this->cur, NUT_TOK_IDENT, "true")) {
+		value = OID_TRUE;
+	}
+	else if (nut_parser_is(&this->cur, NUT_TOK_IDENT, "false")) {
+		value = OID_FALSE;
+	}
+	else if (this->cur.type == NUT_TOK_INTEGER) {
+		value = MAKE_OBJID(OCLS_SINT, this->cur.integer);
+	}
+	else {
+		nut_parser_fail(this, "expected nil, true, false or an integer", this->cur.line);
+	}
+	
+	nut_parser_advance(this);
+	
+	return value;
+}
+
+static void nut_parse_syntax_set(nut_parser *this) {
+	/**
+	 * Parse the set for compare_in_set. Only the values the VM's conditional
+	 * jumps test for can be used.
+	 */
+	
+	bool zero = false, no = false, nil = false;
+	
+	nut_parser_expect(this, NUT_TOK_LBRACE, "expected '{' to start set");
+	
+	while (true) {
+		object_id value = nut_parse_syntax_constant(this);
+		
+		zero |= (value == MAKE_OBJID(OCLS_SINT, 0));
+		no |= (value == OID_FALSE);
+		nil |= (value == OID_NIL);
+		
+		if (!IS_OBJ_FALSEY(value)) {
+			nut_parser_fail(this, "compare_in_set only supports the set {0, false, nil}", this->cur.line);
+		}
+		
+		if (!nut_parser_is(&this->cur, NUT_TOK_BINARY, ",")) {
+			break;
+		}
+		
+		nut_parser_advance(this);
+	}
+	
+	if (!zero || !no || !nil) {
+		nut_parser_fail(this, "compare_in_set only supports the set {0, false, nil}", this->cur.line);
+	}
+	
+	nut_parser_expect(this, NUT_TOK_RBRACE, "expected '}' to close set");
+}
+
+static nut_ast *nut_parse_syntax(nut_parser *this) {
+	/**
+	 * Parse a syntax definition:
+	 * 
+	 *     global syntax ifTrue :=
+	 *         <expr: cond> ifTrue: <block: body>
+	 *         =>
+	 *         compare_in_set(cond, {0, false, nil}) \;
+	 *         ...
+	 *     ;
+	 */
+	
+	nut_ast *node = nut_parser_node(this, NUT_AST_SYNTAX, this->cur.line);
+	nut_syntax *syntax = nut_parser_alloc(this, sizeof *syntax);
+	
+	memset(syntax, 0, sizeof *syntax);
+	node->syntax = syntax;
+	
+	if (this->depth) {
+		nut_parser_fail(this, "syntax can only be defined at the top level", this->cur.line);
+	}
+	
+	nut_parser_advance(this);
+	nut_parser_advance(this);
+	
+	if (this->cur.type != NUT_TOK_IDENT) {
+		nut_parser_fail(this, "expected a name for the syntax", this->cur.line);
+	}
+	
+	syntax->name = nut_parser_name(&this->cur);
+	nut_parser_advance(this);
+	nut_parser_expect(this, NUT_TOK_ASSIGN, "expected ':=' after syntax name");
+	
+	// Pattern, which has the same shape as a message send
+	size_t capture_base = this->name_top;
+	nut_capture_kind kinds[256];
+	uint32_t count = 0;
+	
+	kinds[count++] = nut_parse_capture(this);
+	
+	if (this->cur.type == NUT_TOK_IDENT) {
+		syntax->selector = nut_parser_name(&this->cur);
+		nut_parser_advance(this);
+	}
+	else if (this->cur.type == NUT_TOK_BINARY && !nut_parser_is(&this->cur, NUT_TOK_BINARY, "=>")) {
+		syntax->selector = nut_parser_name(&this->cur);
+		nut_parser_advance(this);
+		kinds[count++] = nut_parse_capture(this);
+	}
+	else if (this->cur.type == NUT_TOK_KEYWORD) {
+		nut_name parts[255];
+		uint32_t part_count = 0;
+		size_t length = 0;
+		
+		while (this->cur.type == NUT_TOK_KEYWORD) {
+			if (count >= 256) {
+				nut_parser_fail(this, "too many captures in syntax", this->cur.line);
+			}
+			
+			parts[part_count] = nut_parser_name(&this->cur);
+			length += parts[part_count++].length;
+			nut_parser_advance(this);
+			kinds[count++] = nut_parse_capture(this);
+		}
+		
+		char *data = nut_parser_alloc(this, length);
+		
+		syntax->selector = (nut_name) {data, length};
+		
+		for (uint32_t i = 0; i < part_count; i++) {
+			memcpy(data, parts[i].data, parts[i].length);
+			data += parts[i].length;
+		}
+	}
+	else {
+		nut_parser_fail(this, "expected a selector in syntax pattern", this->cur.line);
+	}
+	
+	syntax->capture_count = count;
+	syntax->captures = nut_parser_alloc(this, sizeof *syntax->captures * count);
+	memcpy(syntax->captures, kinds, sizeof *syntax->captures * count);
+	
+	if (this->cur.type == NUT_TOK_SEMICOLON) {
+		nut_parser_advance(this);
+	}
+	
+	nut_parser_expect_text(this, NUT_TOK_BINARY, "=>", "expected '=>' after syntax pattern");
+	
+	// Template, a list of primitive operations each ending in \;
+	nut_name *captures = this->names + capture_base;
+	size_t label_base = this->name_top;
+	size_t op_capacity = 16;
+	nut_syntax_op *ops = nut_parser_alloc(this, sizeof *ops * op_capacity);
+	uint32_t op_count = 0;
+	uint32_t defined = 0, used = 0;
+	
+	while (this->cur.type != NUT_TOK_SEMICOLON) {
+		if (this->cur.type != NUT_TOK_IDENT) {
+			nut_parser_fail(this, "expected a syntax operation or ';'", this->cur.line);
+		}
+		
+		if (op_count == op_capacity) {
+			nut_syntax_op *new_ops = nut_parser_alloc(this, sizeof *ops * op_capacity * 2);
+			memcpy(new_ops, ops, sizeof *ops * op_capacity);
+			ops = new_ops;
+			op_capacity *= 2;
+		}
+		
+		nut_syntax_op *op = &ops[op_count++];
+		nut_token name = this->cur;
+		
+		op->line = name.line;
+		op->capture = NUT_SYNTAX_NONE;
+		
+		nut_parser_advance(this);
+		nut_parser_expect(this, NUT_TOK_LPAREN, "expected '(' after syntax operation");
+		
+		// Captures are reread from the scratch stack each time since pushing
+		// labels can move it
+		captures = this->names + capture_base;
+		
+		if (nut_parser_is(&name, NUT_TOK_IDENT, "compare_in_set")) {
+			op->kind = NUT_SYNTAX_COMPARE_IN_SET;
+			op->capture = nut_parse_syntax_capture_ref(this, captures, count);
+			nut_parser_expect_text(this, NUT_TOK_BINARY, ",", "expected ',' after capture");
+			nut_parse_syntax_set(this);
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "goto_when_equal")) {
+			op->kind = NUT_SYNTAX_GOTO_WHEN_EQUAL;
+			op->label = nut_parse_syntax_label(this, label_base);
+			used |= 1 << op->label;
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "goto_when_not_equal")) {
+			op->kind = NUT_SYNTAX_GOTO_WHEN_NOT_EQUAL;
+			op->label = nut_parse_syntax_label(this, label_base);
+			used |= 1 << op->label;
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "goto")) {
+			op->kind = NUT_SYNTAX_GOTO;
+			op->label = nut_parse_syntax_label(this, label_base);
+			used |= 1 << op->label;
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "label")) {
+			op->kind = NUT_SYNTAX_LABEL;
+			op->label = nut_parse_syntax_label(this, label_base);
+			
+			if (defined & (1 << op->label)) {
+				nut_parser_fail(this, "label defined twice", name.line);
+			}
+			
+			defined |= 1 << op->label;
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "do_block")) {
+			op->kind = NUT_SYNTAX_DO_BLOCK;
+			op->capture = nut_parse_syntax_capture_ref(this, captures, count);
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "push")) {
+			op->kind = NUT_SYNTAX_PUSH;
+			
+			if (this->cur.type == NUT_TOK_IDENT && !nut_parser_is(&this->cur, NUT_TOK_IDENT, "nil")
+				&& !nut_parser_is(&this->cur, NUT_TOK_IDENT, "true") && !nut_parser_is(&this->cur, NUT_TOK_IDENT, "false")) {
+				op->capture = nut_parse_syntax_capture_ref(this, captures, count);
+			}
+			else {
+				op->value = nut_parse_syntax_constant(this);
+			}
+		}
+		else if (nut_parser_is(&name, NUT_TOK_IDENT, "pop")) {
+			op->kind = NUT_SYNTAX_POP;
+		}
+		else {
+			nut_parser_fail(this, "unknown syntax operation", name.line);
+		}
+		
+		nut_parser_expect(this, NUT_TOK_RPAREN, "expected ')' after syntax operation");
+		
+		// Each operation ends with \; so that ; alone can end the definition
+		nut_parser_expect_text(this, NUT_TOK_BINARY, "\\", "expected '\\;' after syntax operation");
+		nut_parser_expect(this, NUT_TOK_SEMICOLON, "expected '\\;' after syntax operation");
+	}
+	
+	if (used & ~defined) {
+		nut_parser_fail(this, "syntax jumps to a label that isn't defined", this->cur.line);
+	}
+	
+	nut_parser_advance(this);
+	
+	syntax->ops = ops;
+	syntax->op_count = op_count;
+	syntax->label_count = this->name_top - label_base;
+	this->name_top = capture_base;
+	
+	return node;
+}
+
+static nut_ast *nut_parse_statement(nut_parser *this) {
+	if (nut_parser_is(&this->cur, NUT_TOK_IDENT, "global") && nut_parser_is(&this->next, NUT_TOK_IDENT, "syntax")) {
+		return nut_parse_syntax(this);
+	}
+	
+	if (this->cur.type == NUT_TOK_CARET) {
+		nut_ast *node = nut_parser_node(this, NUT_AST_RETURN, this->cur.line);
+		nut_parser_advance(this);
+		node->ret = nut_parse_expression(this);
+		return node;
+	}
+	
+	return nut_parse_expression(this);
+}
+
+static void nut_parser_skip_comments(nut_parser *this) {
+	while (this->cur.type == NUT_TOK_DSTRING) {
+		nut_parser_advance(this);
+	}
+}
+
+static void nut_parse_body(nut_parser *this, nut_block *block, nut_token_type terminator) {
+	/**
+	 * Parse the temporaries and statements of a block or script, up to but not
+	 * including the terminator.
+	 */
+	
+	nut_parser_skip_comments(this);
+	
+	if (this->cur.type == NUT_TOK_BAR) {
+		size_t name_base = this->name_top;
+		
+		nut_parser_advance(this);
+		
+		while (this->cur.type == NUT_TOK_IDENT) {
+			nut_parser_push_name(this, nut_parser_name(&this->cur));
+			nut_parser_advance(this);
+		}
+		
+		nut_parser_expect(this, NUT_TOK_BAR, "expected '|' to close temporaries");
+		
+		block->temp_count = this->name_top - name_base;
+		block->temps = nut_parser_pop_names(this, name_base);
+	}
+	
+	size_t node_base = this->node_top;
+	
+	while (true) {
+		nut_parser_skip_comments(this);
+		
+		if (this->cur.type == terminator) {
+			break;
+		}
+		
+		nut_parser_push_node(this, nut_parse_statement(this));
+		nut_parser_skip_comments(this);
+		
+		if (this->cur.type == NUT_TOK_PERIOD) {
+			nut_parser_advance(this);
+		}
+		else if (!this->cur.margin) {
+			break;
+		}
+	}
+	
+	if (this->cur.type != terminator) {
+		nut_parser_fail(this, "expected '.' between statements", this->cur.line);
+	}
+	
+	block->body_count = this->node_top - node_base;
+	block->body = nut_parser_pop_nodes(this, node_base);
+}
+
+nut_ast *nut_parse(nut_arena *arena, const char *source, size_t length, nut_error *error) {
+	/**
+	 * Parse a script into an AST allocated from `arena`. The script itself is
+	 * returned as a block without a selector. On failure NULL is returned and
+	 * `error` describes what went wrong.
+	 * 
+	 * @param arena Arena to allocate the AST from
+	 * @param source Script source text, which must outlive the AST
+	 * @param length Length of the source text
+	 * @param error Filled in with the first error if parsing fails
+	 * @return The AST of the script, or NULL on failure
+	 */
+	
+	nut_parser parser;
+	nut_parser *this = &parser;
+	nut_ast *volatile script = NULL;
+	
+	memset(this, 0, sizeof *this);
+	this->arena = arena;
+	this->error = error;
+	
+	nut_lexer_init(&this->lexer, source, length);
+	
+	if (!setjmp(this->bail)) {
+		nut_lexer_next(&this->lexer, &this->next);
+		nut_parser_advance(this);
+		
+		nut_ast *node = nut_parser_node(this, NUT_AST_BLOCK, 1);
+		nut_parse_body(this, &node->block, NUT_TOK_EOF);
+		script = node;
+	}
+	
+	DgMemoryFree(this->nodes);
+	DgMemoryFree(this->names);
+	
+	return script;
+}
@@ -0,0 +1,16 @@
+/**
+ * Nuttle parser
+ */
+
+#pragma once
+
+#include "common.h"
+#include "nut_arena.h"
+#include "nut_ast.h"
+
+typedef struct {
+	const char *message;
+	uint32_t line;
+} nut_error;
+
+nut_ast *nut_parse(nut_arena *arena, const char *source, size_t length, nut_error *error);
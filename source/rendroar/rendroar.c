@@ -393,8 +393,34 @@ enum {
 	RO_CMD_DRAW_TRIS,
 	RO_CMD_SET_TEXTURE,
 	RO_CMD_CLEAR_TEXTURE,
+	RO_CMD_DRAW_TRIS_REF,
+	RO_CMD_CALL,
 };
 
+static void RoWriteTextureCommand(RoContext * const this, DgMemoryStream *stream, const char *texture) {
+	if (texture) {
+		DgMemoryStreamWriteUInt32(stream, RO_CMD_SET_TEXTURE);
+		DgMemoryStreamWriteInt32(stream, RoLookupTextureId(this, texture));
+	}
+	else {
+		DgMemoryStreamWriteUInt32(stream, RO_CMD_CLEAR_TEXTURE);
+	}
+}
+
+static DgError RoWriteVerts(RoContext * const this, DgMemoryStream *stream, size_t count, const RoVertex *verticies, const char *texture) {
+	RoWriteTextureCommand(this, stream, texture);
+	
+	DgMemoryStreamWriteUInt32(stream, RO_CMD_DRAW_TRIS);
+	DgMemoryStreamWriteUInt32(stream, count);
+	DgMemoryStreamWrite(stream, sizeof *verticies * count, verticies);
+	
+	if (DgMemoryStreamError(stream) != DG_MEMORY_STREAM_OKAY) {
+		return DG_ERROR_FAILED;
+	}
+	
+	return DG_ERROR_SUCCESS;
+}
+
 DgError RoDrawVerts(RoContext * const this, size_t count, RoVertex *verticies, const char *texture) {
 	/**
 	 * Draw textured verticies to the screen
@@ -406,66 +432,177 @@ DgError RoDrawVerts(RoContext * const this, size_t count, RoVertex *verticies, c
 	 * @return Error while drawing verticies
 	 */
 	
-	if (texture) {
-		DgMemoryStreamWriteUInt32(this->buffer, RO_CMD_SET_TEXTURE);
-		DgMemoryStreamWriteInt32(this->buffer, RoLookupTextureId(this, texture));
-	}
-	else {
-		DgMemoryStreamWriteUInt32(this->buffer, RO_CMD_CLEAR_TEXTURE);
-	}
+	return RoWriteVerts(this, this->buffer, count, verticies, texture);
+}
+
+DgError RoDrawPlainVerts(RoContext * const this, size_t count, RoVertex *verticies) {
+	return RoDrawVerts(this, count, verticies, NULL);
+}
+
+DgError RoDrawCommandBuffer(RoContext * const this, RoCommandBuffer * const buffer) {
+	/**
+	 * Draw the commands recorded in a command buffer, in order with the rest
+	 * of the frame. The buffer isn't copied, so it must not be changed until
+	 * RoDrawEnd has consumed it.
+	 * 
+	 * @param this Context
+	 * @param buffer Recorded commands
+	 * @return Error while drawing the buffer
+	 */
+	
+	DgMemoryStreamWriteUInt32(buffer->stream, RO_CMD_STOP);
 	
-	DgMemoryStreamWriteUInt32(this->buffer, RO_CMD_DRAW_TRIS);
-	DgMemoryStreamWriteUInt32(this->buffer, count);
-	DgMemoryStreamWrite(this->buffer, sizeof *verticies * count, verticies);
+	DgMemoryStreamWriteUInt32(this->buffer, RO_CMD_CALL);
+	DgMemoryStreamWrite(this->buffer, sizeof buffer->stream, &buffer->stream);
 	
-	if (DgMemoryStreamError(this->buffer) != DG_MEMORY_STREAM_OKAY) {
+	if (DgMemoryStreamError(this->buffer) != DG_MEMORY_STREAM_OKAY || DgMemoryStreamError(buffer->stream) != DG_MEMORY_STREAM_OKAY) {
 		return DG_ERROR_FAILED;
 	}
 	
 	return DG_ERROR_SUCCESS;
 }
 
-DgError RoDrawPlainVerts(RoContext * const this, size_t count, RoVertex *verticies) {
-	return RoDrawVerts(this, count, verticies, NULL);
+DgError RoCommandBufferInit(RoCommandBuffer * const this) {
+	this->stream = DgMemoryStreamCreate();
+	
+	return this->stream ? DG_ERROR_SUCCESS : DG_ERROR_ALLOCATION_FAILED;
 }
 
-DgError RoDrawEnd(RoContext * const this) {
+void RoCommandBufferFree(RoCommandBuffer * const this) {
+	DgMemoryStreamFree(this->stream);
+}
+
+void RoCommandBufferBegin(RoCommandBuffer * const this) {
 	/**
-	 * Finish the drawing process and swap front and back buffers
+	 * Start recording a command buffer again, dropping what it had
 	 */
 	
-	GLenum gl_error = glGetError();
+	DgMemoryStreamRewind(this->stream);
+}
+
+DgError RoCommandBufferVerts(RoCommandBuffer * const this, RoContext * const context, size_t count, const RoVertex *verticies, const char *texture) {
+	/**
+	 * Record drawing textured verticies, like RoDrawVerts
+	 * 
+	 * @param this Command buffer
+	 * @param context Context the buffer will be drawn with, which is only
+	 * read, to look up textures
+	 * @param count Number of verticies
+	 * @param verticies Vertex data, which is copied
+	 * @param texture Name of texture to use
+	 * @return Error while recording verticies
+	 */
 	
-	if (gl_error != GL_NO_ERROR) {
-		DgLog(DG_LOG_ERROR, "Not drawing due to previous unhandled OpenGL error: <0x%x>", gl_error);
-		return DG_ERROR_FAILED;
-	}
+	return RoWriteVerts(context, this->stream, count, verticies, texture);
+}
+
+DgError RoCommandBufferVertsRef(RoCommandBuffer * const this, RoContext * const context, size_t count, const RoVertex *verticies, const char *texture) {
+	/**
+	 * Record drawing textured verticies without copying them. Only a pointer
+	 * to the data is recorded, so it must stay valid and unchanged until
+	 * RoDrawEnd has consumed the buffer.
+	 * 
+	 * @param this Command buffer
+	 * @param context Context the buffer will be drawn with, which is only
+	 * read, to look up textures
+	 * @param count Number of verticies
+	 * @param verticies Vertex data, which the caller keeps around
+	 * @param texture Name of texture to use
+	 * @return Error while recording verticies
+	 */
 	
-	// finish off buffer
-	DgMemoryStreamWriteUInt32(this->buffer, RO_CMD_STOP);
-	DgMemoryStreamRewind(this->buffer);
+	RoWriteTextureCommand(context, this->stream, texture);
 	
-	RoContextMakeCurrent(this);
+	DgMemoryStreamWriteUInt32(this->stream, RO_CMD_DRAW_TRIS_REF);
+	DgMemoryStreamWriteUInt32(this->stream, count);
+	DgMemoryStreamWrite(this->stream, sizeof verticies, &verticies);
 	
-	// Update the viewport
-	EGLint width, height;
-	eglQuerySurface(this->egl_display, this->egl_surface, EGL_WIDTH, &width);
-	eglQuerySurface(this->egl_display, this->egl_surface, EGL_HEIGHT, &height);
+	if (DgMemoryStreamError(this->stream) != DG_MEMORY_STREAM_OKAY) {
+		return DG_ERROR_FAILED;
+	}
 	
-	glViewport(0, 0, width, height);
+	return DG_ERROR_SUCCESS;
+}
+
+static DgError RoDrawTris(RoContext * const this, GLuint program, size_t vertex_count, const RoVertex *data) {
+	/**
+	 * Actually submit triangles to OpenGL
+	 */
+
+// 	glValidateProgram(program);
+// 	GLint status;
+// 	glGetProgramiv(program, GL_VALIDATE_STATUS, &status);
+// 	
+// 	if (status != GL_TRUE) {
+// 		DgLog(DG_LOG_WARNING, "Program validation failed!");
+// 		char log[2048];
+// 		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+// 		DgLog(DG_LOG_WARNING, "%s", log);
+// 	}
+
+	DgLog(DG_LOG_VERBOSE, "Drawing.DrawTris %zu <@ 0x%llx>", vertex_count, data);
+	
+	for (size_t i = 0; i < vertex_count; i++) {
+		DgLog(DG_LOG_VERBOSE, "%f %f %f   %f %f   %d %d %d %d", data[i].x, data[i].y, data[i].z, data[i].u, data[i].v, data[i].r, data[i].g, data[i].b, data[i].a);
+	}
+	
+	GLint inPosition = RoUseVertexAttrib(
+		program,
+		"inPosition",
+		3,
+		GL_FLOAT,
+		GL_FALSE,
+		sizeof(RoVertex),
+		&data[0].x
+	);
+	
+	GLint inTextureCoords = RoUseVertexAttrib(
+		program,
+		"inTextureCoords",
+		2,
+		GL_FLOAT,
+		GL_FALSE,
+		sizeof(RoVertex),
+		&data[0].u
+	);
+	
+	GLint inColour = RoUseVertexAttrib(
+		program,
+		"inColour",
+		4,
+		GL_UNSIGNED_BYTE,
+		GL_TRUE,
+		sizeof(RoVertex),
+		&data[0].r
+	);
+	
+	// Draw the arrays
+	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+	
+	// Undo setup
+	if (inPosition >= 0) glDisableVertexAttribArray(inPosition);
+	if (inTextureCoords >= 0) glDisableVertexAttribArray(inTextureCoords);
+	if (inColour >= 0) glDisableVertexAttribArray(inColour);
 	
-	// Clear the screen
-	glClearColor(this->background.r, this->background.g, this->background.b, this->background.a);
-	glClear(GL_COLOR_BUFFER_BIT);
+	GLenum gl_error = glGetError();
 	
-	// Set the active program
-	GLuint program = this->program->program;
-	glUseProgram(program);
+	if (gl_error != GL_NO_ERROR) {
+		DgLog(DG_LOG_ERROR, "Did not draw sucessfully: <0x%x>", gl_error);
+		return DG_ERROR_FAILED;
+	}
+	
+	return DG_ERROR_SUCCESS;
+}
+
+static DgError RoRunCommands(RoContext * const this, GLuint program, DgMemoryStream *stream) {
+	/**
+	 * Run the commands in a stream until it stops, and the streams it calls
+	 */
 	
 	bool drawing = true;
 	
 	while (drawing) {
-		uint32_t cmd = DgMemoryStreamReadUInt32(this->buffer);
+		uint32_t cmd = DgMemoryStreamReadUInt32(stream);
 		
 		switch (cmd) {
 			case RO_CMD_STOP: {
@@ -475,7 +612,7 @@ DgError RoDrawEnd(RoContext * const this) {
 			}
 			
 			case RO_CMD_SET_TEXTURE: {
-				GLint id = DgMemoryStreamReadInt32(this->buffer);
+				GLint id = DgMemoryStreamReadInt32(stream);
 				DgLog(DG_LOG_VERBOSE, "Drawing.SetTexture %d", id);
 				RoSetTextureAsCurrentFromID(id);
 				break;
@@ -489,69 +626,39 @@ DgError RoDrawEnd(RoContext * const this) {
 			}
 			
 			case RO_CMD_DRAW_TRIS: {
-// 				glValidateProgram(program);
-// 				GLint status;
-// 				glGetProgramiv(program, GL_VALIDATE_STATUS, &status);
-// 				
-// 				if (status != GL_TRUE) {
-// 					DgLog(DG_LOG_WARNING, "Program validation failed!");
-// 					char log[2048];
-// 					glGetProgramInfoLog(program, sizeof(log), NULL, log);
-// 					DgLog(DG_LOG_WARNING, "%s", log);
-// 				}
+				size_t vertex_count = DgMemoryStreamReadUInt32(stream);
+				RoVertex *data = DgMemoryStreamGetHeadPointer(stream);
+				DgMemoryStreamSetpos(stream, DG_MEMORY_STREAM_CUR, sizeof(RoVertex) * vertex_count);
 				
-				size_t vertex_count = DgMemoryStreamReadUInt32(this->buffer);
-				RoVertex *data = DgMemoryStreamGetHeadPointer(this->buffer);
-				DgMemoryStreamSetpos(this->buffer, DG_MEMORY_STREAM_CUR, sizeof(RoVertex) * vertex_count);
-				
-				DgLog(DG_LOG_VERBOSE, "Drawing.DrawTris %zu <@ 0x%llx>", vertex_count, data);
-				
-				for (size_t i = 0; i < vertex_count; i++) {
-					DgLog(DG_LOG_VERBOSE, "%f %f %f   %f %f   %d %d %d %d", data[i].x, data[i].y, data[i].z, data[i].u, data[i].v, data[i].r, data[i].g, data[i].b, data[i].a);
+				if (RoDrawTris(this, program, vertex_count, data)) {
+					return DG_ERROR_FAILED;
 				}
 				
-				GLint inPosition = RoUseVertexAttrib(
-					program,
-					"inPosition",
-					3,
-					GL_FLOAT,
-					GL_FALSE,
-					sizeof(RoVertex),
-					&data[0].x
-				);
-				
-				GLint inTextureCoords = RoUseVertexAttrib(
-					program,
-					"inTextureCoords",
-					2,
-					GL_FLOAT,
-					GL_FALSE,
-					sizeof(RoVertex),
-					&data[0].u
-				);
-				
-				GLint inColour = RoUseVertexAttrib(
-					program,
-					"inColour",
-					4,
-					GL_UNSIGNED_BYTE,
-					GL_TRUE,
-					sizeof(RoVertex),
-					&data[0].r
-				);
+				break;
+			}
+			
+			case RO_CMD_DRAW_TRIS_REF: {
+				size_t vertex_count = DgMemoryStreamReadUInt32(stream);
+				const RoVertex *data;
+				memcpy(&data, DgMemoryStreamGetHeadPointer(stream), sizeof data);
+				DgMemoryStreamSetpos(stream, DG_MEMORY_STREAM_CUR, sizeof data);
 				
-				// Draw the arrays
-				glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+				if (RoDrawTris(this, program, vertex_count, data)) {
+					return DG_ERROR_FAILED;
+				}
 				
-				// Undo setup
-				if (inPosition >= 0) glDisableVertexAttribArray(inPosition);
-				if (inTextureCoords >= 0) glDisableVertexAttribArray(inTextureCoords);
-				if (inColour >= 0) glDisableVertexAttribArray(inColour);
+				break;
+			}
+			
+			case RO_CMD_CALL: {
+				DgMemoryStream *called;
+				memcpy(&called, DgMemoryStreamGetHeadPointer(stream), sizeof called);
+				DgMemoryStreamSetpos(stream, DG_MEMORY_STREAM_CUR, sizeof called);
+				DgLog(DG_LOG_VERBOSE, "Drawing.Call <@ %p>", (void *) called);
 				
-				gl_error = glGetError();
+				DgMemoryStreamRewind(called);
 				
-				if (gl_error != GL_NO_ERROR) {
-					DgLog(DG_LOG_ERROR, "Did not draw sucessfully: <0x%x>", gl_error);
+				if (RoRunCommands(this, program, called)) {
 					return DG_ERROR_FAILED;
 				}
 				
@@ -566,6 +673,46 @@ DgError RoDrawEnd(RoContext * const this) {
 		}
 	}
 	
+	return DG_ERROR_SUCCESS;
+}
+
+DgError RoDrawEnd(RoContext * const this) {
+	/**
+	 * Finish the drawing process and swap front and back buffers
+	 */
+	
+	GLenum gl_error = glGetError();
+	
+	if (gl_error != GL_NO_ERROR) {
+		DgLog(DG_LOG_ERROR, "Not drawing due to previous unhandled OpenGL error: <0x%x>", gl_error);
+		return DG_ERROR_FAILED;
+	}
+	
+	// finish off buffer
+	DgMemoryStreamWriteUInt32(this->buffer, RO_CMD_STOP);
+	DgMemoryStreamRewind(this->buffer);
+	
+	RoContextMakeCurrent(this);
+	
+	// Update the viewport
+	EGLint width, height;
+	eglQuerySurface(this->egl_display, this->egl_surface, EGL_WIDTH, &width);
+	eglQuerySurface(this->egl_display, this->egl_surface, EGL_HEIGHT, &height);
+	
+	glViewport(0, 0, width, height);
+	
+	// Clear the screen
+	glClearColor(this->background.r, this->background.g, this->background.b, this->background.a);
+	glClear(GL_COLOR_BUFFER_BIT);
+	
+	// Set the active program
+	GLuint program = this->program->program;
+	glUseProgram(program);
+	
+	if (RoRunCommands(this, program, this->buffer)) {
+		return DG_ERROR_FAILED;
+	}
+	
 	// Swap buffers
 	eglSwapBuffers(this->egl_display, this->egl_surface);
 	
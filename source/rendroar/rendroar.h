@@ -53,6 +53,15 @@ typedef struct {
 	DgMemoryStream *buffer;
 } RoContext;
 
+typedef struct {
+	/**
+	 * Draw commands recorded apart from a context's own, so that several
+	 * threads can record at once. Recording only reads the context.
+	 */
+	
+	DgMemoryStream *stream;
+} RoCommandBuffer;
+
 DgError RoContextCreate(RoContext * const context, DgVec2I size);
 DgError RoContextCreateDW(RoContext * const this, void *display, void *window);
 void RoContextDestroy(RoContext * const context);
@@ -65,3 +74,10 @@ DgError RoGetFrameData(RoContext * const this, size_t size, void *data, bool alp
 
 DgError RoDrawVerts(RoContext * const this, size_t count, RoVertex *verticies, const char *texture);
 DgError RoDrawPlainVerts(RoContext * const this, size_t count, RoVertex *verticies);
+DgError RoDrawCommandBuffer(RoContext * const this, RoCommandBuffer * const buffer);
+
+DgError RoCommandBufferInit(RoCommandBuffer * const this);
+void RoCommandBufferFree(RoCommandBuffer * const this);
+void RoCommandBufferBegin(RoCommandBuffer * const this);
+DgError RoCommandBufferVerts(RoCommandBuffer * const this, RoContext * const context, size_t count, const RoVertex *verticies, const char *texture);
+DgError RoCommandBufferVertsRef(RoCommandBuffer * const this, RoContext * const context, size_t count, const RoVertex *verticies, const char *texture);
@@ -0,0 +1,231 @@
+/**
+ * Frame phase scheduler
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "jobs.h"
+#include "scheduler.h"
+
+void SchedulerInit(Scheduler *this, Jobs *jobs) {
+	/**
+	 * Make a scheduler with no phases, which runs them on a job system
+	 */
+	
+	memset(this, 0, sizeof *this);
+	
+	this->jobs = jobs;
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->finished, NULL);
+}
+
+void SchedulerFree(Scheduler *this) {
+	SchedulerWait(this);
+	pthread_cond_destroy(&this->finished);
+	pthread_mutex_destroy(&this->lock);
+}
+
+int SchedulerAdd(Scheduler *this, const char *name, SchedulerFunction function, void *context, uint64_t reads, uint64_t writes, uint32_t flags) {
+	/**
+	 * Add a phase after the ones already added. This has to be done before
+	 * the first frame.
+	 *
+	 * @param name Name for logs
+	 * @param function Run once each frame with `context`
+	 * @param reads Resources the phase reads
+	 * @param writes Resources the phase writes
+	 * @param flags SCHEDULER_MAIN_THREAD and SCHEDULER_OVERLAP
+	 * @return Index of the phase, or -1 if there are too many
+	 */
+	
+	if (this->phase_count == SCHEDULER_MAX_PHASES) {
+		DgLog(DG_LOG_ERROR, "Too many phases to add %s", name);
+		return -1;
+	}
+	
+	this->phases[this->phase_count] = (SchedulerPhase) {
+		.name = name,
+		.function = function,
+		.context = context,
+		.reads = reads,
+		.writes = writes,
+		.flags = flags,
+	};
+	
+	this->built = false;
+	
+	return this->phase_count++;
+}
+
+static bool SchedulerConflict(const SchedulerPhase *a, const SchedulerPhase *b) {
+	return (a->writes & (b->reads | b->writes)) || (b->writes & a->reads);
+}
+
+static void SchedulerBuild(Scheduler *this) {
+	/**
+	 * Work out what each phase waits for. Phases of the last frame that
+	 * don't overlap are always finished when a frame starts, so only
+	 * overlapping ones are waited for across frames, including the phase's
+	 * own run in the last frame.
+	 */
+	
+	for (size_t j = 0; j < this->phase_count; j++) {
+		SchedulerPhase *phase = &this->phases[j];
+		
+		phase->before = 0;
+		phase->previous = 0;
+		
+		for (size_t i = 0; i < this->phase_count; i++) {
+			SchedulerPhase *other = &this->phases[i];
+			
+			if (i < j && SchedulerConflict(other, phase)) {
+				phase->before |= (uint64_t) 1 << i;
+			}
+			else if (i >= j && (other->flags & SCHEDULER_OVERLAP) && (i == j || SchedulerConflict(other, phase))) {
+				phase->previous |= (uint64_t) 1 << i;
+			}
+		}
+	}
+	
+	this->built = true;
+}
+
+static bool SchedulerReady(Scheduler *this, size_t index) {
+	/**
+	 * Check if a phase can start in the current frame. The lock must be
+	 * held.
+	 */
+	
+	SchedulerPhase *phase = &this->phases[index];
+	
+	for (size_t i = 0; i < this->phase_count; i++) {
+		if ((phase->before >> i) & 1 && this->phases[i].finished != this->frame) {
+			return false;
+		}
+		
+		if ((phase->previous >> i) & 1 && this->phases[i].finished + 1 < this->frame) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void SchedulerFinish(Scheduler *this, SchedulerPhase *phase) {
+	pthread_mutex_lock(&this->lock);
+	phase->finished = phase->started;
+	this->finish_count++;
+	pthread_cond_broadcast(&this->finished);
+	pthread_mutex_unlock(&this->lock);
+}
+
+static void SchedulerJob(void *context, size_t index) {
+	Scheduler *this = context;
+	SchedulerPhase *phase = &this->phases[index];
+	
+	phase->function(phase->context);
+	SchedulerFinish(this, phase);
+}
+
+static void SchedulerIdle(Scheduler *this) {
+	/**
+	 * Wait for a phase to finish, running jobs meanwhile. The lock must be
+	 * held.
+	 */
+	
+	uint64_t count = this->finish_count;
+	
+	pthread_mutex_unlock(&this->lock);
+	bool helped = JobsHelp(this->jobs);
+	pthread_mutex_lock(&this->lock);
+	
+	while (!helped && this->finish_count == count) {
+		pthread_cond_wait(&this->finished, &this->lock);
+	}
+}
+
+void SchedulerFrame(Scheduler *this) {
+	/**
+	 * Run every phase once. This returns when they have all finished, except
+	 * overlapping phases, which may go on into the next frame. It has to be
+	 * called from the same thread every time.
+	 */
+	
+	if (!this->built) {
+		SchedulerBuild(this);
+	}
+	
+	pthread_mutex_lock(&this->lock);
+	
+	uint64_t frame = ++this->frame;
+	
+	while (true) {
+		bool waiting = false;
+		SchedulerPhase *inline_phase = NULL;
+		
+		for (size_t i = 0; i < this->phase_count; i++) {
+			SchedulerPhase *phase = &this->phases[i];
+			
+			if (phase->started == frame) {
+				waiting |= !(phase->flags & SCHEDULER_OVERLAP) && phase->finished != frame;
+				continue;
+			}
+			
+			waiting = true;
+			
+			if (!SchedulerReady(this, i)) {
+				continue;
+			}
+			
+			if (phase->flags & SCHEDULER_MAIN_THREAD) {
+				inline_phase = inline_phase ? inline_phase : phase;
+				continue;
+			}
+			
+			uint64_t started = phase->started;
+			phase->started = frame;
+			
+			// Without the memory to queue it, it's run here instead
+			if (!JobsPush(this->jobs, NULL, SchedulerJob, this, i)) {
+				phase->started = started;
+				inline_phase = inline_phase ? inline_phase : phase;
+			}
+		}
+		
+		if (inline_phase) {
+			inline_phase->started = frame;
+			pthread_mutex_unlock(&this->lock);
+			inline_phase->function(inline_phase->context);
+			SchedulerFinish(this, inline_phase);
+			pthread_mutex_lock(&this->lock);
+		}
+		else if (waiting) {
+			SchedulerIdle(this);
+		}
+		else {
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&this->lock);
+}
+
+void SchedulerWait(Scheduler *this) {
+	/**
+	 * Wait for overlapping phases that are still running, so that nothing
+	 * is running once this returns
+	 */
+	
+	pthread_mutex_lock(&this->lock);
+	
+	for (size_t i = 0; i < this->phase_count; i++) {
+		while (this->phases[i].finished != this->phases[i].started) {
+			SchedulerIdle(this);
+		}
+	}
+	
+	pthread_mutex_unlock(&this->lock);
+}
@@ -0,0 +1,59 @@
+/**
+ * Runs the phases of a frame, in parallel where they don't conflict
+ */
+
+#pragma once
+
+#include "common.h"
+#include "jobs.h"
+
+#define SCHEDULER_MAX_PHASES 64
+
+typedef void (*SchedulerFunction)(void *context);
+
+typedef enum SchedulerFlags {
+	SCHEDULER_MAIN_THREAD = (1 << 0), // Has to run on the thread running frames
+	SCHEDULER_OVERLAP = (1 << 1),     // May still be running when the next frame starts
+} SchedulerFlags;
+
+typedef struct SchedulerPhase {
+	const char *name;
+	SchedulerFunction function;
+	void *context;
+	uint64_t reads;  // Resources read, as bits
+	uint64_t writes; // Resources written, as bits
+	uint32_t flags;
+	
+	// Dependencies, as bits of phase indices
+	uint64_t before;   // Earlier phases of the same frame to wait for
+	uint64_t previous; // Overlapping phases of the last frame to wait for
+	
+	uint64_t started;  // Frame the phase was last started in
+	uint64_t finished; // Frame the phase last finished in
+} SchedulerPhase;
+
+typedef struct Scheduler {
+	/**
+	 * Phases are added in the order they would run one after another. Two
+	 * phases conflict if one writes a resource the other reads or writes,
+	 * and then the later one waits for the earlier one; other phases run at
+	 * the same time. What the resources are is up to whoever adds phases.
+	 * The dependencies are worked out once, the first time a frame is run.
+	 */
+	
+	Jobs *jobs;
+	SchedulerPhase phases[SCHEDULER_MAX_PHASES];
+	size_t phase_count;
+	bool built;
+	uint64_t frame; // Frames started, so the first one is 1
+	
+	pthread_mutex_t lock;
+	pthread_cond_t finished; // A phase finished
+	uint64_t finish_count;
+} Scheduler;
+
+void SchedulerInit(Scheduler *this, Jobs *jobs);
+void SchedulerFree(Scheduler *this);
+int SchedulerAdd(Scheduler *this, const char *name, SchedulerFunction function, void *context, uint64_t reads, uint64_t writes, uint32_t flags);
+void SchedulerFrame(Scheduler *this);
+void SchedulerWait(Scheduler *this);
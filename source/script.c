@@ -0,0 +1,313 @@
+/**
+ * Loading Nuttle scripts into the VM
+ */
+
+#include <string.h>
+
+#include "util/log.h"
+#include "nuttle/nut_parser.h"
+#include "nuttle/nut_compiler.h"
+#include "nuttle/nut_cache.h"
+
+#include "script.h"
+
+static object_id ScriptCompileTree(vm_context vm, const char *name, const char *source, size_t length, nut_arena *arena, nut_ast **tree) {
+	/**
+	 * Parse and compile a script's source, keeping its syntax tree in `arena`
+	 */
+	
+	nut_error error;
+	object_id method = OID_NIL;
+	
+	nut_arena_init(arena, 0);
+	
+	nut_ast *script = nut_parse(arena, source, length, &error);
+	
+	if (script) {
+		method = nut_compile(vm, script, vm_intern(vm, name), &error);
+	}
+	
+	if (method == OID_NIL) {
+		DgLog(DG_LOG_ERROR, "%s:%u: %s", name, error.line, error.message);
+	}
+	
+	*tree = script;
+	
+	return method;
+}
+
+object_id ScriptCompile(vm_context vm, const char *name, const char *source, size_t length) {
+	/**
+	 * Parse and compile a script's source
+	 * 
+	 * @param vm VM to compile into
+	 * @param name Name of the script for error messages
+	 * @param source Source text
+	 * @param length Length of the source text
+	 * @return Method that runs the top level of the script, or nil on error
+	 */
+	
+	nut_arena arena;
+	nut_ast *script;
+	object_id method = ScriptCompileTree(vm, name, source, length, &arena, &script);
+	
+	nut_arena_free(&arena);
+	
+	return method;
+}
+
+static bool ScriptPrototypeName(const char *path, char *name, size_t size) {
+	/**
+	 * Get the name of the global a script runs as, which is its file name
+	 * without the extension and capitalised
+	 */
+	
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	
+	size_t length = strcspn(base, ".");
+	
+	if (length == 0 || length >= size) {
+		return false;
+	}
+	
+	memcpy(name, base, length);
+	name[0] = (name[0] >= 'a' && name[0] <= 'z') ? name[0] - 'a' + 'A' : name[0];
+	name[length] = '\0';
+	
+	return true;
+}
+
+object_id ScriptPrototype(vm_context vm, const char *path) {
+	/**
+	 * Find the prototype a script's top level runs in, creating it if it does
+	 * not exist yet. It is the global named after the script's file, so
+	 * "levels/main.script" runs as `Main`.
+	 */
+	
+	char name[128];
+	
+	if (!ScriptPrototypeName(path, name, sizeof name)) {
+		return OID_NIL;
+	}
+	
+	object_id proto = vm_get_global(vm, vm_intern(vm, name));
+	
+	if (proto == OID_NIL) {
+		proto = vm_make_proto(vm, name, vm->root);
+	}
+	
+	return proto;
+}
+
+static char *ScriptCachePath(const char *path) {
+	/**
+	 * Get the name of the bytecode cache for a script, which is the script's
+	 * name with its extension replaced by .nutc
+	 */
+	
+	const char *base = strrchr(path, '/');
+	const char *dot = strrchr(base ? base : path, '.');
+	size_t length = dot ? (size_t) (dot - path) : strlen(path);
+	char *cache = DgMemoryAllocate(length + 6);
+	
+	if (cache) {
+		memcpy(cache, path, length);
+		memcpy(cache + length, ".nutc", 6);
+	}
+	
+	return cache;
+}
+
+static void ScriptWriteCache(AssetManager *assman, vm_context vm, const char *path, object_id method, uint64_t hash, size_t length) {
+	/**
+	 * Replace the bytecode cache of a script with a freshly compiled method
+	 */
+	
+	if (method == OID_NIL) {
+		return;
+	}
+	
+	char *cache_path = ScriptCachePath(path);
+	size_t size;
+	void *data = cache_path ? nut_cache_write(vm, method, hash, length, &size) : NULL;
+	
+	if (!data || AssetManagerWriteFile(assman, cache_path, data, size)) {
+		DgLog(DG_LOG_WARNING, "Failed to write bytecode cache: %s", cache_path ? cache_path : path);
+	}
+	
+	DgMemoryFree(data);
+	DgMemoryFree(cache_path);
+}
+
+static object_id ScriptLoadMethod(AssetManager *assman, vm_context vm, const char *path, const char *source, size_t length) {
+	/**
+	 * Get the top level method of a script, from its bytecode cache if that
+	 * was made from the same source, or by compiling it and then updating the
+	 * cache.
+	 */
+	
+	uint64_t hash = vm_hash_bytes(source, length);
+	char *cache_path = ScriptCachePath(path);
+	object_id method = OID_NIL;
+	
+	if (!cache_path) {
+		return ScriptCompile(vm, path, source, length);
+	}
+	
+	size_t cache_size;
+	void *cache = AssetManagerMapFile(assman, cache_path, &cache_size);
+	
+	if (cache) {
+		method = nut_cache_load(vm, cache, cache_size, hash, length, vm_intern(vm, path));
+		AssetManagerUnmapFile(assman, cache, cache_size);
+	}
+	
+	DgMemoryFree(cache_path);
+	
+	if (method == OID_NIL) {
+		method = ScriptCompile(vm, path, source, length);
+		ScriptWriteCache(assman, vm, path, method, hash, length);
+	}
+	
+	return method;
+}
+
+object_id ScriptLoad(AssetManager *assman, vm_context vm, const char *path) {
+	/**
+	 * Load a script asset and run its top level, which usually defines the
+	 * methods of its prototype.
+	 * 
+	 * @param assman Asset manager to load the script from
+	 * @param vm VM to load the script into
+	 * @param path Path of the script asset
+	 * @return The script's prototype, or nil on failure
+	 */
+	
+	size_t length;
+	char *source = AssetManagerMapFile(assman, path, &length);
+	
+	if (!source) {
+		DgLog(DG_LOG_ERROR, "Failed to load script: %s", path);
+		return OID_NIL;
+	}
+	
+	object_id method = vm_accquire(vm, ScriptLoadMethod(assman, vm, path, source, length));
+	
+	AssetManagerUnmapFile(assman, source, length);
+	
+	if (method == OID_NIL) {
+		return OID_NIL;
+	}
+	
+	object_id proto = ScriptPrototype(vm, path);
+	
+	if (proto != OID_NIL) {
+		vm_call(vm, method, proto, 0, NULL);
+	}
+	
+	vm_release(vm, method);
+	
+	return proto;
+}
+
+static size_t ScriptInstallMethods(vm_context vm, const char *path, nut_ast *script, object_id proto) {
+	/**
+	 * Install the methods that the top level of a script defines with
+	 * statements like `Main method: [tick: time | ...]`, on the objects that
+	 * already exist. Nothing else in the script is run.
+	 */
+	
+	size_t count = 0;
+	
+	for (uint32_t i = 0; i < script->block.body_count; i++) {
+		nut_ast *statement = script->block.body[i];
+		
+		if (statement->kind != NUT_AST_SEND || statement->send.syntax || statement->send.arg_count != 1 || !nut_name_equal(statement->send.selector, "method:", 7)) {
+			continue;
+		}
+		
+		nut_ast *receiver = statement->send.receiver;
+		nut_ast *block = statement->send.args[0];
+		
+		if (receiver->kind != NUT_AST_VARIABLE || block->kind != NUT_AST_BLOCK || block->block.method == OID_NIL) {
+			continue;
+		}
+		
+		// Same rules as names in the script itself
+		nut_name name = receiver->variable;
+		object_id target;
+		
+		if (nut_name_equal(name, "self", 4)) {
+			target = proto;
+		}
+		else if (name.data[0] >= 'A' && name.data[0] <= 'Z') {
+			target = vm_get_global(vm, vm_tolstring(vm, name.data, name.length));
+		}
+		else {
+			target = vm_get_field(vm, proto, vm_tolstring(vm, name.data, name.length));
+		}
+		
+		objt_method *method = (objt_method *) vm_lookup(vm, block->block.method);
+		
+		if (!method || method->selector == OID_NIL || !vm_define_method(vm, target, method->selector, block->block.method)) {
+			DgLog(DG_LOG_WARNING, "%s:%u: can't reload method, %.*s isn't a script object yet", path, statement->line, (int) name.length, name.data);
+			continue;
+		}
+		
+		count++;
+	}
+	
+	return count;
+}
+
+object_id ScriptReload(AssetManager *assman, vm_context vm, const char *path) {
+	/**
+	 * Recompile a script that was loaded before and swap the methods it
+	 * defines into the live objects. The rest of its top level isn't run
+	 * again, so the state of every object is kept. Only call this when no
+	 * script is running, like between frames.
+	 *
+	 * @param assman Asset manager to load the script from
+	 * @param vm VM the script was loaded into
+	 * @param path Path of the script asset
+	 * @return The script's prototype, or nil if the script wasn't loaded or
+	 * doesn't compile
+	 */
+	
+	char name[128];
+	
+	if (!ScriptPrototypeName(path, name, sizeof name)) {
+		return OID_NIL;
+	}
+	
+	object_id proto = vm_get_global(vm, vm_intern(vm, name));
+	
+	if (proto == OID_NIL) {
+		return OID_NIL;
+	}
+	
+	size_t length;
+	char *source = AssetManagerMapFile(assman, path, &length);
+	
+	if (!source) {
+		DgLog(DG_LOG_ERROR, "Failed to reload script: %s", path);
+		return OID_NIL;
+	}
+	
+	nut_arena arena;
+	nut_ast *script;
+	object_id method = vm_accquire(vm, ScriptCompileTree(vm, path, source, length, &arena, &script));
+	
+	if (method != OID_NIL) {
+		size_t count = ScriptInstallMethods(vm, path, script, proto);
+		DgLog(DG_LOG_INFO, "Reloaded %zu methods from %s", count, path);
+		ScriptWriteCache(assman, vm, path, method, vm_hash_bytes(source, length), length);
+	}
+	
+	nut_arena_free(&arena);
+	AssetManagerUnmapFile(assman, source, length);
+	vm_release(vm, method);
+	
+	return (method != OID_NIL) ? proto : OID_NIL;
+}
@@ -0,0 +1,14 @@
+/**
+ * Loading Nuttle scripts into the VM
+ */
+
+#pragma once
+
+#include "common.h"
+#include "assets.h"
+#include "vm.h"
+
+object_id ScriptCompile(vm_context vm, const char *name, const char *source, size_t length);
+object_id ScriptPrototype(vm_context vm, const char *path);
+object_id ScriptLoad(AssetManager *assman, vm_context vm, const char *path);
+object_id ScriptReload(AssetManager *assman, vm_context vm, const char *path);
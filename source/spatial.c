@@ -0,0 +1,432 @@
+/**
+ * Loose uniform grid
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "bitmap.h"
+#include "spatial.h"
+
+// Cell coordinates are kept well inside the range of int32_t, so that
+// rings around a cell can't overflow
+#define SPATIAL_MAX_COORDINATE (1 << 30)
+
+// Cells
+
+static int32_t SpatialCoordinate(SpatialGrid *this, float value) {
+	float cell = floorf(value / this->cell_size);
+	
+	// NaN goes here too
+	if (!(cell >= -SPATIAL_MAX_COORDINATE)) {
+		return -SPATIAL_MAX_COORDINATE;
+	}
+	else if (cell > SPATIAL_MAX_COORDINATE) {
+		return SPATIAL_MAX_COORDINATE;
+	}
+	
+	return (int32_t) cell;
+}
+
+static size_t SpatialHome(SpatialGrid *this, int32_t x, int32_t y) {
+	uint64_t key = ((uint64_t) (uint32_t) x << 32) | (uint32_t) y;
+	
+	key *= 0x9e3779b97f4a7c15;
+	
+	return (key ^ (key >> 29)) & (this->table_capacity - 1);
+}
+
+static uint32_t SpatialFind(SpatialGrid *this, int64_t x, int64_t y) {
+	/**
+	 * Find the cell at some cell coordinates, or SPATIAL_NONE
+	 */
+	
+	if (!this->cell_count || x < this->min_x || x > this->max_x || y < this->min_y || y > this->max_y) {
+		return SPATIAL_NONE;
+	}
+	
+	size_t mask = this->table_capacity - 1;
+	
+	for (size_t i = SpatialHome(this, x, y); this->table[i] != SPATIAL_NONE; i = (i + 1) & mask) {
+		SpatialCell *cell = &this->cells[this->table[i]];
+		
+		if (cell->x == x && cell->y == y) {
+			return this->table[i];
+		}
+	}
+	
+	return SPATIAL_NONE;
+}
+
+static void SpatialPlace(SpatialGrid *this, uint32_t index) {
+	size_t mask = this->table_capacity - 1;
+	size_t i = SpatialHome(this, this->cells[index].x, this->cells[index].y);
+	
+	while (this->table[i] != SPATIAL_NONE) {
+		i = (i + 1) & mask;
+	}
+	
+	this->table[i] = index;
+}
+
+static bool SpatialGrowTable(SpatialGrid *this) {
+	size_t capacity = this->table_capacity ? 2 * this->table_capacity : 64;
+	uint32_t *table = DgMemoryAllocate(sizeof *table * capacity);
+	
+	if (!table) {
+		return false;
+	}
+	
+	memset(table, 0xff, sizeof *table * capacity);
+	DgMemoryFree(this->table);
+	this->table = table;
+	this->table_capacity = capacity;
+	
+	for (size_t i = 0; i < this->cell_count; i++) {
+		SpatialPlace(this, i);
+	}
+	
+	return true;
+}
+
+static uint32_t SpatialCellOf(SpatialGrid *this, SpatialBox box) {
+	/**
+	 * Get the cell a box's centre is in, making it if it doesn't exist yet
+	 *
+	 * @return Cell, or SPATIAL_NONE if there isn't enough memory
+	 */
+	
+	int32_t x = SpatialCoordinate(this, 0.5f * box.min_x + 0.5f * box.max_x);
+	int32_t y = SpatialCoordinate(this, 0.5f * box.min_y + 0.5f * box.max_y);
+	uint32_t cell = SpatialFind(this, x, y);
+	
+	if (cell != SPATIAL_NONE) {
+		return cell;
+	}
+	
+	if ((this->cell_count + 1) * 4 > this->table_capacity * 3 && !SpatialGrowTable(this)) {
+		return SPATIAL_NONE;
+	}
+	
+	if (this->cell_count >= this->cell_capacity) {
+		size_t capacity = this->cell_capacity ? 2 * this->cell_capacity : 64;
+		SpatialCell *cells = DgMemoryReallocate(this->cells, sizeof *cells * capacity);
+		
+		if (!cells) {
+			return SPATIAL_NONE;
+		}
+		
+		this->cells = cells;
+		this->cell_capacity = capacity;
+	}
+	
+	if (!this->cell_count) {
+		this->min_x = this->max_x = x;
+		this->min_y = this->max_y = y;
+	}
+	
+	this->min_x = (x < this->min_x) ? x : this->min_x;
+	this->max_x = (x > this->max_x) ? x : this->max_x;
+	this->min_y = (y < this->min_y) ? y : this->min_y;
+	this->max_y = (y > this->max_y) ? y : this->max_y;
+	
+	this->cells[this->cell_count] = (SpatialCell) {x, y, NULL, 0, 0};
+	SpatialPlace(this, this->cell_count);
+	
+	return this->cell_count++;
+}
+
+// Grid
+
+void SpatialInit(SpatialGrid *this, float cell_size) {
+	memset(this, 0, sizeof *this);
+	this->cell_size = cell_size;
+}
+
+void SpatialFree(SpatialGrid *this) {
+	for (size_t i = 0; i < this->cell_count; i++) {
+		DgMemoryFree(this->cells[i].items);
+	}
+	
+	DgMemoryFree(this->cells);
+	DgMemoryFree(this->table);
+	SpatialInit(this, this->cell_size);
+}
+
+void SpatialTake(SpatialGrid *this, uint32_t *cells, uint32_t *places, uint32_t item) {
+	/**
+	 * Take an item out of the grid, if it's in it. The last item of its cell
+	 * is moved into its place.
+	 */
+	
+	if (cells[item] == SPATIAL_NONE) {
+		return;
+	}
+	
+	SpatialCell *cell = &this->cells[cells[item]];
+	uint32_t place = places[item];
+	uint32_t last = cell->items[--cell->count];
+	
+	cell->items[place] = last;
+	places[last] = place;
+	cells[item] = SPATIAL_NONE;
+}
+
+bool SpatialPut(SpatialGrid *this, uint32_t *cells, uint32_t *places, uint32_t item, SpatialBox box) {
+	/**
+	 * Put an item in the grid, or move it to the cell its new box is in
+	 *
+	 * @return If the item is in the grid, which only fails when out of memory
+	 */
+	
+	float reach = fmaxf(box.max_x - box.min_x, box.max_y - box.min_y) / 2.0f;
+	this->reach = fmaxf(this->reach, reach);
+	
+	uint32_t index = SpatialCellOf(this, box);
+	
+	if (index != SPATIAL_NONE && index == cells[item]) {
+		return true;
+	}
+	
+	SpatialTake(this, cells, places, item);
+	
+	if (index == SPATIAL_NONE) {
+		return false;
+	}
+	
+	SpatialCell *cell = &this->cells[index];
+	
+	if (cell->count >= cell->capacity) {
+		uint32_t capacity = cell->capacity ? 2 * cell->capacity : 8;
+		uint32_t *items = DgMemoryReallocate(cell->items, sizeof *items * capacity);
+		
+		if (!items) {
+			return false;
+		}
+		
+		cell->items = items;
+		cell->capacity = capacity;
+	}
+	
+	cells[item] = index;
+	places[item] = cell->count;
+	cell->items[cell->count++] = item;
+	
+	return true;
+}
+
+// Queries
+
+static bool SpatialOverlaps(SpatialBox a, SpatialBox b) {
+	return a.min_x <= b.max_x && a.max_x >= b.min_x && a.min_y <= b.max_y && a.max_y >= b.min_y;
+}
+
+static bool SpatialOutside(SpatialBox box, const float *planes, size_t count) {
+	/**
+	 * Check if a box is entirely outside one of the planes, where the inside
+	 * of a plane (a, b, c) is where a * x + b * y + c >= 0
+	 */
+	
+	for (size_t i = 0; i < count; i++) {
+		float a = planes[3 * i], b = planes[3 * i + 1], c = planes[3 * i + 2];
+		
+		// The corner furthest inside
+		float x = (a >= 0.0f) ? box.max_x : box.min_x;
+		float y = (b >= 0.0f) ? box.max_y : box.min_y;
+		
+		if (a * x + b * y + c < 0.0f) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static SpatialBox SpatialCellBox(SpatialGrid *this, SpatialCell *cell) {
+	/**
+	 * Get the box any item in a cell is within
+	 */
+	
+	return (SpatialBox) {
+		cell->x * this->cell_size - this->reach,
+		cell->y * this->cell_size - this->reach,
+		(cell->x + 1) * this->cell_size + this->reach,
+		(cell->y + 1) * this->cell_size + this->reach,
+	};
+}
+
+static bool SpatialCollect(SpatialCell *cell, const SpatialBox *boxes, SpatialBox box, Bitmap *result) {
+	for (uint32_t i = 0; i < cell->count; i++) {
+		if (SpatialOverlaps(boxes[cell->items[i]], box) && !BitmapAdd(result, cell->items[i])) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool SpatialQueryBox(SpatialGrid *this, const SpatialBox *boxes, SpatialBox box, Bitmap *result) {
+	/**
+	 * Add the items whose boxes overlap `box` to `result`
+	 *
+	 * @return If the query could be done, which only fails when out of memory
+	 */
+	
+	if (!this->cell_count) {
+		return true;
+	}
+	
+	int64_t min_x = SpatialCoordinate(this, box.min_x - this->reach);
+	int64_t min_y = SpatialCoordinate(this, box.min_y - this->reach);
+	int64_t max_x = SpatialCoordinate(this, box.max_x + this->reach);
+	int64_t max_y = SpatialCoordinate(this, box.max_y + this->reach);
+	
+	min_x = (min_x > this->min_x) ? min_x : this->min_x;
+	min_y = (min_y > this->min_y) ? min_y : this->min_y;
+	max_x = (max_x < this->max_x) ? max_x : this->max_x;
+	max_y = (max_y < this->max_y) ? max_y : this->max_y;
+	
+	if (min_x > max_x || min_y > max_y) {
+		return true;
+	}
+	
+	// Big boxes are cheaper to check against every cell than to look up
+	// each cell they cover
+	if ((uint64_t) (max_x - min_x + 1) * (uint64_t) (max_y - min_y + 1) > this->cell_count) {
+		for (size_t i = 0; i < this->cell_count; i++) {
+			SpatialCell *cell = &this->cells[i];
+			
+			if (cell->x >= min_x && cell->x <= max_x && cell->y >= min_y && cell->y <= max_y && !SpatialCollect(cell, boxes, box, result)) {
+				return false;
+			}
+		}
+		
+		return true;
+	}
+	
+	for (int64_t y = min_y; y <= max_y; y++) {
+		for (int64_t x = min_x; x <= max_x; x++) {
+			uint32_t cell = SpatialFind(this, x, y);
+			
+			if (cell != SPATIAL_NONE && !SpatialCollect(&this->cells[cell], boxes, box, result)) {
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+bool SpatialQueryPlanes(SpatialGrid *this, const SpatialBox *boxes, const float *planes, size_t count, Bitmap *result) {
+	/**
+	 * Add the items whose boxes are at least partly inside every plane to
+	 * `result`, like the planes of a view frustum. Whole cells outside a
+	 * plane are skipped.
+	 *
+	 * @param planes `count` planes of three floats, see SpatialOutside()
+	 * @return If the query could be done, which only fails when out of memory
+	 */
+	
+	for (size_t i = 0; i < this->cell_count; i++) {
+		SpatialCell *cell = &this->cells[i];
+		
+		if (!cell->count || SpatialOutside(SpatialCellBox(this, cell), planes, count)) {
+			continue;
+		}
+		
+		for (uint32_t j = 0; j < cell->count; j++) {
+			if (!SpatialOutside(boxes[cell->items[j]], planes, count) && !BitmapAdd(result, cell->items[j])) {
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+static float SpatialDistance(SpatialBox box, float x, float y) {
+	/**
+	 * Get the squared distance from a point to a box, which is 0 inside it
+	 */
+	
+	float dx = fmaxf(fmaxf(box.min_x - x, x - box.max_x), 0.0f);
+	float dy = fmaxf(fmaxf(box.min_y - y, y - box.max_y), 0.0f);
+	
+	return dx * dx + dy * dy;
+}
+
+static void SpatialClosest(SpatialCell *cell, const SpatialBox *boxes, float x, float y, uint32_t *best, float *best_distance) {
+	for (uint32_t i = 0; i < cell->count; i++) {
+		float distance = SpatialDistance(boxes[cell->items[i]], x, y);
+		
+		if (distance < *best_distance || (*best == SPATIAL_NONE && distance <= *best_distance)) {
+			*best = cell->items[i];
+			*best_distance = distance;
+		}
+	}
+}
+
+uint32_t SpatialNearest(SpatialGrid *this, const SpatialBox *boxes, float x, float y, float within) {
+	/**
+	 * Find the item whose box is nearest to a point. Rings of cells are
+	 * searched outwards from the point's cell until nothing in the next ring
+	 * could be nearer than what was found.
+	 *
+	 * @param within Largest distance to look at, which may be INFINITY
+	 * @return Nearest item, or SPATIAL_NONE if there's nothing close enough
+	 */
+	
+	uint32_t best = SPATIAL_NONE;
+	float best_distance = within * within;
+	
+	if (!this->cell_count) {
+		return SPATIAL_NONE;
+	}
+	
+	int64_t center_x = SpatialCoordinate(this, x);
+	int64_t center_y = SpatialCoordinate(this, y);
+	
+	// Past this ring there are no more cells
+	int64_t last = 0;
+	int64_t edges[4] = {center_x - this->min_x, this->max_x - center_x, center_y - this->min_y, this->max_y - center_y};
+	
+	for (size_t i = 0; i < 4; i++) {
+		last = (edges[i] > last) ? edges[i] : last;
+	}
+	
+	for (int64_t ring = 0; ring <= last; ring++) {
+		// Items in this ring are at least this far away
+		float near = (ring - 1) * this->cell_size - this->reach;
+		
+		if (near > 0.0f && near * near > best_distance) {
+			break;
+		}
+		
+		// Once the rings are bigger than the grid, it's cheaper to look at
+		// every cell
+		if ((uint64_t) (2 * ring + 1) * (uint64_t) (2 * ring + 1) > 4 * this->cell_count) {
+			for (size_t i = 0; i < this->cell_count; i++) {
+				SpatialClosest(&this->cells[i], boxes, x, y, &best, &best_distance);
+			}
+			
+			break;
+		}
+		
+		for (int64_t dy = -ring; dy <= ring; dy++) {
+			// Only the edges of the ring, the inside was done already
+			int64_t step = (dy == -ring || dy == ring) ? 1 : 2 * ring;
+			
+			for (int64_t dx = -ring; dx <= ring; dx += step) {
+				uint32_t cell = SpatialFind(this, center_x + dx, center_y + dy);
+				
+				if (cell != SPATIAL_NONE) {
+					SpatialClosest(&this->cells[cell], boxes, x, y, &best, &best_distance);
+				}
+			}
+		}
+	}
+	
+	return best;
+}
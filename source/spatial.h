@@ -0,0 +1,52 @@
+/**
+ * Loose uniform grid, for finding things by where they are
+ */
+
+#pragma once
+
+#include "common.h"
+#include "bitmap.h"
+
+#define SPATIAL_NONE UINT32_MAX
+
+typedef struct SpatialBox {
+	float min_x, min_y;
+	float max_x, max_y;
+} SpatialBox;
+
+typedef struct SpatialCell {
+	int32_t x, y;     // Cell coordinates
+	uint32_t *items;  // In no order
+	uint32_t count;
+	uint32_t capacity;
+} SpatialCell;
+
+typedef struct SpatialGrid {
+	/**
+	 * Items are numbers, like slots. Whoever owns the grid keeps each item's
+	 * box, cell and place in the cell in columns indexed by item, which are
+	 * passed in. Each item is in the cell its box's centre is in, so it's
+	 * only ever in one cell, and queries look as far around as the biggest
+	 * box could reach. Cells are never freed, so their indices are stable.
+	 */
+	
+	float cell_size;
+	float reach; // Largest half size of any box put in the grid
+	
+	SpatialCell *cells;
+	size_t cell_count;
+	size_t cell_capacity;
+	int32_t min_x, min_y, max_x, max_y; // Bounds of the cells
+	
+	// Hash from cell coordinates to cells
+	uint32_t *table;
+	size_t table_capacity;
+} SpatialGrid;
+
+void SpatialInit(SpatialGrid *this, float cell_size);
+void SpatialFree(SpatialGrid *this);
+bool SpatialPut(SpatialGrid *this, uint32_t *cells, uint32_t *places, uint32_t item, SpatialBox box);
+void SpatialTake(SpatialGrid *this, uint32_t *cells, uint32_t *places, uint32_t item);
+bool SpatialQueryBox(SpatialGrid *this, const SpatialBox *boxes, SpatialBox box, Bitmap *result);
+bool SpatialQueryPlanes(SpatialGrid *this, const SpatialBox *boxes, const float *planes, size_t count, Bitmap *result);
+uint32_t SpatialNearest(SpatialGrid *this, const SpatialBox *boxes, float x, float y, float within);
@@ -0,0 +1,2959 @@
+/**
+ * The Universe
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "vm.h"
+
+#include "bitmap.h"
+#include "spatial.h"
+#include "mailbox.h"
+#include "universe.h"
+#include "history.h"
+
+#define UNIVERSE_IMAGE_MAGIC 0x564e5555 // "UUNV"
+#define UNIVERSE_IMAGE_VERSION 4
+
+// Layout of UniverseSave(): this header, the tag names, the collections, the
+// messages waiting to be delivered, then each column for `count` slots, each
+// padded to 8 bytes
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t tag_count;
+	uint32_t collection_count;
+	float cell_size;
+	uint64_t count;
+	object_id locator;
+	uint64_t message_count;
+} UniverseImage;
+
+typedef struct {
+	object_id object;
+	object_id name;
+	object_id predicate;
+} UniverseImageCollection;
+
+// Columns start on huge page boundaries in the arena
+#define UNIVERSE_ARENA_ALIGN ((size_t) 2 << 20)
+
+// Element size of each column, in the order UniverseColumns() lists them
+static const size_t UniverseColumnSizes[] = {
+	sizeof(object_id),  // objects
+	sizeof(object_id),  // names
+	sizeof(uint64_t),   // tags
+	sizeof(uint64_t),   // collections
+	sizeof(uint8_t),    // alive
+	sizeof(uint8_t),    // dirty
+	sizeof(SpatialBox), // boxes
+	sizeof(uint32_t),   // cells
+	sizeof(uint32_t),   // places
+	sizeof(void *),     // shapes
+};
+
+#define UNIVERSE_COLUMN_COUNT (sizeof UniverseColumnSizes / sizeof *UniverseColumnSizes)
+
+// Shapes point outside the arena, so they're asked for again instead of
+// being saved
+#define UNIVERSE_SAVED_COLUMN_COUNT (UNIVERSE_COLUMN_COUNT - 1)
+
+#define UNIVERSE_NATIVE(name) static object_id name(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids)
+
+// Index
+
+static size_t UniverseIndexHome(UniverseIndex *index, object_id key) {
+	return vm_hash_id(key) & (index->capacity - 1);
+}
+
+static UniverseSlot UniverseIndexFind(UniverseIndex *index, const object_id *keys, object_id key) {
+	/**
+	 * Find a slot whose key is `key`, or UNIVERSE_NO_SLOT
+	 */
+	
+	if (!index->count) {
+		return UNIVERSE_NO_SLOT;
+	}
+	
+	size_t mask = index->capacity - 1;
+	
+	for (size_t i = UniverseIndexHome(index, key); index->slots[i] != UNIVERSE_NO_SLOT; i = (i + 1) & mask) {
+		if (keys[index->slots[i]] == key) {
+			return index->slots[i];
+		}
+	}
+	
+	return UNIVERSE_NO_SLOT;
+}
+
+static void UniverseIndexPlace(UniverseIndex *index, const object_id *keys, UniverseSlot slot) {
+	size_t mask = index->capacity - 1;
+	size_t i = UniverseIndexHome(index, keys[slot]);
+	
+	while (index->slots[i] != UNIVERSE_NO_SLOT) {
+		i = (i + 1) & mask;
+	}
+	
+	index->slots[i] = slot;
+}
+
+static bool UniverseIndexResize(UniverseIndex *index, const object_id *keys, size_t capacity) {
+	UniverseSlot *old = index->slots;
+	size_t old_capacity = index->capacity;
+	
+	index->slots = DgMemoryAllocate(sizeof *index->slots * capacity);
+	
+	if (!index->slots) {
+		index->slots = old;
+		return false;
+	}
+	
+	memset(index->slots, 0xff, sizeof *index->slots * capacity);
+	index->capacity = capacity;
+	
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old[i] != UNIVERSE_NO_SLOT) {
+			UniverseIndexPlace(index, keys, old[i]);
+		}
+	}
+	
+	DgMemoryFree(old);
+	
+	return true;
+}
+
+static bool UniverseIndexInsert(UniverseIndex *index, const object_id *keys, UniverseSlot slot) {
+	/**
+	 * Add a slot under the key it has in `keys`
+	 */
+	
+	if ((index->count + 1) * 4 > index->capacity * 3 && !UniverseIndexResize(index, keys, index->capacity ? 2 * index->capacity : 64)) {
+		return false;
+	}
+	
+	UniverseIndexPlace(index, keys, slot);
+	index->count++;
+	
+	return true;
+}
+
+static void UniverseIndexRemove(UniverseIndex *index, const object_id *keys, UniverseSlot slot) {
+	/**
+	 * Remove a slot, which must still have the key it was added under. The
+	 * entries after it are shifted back instead of leaving a tombstone.
+	 */
+	
+	if (!index->count) {
+		return;
+	}
+	
+	size_t mask = index->capacity - 1;
+	size_t i = UniverseIndexHome(index, keys[slot]);
+	
+	while (index->slots[i] != slot) {
+		if (index->slots[i] == UNIVERSE_NO_SLOT) {
+			return;
+		}
+		
+		i = (i + 1) & mask;
+	}
+	
+	for (size_t j = (i + 1) & mask; index->slots[j] != UNIVERSE_NO_SLOT; j = (j + 1) & mask) {
+		size_t home = UniverseIndexHome(index, keys[index->slots[j]]);
+		
+		// Move the entry into the hole unless its home is after the hole
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			index->slots[i] = index->slots[j];
+			i = j;
+		}
+	}
+	
+	index->slots[i] = UNIVERSE_NO_SLOT;
+	index->count--;
+}
+
+static size_t UniverseIndexCapacity(size_t count) {
+	/**
+	 * Get the capacity an index needs to hold `count` slots
+	 */
+	
+	size_t capacity = 64;
+	
+	while (capacity * 3 < count * 4) {
+		capacity *= 2;
+	}
+	
+	return capacity;
+}
+
+static bool UniverseIndexRebuild(UniverseIndex *index, const object_id *keys, const uint8_t *alive, size_t count) {
+	/**
+	 * Index every live slot with a key at once, like after loading
+	 */
+	
+	size_t capacity = UniverseIndexCapacity(count);
+	
+	DgMemoryFree(index->slots);
+	index->slots = NULL;
+	index->capacity = 0;
+	index->count = 0;
+	
+	if (!UniverseIndexResize(index, keys, capacity)) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		if (alive[i] && keys[i] != OID_NIL) {
+			UniverseIndexPlace(index, keys, i);
+			index->count++;
+		}
+	}
+	
+	return true;
+}
+
+// Slots
+
+static bool UniversePushSlot(UniverseSlot **list, size_t *count, size_t *capacity, UniverseSlot slot) {
+	if (*count >= *capacity) {
+		size_t new_capacity = *capacity ? (2 * *capacity) : 64;
+		UniverseSlot *new_list = DgMemoryReallocate(*list, sizeof *new_list * new_capacity);
+		
+		if (!new_list) {
+			return false;
+		}
+		
+		*list = new_list;
+		*capacity = new_capacity;
+	}
+	
+	(*list)[(*count)++] = slot;
+	
+	return true;
+}
+
+// Columns
+
+static void UniverseColumns(Universe *this, void **columns[UNIVERSE_COLUMN_COUNT]) {
+	columns[0] = (void **) &this->objects;
+	columns[1] = (void **) &this->names;
+	columns[2] = (void **) &this->tags;
+	columns[3] = (void **) &this->collections;
+	columns[4] = (void **) &this->alive;
+	columns[5] = (void **) &this->dirty;
+	columns[6] = (void **) &this->boxes;
+	columns[7] = (void **) &this->cells;
+	columns[8] = (void **) &this->places;
+	columns[9] = (void **) &this->shapes;
+}
+
+static bool UniverseMapArena(Universe *this) {
+	/**
+	 * Reserve address space for every column at its largest, without
+	 * committing any memory yet
+	 */
+	
+	void **columns[UNIVERSE_COLUMN_COUNT];
+	size_t offsets[UNIVERSE_COLUMN_COUNT];
+	size_t size = 0;
+	
+	for (size_t i = 0; i < UNIVERSE_COLUMN_COUNT; i++) {
+		offsets[i] = size;
+		size += (UNIVERSE_MAX_SLOTS * UniverseColumnSizes[i] + UNIVERSE_ARENA_ALIGN - 1) & ~(UNIVERSE_ARENA_ALIGN - 1);
+	}
+	
+	// There is room to move the start up to a huge page boundary
+	uint8_t *arena = mmap(NULL, size + UNIVERSE_ARENA_ALIGN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	
+	if (arena == MAP_FAILED) {
+		return false;
+	}
+	
+	this->arena = arena;
+	this->arena_size = size + UNIVERSE_ARENA_ALIGN;
+	
+	uint8_t *base = (uint8_t *) (((uintptr_t) arena + UNIVERSE_ARENA_ALIGN - 1) & ~(uintptr_t) (UNIVERSE_ARENA_ALIGN - 1));
+
+#ifdef MADV_HUGEPAGE
+	madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+	UniverseColumns(this, columns);
+	
+	for (size_t i = 0; i < UNIVERSE_COLUMN_COUNT; i++) {
+		*columns[i] = base + offsets[i];
+	}
+	
+	return true;
+}
+
+static bool UniverseGrow(Universe *this, size_t capacity) {
+	/**
+	 * Make room for `capacity` slots in every column. This only commits more
+	 * of the arena, so the columns never move and nothing is copied.
+	 */
+	
+	if (capacity > UNIVERSE_MAX_SLOTS) {
+		return false;
+	}
+	
+	void **columns[UNIVERSE_COLUMN_COUNT];
+	UniverseColumns(this, columns);
+	
+	for (size_t i = 0; i < UNIVERSE_COLUMN_COUNT; i++) {
+		if (mprotect(*columns[i], capacity * UniverseColumnSizes[i], PROT_READ | PROT_WRITE)) {
+			return false;
+		}
+	}
+	
+	this->capacity = capacity;
+	
+	return true;
+}
+
+static bool UniverseReset(Universe *this, vm_context vm) {
+	memset(this, 0, sizeof *this);
+	this->vm = vm;
+	this->proto = vm_get_global(vm, vm_intern(vm, "Universe"));
+	this->collection_proto = vm_get_global(vm, vm_intern(vm, "Collection"));
+	vm->host = this;
+	
+	for (size_t i = 0; i < UNIVERSE_MAILBOXES; i++) {
+		if (MailboxInit(&this->mailboxes[i], UNIVERSE_MAILBOX_CAPACITY)) {
+			return false;
+		}
+	}
+	
+	return UniverseMapArena(this);
+}
+
+// Messages
+
+static Mailbox *UniverseMailbox(Universe *this, object_id receiver) {
+	if (this->ordered) {
+		UniverseSlot slot = UniverseFind(this, receiver);
+		return &this->mailboxes[(slot != UNIVERSE_NO_SLOT) ? slot % UNIVERSE_MAILBOXES : 0];
+	}
+	
+	return &this->mailboxes[vm_hash_id(receiver) % UNIVERSE_MAILBOXES];
+}
+
+static size_t UniverseWaiting(Mailbox *mailbox) {
+	/**
+	 * Count the messages in a mailbox that are ready to be delivered
+	 */
+	
+	size_t count = 0;
+	
+	while (MailboxPeek(mailbox, count)) {
+		count++;
+	}
+	
+	return count;
+}
+
+static void UniverseReleaseMessage(Universe *this, MailboxMessage *message) {
+	vm_release(this->vm, message->receiver);
+	vm_release(this->vm, message->selector);
+	vm_release(this->vm, message->argument);
+}
+
+// Collections
+
+static int UniverseSlotCompare(const void *a, const void *b) {
+	UniverseSlot x = *(const UniverseSlot *) a;
+	UniverseSlot y = *(const UniverseSlot *) b;
+	
+	return (x > y) - (x < y);
+}
+
+static int UniverseSlotCompareReversed(const void *a, const void *b) {
+	return UniverseSlotCompare(b, a);
+}
+
+static bool UniverseCollectionSync(Universe *this, int collection) {
+	/**
+	 * Bring the sorted members of a collection up to date, dropping the ones
+	 * that were removed and merging in the ones that were added
+	 */
+	
+	UniverseCollection *c = &this->collection_list[collection];
+	uint64_t bit = (uint64_t) 1 << collection;
+	
+	if (!c->stale && !c->added_count) {
+		return true;
+	}
+	
+	size_t end = c->member_count + c->added_count;
+	
+	if (end > c->member_capacity) {
+		size_t capacity = (2 * c->member_capacity > end) ? 2 * c->member_capacity : end;
+		UniverseSlot *members = DgMemoryReallocate(c->members, sizeof *members * capacity);
+		
+		if (!members) {
+			return false;
+		}
+		
+		c->members = members;
+		c->member_capacity = capacity;
+	}
+	
+	if (c->added_count) {
+		qsort(c->added, c->added_count, sizeof *c->added, UniverseSlotCompare);
+	}
+	
+	// Merge from the back, so the members are written over only after they
+	// have been read. A slot that was removed and added again is in both
+	// lists but kept once.
+	size_t i = c->member_count, j = c->added_count, at = end;
+	
+	while (i || j) {
+		UniverseSlot slot = (!j || (i && c->members[i - 1] > c->added[j - 1])) ? c->members[--i] : c->added[--j];
+		
+		if ((this->collections[slot] & bit) && (at == end || c->members[at] != slot)) {
+			c->members[--at] = slot;
+		}
+	}
+	
+	memmove(c->members, c->members + at, sizeof *c->members * (end - at));
+	c->member_count = end - at;
+	c->added_count = 0;
+	c->stale = false;
+	
+	return true;
+}
+
+// Natives
+
+static Universe *UniverseNativeUniverse(vm_context vm) {
+	if (!vm->host) {
+		vm_error(vm, "There is no Universe");
+	}
+	
+	return vm->host;
+}
+
+UNIVERSE_NATIVE(UniverseNativeNew) {
+	/**
+	 * There is only the one Universe, which is the prototype itself
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	return this ? this->proto : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeAdd) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	UniverseSlot slot = UniverseAdd(this, ids[0]);
+	
+	if (slot == UNIVERSE_NO_SLOT) {
+		vm_error(vm, "add: expects a script object");
+		return OID_NIL;
+	}
+	
+	return MAKE_OBJID(OCLS_SINT, slot);
+}
+
+UNIVERSE_NATIVE(UniverseNativeRemove) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (this) {
+		UniverseRemove(this, ids[0]);
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativePrealloc) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(ids[0]) != OCLS_SINT || OBJID_SEXT(ids[0]) < 0) {
+		vm_error(vm, "prealloc: expects a count");
+		return OID_NIL;
+	}
+	
+	if (!UniverseReserve(this, OBJID_SEXT(ids[0]))) {
+		vm_error(vm, "There isn't room for %lld more objects", (long long) OBJID_SEXT(ids[0]));
+		return OID_NIL;
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeIncludes) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	return (this && UniverseFind(this, ids[0]) != UNIVERSE_NO_SLOT) ? OID_TRUE : OID_FALSE;
+}
+
+UNIVERSE_NATIVE(UniverseNativeSlotOf) {
+	Universe *this = UniverseNativeUniverse(vm);
+	UniverseSlot slot = this ? UniverseFind(this, ids[0]) : UNIVERSE_NO_SLOT;
+	
+	return (slot != UNIVERSE_NO_SLOT) ? MAKE_OBJID(OCLS_SINT, slot) : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeAt) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this || GET_OBJID_CLS(ids[0]) != OCLS_SINT) {
+		return OID_NIL;
+	}
+	
+	int64_t slot = OBJID_SEXT(ids[0]);
+	
+	if (slot < 0 || (size_t) slot >= this->count || !this->alive[slot]) {
+		return OID_NIL;
+	}
+	
+	return this->objects[slot];
+}
+
+UNIVERSE_NATIVE(UniverseNativeSize) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	return MAKE_OBJID(OCLS_SINT, this ? this->population : 0);
+}
+
+UNIVERSE_NATIVE(UniverseNativeDo) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	// Removed objects keep their slots until the sweep, so slots don't move
+	// while iterating
+	for (size_t i = 0; this && i < this->count && !vm->failed; i++) {
+		if (this->alive[i]) {
+			object_id element = this->objects[i];
+			vm_block_call(vm, ids[0], 1, &element);
+		}
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeNameAs) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	char aux[8];
+	UniverseSlot slot = UniverseFind(this, ids[0]);
+	
+	if (slot == UNIVERSE_NO_SLOT) {
+		vm_error(vm, "name:as: expects an object in the Universe");
+		return OID_NIL;
+	}
+	
+	if (ids[1] != OID_NIL && !vm_tocstring(vm, ids[1], aux)) {
+		vm_error(vm, "name:as: expects a string or nil");
+		return OID_NIL;
+	}
+	
+	UniverseSlot other = UniverseFindName(this, ids[1]);
+	
+	if (other != UNIVERSE_NO_SLOT && other != slot) {
+		vm_error(vm, "Another object is named %s", vm_tocstring(vm, ids[1], aux));
+		return OID_NIL;
+	}
+	
+	if (!UniverseSetName(this, slot, ids[1])) {
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeNamed) {
+	Universe *this = UniverseNativeUniverse(vm);
+	UniverseSlot slot = this ? UniverseFindName(this, ids[0]) : UNIVERSE_NO_SLOT;
+	
+	return (slot != UNIVERSE_NO_SLOT) ? this->objects[slot] : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeNameOf) {
+	Universe *this = UniverseNativeUniverse(vm);
+	UniverseSlot slot = this ? UniverseFind(this, ids[0]) : UNIVERSE_NO_SLOT;
+	
+	return (slot != UNIVERSE_NO_SLOT) ? this->names[slot] : OID_NIL;
+}
+
+static int UniverseNativeTagBit(Universe *this, const char *name, size_t size) {
+	/**
+	 * Find a tag by its name's content, so that looking up a tag never makes
+	 * a new string
+	 */
+	
+	for (size_t i = 0; i < this->tag_count; i++) {
+		char aux[8];
+		size_t tag_size;
+		const char *tag = vm_tolcstring(this->vm, this->tag_names[i], aux, &tag_size);
+		
+		if (tag_size == size && !memcmp(tag, name, size)) {
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+UNIVERSE_NATIVE(UniverseNativeTagAs) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	char aux[8];
+	UniverseSlot slot = UniverseFind(this, ids[0]);
+	
+	if (slot == UNIVERSE_NO_SLOT) {
+		vm_error(vm, "tag:as: expects an object in the Universe");
+		return OID_NIL;
+	}
+	
+	if (!vm_tocstring(vm, ids[1], aux)) {
+		vm_error(vm, "tag:as: expects a string tag");
+		return OID_NIL;
+	}
+	
+	int bit = UniverseTagBit(this, ids[1], true);
+	
+	if (bit < 0) {
+		vm_error(vm, "There can't be more than 64 tags");
+		return OID_NIL;
+	}
+	
+	UniverseSetTag(this, slot, bit, true);
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeUntagAs) {
+	Universe *this = UniverseNativeUniverse(vm);
+	UniverseSlot slot = this ? UniverseFind(this, ids[0]) : UNIVERSE_NO_SLOT;
+	
+	if (slot != UNIVERSE_NO_SLOT) {
+		UniverseSetTag(this, slot, UniverseTagBit(this, ids[1], false), false);
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeIsTagged) {
+	Universe *this = UniverseNativeUniverse(vm);
+	UniverseSlot slot = this ? UniverseFind(this, ids[0]) : UNIVERSE_NO_SLOT;
+	int bit = (slot != UNIVERSE_NO_SLOT) ? UniverseTagBit(this, ids[1], false) : -1;
+	
+	return (bit >= 0 && (this->tags[slot] & ((uint64_t) 1 << bit))) ? OID_TRUE : OID_FALSE;
+}
+
+UNIVERSE_NATIVE(UniverseNativeTagsOf) {
+	Universe *this = UniverseNativeUniverse(vm);
+	UniverseSlot slot = this ? UniverseFind(this, ids[0]) : UNIVERSE_NO_SLOT;
+	uint64_t tags = (slot != UNIVERSE_NO_SLOT) ? this->tags[slot] : 0;
+	object_id array = vm_array_new(vm, __builtin_popcountll(tags));
+	
+	for (; tags; tags &= tags - 1) {
+		vm_array_push(vm, array, this->tag_names[__builtin_ctzll(tags)]);
+	}
+	
+	return array;
+}
+
+static object_id UniverseNativeObjects(vm_context vm, Universe *this, Bitmap *slots) {
+	/**
+	 * Answer an Array of the objects in some slots, in slot order, and free
+	 * the bitmap of slots
+	 */
+	
+	size_t count = BitmapCardinality(slots);
+	uint32_t *values = DgMemoryAllocate(sizeof *values * (count ? count : 1));
+	object_id array = vm_array_new(vm, count);
+	
+	if (values) {
+		BitmapValues(slots, values);
+		
+		for (size_t i = 0; i < count; i++) {
+			vm_array_push(vm, array, this->objects[values[i]]);
+		}
+	}
+	
+	DgMemoryFree(values);
+	BitmapFree(slots);
+	
+	return array;
+}
+
+static object_id UniverseNativeQuery(vm_context vm, Universe *this, object_id string, const Bitmap *within) {
+	/**
+	 * Answer the objects with some tags and without others, given as a
+	 * string like 'Enemy Visible -Dead', and in `within` if it's given
+	 */
+	
+	char aux[8];
+	size_t size;
+	const char *query = vm_tolcstring(vm, string, aux, &size);
+	
+	if (!query) {
+		vm_error(vm, "tagged: expects a string of tags");
+		return OID_NIL;
+	}
+	
+	uint64_t all = 0, none = 0;
+	bool empty = false;
+	
+	for (size_t i = 0; i < size;) {
+		if (query[i] == ' ') {
+			i++;
+			continue;
+		}
+		
+		bool exclude = (query[i] == '-');
+		size_t start = i + exclude;
+		
+		for (i = start; i < size && query[i] != ' '; i++);
+		
+		int bit = UniverseNativeTagBit(this, query + start, i - start);
+		
+		// No object has a tag that doesn't exist
+		if (bit < 0) {
+			empty = empty || !exclude;
+		}
+		else if (exclude) {
+			none |= (uint64_t) 1 << bit;
+		}
+		else {
+			all |= (uint64_t) 1 << bit;
+		}
+	}
+	
+	Bitmap slots, found;
+	BitmapInit(&slots);
+	BitmapInit(&found);
+	
+	if (!empty && (!UniverseQuery(this, all, none, &found) || !(within ? BitmapAnd(&slots, &found, within) : BitmapCopy(&slots, &found)))) {
+		BitmapFree(&slots);
+		BitmapFree(&found);
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
+	}
+	
+	BitmapFree(&found);
+	
+	return UniverseNativeObjects(vm, this, &slots);
+}
+
+UNIVERSE_NATIVE(UniverseNativeTagged) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	return this ? UniverseNativeQuery(vm, this, ids[0], NULL) : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeChanged) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (this) {
+		UniverseChanged(this, UniverseFind(this, ids[0]));
+	}
+	
+	return object;
+}
+
+static Universe *UniverseNativeCollection(vm_context vm, object_id object, int *collection) {
+	/**
+	 * Find the collection a Collection object stands for
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	for (size_t i = 0; this && i < this->collection_count; i++) {
+		if (this->collection_list[i].object == object) {
+			*collection = i;
+			return this;
+		}
+	}
+	
+	if (this) {
+		vm_error(vm, "Not a collection");
+	}
+	
+	return NULL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionNew) {
+	/**
+	 * Make a collection. Like object names, collection names are unique.
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	char aux[8];
+	
+	if (!vm_tocstring(vm, ids[0], aux) || ids[1] != this->proto) {
+		vm_error(vm, "newWithName:forUniverse: expects a string and the Universe");
+		return OID_NIL;
+	}
+	
+	for (size_t i = 0; i < this->collection_count; i++) {
+		if (this->collection_list[i].name == ids[0]) {
+			vm_error(vm, "There already is a collection named %s", vm_tocstring(vm, ids[0], aux));
+			return OID_NIL;
+		}
+	}
+	
+	int collection = UniverseNewCollection(this, ids[0]);
+	
+	if (collection < 0) {
+		vm_error(vm, "There can't be more than 64 collections");
+		return OID_NIL;
+	}
+	
+	return this->collection_list[collection].object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionNamed) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	for (size_t i = 0; this && i < this->collection_count; i++) {
+		if (this->collection_list[i].name == ids[0]) {
+			return this->collection_list[i].object;
+		}
+	}
+	
+	return OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionName) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	return this ? this->collection_list[collection].name : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionSetPredicate) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	object_id method, self, env;
+	
+	if (ids[0] != OID_NIL && !vm_block_parts(vm, ids[0], &method, &self, &env)) {
+		vm_error(vm, "setAutoInclusionPredicate: expects a block or nil");
+		return OID_NIL;
+	}
+	
+	UniverseSetPredicate(this, collection, ids[0]);
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionAdd) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	if (this && !UniverseSetMember(this, collection, UniverseFind(this, ids[0]), true)) {
+		vm_error(vm, "add: expects an object in the Universe");
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionRemove) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	if (this) {
+		UniverseSetMember(this, collection, UniverseFind(this, ids[0]), false);
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionIncludes) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	UniverseSlot slot = this ? UniverseFind(this, ids[0]) : UNIVERSE_NO_SLOT;
+	
+	return (slot != UNIVERSE_NO_SLOT && (this->collections[slot] & ((uint64_t) 1 << collection))) ? OID_TRUE : OID_FALSE;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionSize) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	return MAKE_OBJID(OCLS_SINT, this ? BitmapCardinality(&this->collection_list[collection].slots) : 0);
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionDo) {
+	/**
+	 * Go over the members in slot order. The block may change the collection,
+	 * so this goes over a copy of the members and skips removed ones.
+	 */
+	
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	size_t count;
+	const UniverseSlot *members = UniverseMembers(this, collection, &count);
+	UniverseSlot *copy = DgMemoryAllocate(sizeof *copy * (count ? count : 1));
+	
+	if (!copy || !members) {
+		DgMemoryFree(copy);
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
+	}
+	
+	memcpy(copy, members, sizeof *copy * count);
+	
+	for (size_t i = 0; i < count && !vm->failed; i++) {
+		if (this->collections[copy[i]] & ((uint64_t) 1 << collection)) {
+			object_id element = this->objects[copy[i]];
+			vm_block_call(vm, ids[0], 1, &element);
+		}
+	}
+	
+	DgMemoryFree(copy);
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeCollectionTagged) {
+	int collection;
+	Universe *this = UniverseNativeCollection(vm, object, &collection);
+	
+	return this ? UniverseNativeQuery(vm, this, ids[0], &this->collection_list[collection].slots) : OID_NIL;
+}
+
+static bool UniverseNativeNumber(object_id object, float *value) {
+	if (GET_OBJID_CLS(object) == OCLS_SINT) {
+		*value = OBJID_SEXT(object);
+	}
+	else if (GET_OBJID_CLS(object) == OCLS_FLOAT) {
+		*value = OBJ_ID2DOUBLE(object);
+	}
+	else {
+		return false;
+	}
+	
+	return isfinite(*value);
+}
+
+UNIVERSE_NATIVE(UniverseNativeLocateWith) {
+	/**
+	 * Start locating objects by sending them a selector, or stop if it's nil
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	char aux[8];
+	float cell_size;
+	
+	if ((ids[0] != OID_NIL && !vm_tocstring(vm, ids[0], aux)) || !UniverseNativeNumber(ids[1], &cell_size) || cell_size <= 0.0f) {
+		vm_error(vm, "locateWith:cellSize: expects a selector and a size");
+		return OID_NIL;
+	}
+	
+	UniverseSetLocator(this, ids[0], cell_size);
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeInBox) {
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	float x, y, width, height;
+	
+	if (!UniverseNativeNumber(ids[0], &x) || !UniverseNativeNumber(ids[1], &y) || !UniverseNativeNumber(ids[2], &width) || !UniverseNativeNumber(ids[3], &height)) {
+		vm_error(vm, "inBoxX:y:width:height: expects numbers");
+		return OID_NIL;
+	}
+	
+	Bitmap slots;
+	BitmapInit(&slots);
+	
+	if (this->locator != OID_NIL && !SpatialQueryBox(&this->grid, this->boxes, (SpatialBox) {x, y, x + width, y + height}, &slots)) {
+		BitmapFree(&slots);
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
+	}
+	
+	return UniverseNativeObjects(vm, this, &slots);
+}
+
+UNIVERSE_NATIVE(UniverseNativeInFrustum) {
+	/**
+	 * Answer the objects inside some planes, given as an Array of a, b and c
+	 * for each plane, where a * x + b * y + c >= 0 is inside
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	objt_array *array = (objt_array *) vm_lookup(vm, ids[0]);
+	
+	if (!array || array->header.type != OID_ARRAY || array->length % 3) {
+		vm_error(vm, "inFrustum: expects an Array of three numbers per plane");
+		return OID_NIL;
+	}
+	
+	float *planes = DgMemoryAllocate(sizeof *planes * (array->length ? array->length : 1));
+	
+	if (!planes) {
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
+	}
+	
+	for (size_t i = 0; i < array->length; i++) {
+		if (!UniverseNativeNumber(array->data[i], &planes[i])) {
+			DgMemoryFree(planes);
+			vm_error(vm, "inFrustum: expects an Array of three numbers per plane");
+			return OID_NIL;
+		}
+	}
+	
+	Bitmap slots;
+	BitmapInit(&slots);
+	bool ok = this->locator == OID_NIL || SpatialQueryPlanes(&this->grid, this->boxes, planes, array->length / 3, &slots);
+	
+	DgMemoryFree(planes);
+	
+	if (!ok) {
+		BitmapFree(&slots);
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
+	}
+	
+	return UniverseNativeObjects(vm, this, &slots);
+}
+
+UNIVERSE_NATIVE(UniverseNativeBroadcast) {
+	/**
+	 * Send a message with no argument or one to every member of a
+	 * collection, or to every object if the target is the Universe itself,
+	 * answering how many understood it
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	char aux[8];
+	int collection = -1;
+	
+	if (!vm_tocstring(vm, ids[0], aux)) {
+		vm_error(vm, "broadcast:to: expects a selector");
+		return OID_NIL;
+	}
+	
+	for (size_t i = 0; ids[1] != this->proto && i < this->collection_count; i++) {
+		if (this->collection_list[i].object == ids[1]) {
+			collection = i;
+		}
+	}
+	
+	if (ids[1] != this->proto && collection < 0) {
+		vm_error(vm, "broadcast:to: expects a collection or the Universe");
+		return OID_NIL;
+	}
+	
+	size_t sent = UniverseBroadcast(this, collection, ids[0], args - 2, ids + 2);
+	
+	return MAKE_OBJID(OCLS_SINT, sent);
+}
+
+UNIVERSE_NATIVE(UniverseNativePost) {
+	/**
+	 * Post a message with no argument or one to an object in the Universe,
+	 * the members of a collection, or every object if the target is the
+	 * Universe itself. It's sent when messages are next delivered, and this
+	 * answers false if there was no room for it.
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	char aux[8];
+	bool collection = false;
+	
+	if (!vm_tocstring(vm, ids[0], aux)) {
+		vm_error(vm, "post:to: expects a selector");
+		return OID_NIL;
+	}
+	
+	for (size_t i = 0; i < this->collection_count; i++) {
+		collection |= this->collection_list[i].object == ids[1];
+	}
+	
+	if (ids[1] != this->proto && !collection && UniverseFind(this, ids[1]) == UNIVERSE_NO_SLOT) {
+		vm_error(vm, "post:to: expects an object in the Universe, a collection or the Universe");
+		return OID_NIL;
+	}
+	
+	return UniversePost(this, ids[1], ids[0], args - 2, ids + 2) ? OID_TRUE : OID_FALSE;
+}
+
+UNIVERSE_NATIVE(UniverseNativePack) {
+	/**
+	 * Answer every object in the Universe in the pack format, as a
+	 * PackedArray of bytes
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	DgMemoryStream *stream = this ? DgMemoryStreamCreate() : NULL;
+	object_id bytes = OID_NIL;
+	
+	if (!stream) {
+		return OID_NIL;
+	}
+	
+	if (UniversePack(this, stream)) {
+		vm_error(vm, "pack failed");
+	}
+	else if ((bytes = vm_pack_bytes(vm, stream)) == OID_NIL) {
+		vm_error(vm, "Out of memory");
+	}
+	
+	DgMemoryStreamFree(stream);
+	
+	return bytes;
+}
+
+UNIVERSE_NATIVE(UniverseNativeUnpack) {
+	/**
+	 * Replace every object in the Universe with the ones in bytes answered
+	 * by pack
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	size_t stride, length;
+	const void *data = this ? vm_packed_data(vm, ids[0], &stride, &length) : NULL;
+	
+	if (!data || stride != 1) {
+		vm_error(vm, "unpack: expects a PackedArray of bytes");
+		return OID_NIL;
+	}
+	
+	if (UniverseUnpack(this, data, length)) {
+		vm_error(vm, "unpack: failed");
+		return OID_NIL;
+	}
+	
+	return object;
+}
+
+UNIVERSE_NATIVE(UniverseNativeNearest) {
+	/**
+	 * Answer the object nearest to a point, optionally within some distance,
+	 * or nil
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (!this) {
+		return OID_NIL;
+	}
+	
+	float x, y, within = INFINITY;
+	
+	if (!UniverseNativeNumber(ids[0], &x) || !UniverseNativeNumber(ids[1], &y) || (args > 2 && !UniverseNativeNumber(ids[2], &within))) {
+		vm_error(vm, "nearestToX:y: expects numbers");
+		return OID_NIL;
+	}
+	
+	uint32_t slot = (this->locator != OID_NIL) ? SpatialNearest(&this->grid, this->boxes, x, y, within) : SPATIAL_NONE;
+	
+	return (slot != SPATIAL_NONE) ? this->objects[slot] : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeChecksum) {
+	/**
+	 * Answer a hash of the state of every object in the Universe, for
+	 * telling whether two peers running in lockstep still agree
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	return MAKE_OBJID(OCLS_SINT, this ? UniverseChecksum(this) & ((1ull << 60) - 1) : 0);
+}
+
+UNIVERSE_NATIVE(UniverseNativeFrame) {
+	/**
+	 * Answer the number of the latest frame kept for rolling back to, or nil
+	 * if frames aren't being kept
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	uint64_t frame = (this && this->history) ? HistoryLatest(this->history) : 0;
+	
+	return frame ? MAKE_OBJID(OCLS_SINT, frame) : OID_NIL;
+}
+
+UNIVERSE_NATIVE(UniverseNativeRollbackTo) {
+	/**
+	 * Go back to a kept frame when this one ends, dropping the frames after
+	 * it. Everything done until then is undone too.
+	 *
+	 * @return Whether the frame is kept
+	 */
+	
+	Universe *this = UniverseNativeUniverse(vm);
+	
+	if (GET_OBJID_CLS(ids[0]) != OCLS_SINT) {
+		vm_error(vm, "rollbackTo: expects a frame number");
+		return OID_NIL;
+	}
+	
+	uint64_t frame = GET_OBJID_VAL(ids[0]);
+	
+	if (!this || !this->history || !frame || frame < HistoryOldest(this->history) || frame > HistoryLatest(this->history)) {
+		return OID_FALSE;
+	}
+	
+	this->history->pending = frame;
+	
+	return OID_TRUE;
+}
+
+void UniverseInstall(vm_context vm) {
+	/**
+	 * Create the Universe prototype and its natives. This has to be done
+	 * right after vm_create(), in the same order every time, since images
+	 * find natives by their slot.
+	 */
+	
+	object_id proto = vm_make_proto(vm, "Universe", vm->root);
+	
+	vm_define_native(vm, proto, "new", UniverseNativeNew);
+	vm_define_native(vm, proto, "add:", UniverseNativeAdd);
+	vm_define_native(vm, proto, "remove:", UniverseNativeRemove);
+	vm_define_native(vm, proto, "includes:", UniverseNativeIncludes);
+	vm_define_native(vm, proto, "slotOf:", UniverseNativeSlotOf);
+	vm_define_native(vm, proto, "at:", UniverseNativeAt);
+	vm_define_native(vm, proto, "size", UniverseNativeSize);
+	vm_define_native(vm, proto, "do:", UniverseNativeDo);
+	vm_define_native(vm, proto, "name:as:", UniverseNativeNameAs);
+	vm_define_native(vm, proto, "named:", UniverseNativeNamed);
+	vm_define_native(vm, proto, "nameOf:", UniverseNativeNameOf);
+	vm_define_native(vm, proto, "tag:as:", UniverseNativeTagAs);
+	vm_define_native(vm, proto, "untag:as:", UniverseNativeUntagAs);
+	vm_define_native(vm, proto, "is:tagged:", UniverseNativeIsTagged);
+	vm_define_native(vm, proto, "tagsOf:", UniverseNativeTagsOf);
+	vm_define_native(vm, proto, "tagged:", UniverseNativeTagged);
+	vm_define_native(vm, proto, "changed:", UniverseNativeChanged);
+	vm_define_native(vm, proto, "prealloc:", UniverseNativePrealloc);
+	vm_define_native(vm, proto, "locateWith:cellSize:", UniverseNativeLocateWith);
+	vm_define_native(vm, proto, "inBoxX:y:width:height:", UniverseNativeInBox);
+	vm_define_native(vm, proto, "inFrustum:", UniverseNativeInFrustum);
+	vm_define_native(vm, proto, "nearestToX:y:", UniverseNativeNearest);
+	vm_define_native(vm, proto, "nearestToX:y:within:", UniverseNativeNearest);
+	vm_define_native(vm, proto, "broadcast:to:", UniverseNativeBroadcast);
+	vm_define_native(vm, proto, "broadcast:to:with:", UniverseNativeBroadcast);
+	vm_define_native(vm, proto, "post:to:", UniverseNativePost);
+	vm_define_native(vm, proto, "post:to:with:", UniverseNativePost);
+	vm_define_native(vm, proto, "pack", UniverseNativePack);
+	vm_define_native(vm, proto, "unpack:", UniverseNativeUnpack);
+	vm_define_native(vm, proto, "frame", UniverseNativeFrame);
+	vm_define_native(vm, proto, "rollbackTo:", UniverseNativeRollbackTo);
+	vm_define_native(vm, proto, "checksum", UniverseNativeChecksum);
+	
+	object_id collection = vm_make_proto(vm, "Collection", vm->root);
+	
+	vm_define_native(vm, collection, "newWithName:forUniverse:", UniverseNativeCollectionNew);
+	vm_define_native(vm, collection, "named:", UniverseNativeCollectionNamed);
+	vm_define_native(vm, collection, "name", UniverseNativeCollectionName);
+	vm_define_native(vm, collection, "setAutoInclusionPredicate:", UniverseNativeCollectionSetPredicate);
+	vm_define_native(vm, collection, "add:", UniverseNativeCollectionAdd);
+	vm_define_native(vm, collection, "remove:", UniverseNativeCollectionRemove);
+	vm_define_native(vm, collection, "includes:", UniverseNativeCollectionIncludes);
+	vm_define_native(vm, collection, "size", UniverseNativeCollectionSize);
+	vm_define_native(vm, collection, "do:", UniverseNativeCollectionDo);
+	vm_define_native(vm, collection, "tagged:", UniverseNativeCollectionTagged);
+}
+
+// Universe
+
+DgError UniverseInit(Universe *this, vm_context vm) {
+	/**
+	 * Create an empty Universe for a VM, which natives reach through the
+	 * VM's host pointer
+	 */
+	
+	UniverseInstall(vm);
+	
+	if (!UniverseReset(this, vm) || this->proto == OID_NIL || this->collection_proto == OID_NIL) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	vm_accquire(vm, this->proto);
+	
+	return DG_ERROR_SUCCESS;
+}
+
+static void UniverseFreeShape(Universe *this, UniverseShape *shape) {
+	if (shape) {
+		vm_unpin(this->vm, shape->packed);
+		DgMemoryFree(shape);
+	}
+}
+
+void UniverseFree(Universe *this) {
+	/**
+	 * Release every object in the Universe and free it
+	 */
+	
+	for (size_t i = 0; i < UNIVERSE_MAILBOXES; i++) {
+		MailboxMessage message;
+		
+		while (this->mailboxes[i].cells && MailboxTake(&this->mailboxes[i], &message)) {
+			UniverseReleaseMessage(this, &message);
+		}
+		
+		MailboxFree(&this->mailboxes[i]);
+	}
+	
+	for (size_t i = 0; i < this->count; i++) {
+		vm_release(this->vm, this->objects[i]);
+		vm_release(this->vm, this->names[i]);
+		UniverseFreeShape(this, this->shapes[i]);
+	}
+	
+	for (size_t i = 0; i < this->tag_count; i++) {
+		vm_release(this->vm, this->tag_names[i]);
+		BitmapFree(&this->tag_slots[i]);
+	}
+	
+	for (size_t i = 0; i < this->collection_count; i++) {
+		UniverseCollection *c = &this->collection_list[i];
+		
+		vm_release(this->vm, c->object);
+		vm_release(this->vm, c->name);
+		vm_release(this->vm, c->predicate);
+		BitmapFree(&c->slots);
+		DgMemoryFree(c->members);
+		DgMemoryFree(c->added);
+	}
+	
+	vm_release(this->vm, this->locator);
+	SpatialFree(&this->grid);
+	vm_release(this->vm, this->drawer);
+	DgMemoryFree(this->shaped);
+	UniverseReleaseShapes(this);
+	DgMemoryFree(this->dropped);
+	vm_release(this->vm, this->proto);
+	
+	if (this->vm->host == this) {
+		this->vm->host = NULL;
+	}
+	
+	if (this->arena) {
+		munmap(this->arena, this->arena_size);
+	}
+	
+	DgMemoryFree(this->free);
+	DgMemoryFree(this->dead);
+	DgMemoryFree(this->changed);
+	DgMemoryFree(this->by_object.slots);
+	DgMemoryFree(this->by_name.slots);
+	DgMemoryFree(this->hashes);
+	memset(this, 0, sizeof *this);
+}
+
+bool UniverseReserve(Universe *this, size_t count) {
+	/**
+	 * Make room for `count` more objects up front, in the columns, the
+	 * indexes and the VM's object table, so that adding them doesn't have to
+	 * grow anything. The new part of the columns is written to now, so adding
+	 * objects doesn't fault pages in either.
+	 */
+	
+	size_t needed = (count > this->free_count) ? count - this->free_count : 0;
+	size_t capacity = this->count + needed;
+	size_t old_capacity = this->capacity;
+	
+	if (capacity > old_capacity) {
+		if (!UniverseGrow(this, capacity)) {
+			return false;
+		}
+		
+		void **columns[UNIVERSE_COLUMN_COUNT];
+		UniverseColumns(this, columns);
+		
+		for (size_t i = 0; i < UNIVERSE_COLUMN_COUNT; i++) {
+			memset((uint8_t *) *columns[i] + old_capacity * UniverseColumnSizes[i], 0, (capacity - old_capacity) * UniverseColumnSizes[i]);
+		}
+	}
+	
+	size_t index_capacity = UniverseIndexCapacity(this->population + count);
+	
+	if (index_capacity > this->by_object.capacity && !UniverseIndexResize(&this->by_object, this->objects, index_capacity)) {
+		return false;
+	}
+	
+	if (index_capacity > this->by_name.capacity && !UniverseIndexResize(&this->by_name, this->names, index_capacity)) {
+		return false;
+	}
+	
+	return vm_reserve(this->vm, count);
+}
+
+UniverseSlot UniverseAdd(Universe *this, object_id object) {
+	/**
+	 * Add a script object to the Universe, or find the slot it already has
+	 *
+	 * @return Slot of the object, or UNIVERSE_NO_SLOT if it's not a script
+	 * object or there isn't enough memory
+	 */
+	
+	object_hd *header = vm_lookup(this->vm, object);
+	
+	if (!header || GET_OBJID_CLS(header->type) != OCLS_ID) {
+		return UNIVERSE_NO_SLOT;
+	}
+	
+	UniverseSlot slot = UniverseFind(this, object);
+	
+	if (slot != UNIVERSE_NO_SLOT) {
+		return slot;
+	}
+	
+	if (this->free_count) {
+		slot = this->free[--this->free_count];
+	}
+	else {
+		size_t capacity = this->capacity ? 2 * this->capacity : 64;
+		
+		if (this->count >= this->capacity && !UniverseGrow(this, (capacity < UNIVERSE_MAX_SLOTS) ? capacity : UNIVERSE_MAX_SLOTS)) {
+			return UNIVERSE_NO_SLOT;
+		}
+		
+		slot = this->count++;
+		this->dirty[slot] = 0;
+		this->cells[slot] = SPATIAL_NONE;
+	}
+	
+	this->objects[slot] = object;
+	this->names[slot] = OID_NIL;
+	this->tags[slot] = 0;
+	this->collections[slot] = 0;
+	this->alive[slot] = 1;
+	
+	if (!UniverseIndexInsert(&this->by_object, this->objects, slot)) {
+		this->objects[slot] = OID_NIL;
+		this->alive[slot] = 0;
+		UniversePushSlot(&this->free, &this->free_count, &this->free_capacity, slot);
+		return UNIVERSE_NO_SLOT;
+	}
+	
+	vm_accquire(this->vm, object);
+	this->population++;
+	
+	// New objects are run through the predicates at the next update
+	UniverseChanged(this, slot);
+	
+	return slot;
+}
+
+UniverseSlot UniverseAddAt(Universe *this, object_id object, UniverseSlot slot) {
+	/**
+	 * Add a script object to the Universe in a given slot if it's free, for
+	 * putting it back where it was, or wherever UniverseAdd() puts it if
+	 * not. Slots skipped to reach the end are freed.
+	 */
+	
+	if (slot < UNIVERSE_MAX_SLOTS && slot >= this->count) {
+		size_t capacity = this->capacity ? this->capacity : 64;
+		
+		while (capacity <= slot) {
+			capacity *= 2;
+		}
+		
+		if (slot >= this->capacity && !UniverseGrow(this, (capacity < UNIVERSE_MAX_SLOTS) ? capacity : UNIVERSE_MAX_SLOTS)) {
+			return UniverseAdd(this, object);
+		}
+		
+		while (this->count <= slot) {
+			UniverseSlot skipped = this->count++;
+			
+			this->objects[skipped] = OID_NIL;
+			this->alive[skipped] = 0;
+			this->dirty[skipped] = 0;
+			this->cells[skipped] = SPATIAL_NONE;
+			UniversePushSlot(&this->free, &this->free_count, &this->free_capacity, skipped);
+		}
+	}
+	
+	// UniverseAdd() takes the last free slot
+	for (size_t i = this->free_count; i-- > 0;) {
+		if (this->free[i] == slot) {
+			this->free[i] = this->free[this->free_count - 1];
+			this->free[this->free_count - 1] = slot;
+			break;
+		}
+	}
+	
+	return UniverseAdd(this, object);
+}
+
+bool UniverseRemove(Universe *this, object_id object) {
+	/**
+	 * Take an object out of the Universe. It isn't seen by queries from now
+	 * on, but its slot is only freed by the next sweep, so that slots don't
+	 * change under anything going over the Universe.
+	 */
+	
+	UniverseSlot slot = UniverseFind(this, object);
+	
+	if (slot == UNIVERSE_NO_SLOT) {
+		return false;
+	}
+	
+	UniverseIndexRemove(&this->by_object, this->objects, slot);
+	UniverseSetName(this, slot, OID_NIL);
+	
+	for (uint64_t tags = this->tags[slot]; tags; tags &= tags - 1) {
+		BitmapRemove(&this->tag_slots[__builtin_ctzll(tags)], slot);
+	}
+	
+	this->tags[slot] = 0;
+	SpatialTake(&this->grid, this->cells, this->places, slot);
+	
+	for (uint64_t collections = this->collections[slot]; collections; collections &= collections - 1) {
+		UniverseSetMember(this, __builtin_ctzll(collections), slot, false);
+	}
+	
+	// The next update drops its shape
+	UniverseChanged(this, slot);
+	
+	this->alive[slot] = 0;
+	this->population--;
+	
+	if (!UniversePushSlot(&this->dead, &this->dead_count, &this->dead_capacity, slot)) {
+		// The slot is leaked, but the object is still released
+		vm_release(this->vm, object);
+		this->objects[slot] = OID_NIL;
+	}
+	
+	return true;
+}
+
+UniverseSlot UniverseFind(Universe *this, object_id object) {
+	/**
+	 * Get the slot of an object in the Universe, or UNIVERSE_NO_SLOT
+	 */
+	
+	return UniverseIndexFind(&this->by_object, this->objects, object);
+}
+
+bool UniverseSetName(Universe *this, UniverseSlot slot, object_id name) {
+	/**
+	 * Give an object a name, or take its name away if `name` is nil. Names
+	 * are unique, like HTML IDs, and since strings are interned the name
+	 * index can compare them by ID.
+	 *
+	 * @return If the object was named, which fails if another object has the
+	 * name or there isn't enough memory
+	 */
+	
+	if (slot >= this->count || !this->alive[slot]) {
+		return false;
+	}
+	
+	if (this->names[slot] == name) {
+		return true;
+	}
+	
+	if (name != OID_NIL && UniverseFindName(this, name) != UNIVERSE_NO_SLOT) {
+		return false;
+	}
+	
+	if (this->names[slot] != OID_NIL) {
+		UniverseIndexRemove(&this->by_name, this->names, slot);
+		vm_release(this->vm, this->names[slot]);
+		this->names[slot] = OID_NIL;
+	}
+	
+	if (name == OID_NIL) {
+		return true;
+	}
+	
+	this->names[slot] = name;
+	
+	if (!UniverseIndexInsert(&this->by_name, this->names, slot)) {
+		this->names[slot] = OID_NIL;
+		return false;
+	}
+	
+	vm_accquire(this->vm, name);
+	UniverseChanged(this, slot);
+	
+	return true;
+}
+
+UniverseSlot UniverseFindName(Universe *this, object_id name) {
+	/**
+	 * Get the slot of the object with a name, or UNIVERSE_NO_SLOT
+	 */
+	
+	return (name != OID_NIL) ? UniverseIndexFind(&this->by_name, this->names, name) : UNIVERSE_NO_SLOT;
+}
+
+int UniverseTagBit(Universe *this, object_id name, bool create) {
+	/**
+	 * Get the bit of a tag in the tags column, giving the tag the next bit if
+	 * it's new and `create` is set
+	 *
+	 * @return Bit of the tag, or -1 if there is no such tag or no bits are
+	 * left
+	 */
+	
+	for (size_t i = 0; i < this->tag_count; i++) {
+		if (this->tag_names[i] == name) {
+			return i;
+		}
+	}
+	
+	if (!create || name == OID_NIL || this->tag_count >= UNIVERSE_MAX_TAGS) {
+		return -1;
+	}
+	
+	vm_accquire(this->vm, name);
+	this->tag_names[this->tag_count] = name;
+	
+	return this->tag_count++;
+}
+
+bool UniverseSetTag(Universe *this, UniverseSlot slot, int bit, bool on) {
+	/**
+	 * Give an object a tag or take it away, keeping the tag's slot list in
+	 * step with the tags column
+	 */
+	
+	if (slot >= this->count || !this->alive[slot] || bit < 0 || (size_t) bit >= this->tag_count) {
+		return false;
+	}
+	
+	uint64_t mask = (uint64_t) 1 << bit;
+	
+	if (on && !(this->tags[slot] & mask)) {
+		if (!BitmapAdd(&this->tag_slots[bit], slot)) {
+			return false;
+		}
+		
+		this->tags[slot] |= mask;
+		UniverseChanged(this, slot);
+	}
+	else if (!on && (this->tags[slot] & mask)) {
+		BitmapRemove(&this->tag_slots[bit], slot);
+		this->tags[slot] &= ~mask;
+		UniverseChanged(this, slot);
+	}
+	
+	return true;
+}
+
+bool UniverseQuery(Universe *this, uint64_t all, uint64_t none, Bitmap *result) {
+	/**
+	 * Find the live objects that have every tag in `all` and none of the tags
+	 * in `none`. This works on the tags' slot lists instead of looking at
+	 * each object, starting from the rarest tag.
+	 *
+	 * @param result Set to the slots of the objects found
+	 * @return If the query could be done, which only fails when out of memory
+	 */
+	
+	BitmapClear(result);
+	
+	// Nothing has a tag that doesn't exist
+	uint64_t known = (this->tag_count < UNIVERSE_MAX_TAGS) ? ((uint64_t) 1 << this->tag_count) - 1 : UINT64_MAX;
+	
+	if (all & ~known) {
+		return true;
+	}
+	
+	if (!all) {
+		// Without a tag to start from, every object has to be looked at
+		for (size_t i = 0; i < this->count; i++) {
+			if (this->alive[i] && !(this->tags[i] & none) && !BitmapAdd(result, i)) {
+				return false;
+			}
+		}
+		
+		return true;
+	}
+	
+	int first = __builtin_ctzll(all);
+	
+	for (uint64_t tags = all; tags; tags &= tags - 1) {
+		int bit = __builtin_ctzll(tags);
+		
+		if (BitmapCardinality(&this->tag_slots[bit]) < BitmapCardinality(&this->tag_slots[first])) {
+			first = bit;
+		}
+	}
+	
+	if (!BitmapCopy(result, &this->tag_slots[first])) {
+		return false;
+	}
+	
+	// Each step writes into the other bitmap, then they're swapped
+	Bitmap scratch, swap;
+	BitmapInit(&scratch);
+	bool ok = true;
+	
+	for (uint64_t tags = all & ~((uint64_t) 1 << first); tags && ok; tags &= tags - 1) {
+		ok = BitmapAnd(&scratch, result, &this->tag_slots[__builtin_ctzll(tags)]);
+		swap = *result, *result = scratch, scratch = swap;
+	}
+	
+	for (uint64_t tags = none & known; tags && ok; tags &= tags - 1) {
+		ok = BitmapAndNot(&scratch, result, &this->tag_slots[__builtin_ctzll(tags)]);
+		swap = *result, *result = scratch, scratch = swap;
+	}
+	
+	BitmapFree(&scratch);
+	
+	return ok;
+}
+
+void UniverseChanged(Universe *this, UniverseSlot slot) {
+	/**
+	 * Note that an object's tags or attributes changed, so that the next
+	 * update runs it through the collections' predicates again and the next
+	 * recorded frame packs it again. Objects are only logged once between
+	 * updates.
+	 */
+	
+	if (slot >= this->count || !this->alive[slot]) {
+		return;
+	}
+	
+	vm_touch(this->vm, this->objects[slot]);
+	
+	if (this->dirty[slot]) {
+		return;
+	}
+	
+	if (UniversePushSlot(&this->changed, &this->changed_count, &this->changed_capacity, slot)) {
+		this->dirty[slot] = 1;
+	}
+}
+
+int UniverseNewCollection(Universe *this, object_id name) {
+	/**
+	 * Make an empty collection and the object scripts see for it
+	 *
+	 * @return Index of the collection, or -1 if there can't be any more
+	 */
+	
+	if (this->collection_count >= UNIVERSE_MAX_COLLECTIONS) {
+		return -1;
+	}
+	
+	object_id object = vm_object_new(this->vm, this->collection_proto);
+	
+	if (object == OID_NIL) {
+		return -1;
+	}
+	
+	UniverseCollection *c = &this->collection_list[this->collection_count];
+	
+	memset(c, 0, sizeof *c);
+	c->object = vm_accquire(this->vm, object);
+	c->name = vm_accquire(this->vm, name);
+	c->predicate = OID_NIL;
+	BitmapInit(&c->slots);
+	
+	return this->collection_count++;
+}
+
+bool UniverseSetMember(Universe *this, int collection, UniverseSlot slot, bool member) {
+	/**
+	 * Put an object in a collection or take it out. The sorted members only
+	 * catch up when they're asked for.
+	 */
+	
+	if (collection < 0 || (size_t) collection >= this->collection_count || slot >= this->count || !this->alive[slot]) {
+		return false;
+	}
+	
+	UniverseCollection *c = &this->collection_list[collection];
+	uint64_t bit = (uint64_t) 1 << collection;
+	
+	if (member && !(this->collections[slot] & bit)) {
+		if (!BitmapAdd(&c->slots, slot)) {
+			return false;
+		}
+		
+		if (!UniversePushSlot(&c->added, &c->added_count, &c->added_capacity, slot)) {
+			BitmapRemove(&c->slots, slot);
+			return false;
+		}
+		
+		this->collections[slot] |= bit;
+	}
+	else if (!member && (this->collections[slot] & bit)) {
+		BitmapRemove(&c->slots, slot);
+		this->collections[slot] &= ~bit;
+		c->stale = true;
+	}
+	
+	return true;
+}
+
+void UniverseSetPredicate(Universe *this, int collection, object_id predicate) {
+	/**
+	 * Set the block that decides which objects are in a collection, or nil
+	 * to stop deciding, and run every object through it. After this only
+	 * objects that changed are run through it again, by UniverseUpdate().
+	 */
+	
+	UniverseCollection *c = &this->collection_list[collection];
+	
+	// Blocks are promoted off the stack when they're kept
+	predicate = vm_accquire(this->vm, predicate);
+	vm_release(this->vm, c->predicate);
+	c->predicate = predicate;
+	
+	for (size_t i = 0; i < this->count && predicate != OID_NIL && c->predicate == predicate; i++) {
+		if (this->alive[i]) {
+			object_id object = this->objects[i];
+			UniverseSetMember(this, collection, i, !IS_OBJ_FALSEY(vm_block_call(this->vm, predicate, 1, &object)));
+		}
+	}
+}
+
+const UniverseSlot *UniverseMembers(Universe *this, int collection, size_t *count) {
+	/**
+	 * Get the slots of a collection's members, in order. They stay valid
+	 * until the collection changes.
+	 *
+	 * @return Slots, or NULL if there isn't enough memory
+	 */
+	
+	*count = 0;
+	
+	if (!UniverseCollectionSync(this, collection)) {
+		return NULL;
+	}
+	
+	*count = this->collection_list[collection].member_count;
+	
+	return this->collection_list[collection].members;
+}
+
+static void UniverseLocate(Universe *this, UniverseSlot slot) {
+	/**
+	 * Ask an object where it is, and move it in the grid. Objects answer an
+	 * Array of x and y, or of x, y, width and height. Anything else takes
+	 * the object out of the grid.
+	 */
+	
+	object_id object = this->objects[slot];
+	object_id shape = vm_responds_to(this->vm, object, this->locator) ? vm_msg_send(this->vm, object, this->locator, 0, NULL) : OID_NIL;
+	objt_array *array = (objt_array *) vm_lookup(this->vm, shape);
+	float values[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	bool valid = array && array->header.type == OID_ARRAY && (array->length == 2 || array->length == 4);
+	
+	for (size_t i = 0; valid && i < array->length; i++) {
+		valid = UniverseNativeNumber(array->data[i], &values[i]);
+	}
+	
+	if (!valid || values[2] < 0.0f || values[3] < 0.0f || !this->alive[slot]) {
+		SpatialTake(&this->grid, this->cells, this->places, slot);
+		return;
+	}
+	
+	this->boxes[slot] = (SpatialBox) {values[0], values[1], values[0] + values[2], values[1] + values[3]};
+	SpatialPut(&this->grid, this->cells, this->places, slot, this->boxes[slot]);
+}
+
+void UniverseSetLocator(Universe *this, object_id selector, float cell_size) {
+	/**
+	 * Set the selector objects are sent to find out where they are, or nil
+	 * to stop locating objects, and locate every object. After this objects
+	 * are only located again when they change, by UniverseUpdate().
+	 */
+	
+	vm_accquire(this->vm, selector);
+	vm_release(this->vm, this->locator);
+	this->locator = selector;
+	
+	SpatialFree(&this->grid);
+	SpatialInit(&this->grid, cell_size);
+	
+	for (size_t i = 0; i < this->count; i++) {
+		this->cells[i] = SPATIAL_NONE;
+	}
+	
+	for (size_t i = 0; i < this->count && selector != OID_NIL && this->locator == selector; i++) {
+		if (this->alive[i]) {
+			UniverseLocate(this, i);
+		}
+	}
+}
+
+static uint8_t UniverseColour(float value) {
+	// NaN is 0 too
+	return (value > 0.0f) ? ((value < 255.0f) ? (uint8_t) value : 255) : 0;
+}
+
+static void UniverseDropShape(Universe *this, UniverseSlot slot) {
+	/**
+	 * Take away the shape of a slot. Draw commands that were gathered but
+	 * not presented yet may still point into its PackedArray, so it's kept
+	 * until UniverseReleaseShapes().
+	 */
+	
+	UniverseShape *shape = this->shapes[slot];
+	
+	this->shapes[slot] = NULL;
+	
+	if (!shape || shape->packed == OID_NIL) {
+		DgMemoryFree(shape);
+		return;
+	}
+	
+	if (this->dropped_count >= this->dropped_capacity) {
+		size_t capacity = this->dropped_capacity ? 2 * this->dropped_capacity : 16;
+		UniverseShape **dropped = DgMemoryReallocate(this->dropped, sizeof *dropped * capacity);
+		
+		// Better to keep the array pinned for good than to free it early
+		if (!dropped) {
+			return;
+		}
+		
+		this->dropped = dropped;
+		this->dropped_capacity = capacity;
+	}
+	
+	this->dropped[this->dropped_count++] = shape;
+}
+
+void UniverseReleaseShapes(Universe *this) {
+	/**
+	 * Free the shapes that were replaced since the last call. Call this
+	 * once the frame gathered before they were replaced has been presented.
+	 */
+	
+	for (size_t i = 0; i < this->dropped_count; i++) {
+		UniverseFreeShape(this, this->dropped[i]);
+	}
+	
+	this->dropped_count = 0;
+}
+
+static void UniverseReshape(Universe *this, UniverseSlot slot) {
+	/**
+	 * Ask an object how it's drawn, and keep a copy. Objects answer an Array
+	 * of nine numbers for each vertex: x, y, z, u, v, and r, g, b and a from
+	 * 0 to 255, with three vertices for each triangle. The Array may start
+	 * with the name of a texture. Objects can also answer a PackedArray of
+	 * UniverseVertex, alone or after the name of a texture in an Array,
+	 * which isn't copied. Anything else means the object isn't drawn.
+	 */
+	
+	object_id object = this->objects[slot];
+	object_id answer = (this->alive[slot] && vm_responds_to(this->vm, object, this->drawer)) ? vm_msg_send(this->vm, object, this->drawer, 0, NULL) : OID_NIL;
+	objt_array *array = (objt_array *) vm_lookup(this->vm, answer);
+	bool valid = array && array->header.type == OID_ARRAY && array->length;
+	char aux[8];
+	const char *texture = valid ? vm_tocstring(this->vm, array->data[0], aux) : NULL;
+	size_t first = texture ? 1 : 0;
+	object_id packed = (valid && array->length == first + 1) ? array->data[first] : answer;
+	size_t stride, length;
+	const UniverseVertex *shared = vm_packed_data(this->vm, packed, &stride, &length);
+	UniverseShape *shape = NULL;
+	
+	if (shared && stride != sizeof *shared) {
+		shared = NULL;
+	}
+	
+	size_t count = shared ? length : (valid ? (array->length - first) / 9 : 0);
+	
+	valid = (shared || (valid && (array->length - first) % 27 == 0)) && count && count % 3 == 0 && count <= UINT32_MAX && (!texture || strlen(texture) < UNIVERSE_TEXTURE_NAME);
+	
+	if (valid) {
+		shape = DgMemoryAllocate(sizeof *shape + (shared ? 0 : sizeof *shape->copied * count));
+	}
+	
+	for (size_t i = 0; shape && !shared && valid && i < count; i++) {
+		float v[9];
+		
+		for (size_t j = 0; valid && j < 9; j++) {
+			valid = UniverseNativeNumber(array->data[first + 9 * i + j], &v[j]);
+		}
+		
+		shape->copied[i] = (UniverseVertex) {v[0], v[1], v[2], v[3], v[4], UniverseColour(v[5]), UniverseColour(v[6]), UniverseColour(v[7]), UniverseColour(v[8])};
+	}
+	
+	if (shape && !valid) {
+		DgMemoryFree(shape);
+		shape = NULL;
+	}
+	
+	if (shape) {
+		shape->box = this->boxes[slot];
+		shape->located = this->cells[slot] != SPATIAL_NONE;
+		strcpy(shape->texture, texture ? texture : "");
+		shape->count = count;
+		shape->vertices = shared ? vm_pin(this->vm, packed) : shape->copied;
+		shape->packed = shared ? packed : OID_NIL;
+	}
+	
+	if (!shape != !this->shapes[slot]) {
+		this->shaped_stale = true;
+	}
+	
+	UniverseDropShape(this, slot);
+	this->shapes[slot] = shape;
+}
+
+static void UniverseListShaped(Universe *this) {
+	/**
+	 * List the slots of objects with shapes again, if some gained or lost
+	 * their shapes
+	 */
+	
+	if (!this->shaped_stale) {
+		return;
+	}
+	
+	if (this->count > this->shaped_capacity) {
+		UniverseSlot *shaped = DgMemoryReallocate(this->shaped, sizeof *shaped * this->count);
+		
+		if (!shaped) {
+			return;
+		}
+		
+		this->shaped = shaped;
+		this->shaped_capacity = this->count;
+	}
+	
+	this->shaped_count = 0;
+	
+	for (size_t i = 0; i < this->count; i++) {
+		if (this->shapes[i]) {
+			this->shaped[this->shaped_count++] = i;
+		}
+	}
+	
+	this->shaped_stale = false;
+}
+
+void UniverseSetDrawer(Universe *this, object_id selector) {
+	/**
+	 * Set the selector objects are sent to find out how they're drawn, or
+	 * nil to stop drawing them, and ask every object. After this objects are
+	 * only asked again when they change, by UniverseUpdate().
+	 */
+	
+	vm_accquire(this->vm, selector);
+	vm_release(this->vm, this->drawer);
+	this->drawer = selector;
+	
+	for (size_t i = 0; i < this->count; i++) {
+		if (selector != OID_NIL) {
+			UniverseReshape(this, i);
+		}
+		else if (this->shapes[i]) {
+			UniverseDropShape(this, i);
+			this->shaped_stale = true;
+		}
+	}
+	
+	UniverseListShaped(this);
+}
+
+void UniverseSetOrdered(Universe *this, bool ordered) {
+	/**
+	 * Tick, broadcast and deliver posted messages in slot order, for running
+	 * in lockstep. Otherwise receivers are grouped by prototype and messages
+	 * by a hash of the receiver, which is faster but depends on how objects
+	 * happen to be numbered.
+	 */
+	
+	this->ordered = ordered;
+}
+
+const UniverseSlot *UniverseShaped(Universe *this, size_t *count) {
+	/**
+	 * Get the slots of objects with shapes, in slot order. The list and the
+	 * shapes only change in UniverseUpdate() and UniverseSetDrawer(), so
+	 * they can be read while scripts run between those.
+	 */
+	
+	*count = this->shaped_count;
+	
+	return this->shaped;
+}
+
+size_t UniverseBroadcast(Universe *this, int collection, object_id selector, size_t args, object_id *ids) {
+	/**
+	 * Send a message to every member of a collection, or to every object in
+	 * the Universe if `collection` is -1, looking the method up once per
+	 * prototype rather than once per object. Objects that don't understand
+	 * it are skipped. The receivers are the ones there were when this was
+	 * called.
+	 *
+	 * @return How many objects the message was sent to
+	 */
+	
+	size_t count = 0;
+	const UniverseSlot *members = NULL;
+	
+	if (collection >= 0) {
+		members = UniverseMembers(this, collection, &count);
+		
+		if (!members) {
+			return 0;
+		}
+	}
+	else {
+		count = this->population;
+	}
+	
+	if (!count) {
+		return 0;
+	}
+	
+	object_id *objects = DgMemoryAllocate(sizeof *objects * count);
+	
+	if (!objects) {
+		return 0;
+	}
+	
+	if (members) {
+		for (size_t i = 0; i < count; i++) {
+			objects[i] = this->objects[members[i]];
+		}
+	}
+	else {
+		count = 0;
+		
+		for (size_t i = 0; i < this->count; i++) {
+			if (this->alive[i]) {
+				objects[count++] = this->objects[i];
+			}
+		}
+	}
+	
+	size_t sent = this->ordered ? vm_broadcast_in_order(this->vm, objects, count, selector, args, ids) : vm_broadcast(this->vm, objects, count, selector, args, ids);
+	
+	DgMemoryFree(objects);
+	
+	return sent;
+}
+
+bool UniversePost(Universe *this, object_id receiver, object_id selector, size_t args, object_id *ids) {
+	/**
+	 * Queue a message with no argument or one for the next delivery. The
+	 * receiver is an object, a Collection object for its members, or the
+	 * Universe prototype for every object. The mailboxes don't need a lock,
+	 * but retaining the message's objects touches the script heap, so for
+	 * now this has to be called from the thread running scripts.
+	 *
+	 * @return false if the receiver's mailbox is full
+	 */
+	
+	MailboxMessage message = {
+		.receiver = vm_accquire(this->vm, receiver),
+		.selector = vm_accquire(this->vm, selector),
+		.argument = vm_accquire(this->vm, args ? ids[0] : OID_NIL),
+		.args = args ? 1 : 0,
+	};
+	
+	if (!MailboxPost(UniverseMailbox(this, receiver), &message)) {
+		UniverseReleaseMessage(this, &message);
+		return false;
+	}
+	
+	return true;
+}
+
+static void UniverseSend(Universe *this, MailboxMessage *message) {
+	object_id *ids = &message->argument;
+	
+	if (message->receiver == this->proto) {
+		UniverseBroadcast(this, -1, message->selector, message->args, ids);
+		return;
+	}
+	
+	for (size_t i = 0; i < this->collection_count; i++) {
+		if (this->collection_list[i].object == message->receiver) {
+			UniverseBroadcast(this, i, message->selector, message->args, ids);
+			return;
+		}
+	}
+	
+	// Objects removed since the message was posted don't get it
+	if (UniverseFind(this, message->receiver) != UNIVERSE_NO_SLOT && vm_responds_to(this->vm, message->receiver, message->selector)) {
+		vm_msg_send(this->vm, message->receiver, message->selector, message->args, ids);
+	}
+}
+
+size_t UniverseDeliver(Universe *this) {
+	/**
+	 * Send the messages that were posted, one mailbox after another and in
+	 * the order they were posted within each. Messages posted meanwhile are
+	 * left for the next delivery. Receivers that don't understand a message
+	 * are skipped.
+	 *
+	 * @return How many messages were delivered
+	 */
+	
+	size_t delivered = 0;
+	
+	for (size_t i = 0; i < UNIVERSE_MAILBOXES; i++) {
+		Mailbox *mailbox = &this->mailboxes[i];
+		size_t count = MailboxCount(mailbox);
+		MailboxMessage message;
+		
+		for (size_t j = 0; j < count && MailboxTake(mailbox, &message); j++) {
+			UniverseSend(this, &message);
+			UniverseReleaseMessage(this, &message);
+			delivered++;
+		}
+	}
+	
+	return delivered;
+}
+
+void UniverseTick(Universe *this, object_id selector, object_id time) {
+	/**
+	 * Send `selector` with the time to every object in the Universe that
+	 * understands it. Objects of the same prototype are ticked one after
+	 * another, in slot order, unless the Universe is ordered, when they're
+	 * all ticked in slot order.
+	 */
+	
+	UniverseBroadcast(this, -1, selector, 1, &time);
+}
+
+void UniverseUpdate(Universe *this) {
+	/**
+	 * Locate the objects that changed since the last update, ask them how
+	 * they're drawn, and run them through the predicates of the
+	 * collections. This is done once at the end of the tick phase, so an
+	 * object is looked at once however often it changed, and objects that
+	 * didn't change aren't looked at. Changes made meanwhile are left for
+	 * the next update.
+	 */
+	
+	size_t count = this->changed_count;
+	
+	if (!count) {
+		return;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		this->dirty[this->changed[i]] = 0;
+	}
+	
+	// Objects are located first, so that predicates can use the grid
+	for (size_t i = 0; i < count && this->locator != OID_NIL; i++) {
+		if (this->alive[this->changed[i]]) {
+			UniverseLocate(this, this->changed[i]);
+		}
+	}
+	
+	// Removed objects are in the log too, and lose their shapes here
+	for (size_t i = 0; i < count && this->drawer != OID_NIL; i++) {
+		UniverseReshape(this, this->changed[i]);
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		UniverseSlot slot = this->changed[i];
+		
+		for (size_t j = 0; j < this->collection_count && this->alive[slot]; j++) {
+			// The predicate could replace itself
+			object_id predicate = vm_accquire(this->vm, this->collection_list[j].predicate);
+			object_id object = this->objects[slot];
+			
+			if (predicate != OID_NIL) {
+				UniverseSetMember(this, j, slot, !IS_OBJ_FALSEY(vm_block_call(this->vm, predicate, 1, &object)));
+			}
+			
+			vm_release(this->vm, predicate);
+		}
+	}
+	
+	this->changed_count -= count;
+	memmove(this->changed, this->changed + count, sizeof *this->changed * this->changed_count);
+	
+	UniverseListShaped(this);
+}
+
+void UniverseSweep(Universe *this) {
+	/**
+	 * Free the slots of objects removed since the last sweep. This must only
+	 * be called when nothing is going over the Universe, like between frames.
+	 */
+	
+	for (size_t i = 0; i < this->dead_count; i++) {
+		UniverseSlot slot = this->dead[i];
+		
+		vm_release(this->vm, this->objects[slot]);
+		this->objects[slot] = OID_NIL;
+		this->names[slot] = OID_NIL;
+		UniversePushSlot(&this->free, &this->free_count, &this->free_capacity, slot);
+		
+		// Its ID may be reused, so its hash must not be
+		if (slot < this->hash_capacity) {
+			this->hashes[slot].object = OID_NIL;
+		}
+	}
+	
+	this->dead_count = 0;
+}
+
+// Checksums
+
+typedef struct {
+	Universe *universe;
+	bool linked; // An object in the Universe was hashed as its rank
+} UniverseHashing;
+
+static bool UniverseHashExternal(void *context, object_id object, uint64_t *number) {
+	UniverseHashing *hashing = context;
+	Universe *this = hashing->universe;
+	UniverseSlot slot = UniverseFind(this, object);
+	
+	if (slot == UNIVERSE_NO_SLOT || !this->alive[slot]) {
+		return false;
+	}
+	
+	*number = this->hashes[slot].rank;
+	hashing->linked = true;
+	
+	return true;
+}
+
+uint64_t UniverseChecksum(Universe *this) {
+	/**
+	 * Hash everything scripts can see in the Universe: each object's rank
+	 * among the live slots, name, tags, collections, prototype and fields,
+	 * with references to other objects in the Universe counting as their
+	 * ranks (see vm_hash_value()). Two Universes in the same state get the
+	 * same checksum however their objects were numbered, and so do two
+	 * with their objects in the same order but in other slots, like after
+	 * unpacking. An object is only hashed again when its write count
+	 * changes, or when it refers to objects in the Universe and their ranks
+	 * moved, unless it refers to arrays or other objects that could have
+	 * changed on their own, so this is cheap enough to do every frame.
+	 */
+	
+	UniverseHashing hashing = {.universe = this};
+	vm_hasher hasher = {.vm = this->vm, .external = UniverseHashExternal, .context = &hashing};
+	uint64_t checksum = vm_hash_bytes(&this->population, sizeof this->population);
+	uint32_t rank = 0;
+	bool moved = false;
+	
+	if (this->hash_capacity < this->count) {
+		UniverseHash *hashes = DgMemoryReallocate(this->hashes, sizeof *hashes * this->capacity);
+		
+		// Without ranks for every slot, references can't be hashed
+		if (!hashes) {
+			DgLog(DG_LOG_ERROR, "Out of memory for checksum");
+			return 0;
+		}
+		
+		memset(hashes + this->hash_capacity, 0, sizeof *hashes * (this->capacity - this->hash_capacity));
+		this->hashes = hashes;
+		this->hash_capacity = this->capacity;
+	}
+	
+	// References hash as ranks, so they change when any object in the
+	// Universe is added, removed or moved
+	for (size_t i = 0; i < this->count; i++) {
+		if (this->alive[i]) {
+			moved = moved || this->hashes[i].object != this->objects[i] || this->hashes[i].rank != rank;
+			this->hashes[i].rank = rank++;
+		}
+	}
+	
+	moved = moved || this->ranked != rank;
+	this->ranked = rank;
+	
+	for (size_t i = 0; i < this->count; i++) {
+		if (!this->alive[i]) {
+			continue;
+		}
+		
+		object_id object = this->objects[i];
+		uint32_t writes = vm_writes(this->vm, object);
+		UniverseHash *cached = &this->hashes[i];
+		
+		if (cached->object != object || cached->writes != writes || cached->deep || (cached->linked && moved)) {
+			hasher.deep = false;
+			hashing.linked = false;
+			cached->hash = vm_hash_object(&hasher, object);
+			cached->object = object;
+			cached->writes = writes;
+			cached->deep = hasher.deep;
+			cached->linked = hashing.linked;
+		}
+		
+		uint64_t parts[] = {cached->rank, vm_hash_value(&hasher, this->names[i]), this->tags[i], this->collections[i], cached->hash};
+		
+		checksum += vm_hash_bytes(parts, sizeof parts);
+	}
+	
+	return checksum;
+}
+
+static size_t UniverseImageSize(size_t tag_count, size_t collection_count, size_t message_count, size_t count) {
+	size_t size = sizeof(UniverseImage) + sizeof(object_id) * tag_count + sizeof(UniverseImageCollection) * collection_count + sizeof(MailboxMessage) * message_count;
+	
+	for (size_t i = 0; i < UNIVERSE_SAVED_COLUMN_COUNT; i++) {
+		size += (UniverseColumnSizes[i] * count + 7) & ~(size_t) 7;
+	}
+	
+	return size;
+}
+
+void *UniverseSave(Universe *this, size_t *size) {
+	/**
+	 * Write the columns of the Universe, to be kept with an image of its VM
+	 * since they refer to objects by ID. Bitmaps, indexes and sorted members
+	 * are made again from the columns when loading.
+	 *
+	 * @return Data to write, to be freed with DgMemoryFree, or NULL on error
+	 */
+	
+	size_t count = this->count;
+	size_t message_count = 0;
+	
+	for (size_t i = 0; i < UNIVERSE_MAILBOXES; i++) {
+		message_count += UniverseWaiting(&this->mailboxes[i]);
+	}
+	
+	*size = UniverseImageSize(this->tag_count, this->collection_count, message_count, count);
+	
+	uint8_t *data = DgMemoryAllocate(*size);
+	
+	if (!data) {
+		return NULL;
+	}
+	
+	memset(data, 0, *size);
+	
+	UniverseImage *header = (UniverseImage *) data;
+	header->magic = UNIVERSE_IMAGE_MAGIC;
+	header->version = UNIVERSE_IMAGE_VERSION;
+	header->tag_count = this->tag_count;
+	header->collection_count = this->collection_count;
+	header->cell_size = this->grid.cell_size;
+	header->count = count;
+	header->locator = this->locator;
+	header->message_count = message_count;
+	
+	uint8_t *at = data + sizeof *header;
+	
+	memcpy(at, this->tag_names, sizeof(object_id) * this->tag_count);
+	at += sizeof(object_id) * this->tag_count;
+	
+	for (size_t i = 0; i < this->collection_count; i++) {
+		UniverseCollection *c = &this->collection_list[i];
+		UniverseImageCollection *saved = (UniverseImageCollection *) at;
+		
+		saved->object = c->object;
+		saved->name = c->name;
+		saved->predicate = c->predicate;
+		at += sizeof *saved;
+	}
+	
+	// Their references are counted in the image like the Universe's own
+	for (size_t i = 0; i < UNIVERSE_MAILBOXES; i++) {
+		for (size_t j = 0, n = UniverseWaiting(&this->mailboxes[i]); j < n; j++) {
+			memcpy(at, MailboxPeek(&this->mailboxes[i], j), sizeof(MailboxMessage));
+			at += sizeof(MailboxMessage);
+		}
+	}
+	
+	void **columns[UNIVERSE_COLUMN_COUNT];
+	UniverseColumns(this, columns);
+	
+	for (size_t i = 0; i < UNIVERSE_SAVED_COLUMN_COUNT && count; i++) {
+		memcpy(at, *columns[i], UniverseColumnSizes[i] * count);
+		at += (UniverseColumnSizes[i] * count + 7) & ~(size_t) 7;
+	}
+	
+	return data;
+}
+
+DgError UniverseLoad(Universe *this, vm_context vm, const void *data, size_t size) {
+	/**
+	 * Make the Universe of a VM loaded from an image, from the columns saved
+	 * with it. The references the Universe held are still counted in the
+	 * image, so nothing is retained again. If the data isn't valid, the
+	 * Universe is left empty.
+	 */
+	
+	if (!UniverseReset(this, vm)) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	const UniverseImage *header = data;
+	
+	if (size < sizeof *header || header->magic != UNIVERSE_IMAGE_MAGIC || header->version != UNIVERSE_IMAGE_VERSION) {
+		return DG_ERROR_FAILED;
+	}
+	
+	size_t count = header->count;
+	size_t tag_count = header->tag_count;
+	size_t collection_count = header->collection_count;
+	size_t message_count = header->message_count;
+	
+	if (tag_count > UNIVERSE_MAX_TAGS || collection_count > UNIVERSE_MAX_COLLECTIONS || count > UNIVERSE_MAX_SLOTS || message_count > UNIVERSE_MAILBOXES * UNIVERSE_MAILBOX_CAPACITY || size != UniverseImageSize(tag_count, collection_count, message_count, count)) {
+		return DG_ERROR_FAILED;
+	}
+	
+	const uint8_t *at = (const uint8_t *) (header + 1);
+	
+	memcpy(this->tag_names, at, sizeof(object_id) * tag_count);
+	at += sizeof(object_id) * tag_count;
+	this->tag_count = tag_count;
+	
+	for (size_t i = 0; i < collection_count; i++) {
+		UniverseCollection *c = &this->collection_list[i];
+		const UniverseImageCollection *saved = (const UniverseImageCollection *) at;
+		
+		c->object = saved->object;
+		c->name = saved->name;
+		c->predicate = saved->predicate;
+		at += sizeof *saved;
+	}
+	
+	this->collection_count = collection_count;
+	
+	for (size_t i = 0; i < message_count; i++) {
+		MailboxMessage message;
+		
+		memcpy(&message, at, sizeof message);
+		at += sizeof message;
+		
+		if (!MailboxPost(UniverseMailbox(this, message.receiver), &message)) {
+			return DG_ERROR_FAILED;
+		}
+	}
+	this->locator = header->locator;
+	SpatialInit(&this->grid, header->cell_size);
+	
+	if (!count) {
+		return DG_ERROR_SUCCESS;
+	}
+	
+	if (!UniverseGrow(this, count)) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	void **columns[UNIVERSE_COLUMN_COUNT];
+	UniverseColumns(this, columns);
+	
+	for (size_t i = 0; i < UNIVERSE_SAVED_COLUMN_COUNT; i++) {
+		memcpy(*columns[i], at, UniverseColumnSizes[i] * count);
+		at += (UniverseColumnSizes[i] * count + 7) & ~(size_t) 7;
+	}
+	
+	this->count = count;
+	
+	for (size_t i = 0; i < count; i++) {
+		if (this->alive[i]) {
+			this->population++;
+		}
+		else if (this->objects[i] != OID_NIL) {
+			UniversePushSlot(&this->dead, &this->dead_count, &this->dead_capacity, i);
+		}
+		else {
+			UniversePushSlot(&this->free, &this->free_count, &this->free_capacity, i);
+		}
+		
+		if (this->alive[i] && this->dirty[i]) {
+			UniversePushSlot(&this->changed, &this->changed_count, &this->changed_capacity, i);
+		}
+		else {
+			this->dirty[i] = 0;
+		}
+		
+		// Objects go back in the grid where they were
+		bool located = this->alive[i] && this->cells[i] != SPATIAL_NONE;
+		this->cells[i] = SPATIAL_NONE;
+		
+		if (located && (this->locator == OID_NIL || !(this->grid.cell_size > 0.0f) || !SpatialPut(&this->grid, this->cells, this->places, i, this->boxes[i]))) {
+			return DG_ERROR_FAILED;
+		}
+	}
+	
+	if (!UniverseIndexRebuild(&this->by_object, this->objects, this->alive, count) || !UniverseIndexRebuild(&this->by_name, this->names, this->alive, count)) {
+		return DG_ERROR_ALLOCATION_FAILED;
+	}
+	
+	// The tags' slot lists and the collections' members are made again from
+	// their columns, in slot order, so the members are already sorted
+	for (size_t i = 0; i < count; i++) {
+		uint64_t tags = this->alive[i] ? this->tags[i] : 0;
+		uint64_t collections = this->alive[i] ? this->collections[i] : 0;
+		
+		for (; tags; tags &= tags - 1) {
+			int bit = __builtin_ctzll(tags);
+			
+			if ((size_t) bit >= tag_count || !BitmapAdd(&this->tag_slots[bit], i)) {
+				return DG_ERROR_FAILED;
+			}
+		}
+		
+		for (; collections; collections &= collections - 1) {
+			int bit = __builtin_ctzll(collections);
+			UniverseCollection *c = &this->collection_list[bit];
+			
+			if ((size_t) bit >= collection_count || !BitmapAdd(&c->slots, i) || !UniversePushSlot(&c->members, &c->member_count, &c->member_capacity, i)) {
+				return DG_ERROR_FAILED;
+			}
+		}
+	}
+	
+	return DG_ERROR_SUCCESS;
+}
+
+static bool UniversePackExternal(void *context, object_id object, uint64_t *number) {
+	UniverseSlot slot = UniverseFind(context, object);
+	
+	*number = slot;
+	
+	return slot != UNIVERSE_NO_SLOT;
+}
+
+DgError UniversePack(Universe *this, DgMemoryStream *stream) {
+	/**
+	 * Write every object in the Universe with its name, tags and collections
+	 * in the pack format (see vm_pack.c). Objects are packed with their
+	 * fields and whatever they refer to, except that references to other
+	 * objects in the Universe are written as their slots. Unlike an image,
+	 * this doesn't depend on object IDs, so it can be unpacked into another
+	 * VM running the same scripts.
+	 *
+	 *     tag names, collection names, number of objects
+	 *     for each object: slot, name, tag bits, collection bits, object
+	 *
+	 * @return DG_ERROR_FAILED if some object refers to something that can't
+	 * be packed
+	 */
+	
+	vm_packer packer;
+	vm_packer_init(&packer, this->vm, stream);
+	packer.external = UniversePackExternal;
+	packer.context = this;
+	
+	vm_pack_uint(&packer, this->tag_count);
+	
+	for (size_t i = 0; i < this->tag_count; i++) {
+		vm_pack_value(&packer, this->tag_names[i]);
+	}
+	
+	vm_pack_uint(&packer, this->collection_count);
+	
+	for (size_t i = 0; i < this->collection_count; i++) {
+		vm_pack_value(&packer, this->collection_list[i].name);
+	}
+	
+	vm_pack_uint(&packer, this->population);
+	
+	for (size_t i = 0; i < this->count && !packer.error; i++) {
+		if (this->alive[i]) {
+			vm_pack_uint(&packer, i);
+			UniversePackSlot(this, &packer, i);
+		}
+	}
+	
+	if (packer.error) {
+		DgLog(DG_LOG_ERROR, "Failed to pack the Universe: %s", packer.error);
+	}
+	
+	DgError error = packer.error ? DG_ERROR_FAILED : DG_ERROR_SUCCESS;
+	
+	vm_packer_free(&packer);
+	
+	return error;
+}
+
+bool UniversePackSlot(Universe *this, vm_packer *packer, UniverseSlot slot) {
+	/**
+	 * Write an object in the Universe with its name, tag bits and collection
+	 * bits
+	 */
+	
+	vm_pack_value(packer, this->names[slot]);
+	vm_pack_uint(packer, this->tags[slot]);
+	vm_pack_uint(packer, this->collections[slot]);
+	
+	return vm_pack_object(packer, this->objects[slot]);
+}
+
+bool UniverseUnpackSlot(Universe *this, vm_unpacker *unpacker, UniverseSlot slot) {
+	/**
+	 * Read what UniversePackSlot() wrote back into the object it was packed
+	 * from, which has to be in the Universe. Tags and collections are read
+	 * as bits, so they must not have been renumbered since.
+	 */
+	
+	object_id name = vm_unpack_value(unpacker);
+	uint64_t tags = vm_unpack_uint(unpacker);
+	uint64_t collections = vm_unpack_uint(unpacker);
+	
+	if (unpacker->error || !vm_unpack_object(unpacker, this->objects[slot])) {
+		return false;
+	}
+	
+	if (name != this->names[slot] && !UniverseSetName(this, slot, name)) {
+		DgLog(DG_LOG_WARNING, "Unpacked object's name is taken");
+	}
+	
+	for (uint64_t changed = tags ^ this->tags[slot]; changed; changed &= changed - 1) {
+		int bit = __builtin_ctzll(changed);
+		UniverseSetTag(this, slot, bit, (tags >> bit) & 1);
+	}
+	
+	for (uint64_t changed = collections ^ this->collections[slot]; changed; changed &= changed - 1) {
+		int bit = __builtin_ctzll(changed);
+		
+		if ((size_t) bit < this->collection_count) {
+			UniverseSetMember(this, bit, slot, (collections >> bit) & 1);
+		}
+	}
+	
+	return true;
+}
+
+typedef struct {
+	object_id object;
+	object_id name;
+	uint64_t tags;
+	uint64_t collections;
+} UniverseUnpacked;
+
+typedef struct {
+	vm_context vm;
+	vm_map objects; // Packed slot to the object made for it
+	vm_map filled;  // Packed slots whose objects have been read
+} UniverseUnpacking;
+
+static object_id UniverseUnpackExternal(void *context, uint64_t number) {
+	/**
+	 * Find the object made for a packed slot, making an empty one to read
+	 * into later if the slot hasn't come up yet
+	 */
+	
+	UniverseUnpacking *unpacking = context;
+	object_id key = MAKE_OBJID(OCLS_SINT, number);
+	object_id *found = vm_map_find(&unpacking->objects, key);
+	
+	if (found) {
+		return *found;
+	}
+	
+	object_id object = (number < UNIVERSE_MAX_SLOTS) ? vm_object_new(unpacking->vm, unpacking->vm->root) : OID_NIL;
+	
+	if (object == OID_NIL || !vm_map_put(unpacking->vm, &unpacking->objects, key, object)) {
+		return OID_NIL;
+	}
+	
+	return object;
+}
+
+static uint64_t UniverseUnpackBits(uint64_t bits, const int *map, size_t count) {
+	/**
+	 * Renumber tag or collection bits from packed ones to this Universe's
+	 */
+	
+	uint64_t result = 0;
+	
+	for (; bits; bits &= bits - 1) {
+		size_t bit = __builtin_ctzll(bits);
+		
+		if (bit < count && map[bit] >= 0) {
+			result |= (uint64_t) 1 << map[bit];
+		}
+	}
+	
+	return result;
+}
+
+static bool UniverseUnpackObjects(Universe *this, vm_unpacker *unpacker, UniverseUnpacking *unpacking, UniverseUnpacked **result, size_t *count) {
+	/**
+	 * Read what UniversePack() wrote, without changing the Universe except
+	 * for adding tags it didn't have yet
+	 */
+	
+	int tags[UNIVERSE_MAX_TAGS];
+	int collections[UNIVERSE_MAX_COLLECTIONS];
+	size_t tag_count = vm_unpack_uint(unpacker);
+	
+	if (tag_count > UNIVERSE_MAX_TAGS) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < tag_count; i++) {
+		tags[i] = UniverseTagBit(this, vm_unpack_value(unpacker), true);
+	}
+	
+	size_t collection_count = vm_unpack_uint(unpacker);
+	
+	if (collection_count > UNIVERSE_MAX_COLLECTIONS) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < collection_count; i++) {
+		object_id name = vm_unpack_value(unpacker);
+		
+		collections[i] = -1;
+		
+		for (size_t j = 0; j < this->collection_count; j++) {
+			if (this->collection_list[j].name == name) {
+				collections[i] = j;
+			}
+		}
+	}
+	
+	// Each object takes a few bytes at the very least
+	*count = vm_unpack_uint(unpacker);
+	
+	if (unpacker->error || *count > (size_t) (unpacker->end - unpacker->at) / 4) {
+		return false;
+	}
+	
+	*result = DgMemoryAllocate(sizeof **result * (*count ? *count : 1));
+	
+	if (!*result) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < *count && !unpacker->error; i++) {
+		UniverseUnpacked *record = &(*result)[i];
+		object_id slot = MAKE_OBJID(OCLS_SINT, vm_unpack_uint(unpacker));
+		
+		record->name = vm_unpack_value(unpacker);
+		record->tags = UniverseUnpackBits(vm_unpack_uint(unpacker), tags, tag_count);
+		record->collections = UniverseUnpackBits(vm_unpack_uint(unpacker), collections, collection_count);
+		record->object = UniverseUnpackExternal(unpacking, GET_OBJID_VAL(slot));
+		
+		if (record->object == OID_NIL || vm_map_find(&unpacking->filled, slot) || !vm_map_put(this->vm, &unpacking->filled, slot, OID_TRUE)) {
+			return false;
+		}
+		
+		vm_unpack_object(unpacker, record->object);
+	}
+	
+	// Every object referred to has to have been in there
+	return !unpacker->error && unpacker->at == unpacker->end && unpacking->objects.count == unpacking->filled.count;
+}
+
+DgError UniverseUnpack(Universe *this, const void *data, size_t size) {
+	/**
+	 * Replace every object in the Universe with new ones read from what
+	 * UniversePack() wrote. Slots aren't kept, but references between the
+	 * objects are, and so is their order. Tags are matched by name, and so are collections, which
+	 * have to exist already. If the data isn't valid, nothing is changed.
+	 */
+	
+	vm_context vm = this->vm;
+	vm_unpacker unpacker;
+	UniverseUnpacking unpacking = {.vm = vm};
+	UniverseUnpacked *records = NULL;
+	size_t count = 0;
+	
+	vm_map_init(&unpacking.objects);
+	vm_map_init(&unpacking.filled);
+	vm_unpacker_init(&unpacker, vm, data, size);
+	unpacker.external = UniverseUnpackExternal;
+	unpacker.context = &unpacking;
+	
+	bool ok = UniverseUnpackObjects(this, &unpacker, &unpacking, &records, &count);
+	
+	if (!ok) {
+		DgLog(DG_LOG_ERROR, "Failed to unpack the Universe: %s", unpacker.error ? unpacker.error : "Packed data isn't valid");
+	}
+	
+	for (size_t i = 0; ok && i < this->count; i++) {
+		if (this->alive[i]) {
+			UniverseRemove(this, this->objects[i]);
+		}
+	}
+	
+	// Free slots are taken from the end of the list and new ones come after
+	// them, so with the lowest at the end the objects, which were packed in
+	// slot order, stay in order. The checksum goes by it.
+	if (ok && this->free_count) {
+		qsort(this->free, this->free_count, sizeof *this->free, UniverseSlotCompareReversed);
+	}
+	
+	for (size_t i = 0; ok && i < count; i++) {
+		UniverseSlot slot = UniverseAdd(this, records[i].object);
+		
+		if (slot == UNIVERSE_NO_SLOT) {
+			ok = false;
+			break;
+		}
+		
+		if (records[i].name != OID_NIL && !UniverseSetName(this, slot, records[i].name)) {
+			DgLog(DG_LOG_WARNING, "Unpacked object's name is taken");
+		}
+		
+		for (uint64_t tags = records[i].tags; tags; tags &= tags - 1) {
+			UniverseSetTag(this, slot, __builtin_ctzll(tags), true);
+		}
+		
+		for (uint64_t collections = records[i].collections; collections; collections &= collections - 1) {
+			UniverseSetMember(this, __builtin_ctzll(collections), slot, true);
+		}
+	}
+	
+	DgMemoryFree(records);
+	vm_map_free(vm, &unpacking.objects);
+	vm_map_free(vm, &unpacking.filled);
+	vm_unpacker_free(&unpacker);
+	
+	return ok ? DG_ERROR_SUCCESS : DG_ERROR_FAILED;
+}
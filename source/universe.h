@@ -0,0 +1,241 @@
+/**
+ * The Universe, which holds every object the engine knows about
+ */
+
+#pragma once
+
+#include "common.h"
+#include "vm.h"
+#include "bitmap.h"
+#include "spatial.h"
+#include "mailbox.h"
+
+typedef uint32_t UniverseSlot;
+
+#define UNIVERSE_NO_SLOT UINT32_MAX
+
+// Address space is reserved for this many slots up front, so that columns
+// never move when they grow
+#define UNIVERSE_MAX_SLOTS (1 << 24)
+
+// Tags and collections are bits in a mask, so there can only be this many
+// different ones
+#define UNIVERSE_MAX_TAGS 64
+#define UNIVERSE_MAX_COLLECTIONS 64
+
+// Posted messages are sharded by receiver over this many mailboxes, each
+// holding this many messages
+#define UNIVERSE_MAILBOXES 8
+#define UNIVERSE_MAILBOX_CAPACITY 1024
+
+// Columns, as bits for saying which ones something reads or writes
+typedef enum UniverseColumn {
+	UNIVERSE_OBJECTS = (1 << 0),
+	UNIVERSE_NAMES = (1 << 1),
+	UNIVERSE_TAGS = (1 << 2),
+	UNIVERSE_COLLECTIONS = (1 << 3),
+	UNIVERSE_ALIVE = (1 << 4),
+	UNIVERSE_DIRTY = (1 << 5),
+	UNIVERSE_BOXES = (1 << 6),
+	UNIVERSE_CELLS = (1 << 7), // And places, and the grid
+	UNIVERSE_SHAPES = (1 << 8), // And the list of objects with shapes
+	UNIVERSE_ALL_COLUMNS = (1 << 9) - 1,
+} UniverseColumn;
+
+#define UNIVERSE_TEXTURE_NAME 32
+
+// Laid out like RoVertex, so shapes can be drawn without converting them
+typedef struct UniverseVertex {
+	float x, y, z;
+	float u, v;
+	uint8_t r, g, b, a;
+} UniverseVertex;
+
+typedef struct UniverseShape {
+	/**
+	 * What an object answered when asked how it's drawn, copied out of the
+	 * script heap so that it can be read while scripts run. Vertices in a
+	 * PackedArray are used where they are instead, since scripts can't
+	 * change them, and the array is pinned for as long as the shape is
+	 * kept.
+	 */
+	
+	SpatialBox box; // Where the object was, if it's located
+	bool located;
+	char texture[UNIVERSE_TEXTURE_NAME]; // Empty for none
+	uint32_t count; // Vertices, three per triangle
+	const UniverseVertex *vertices;
+	object_id packed; // PackedArray the vertices are in, or nil if copied
+	UniverseVertex copied[];
+} UniverseShape;
+
+typedef struct UniverseIndex {
+	/**
+	 * Hash index from a key column of the Universe to slots. Only the slots
+	 * are stored, the keys are read from the column.
+	 */
+	
+	UniverseSlot *slots; // UNIVERSE_NO_SLOT for empty entries
+	size_t count;
+	size_t capacity;
+} UniverseIndex;
+
+typedef struct UniverseHash {
+	/**
+	 * What the object in a slot hashed to, kept for the next checksum
+	 */
+	
+	object_id object; // The object hashed, since slots are reused
+	uint32_t writes;  // Its write count when it was hashed
+	uint32_t rank;    // Live slots before it at the last checksum
+	bool deep;        // It refers to things that can change without a write
+	bool linked;      // It refers to other objects in the Universe
+	uint64_t hash;
+} UniverseHash;
+
+typedef struct UniverseCollection {
+	/**
+	 * A set of objects in the Universe, which may decide its members with a
+	 * predicate. Whether an object is a member is its bit in the collections
+	 * column and the bitmap of slots. The members are also kept sorted for
+	 * going over them, which is brought up to date only when needed.
+	 */
+	
+	object_id object;    // Collection object scripts see
+	object_id name;
+	object_id predicate; // Block answering if an object is a member, or nil
+	Bitmap slots;
+	
+	UniverseSlot *members; // Sorted, but may still have removed slots
+	size_t member_count;
+	size_t member_capacity;
+	UniverseSlot *added;   // Not in the members yet, in no order
+	size_t added_count;
+	size_t added_capacity;
+	bool stale;            // Some members were removed
+} UniverseCollection;
+
+typedef struct Universe {
+	/**
+	 * Objects in the Universe live in slots, and what the engine keeps about
+	 * them is stored by column so that going over one attribute of every
+	 * object only touches that attribute. An object keeps its slot for as
+	 * long as it's in the Universe.
+	 */
+	
+	vm_context vm;
+	object_id proto;            // The Universe prototype scripts see
+	object_id collection_proto; // Prototype of collections
+	
+	// Columns, indexed by slot. They are laid out in one arena of reserved
+	// address space, and growing them only commits more of it.
+	uint8_t *arena;
+	size_t arena_size;
+	object_id *objects;    // nil for free slots
+	object_id *names;      // Given name, or nil
+	uint64_t *tags;        // Bit per tag
+	uint64_t *collections; // Bit per collection the object is in
+	uint8_t *alive;        // Cleared when the object is removed
+	uint8_t *dirty;        // Set when the object is in the change log
+	SpatialBox *boxes;     // Where the object is, if it's located
+	uint32_t *cells;       // Cell of the grid the object is in, or SPATIAL_NONE
+	uint32_t *places;      // Where in the cell the object is
+	UniverseShape **shapes; // How the object is drawn, or NULL. Not saved.
+	size_t count;          // Slots used so far, including free ones
+	size_t capacity;
+	size_t population;     // Objects that are alive
+	
+	// Free slots, and slots of removed objects that the next sweep frees
+	UniverseSlot *free;
+	size_t free_count;
+	size_t free_capacity;
+	UniverseSlot *dead;
+	size_t dead_count;
+	size_t dead_capacity;
+	
+	// Slots of objects that changed since the last update
+	UniverseSlot *changed;
+	size_t changed_count;
+	size_t changed_capacity;
+	
+	UniverseIndex by_object;
+	UniverseIndex by_name;
+	
+	// Tags, by bit index, and the slots of live objects having each one
+	object_id tag_names[UNIVERSE_MAX_TAGS];
+	Bitmap tag_slots[UNIVERSE_MAX_TAGS];
+	size_t tag_count;
+	
+	UniverseCollection collection_list[UNIVERSE_MAX_COLLECTIONS];
+	size_t collection_count;
+	
+	// Objects are located by sending them this selector, if it's not nil
+	object_id locator;
+	SpatialGrid grid;
+	
+	// Objects are asked how they're drawn with this selector, if it's not
+	// nil, and the slots of those that answered are listed in slot order
+	object_id drawer;
+	UniverseSlot *shaped;
+	size_t shaped_count;
+	size_t shaped_capacity;
+	bool shaped_stale;
+	
+	// Shapes that were replaced but may still be drawn from, until the
+	// frame they were gathered for is presented
+	UniverseShape **dropped;
+	size_t dropped_count;
+	size_t dropped_capacity;
+	
+	// Messages posted to objects and collections, waiting to be delivered.
+	// Each receiver always goes in the same mailbox, so its messages arrive
+	// in the order they were posted.
+	Mailbox mailboxes[UNIVERSE_MAILBOXES];
+	
+	struct History *history; // Frames kept for rolling back to, or NULL
+	
+	// For lockstep, objects can be ticked, broadcast to and sent posted
+	// messages in slot order, so that nothing depends on how objects and
+	// prototypes are numbered
+	bool ordered;
+	UniverseHash *hashes; // By slot
+	size_t hash_capacity;
+	uint32_t ranked;      // Live objects at the last checksum
+} Universe;
+
+void UniverseInstall(vm_context vm);
+DgError UniverseInit(Universe *this, vm_context vm);
+void UniverseFree(Universe *this);
+bool UniverseReserve(Universe *this, size_t count);
+UniverseSlot UniverseAdd(Universe *this, object_id object);
+UniverseSlot UniverseAddAt(Universe *this, object_id object, UniverseSlot slot);
+bool UniverseRemove(Universe *this, object_id object);
+UniverseSlot UniverseFind(Universe *this, object_id object);
+bool UniverseSetName(Universe *this, UniverseSlot slot, object_id name);
+UniverseSlot UniverseFindName(Universe *this, object_id name);
+int UniverseTagBit(Universe *this, object_id name, bool create);
+bool UniverseSetTag(Universe *this, UniverseSlot slot, int bit, bool on);
+bool UniverseQuery(Universe *this, uint64_t all, uint64_t none, Bitmap *result);
+void UniverseChanged(Universe *this, UniverseSlot slot);
+int UniverseNewCollection(Universe *this, object_id name);
+bool UniverseSetMember(Universe *this, int collection, UniverseSlot slot, bool member);
+void UniverseSetPredicate(Universe *this, int collection, object_id predicate);
+const UniverseSlot *UniverseMembers(Universe *this, int collection, size_t *count);
+void UniverseSetLocator(Universe *this, object_id selector, float cell_size);
+void UniverseSetDrawer(Universe *this, object_id selector);
+void UniverseSetOrdered(Universe *this, bool ordered);
+const UniverseSlot *UniverseShaped(Universe *this, size_t *count);
+void UniverseReleaseShapes(Universe *this);
+size_t UniverseBroadcast(Universe *this, int collection, object_id selector, size_t args, object_id *ids);
+bool UniversePost(Universe *this, object_id receiver, object_id selector, size_t args, object_id *ids);
+size_t UniverseDeliver(Universe *this);
+void UniverseTick(Universe *this, object_id selector, object_id time);
+void UniverseUpdate(Universe *this);
+void UniverseSweep(Universe *this);
+uint64_t UniverseChecksum(Universe *this);
+void *UniverseSave(Universe *this, size_t *size);
+DgError UniverseLoad(Universe *this, vm_context vm, const void *data, size_t size);
+DgError UniversePack(Universe *this, DgMemoryStream *stream);
+DgError UniverseUnpack(Universe *this, const void *data, size_t size);
+bool UniversePackSlot(Universe *this, vm_packer *packer, UniverseSlot slot);
+bool UniverseUnpackSlot(Universe *this, vm_unpacker *unpacker, UniverseSlot slot);
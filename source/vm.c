@@ -1,6 +1,41 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "common.h"
 #include "vm.h"
 
+void vm_install_natives(vm_context vm);
+
+uint64_t vm_hash_bytes(const void *data, size_t size) {
+	/**
+	 * FNV-1a hash. This only depends on the content, never on addresses, so
+	 * it's the same from run to run.
+	 */
+	
+	const uint8_t *bytes = data;
+	uint64_t hash = 0xcbf29ce484222325;
+	
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+	
+	return hash;
+}
+
+static uint64_t vm_hash_mix(uint64_t hash, uint64_t value) {
+	/**
+	 * Fold a value into a hash, with the splitmix64 finalizer
+	 */
+	
+	hash ^= value + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+	
+	return hash ^ (hash >> 31);
+}
+
 const char *vm_tolcstring(vm_context vm, object_id object, char aux[8], size_t *size) {
 	if (GET_OBJID_CLS(object) == OCLS_SSTR) {
 		aux[0] = object;
@@ -20,6 +55,19 @@ const char *vm_tolcstring(vm_context vm, object_id object, char aux[8], size_t *
 	}
 	else {
 		// Return a weak reference to a "real" string object
+		object_hd *header = vm_lookup(vm, object);
+		
+		if (!header || header->type != OID_LONG_STRING) {
+			return NULL;
+		}
+		
+		objt_string *string = (objt_string *) header;
+		
+		if (size) {
+			*size = string->length;
+		}
+		
+		return string->data;
 	}
 }
 
@@ -27,12 +75,49 @@ const char *vm_tocstring(vm_context vm, object_id object, char aux[8]) {
 	return vm_tolcstring(vm, object, aux, NULL);
 }
 
+static bool vm_strings_grow(vm_context vm) {
+	size_t new_capacity = vm->string_capacity ? (2 * vm->string_capacity) : 256;
+	object_id *new_strings = DgMemoryAllocate(sizeof *new_strings * new_capacity);
+	
+	if (!new_strings) {
+		return false;
+	}
+	
+	memset(new_strings, 0, sizeof *new_strings * new_capacity);
+	
+	vm->string_count = 0;
+	
+	for (size_t i = 0; i < vm->string_capacity; i++) {
+		object_id id = vm->strings[i];
+		
+		if (id == OID_NIL || id == VM_MAP_DELETED) {
+			continue;
+		}
+		
+		objt_string *string = (objt_string *) vm_lookup(vm, id);
+		size_t j = string->hash & (new_capacity - 1);
+		
+		while (new_strings[j] != OID_NIL) {
+			j = (j + 1) & (new_capacity - 1);
+		}
+		
+		new_strings[j] = id;
+		vm->string_count++;
+	}
+	
+	DgMemoryFree(vm->strings);
+	vm->strings = new_strings;
+	vm->string_capacity = new_capacity;
+	
+	return true;
+}
+
 object_id vm_tolstring(vm_context vm, const char *string, size_t size) {
 	if (size <= 7) {
 		object_id content = 0;
 		
 		for (size_t i = 0; i < size; i++) {
-			content |= string[i] << (8 * i);
+			content |= (object_id) (uint8_t) string[i] << (8 * i);
 		}
 		
 		content |= (size << 56);
@@ -40,108 +125,2836 @@ object_id vm_tolstring(vm_context vm, const char *string, size_t size) {
 		return MAKE_OBJID(OCLS_SSTR, content);
 	}
 	else {
-		// Allocate a real string object in string table
+		// Allocate a real string object in string table, unless there is
+		// already one with the same content
+		uint64_t hash = vm_hash_bytes(string, size);
+		
+		if (vm->string_count * 4 >= vm->string_capacity * 3 && !vm_strings_grow(vm)) {
+			return OID_NIL;
+		}
+		
+		size_t mask = vm->string_capacity - 1;
+		size_t i = hash & mask;
+		size_t insert = SIZE_MAX;
+		
+		for (; vm->strings[i] != OID_NIL; i = (i + 1) & mask) {
+			if (vm->strings[i] == VM_MAP_DELETED) {
+				if (insert == SIZE_MAX) {
+					insert = i;
+				}
+				
+				continue;
+			}
+			
+			objt_string *other = (objt_string *) vm_lookup(vm, vm->strings[i]);
+			
+			if (other->hash == hash && other->length == size && memcmp(other->data, string, size) == 0) {
+				return vm->strings[i];
+			}
+		}
+		
+		if (insert == SIZE_MAX) {
+			insert = i;
+			vm->string_count++;
+		}
+		
+		object_id id = vm_alloc(vm, OID_LONG_STRING, sizeof(objt_string) + size + 1);
+		objt_string *new_string = (objt_string *) vm_lookup(vm, id);
+		
+		if (!new_string) {
+			return OID_NIL;
+		}
+		
+		new_string->length = size;
+		new_string->hash = hash;
+		memcpy(new_string->data, string, size);
+		new_string->data[size] = '\0';
+		
+		vm->strings[insert] = id;
+		
+		return id;
 	}
 }
 
-object_hd *vm_lookup(vm_context vm, object_id object) {
-	return NULL;
+object_id vm_intern(vm_context vm, const char *string) {
+	return vm_tolstring(vm, string, strlen(string));
 }
 
-object_id vm_accquire(vm_context vm, object_id object) {
+static void vm_strings_remove(vm_context vm, objt_string *string, object_id id) {
+	size_t mask = vm->string_capacity - 1;
+	
+	for (size_t i = string->hash & mask; vm->strings[i] != OID_NIL; i = (i + 1) & mask) {
+		if (vm->strings[i] == id) {
+			vm->strings[i] = VM_MAP_DELETED;
+			return;
+		}
+	}
+}
+
+void vm_map_init(vm_map *map) {
+	map->pairs = NULL;
+	map->count = 0;
+	map->used = 0;
+	map->capacity = 0;
+}
+
+void vm_map_free(vm_context vm, vm_map *map) {
 	/**
-	 * Increment the refcount of an object
+	 * Release everything in a map and free its storage
 	 */
 	
-	if (GET_OBJID_CLS(object) == OCLS_ID) {
-		object_hd *header = vm_lookup(vm, object);
-		header->refs++;
+	for (uint32_t i = 0; i < map->capacity; i++) {
+		object_id key = map->pairs[2 * i];
+		
+		if (key != OID_NIL && key != VM_MAP_DELETED) {
+			vm_release(vm, key);
+			vm_release(vm, map->pairs[2 * i + 1]);
+		}
+	}
+	
+	DgMemoryFree(map->pairs);
+	vm_map_init(map);
+}
+
+object_id *vm_map_find(vm_map *map, object_id key) {
+	/**
+	 * Find the value for a key in a map, or NULL if there is none
+	 */
+	
+	if (!map->count) {
+		return NULL;
+	}
+	
+	uint32_t mask = map->capacity - 1;
+	
+	for (uint32_t i = vm_hash_id(key) & mask;; i = (i + 1) & mask) {
+		object_id other = map->pairs[2 * i];
+		
+		if (other == key) {
+			return &map->pairs[2 * i + 1];
+		}
+		
+		if (other == OID_NIL) {
+			return NULL;
+		}
+	}
+}
+
+static bool vm_map_resize(vm_map *map, uint32_t new_capacity) {
+	object_id *new_pairs = DgMemoryAllocate(sizeof *new_pairs * 2 * new_capacity);
+	
+	if (!new_pairs) {
+		return false;
+	}
+	
+	memset(new_pairs, 0, sizeof *new_pairs * 2 * new_capacity);
+	
+	for (uint32_t i = 0; i < map->capacity; i++) {
+		object_id key = map->pairs[2 * i];
+		
+		if (key == OID_NIL || key == VM_MAP_DELETED) {
+			continue;
+		}
+		
+		uint32_t j = vm_hash_id(key) & (new_capacity - 1);
+		
+		while (new_pairs[2 * j] != OID_NIL) {
+			j = (j + 1) & (new_capacity - 1);
+		}
+		
+		new_pairs[2 * j] = key;
+		new_pairs[2 * j + 1] = map->pairs[2 * i + 1];
+	}
+	
+	DgMemoryFree(map->pairs);
+	map->pairs = new_pairs;
+	map->capacity = new_capacity;
+	map->used = map->count;
+	
+	return true;
+}
+
+bool vm_map_put(vm_context vm, vm_map *map, object_id key, object_id value) {
+	/**
+	 * Set the value for a key, retaining both
+	 */
+	
+	if (key == OID_NIL) {
+		return false;
+	}
+	
+	object_id *existing = vm_map_find(map, key);
+	
+	if (existing) {
+		value = vm_accquire(vm, value);
+		vm_release(vm, *existing);
+		*existing = value;
+		return true;
+	}
+	
+	if ((map->used + 1) * 4 > map->capacity * 3) {
+		uint32_t new_capacity = map->capacity ? map->capacity : 8;
+		
+		// Only grow if it isn't just deleted entries taking up the space
+		if ((map->count + 1) * 2 > map->capacity) {
+			new_capacity *= 2;
+		}
+		
+		if (!vm_map_resize(map, new_capacity)) {
+			return false;
+		}
+	}
+	
+	uint32_t mask = map->capacity - 1;
+	uint32_t i = vm_hash_id(key) & mask;
+	
+	while (map->pairs[2 * i] != OID_NIL && map->pairs[2 * i] != VM_MAP_DELETED) {
+		i = (i + 1) & mask;
+	}
+	
+	if (map->pairs[2 * i] == OID_NIL) {
+		map->used++;
+	}
+	
+	map->pairs[2 * i] = vm_accquire(vm, key);
+	map->pairs[2 * i + 1] = vm_accquire(vm, value);
+	map->count++;
+	
+	return true;
+}
+
+bool vm_map_remove(vm_context vm, vm_map *map, object_id key) {
+	object_id *value = vm_map_find(map, key);
+	
+	if (!value) {
+		return false;
+	}
+	
+	vm_release(vm, value[-1]);
+	vm_release(vm, value[0]);
+	value[-1] = VM_MAP_DELETED;
+	value[0] = OID_NIL;
+	map->count--;
+	
+	return true;
+}
+
+static bool vm_task_init(vm_task *task) {
+	task->stack = DgMemoryAllocate(sizeof *task->stack * VM_TASK_STACK_SIZE);
+	task->frames = DgMemoryAllocate(sizeof *task->frames * VM_TASK_FRAMES);
+	task->sp = task->stack;
+	task->frame_count = 0;
+	
+	return task->stack && task->frames;
+}
+
+static void vm_task_free(vm_task *task) {
+	DgMemoryFree(task->stack);
+	DgMemoryFree(task->frames);
+	task->stack = NULL;
+	task->frames = NULL;
+}
+
+vm_context vm_create(void) {
+	/**
+	 * Create a new VM instance
+	 */
+	
+	vm_context vm = DgMemoryAllocate(sizeof *vm);
+	
+	if (!vm) {
+		return NULL;
+	}
+	
+	memset(vm, 0, sizeof *vm);
+	
+	// Reserve slot zero since its ID is nil
+	vm->table.capacity = 64;
+	vm->table.count = 1;
+	vm->table.objects = DgMemoryAllocate(sizeof *vm->table.objects * vm->table.capacity);
+	
+	if (!vm->table.objects) {
+		DgMemoryFree(vm);
+		return NULL;
+	}
+	
+	vm->table.objects[0] = NULL;
+	
+	if (!vm_task_init(&vm->task)) {
+		vm_destroy(vm);
+		return NULL;
+	}
+	
+	vm->budget_left = UINT32_MAX;
+	
+	vm_map_init(&vm->globals);
+	vm_map_init(&vm->selector_numbers);
+	
+	vm_install_natives(vm);
+	
+	return vm;
+}
+
+void vm_destroy(vm_context vm) {
+	/**
+	 * Free a VM and every object it still owns
+	 */
+	
+	// Objects are freed directly without releasing what they refer to, since
+	// everything is going anyway
+	for (size_t i = 1; i < vm->table.count; i++) {
+		object_hd *header = vm->table.objects[i];
+		
+		if (!header) {
+			continue;
+		}
+		
+		if (GET_OBJID_CLS(header->type) == OCLS_ID) {
+			DgMemoryFree(((objt_object *) header)->fields.pairs);
+			DgMemoryFree(((objt_object *) header)->methods.pairs);
+		}
+		else if (header->type == OID_DICT) {
+			DgMemoryFree(((objt_dict *) header)->map.pairs);
+		}
+		
+		DgMemoryFree(header);
+	}
+	
+	DgMemoryFree(vm->globals.pairs);
+	DgMemoryFree(vm->selector_numbers.pairs);
+	DgMemoryFree(vm->dispatch);
+	DgMemoryFree(vm->dispatch_keys);
+	DgMemoryFree(vm->strings);
+	for (size_t i = 0; i < vm->suspended_count; i++) {
+		vm_task_free(&vm->suspended[i].task);
+		DgMemoryFree(vm->suspended[i].held);
+	}
+	
+	vm_task_free(&vm->task);
+	vm_task_free(&vm->spare);
+	DgMemoryFree(vm->table.objects);
+	DgMemoryFree(vm->table.free);
+	DgMemoryFree(vm->table.zct);
+	DgMemoryFree(vm);
+}
+
+static void vm_zct_push(vm_context vm, object_id object) {
+	object_table *table = &vm->table;
+	
+	if (table->zct_count >= table->zct_capacity) {
+		size_t new_capacity = table->zct_capacity ? (2 * table->zct_capacity) : 64;
+		object_id *new_zct = DgMemoryReallocate(table->zct, sizeof *new_zct * new_capacity);
+		
+		if (!new_zct) {
+			// The object is leaked, which is better than freeing it too early
+			return;
+		}
+		
+		table->zct = new_zct;
+		table->zct_capacity = new_capacity;
+	}
+	
+	table->zct[table->zct_count++] = object;
+}
+
+static bool vm_table_grow(vm_context vm, size_t capacity) {
+	object_table *table = &vm->table;
+	object_hd **new_objects = DgMemoryReallocate(table->objects, sizeof *new_objects * capacity);
+	
+	if (!new_objects) {
+		return false;
+	}
+	
+	table->objects = new_objects;
+	table->capacity = capacity;
+	
+	return true;
+}
+
+bool vm_reserve(vm_context vm, size_t count) {
+	/**
+	 * Make room in the object table for `count` more objects, so that
+	 * allocating them doesn't have to grow it
+	 */
+	
+	object_table *table = &vm->table;
+	size_t needed = table->count + ((count > table->free_count) ? count - table->free_count : 0);
+	
+	return needed <= table->capacity || vm_table_grow(vm, needed);
+}
+
+object_id vm_alloc(vm_context vm, object_id type, size_t size) {
+	/**
+	 * Allocate a new object of the given size (including the header) and
+	 * register it in the object table. The new object starts with a refcount
+	 * of zero, so it will be freed by the next vm_collect() unless it is
+	 * retained.
+	 * 
+	 * @param vm VM context
+	 * @param type Type of the new object
+	 * @param size Size of the object structure in bytes
+	 * @return The new object, or nil on failure
+	 */
+	
+	object_table *table = &vm->table;
+	
+	object_hd *header = DgMemoryAllocate(size);
+	
+	if (!header) {
+		return OID_NIL;
 	}
 	
+	memset(header, 0, size);
+	header->type = type;
+	header->refs = 0;
+	
+	size_t index;
+	
+	if (table->free_count) {
+		index = table->free[--table->free_count];
+	}
+	else {
+		if (table->count >= table->capacity && !vm_table_grow(vm, 2 * table->capacity)) {
+			DgMemoryFree(header);
+			return OID_NIL;
+		}
+		
+		index = table->count++;
+	}
+	
+	table->objects[index] = header;
+	
+	object_id object = MAKE_OBJID(OCLS_ID, index);
+	
+	vm_zct_push(vm, object);
+	
 	return object;
 }
 
-object_id vm_release(vm_context vm, object_id object) {
+object_hd *vm_lookup(vm_context vm, object_id object) {
+	/**
+	 * Get the header of an allocated object, or NULL if the ID does not refer
+	 * to a live allocated object.
+	 */
+	
+	if (GET_OBJID_CLS(object) != OCLS_ID) {
+		return NULL;
+	}
+	
+	size_t index = GET_OBJID_VAL(object);
+	
+	if (index >= vm->table.count) {
+		return NULL;
+	}
+	
+	return vm->table.objects[index];
+}
+
+object_id vm_accquire(vm_context vm, object_id object) {
 	/**
-	 * Decrement the refcount of an object
+	 * Increment the refcount of an object. Blocks that are still on the stack
+	 * are promoted first, so the returned ID is the one that should be stored.
 	 */
 	
+	if (GET_OBJID_CLS(object) >= OCLS_SBLOCK) {
+		object = vm_promote(vm, object);
+	}
+	
 	if (GET_OBJID_CLS(object) == OCLS_ID) {
 		object_hd *header = vm_lookup(vm, object);
-		header->refs--;
 		
-		if (header->refs < 0) {
-			if (GET_OBJID_CLS(header->type) == OCLS_ID) {
-				// Free all subobjects
-			}
-			else {
-				// Handle free for non-inline primitives
-			}
+		if (header) {
+			header->refs++;
 		}
 	}
 	
 	return object;
 }
 
-object_id handle_smallinteger_msg_send(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids) {
-// 	switch (selector) {
-// 		case MAKE_SSTR1('+'): {
-// 			int64_t a = OBJID_SEXT(object), b = OBJID_SEXT(ids[0]);
-// 			int64_t c = a + b;
-// 			return MAKE_OBJID(OCLS_SINT, c);
-// 		}
-// 		
-// 		case MAKE_SSTR1('-'): {
-// 			int64_t a = OBJID_SEXT(object), b = OBJID_SEXT(ids[0]);
-// 			int64_t c = a - b;
-// 			return MAKE_OBJID(OCLS_SINT, c);
-// 		}
-// 		
-// 		case MAKE_SSTR1('*'): {
-// 			int64_t a = OBJID_SEXT(object), b = OBJID_SEXT(ids[0]);
-// 			int64_t c = a * b;
-// 			return MAKE_OBJID(OCLS_SINT, c);
-// 		}
-// 		
-// 		case MAKE_SSTR1('/'): {
-// 			double a = (double)OBJID_SEXT(object), b = (double)OBJID_SEXT(ids[0]);
-// 			double c = a / b;
-// 			return MAKE_OBJID(OCLS_FLOAT, c);
-// 		}
-// 		
-// 		case MAKE_SSTR2('/', '/'): {
-// 			int64_t a = OBJID_SEXT(object), b = OBJID_SEXT(ids[0]);
-// 			int64_t c = a / b;
-// 			return MAKE_OBJID(OCLS_SINT, c);
-// 		}
-// 		
-// 		case MAKE_SSTR1('%'): {
-// 			int64_t a = OBJID_SEXT(object), b = OBJID_SEXT(ids[0]);
-// 			int64_t c = a % b;
-// 			return MAKE_OBJID(OCLS_SINT, c);
-// 		}
-// 		
-// 		default: {
-// 			break;
-// 		}
-// 	}
-}
-
-// nonid_msg_send_handler nonid_msg_send_handlers[] = {
-// 	[OCLS_SINT] = handle_smallinteger_msg_send,
-// 	[OCLS_SSTR] = 
-// 	[OCLS_FLOAT] = 
-// 	[OCLS_BOOL] = 
-// 	[OCLS_PRIM] = 
-// };
-
-object_id vm_msg_send(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids) {
+static object_id vm_promote_env(vm_context vm, object_id env) {
+	/**
+	 * Move an environment to the heap, along with the environments it is
+	 * nested in. The frame keeps using it through the forwarding slot.
+	 */
 	
-	if (GET_OBJID_CLS(object) == OCLS_ID) {
-		// class
+	if (GET_OBJID_CLS(env) != OCLS_SENV) {
+		return env;
+	}
+	
+	object_id *area = vm->task.stack + GET_OBJID_VAL(env);
+	
+	if (area[VM_ENV_FORWARD] != OID_NIL) {
+		return area[VM_ENV_FORWARD];
+	}
+	
+	size_t length = VM_ENV_HEADER + GET_OBJID_VAL(area[VM_ENV_SIZE]);
+	object_id heap = vm_array_new(vm, length);
+	objt_array *array = (objt_array *) vm_lookup(vm, heap);
+	
+	if (!array) {
+		vm_error(vm, "Out of memory");
 		return OID_NIL;
 	}
-	else {
-		// return __handle_nonid_msg_send(vm, object, selector, args, ids);
+	
+	// Forward before copying, since the variables can hold blocks that use
+	// this environment
+	area[VM_ENV_FORWARD] = heap;
+	array->length = length;
+	array->data[VM_ENV_FORWARD] = OID_NIL;
+	array->data[VM_ENV_PARENT] = vm_accquire(vm, vm_promote_env(vm, area[VM_ENV_PARENT]));
+	array->data[VM_ENV_SIZE] = area[VM_ENV_SIZE];
+	
+	for (size_t i = VM_ENV_HEADER; i < length; i++) {
+		array->data[i] = vm_accquire(vm, area[i]);
+	}
+	
+	return heap;
+}
+
+object_id vm_promote(vm_context vm, object_id object) {
+	/**
+	 * Get a heap copy of a block (or environment) that lives in a frame, so
+	 * that it can outlive the frame. Anything else is returned as it is.
+	 * Promoting the same block twice gives the same copy.
+	 */
+	
+	if (GET_OBJID_CLS(object) == OCLS_SENV) {
+		return vm_promote_env(vm, object);
+	}
+	
+	if (GET_OBJID_CLS(object) != OCLS_SBLOCK) {
+		return object;
+	}
+	
+	object_id *record = vm->task.stack + GET_OBJID_VAL(object);
+	
+	if (record[VM_SBLOCK_FORWARD] != OID_NIL) {
+		return record[VM_SBLOCK_FORWARD];
+	}
+	
+	object_id block = vm_alloc(vm, OID_BLOCK, sizeof(objt_block));
+	objt_block *header = (objt_block *) vm_lookup(vm, block);
+	
+	if (!header) {
+		vm_error(vm, "Out of memory");
+		return OID_NIL;
 	}
+	
+	record[VM_SBLOCK_FORWARD] = block;
+	header->method = vm_accquire(vm, record[VM_SBLOCK_METHOD]);
+	header->self = vm_accquire(vm, record[VM_SBLOCK_SELF]);
+	header->env = vm_accquire(vm, vm_promote_env(vm, record[VM_SBLOCK_ENV]));
+	
+	return block;
+}
+
+static inline object_id *vm_env_data(vm_context vm, object_id env) {
+	/**
+	 * Get the slots of an environment, wherever it is now
+	 */
+	
+	if (GET_OBJID_CLS(env) == OCLS_SENV) {
+		object_id *area = vm->task.stack + GET_OBJID_VAL(env);
+		
+		if (area[VM_ENV_FORWARD] == OID_NIL) {
+			return area;
+		}
+		
+		env = area[VM_ENV_FORWARD];
+	}
+	
+	objt_array *array = (objt_array *) vm_lookup(vm, env);
+	
+	return array ? array->data : NULL;
+}
+
+object_id vm_release(vm_context vm, object_id object) {
+	/**
+	 * Decrement the refcount of an object. Once nothing holds the object it is
+	 * queued to be freed at the next vm_collect().
+	 */
+	
+	if (GET_OBJID_CLS(object) == OCLS_ID) {
+		object_hd *header = vm_lookup(vm, object);
+		
+		if (header && header->refs) {
+			header->refs--;
+			
+			if (header->refs == 0) {
+				vm_zct_push(vm, object);
+			}
+		}
+	}
+	
+	return object;
+}
+
+static void vm_dispatch_drop(vm_context vm, size_t index) {
+	/**
+	 * Take the row of a dispatch key out of the table, so that it's made
+	 * again the next time it's needed
+	 */
+	
+	object_id key = vm->dispatch_keys[index];
+	objt_object *header = (objt_object *) vm->table.objects[GET_OBJID_VAL(key)];
+	
+	for (size_t i = header->row; i < header->row + header->row_size; i++) {
+		if (vm->dispatch[i].key == key) {
+			vm->dispatch[i] = (vm_dispatch_entry) {OID_NIL, OID_NIL};
+			vm->dispatch_free = (i < vm->dispatch_free) ? i : vm->dispatch_free;
+		}
+	}
+	
+	header->row_size = 0;
+	vm->dispatch_keys[index] = vm->dispatch_keys[--vm->dispatch_key_count];
+}
+
+static void vm_free_object(vm_context vm, object_id object) {
+	object_table *table = &vm->table;
+	size_t index = GET_OBJID_VAL(object);
+	object_hd *header = table->objects[index];
+	
+	if (GET_OBJID_CLS(header->type) == OCLS_ID) {
+		// Free all subobjects
+		objt_object *obj = (objt_object *) header;
+		vm_map_free(vm, &obj->fields);
+		vm_map_free(vm, &obj->methods);
+		
+		// Its ID will be reused, so nothing can stay cached under it
+		if (obj->row_size) {
+			for (size_t i = 0; i < vm->dispatch_key_count; i++) {
+				if (vm->dispatch_keys[i] == object) {
+					vm_dispatch_drop(vm, i);
+					break;
+				}
+			}
+			
+			vm->epoch++;
+		}
+		
+		vm_release(vm, header->type);
+	}
+	else {
+		// Handle free for non-inline primitives
+		switch (GET_OBJID_VAL(header->type)) {
+			case OCLS_STRING: {
+				vm_strings_remove(vm, (objt_string *) header, object);
+				break;
+			}
+			
+			case OCLS_ARRAY: {
+				objt_array *array = (objt_array *) header;
+				
+				for (size_t i = 0; i < array->length; i++) {
+					vm_release(vm, array->data[i]);
+				}
+				
+				break;
+			}
+			
+			case OCLS_DICT: {
+				vm_map_free(vm, &((objt_dict *) header)->map);
+				break;
+			}
+			
+			case OCLS_METHOD: {
+				objt_method *method = (objt_method *) header;
+				
+				for (size_t i = 0; i < method->literal_count; i++) {
+					vm_release(vm, method->literals[i]);
+				}
+				
+				vm_release(vm, method->selector);
+				vm_release(vm, method->source);
+				break;
+			}
+			
+			case OCLS_BLOCK: {
+				objt_block *block = (objt_block *) header;
+				vm_release(vm, block->method);
+				vm_release(vm, block->self);
+				vm_release(vm, block->env);
+				break;
+			}
+			
+			default: {
+				break;
+			}
+		}
+	}
+	
+	DgMemoryFree(header);
+	table->objects[index] = NULL;
+	
+	if (table->free_count >= table->free_capacity) {
+		size_t new_capacity = table->free_capacity ? (2 * table->free_capacity) : 64;
+		uint32_t *new_free = DgMemoryReallocate(table->free, sizeof *new_free * new_capacity);
+		
+		if (!new_free) {
+			// The slot is just never reused
+			return;
+		}
+		
+		table->free = new_free;
+		table->free_capacity = new_capacity;
+	}
+	
+	table->free[table->free_count++] = index;
+}
+
+void vm_collect(vm_context vm) {
+	/**
+	 * Free every object on the zero count table which is still unreferenced.
+	 * This must only be called when no script code is running, since values
+	 * that only exist on the VM stack are not counted.
+	 */
+	
+	object_table *table = &vm->table;
+	
+	// Freeing an object can release others, which are pushed to the end of
+	// the ZCT and handled by the same loop.
+	for (size_t i = 0; i < table->zct_count; i++) {
+		object_id object = table->zct[i];
+		object_hd *header = vm_lookup(vm, object);
+		
+		if (header && header->refs == 0) {
+			vm_free_object(vm, object);
+		}
+	}
+	
+	table->zct_count = 0;
+}
+
+object_id vm_packed_new(vm_context vm, size_t stride, size_t length) {
+	/**
+	 * Create a packed array with `length` zeroed elements of `stride` bytes
+	 * each, or answer nil if that many bytes can't even be counted.
+	 */
+	
+	if (stride == 0 || length > (SIZE_MAX - sizeof(objt_packed)) / stride) {
+		return OID_NIL;
+	}
+	
+	object_id array = vm_alloc(vm, OID_PACKED_ARRAY, sizeof(objt_packed) + stride * length);
+	objt_packed *packed = (objt_packed *) vm_lookup(vm, array);
+	
+	if (!packed) {
+		return OID_NIL;
+	}
+	
+	packed->stride = stride;
+	packed->length = length;
+	packed->capacity = length;
+	
+	return array;
+}
+
+static objt_packed *vm_lookup_packed(vm_context vm, object_id array) {
+	object_hd *header = vm_lookup(vm, array);
+	
+	if (!header || header->type != OID_PACKED_ARRAY) {
+		return NULL;
+	}
+	
+	return (objt_packed *) header;
+}
+
+bool vm_packed_resize(vm_context vm, object_id array, size_t length) {
+	/**
+	 * Change the number of elements in a packed array. New elements are zeroed.
+	 * This fails if the array is currently pinned.
+	 */
+	
+	objt_packed *packed = vm_lookup_packed(vm, array);
+	
+	if (!packed || packed->pins || length > (SIZE_MAX - sizeof(objt_packed)) / packed->stride) {
+		return false;
+	}
+	
+	if (length > packed->capacity) {
+		size_t new_capacity = packed->capacity ? packed->capacity : 1;
+		
+		while (new_capacity < length) {
+			new_capacity = (new_capacity > SIZE_MAX / 2) ? length : new_capacity * 2;
+		}
+		
+		if (new_capacity > (SIZE_MAX - sizeof(objt_packed)) / packed->stride) {
+			new_capacity = length;
+		}
+		
+		packed = DgMemoryReallocate(packed, sizeof(objt_packed) + packed->stride * new_capacity);
+		
+		if (!packed) {
+			return false;
+		}
+		
+		vm->table.objects[GET_OBJID_VAL(array)] = &packed->header;
+		packed->capacity = new_capacity;
+	}
+	
+	if (length > packed->length) {
+		memset(packed->data + packed->stride * packed->length, 0, packed->stride * (length - packed->length));
+	}
+	
+	packed->length = length;
+	
+	return true;
+}
+
+void *vm_packed_data(vm_context vm, object_id array, size_t *stride, size_t *length) {
+	/**
+	 * Get a pointer to the data of a packed array. The pointer is only valid
+	 * until the array is resized or freed; use vm_pin() to keep it around.
+	 */
+	
+	objt_packed *packed = vm_lookup_packed(vm, array);
+	
+	if (!packed) {
+		return NULL;
+	}
+	
+	if (stride) {
+		*stride = packed->stride;
+	}
+	
+	if (length) {
+		*length = packed->length;
+	}
+	
+	return packed->data;
+}
+
+void *vm_pin(vm_context vm, object_id array) {
+	/**
+	 * Pin a packed array so that its data pointer stays valid: it is retained
+	 * and can't be resized until the matching vm_unpin().
+	 */
+	
+	objt_packed *packed = vm_lookup_packed(vm, array);
+	
+	if (!packed) {
+		return NULL;
+	}
+	
+	packed->pins++;
+	vm_accquire(vm, array);
+	
+	return packed->data;
+}
+
+void vm_unpin(vm_context vm, object_id array) {
+	objt_packed *packed = vm_lookup_packed(vm, array);
+	
+	if (!packed || !packed->pins) {
+		return;
+	}
+	
+	packed->pins--;
+	vm_release(vm, array);
+}
+
+
+object_id vm_array_new(vm_context vm, size_t capacity) {
+	/**
+	 * Create an empty array with space for `capacity` elements
+	 */
+	
+	object_id array = vm_alloc(vm, OID_ARRAY, sizeof(objt_array) + sizeof(object_id) * capacity);
+	objt_array *header = (objt_array *) vm_lookup(vm, array);
+	
+	if (!header) {
+		return OID_NIL;
+	}
+	
+	header->capacity = capacity;
+	header->length = 0;
+	
+	return array;
+}
+
+bool vm_array_push(vm_context vm, object_id array, object_id value) {
+	objt_array *header = (objt_array *) vm_lookup(vm, array);
+	
+	if (!header || header->header.type != OID_ARRAY) {
+		return false;
+	}
+	
+	if (header->length >= header->capacity) {
+		size_t new_capacity = header->capacity ? (2 * header->capacity) : 8;
+		header = DgMemoryReallocate(header, sizeof(objt_array) + sizeof(object_id) * new_capacity);
+		
+		if (!header) {
+			return false;
+		}
+		
+		vm->table.objects[GET_OBJID_VAL(array)] = &header->header;
+		header->capacity = new_capacity;
+	}
+	
+	header->data[header->length++] = vm_accquire(vm, value);
+	
+	return true;
+}
+
+static objt_object *vm_lookup_object(vm_context vm, object_id object) {
+	/**
+	 * Get an object if it's a script object (not nil or a primitive)
+	 */
+	
+	object_hd *header = vm_lookup(vm, object);
+	
+	if (!header || GET_OBJID_CLS(header->type) != OCLS_ID) {
+		return NULL;
+	}
+	
+	return (objt_object *) header;
+}
+
+object_id vm_object_new(vm_context vm, object_id proto) {
+	/**
+	 * Create a new script object which delegates to `proto`
+	 */
+	
+	object_id object = vm_alloc(vm, vm_accquire(vm, proto), sizeof(objt_object));
+	objt_object *header = vm_lookup_object(vm, object);
+	
+	if (!header) {
+		vm_release(vm, proto);
+		return OID_NIL;
+	}
+	
+	vm_map_init(&header->fields);
+	vm_map_init(&header->methods);
+	
+	return object;
+}
+
+object_id vm_get_field(vm_context vm, object_id object, object_id name) {
+	/**
+	 * Read a field, falling back to the prototype chain if the object doesn't
+	 * have it itself
+	 */
+	
+	objt_object *header;
+	
+	while ((header = vm_lookup_object(vm, object))) {
+		object_id *value = vm_map_find(&header->fields, name);
+		
+		if (value) {
+			return *value;
+		}
+		
+		object = header->header.type;
+	}
+	
+	return OID_NIL;
+}
+
+bool vm_set_field(vm_context vm, object_id object, object_id name, object_id value) {
+	/**
+	 * Set a field on the object itself
+	 */
+	
+	objt_object *header = vm_lookup_object(vm, object);
+	
+	if (!header) {
+		return false;
+	}
+	
+	header->writes++;
+	
+	return vm_map_put(vm, &header->fields, name, value);
+}
+
+void vm_touch(vm_context vm, object_id object) {
+	/**
+	 * Note that an object changed without a field being set, for example an
+	 * array in one of its fields was changed in place
+	 */
+	
+	objt_object *header = vm_lookup_object(vm, object);
+	
+	if (header) {
+		header->writes++;
+	}
+}
+
+uint32_t vm_writes(vm_context vm, object_id object) {
+	/**
+	 * Get a number that changes whenever the object's fields do, for telling
+	 * if it changed since some earlier time. Primitives always answer 0.
+	 */
+	
+	objt_object *header = vm_lookup_object(vm, object);
+	
+	return header ? header->writes : 0;
+}
+
+// Containers and objects nested deeper than this hash by ID, which also
+// stops cycles
+#define VM_HASH_MAX_DEPTH 8
+
+static uint64_t vm_hash_fields(vm_hasher *this, const vm_map *map) {
+	/**
+	 * Hash the pairs of a map without depending on where they are in it, so
+	 * that how keys were numbered doesn't matter
+	 */
+	
+	uint64_t hash = map->count;
+	
+	for (uint32_t i = 0; i < map->capacity; i++) {
+		object_id key = map->pairs[2 * i];
+		
+		if (key != OID_NIL && key != VM_MAP_DELETED) {
+			hash += vm_hash_mix(vm_hash_value(this, key), vm_hash_value(this, map->pairs[2 * i + 1]));
+		}
+	}
+	
+	return hash;
+}
+
+uint64_t vm_hash_value(vm_hasher *this, object_id value) {
+	/**
+	 * Hash a value by its contents. Numbers, strings and the contents of
+	 * arrays, dictionaries, packed arrays and script objects count.
+	 * Prototypes (script objects with methods of their own) count by their
+	 * selectors and parents, and blocks and methods by ID.
+	 */
+	
+	object_hd *header = (GET_OBJID_CLS(value) == OCLS_ID) ? vm_lookup(this->vm, value) : NULL;
+	uint64_t number;
+	
+	if (!header) {
+		return vm_hash_mix(0, value);
+	}
+	
+	if (header->type == OID_LONG_STRING) {
+		return ((objt_string *) header)->hash;
+	}
+	
+	if (this->external && this->external(this->context, value, &number)) {
+		return vm_hash_mix(1, number);
+	}
+	
+	if (this->depth >= VM_HASH_MAX_DEPTH) {
+		this->deep = true;
+		return vm_hash_mix(2, value);
+	}
+	
+	uint64_t hash = vm_hash_mix(3, header->type);
+	
+	this->depth++;
+	
+	if (header->type == OID_ARRAY) {
+		objt_array *array = (objt_array *) header;
+		
+		for (size_t i = 0; i < array->length; i++) {
+			hash = vm_hash_mix(hash, vm_hash_value(this, array->data[i]));
+		}
+		
+		this->deep = true;
+	}
+	else if (header->type == OID_DICT) {
+		hash = vm_hash_mix(hash, vm_hash_fields(this, &((objt_dict *) header)->map));
+		this->deep = true;
+	}
+	else if (header->type == OID_PACKED_ARRAY) {
+		objt_packed *packed = (objt_packed *) header;
+		
+		hash = vm_hash_mix(hash, packed->stride);
+		hash = vm_hash_mix(hash, vm_hash_bytes(packed->data, packed->stride * packed->length));
+		this->deep = true;
+	}
+	else if (GET_OBJID_CLS(header->type) == OCLS_ID && !((objt_object *) header)->methods.count) {
+		hash = vm_hash_object(this, value);
+		this->deep = true;
+	}
+	else if (GET_OBJID_CLS(header->type) == OCLS_ID) {
+		// Prototypes are told apart by the selectors they have methods for
+		// and by their parents, since their IDs depend on what was loaded
+		// before them
+		vm_map *methods = &((objt_object *) header)->methods;
+		
+		for (uint32_t i = 0; i < methods->capacity; i++) {
+			object_id selector = methods->pairs[2 * i];
+			
+			if (selector != OID_NIL && selector != VM_MAP_DELETED) {
+				hash += vm_hash_value(this, selector);
+			}
+		}
+		
+		hash = vm_hash_mix(hash, vm_hash_value(this, header->type));
+	}
+	else {
+		hash = vm_hash_mix(4, value);
+	}
+	
+	this->depth--;
+	
+	return hash;
+}
+
+uint64_t vm_hash_object(vm_hasher *this, object_id object) {
+	/**
+	 * Hash a script object's prototype and fields, even if it would hash as
+	 * external. The hasher's deep flag says whether anything it refers to
+	 * was hashed by contents, since those can change without the object's
+	 * write count going up.
+	 */
+	
+	objt_object *header = vm_lookup_object(this->vm, object);
+	
+	if (!header) {
+		return vm_hash_value(this, object);
+	}
+	
+	this->depth++;
+	uint64_t hash = vm_hash_mix(vm_hash_value(this, header->header.type), vm_hash_fields(this, &header->fields));
+	this->depth--;
+	
+	return hash;
+}
+
+object_id vm_get_global(vm_context vm, object_id name) {
+	object_id *value = vm_map_find(&vm->globals, name);
+	return value ? *value : OID_NIL;
+}
+
+bool vm_set_global(vm_context vm, object_id name, object_id value) {
+	object_id *old = vm_map_find(&vm->globals, name);
+	
+	if (!old || *old != value) {
+		vm->globals_epoch++;
+	}
+	
+	return vm_map_put(vm, &vm->globals, name, value);
+}
+
+static inline uint16_t vm_read16(const uint8_t *ip) {
+	return ip[0] | (ip[1] << 8);
+}
+
+object_id vm_method_new(vm_context vm, size_t code_size, size_t literal_count, size_t cache_count) {
+	/**
+	 * Allocate a method with zeroed space for its code, literals and caches
+	 */
+	
+	size_t size = sizeof(objt_method) + sizeof(vm_icache) * cache_count + sizeof(object_id) * literal_count + code_size;
+	object_id method = vm_alloc(vm, OID_METHOD, size);
+	objt_method *header = (objt_method *) vm_lookup(vm, method);
+	
+	if (!header) {
+		return OID_NIL;
+	}
+	
+	header->caches = (vm_icache *) (header + 1);
+	header->literals = (object_id *) (header->caches + cache_count);
+	header->code = (const uint8_t *) (header->literals + literal_count);
+	header->code_size = code_size;
+	header->literal_count = literal_count;
+	header->cache_count = cache_count;
+	
+	return method;
+}
+
+// Quickened instructions, the sends they stand for, and the class both
+// operands must have
+static const struct {
+	uint8_t op;
+	uint8_t cls;
+	object_id selector;
+} vm_quick_ops[] = {
+	{VM_OP_ADD_SINT, OCLS_SINT, MAKE_SSTR1('+')},
+	{VM_OP_SUB_SINT, OCLS_SINT, MAKE_SSTR1('-')},
+	{VM_OP_MUL_SINT, OCLS_SINT, MAKE_SSTR1('*')},
+	{VM_OP_LT_SINT, OCLS_SINT, MAKE_SSTR1('<')},
+	{VM_OP_GT_SINT, OCLS_SINT, MAKE_SSTR1('>')},
+	{VM_OP_LE_SINT, OCLS_SINT, MAKE_SSTR2('<', '=')},
+	{VM_OP_GE_SINT, OCLS_SINT, MAKE_SSTR2('>', '=')},
+	{VM_OP_EQ_SINT, OCLS_SINT, MAKE_SSTR1('=')},
+	{VM_OP_ADD_FLOAT, OCLS_FLOAT, MAKE_SSTR1('+')},
+	{VM_OP_SUB_FLOAT, OCLS_FLOAT, MAKE_SSTR1('-')},
+	{VM_OP_MUL_FLOAT, OCLS_FLOAT, MAKE_SSTR1('*')},
+	{VM_OP_DIV_FLOAT, OCLS_FLOAT, MAKE_SSTR1('/')},
+	{VM_OP_LT_FLOAT, OCLS_FLOAT, MAKE_SSTR1('<')},
+	{VM_OP_GT_FLOAT, OCLS_FLOAT, MAKE_SSTR1('>')},
+	{VM_OP_LE_FLOAT, OCLS_FLOAT, MAKE_SSTR2('<', '=')},
+	{VM_OP_GE_FLOAT, OCLS_FLOAT, MAKE_SSTR2('>', '=')},
+};
+
+// Bytes of operands after each opcode
+static const uint8_t vm_op_operands[VM_OP_COUNT] = {
+	[VM_OP_PUSH_LITERAL] = 2,
+	[VM_OP_PUSH_SLOT] = 1,
+	[VM_OP_STORE_SLOT] = 1,
+	[VM_OP_PUSH_FIELD] = 2,
+	[VM_OP_STORE_FIELD] = 2,
+	[VM_OP_PUSH_GLOBAL] = 2,
+	[VM_OP_STORE_GLOBAL] = 2,
+	[VM_OP_PUSH_BLOCK] = 4,
+	[VM_OP_SEND] = VM_SEND_SIZE - 1,
+	[VM_OP_JUMP] = 2,
+	[VM_OP_JUMP_IF_FALSE] = 2,
+	[VM_OP_JUMP_IF_TRUE] = 2,
+	[VM_OP_PUSH_ENV] = 2,
+	[VM_OP_STORE_ENV] = 2,
+	[VM_OP_ADD_SINT ... VM_OP_GE_FLOAT] = VM_SEND_SIZE - 1,
+};
+
+static void vm_quicken(vm_context vm, uint8_t *send, object_id selector, object_id a, object_id b) {
+	/**
+	 * Swap a send whose method was a folding native for the quickened
+	 * instruction that does the same for the classes of its operands
+	 */
+	
+	uint64_t cls = GET_OBJID_CLS(a);
+	
+	if (cls != GET_OBJID_CLS(b)) {
+		return;
+	}
+	
+	for (size_t i = 0; i < sizeof vm_quick_ops / sizeof *vm_quick_ops; i++) {
+		if (vm_quick_ops[i].selector == selector && vm_quick_ops[i].cls == cls) {
+			*send = vm_quick_ops[i].op;
+			vm->quickened = true;
+			return;
+		}
+	}
+}
+
+void vm_unquicken(uint8_t *code, size_t size) {
+	/**
+	 * Turn quickened instructions in code back into plain sends, like they
+	 * were compiled
+	 */
+	
+	for (size_t i = 0; i < size && code[i] < VM_OP_COUNT; i += 1 + vm_op_operands[code[i]]) {
+		if (code[i] >= VM_OP_ADD_SINT) {
+			code[i] = VM_OP_SEND;
+		}
+	}
+}
+
+static void vm_unquicken_all(vm_context vm) {
+	/**
+	 * Unquicken every method, since the methods they stand for have changed
+	 */
+	
+	if (!vm->quickened) {
+		return;
+	}
+	
+	for (size_t i = 1; i < vm->table.count; i++) {
+		object_hd *header = vm->table.objects[i];
+		
+		if (header && header->type == OID_METHOD) {
+			objt_method *method = (objt_method *) header;
+			vm_unquicken((uint8_t *) method->code, method->code_size);
+		}
+	}
+	
+	vm->quickened = false;
+}
+
+bool vm_define_method(vm_context vm, object_id object, object_id selector, object_id method) {
+	/**
+	 * Add a method (compiled or native) to an object
+	 */
+	
+	objt_object *header = vm_lookup_object(vm, object);
+	
+	if (!header) {
+		return false;
+	}
+	
+	if (!vm_map_put(vm, &header->methods, selector, method)) {
+		return false;
+	}
+	
+	vm->epoch++;
+	
+	// Only the rows of keys that inherit from the object change
+	for (size_t i = vm->dispatch_key_count; i-- > 0;) {
+		objt_object *key;
+		
+		for (object_id id = vm->dispatch_keys[i]; (key = vm_lookup_object(vm, id)); id = key->header.type) {
+			if (id == object) {
+				vm_dispatch_drop(vm, i);
+				break;
+			}
+		}
+	}
+	
+	// Quickened arithmetic assumes the built in methods for numbers
+	if (object == vm->protos[OCLS_SINT] || object == vm->protos[OCLS_FLOAT]) {
+		vm_unquicken_all(vm);
+	}
+	
+	return true;
+}
+
+object_id vm_define_native(vm_context vm, object_id object, const char *selector, vm_native function) {
+	/**
+	 * Add a method implemented in C to an object
+	 */
+	
+	object_id native = vm_alloc(vm, OID_NATIVE, sizeof(objt_native));
+	objt_native *header = (objt_native *) vm_lookup(vm, native);
+	
+	if (!header) {
+		return OID_NIL;
+	}
+	
+	header->function = function;
+	header->name = selector;
+	
+	if (!vm_define_method(vm, object, vm_intern(vm, selector), native)) {
+		return OID_NIL;
+	}
+	
+	return native;
+}
+
+static inline object_id vm_dispatch_key(vm_context vm, object_id object) {
+	/**
+	 * Get the object that method lookup starts from. Objects without any
+	 * methods of their own use their prototype so that all instances of a
+	 * prototype share cache entries.
+	 */
+	
+	uint64_t cls = GET_OBJID_CLS(object);
+	
+	if (cls != OCLS_ID) {
+		return vm->protos[cls];
+	}
+	
+	object_hd *header = vm_lookup(vm, object);
+	
+	if (!header) {
+		return vm->protos[0];
+	}
+	
+	if (GET_OBJID_CLS(header->type) == OCLS_PRIM) {
+		return vm->protos[GET_OBJID_VAL(header->type)];
+	}
+	
+	return ((objt_object *) header)->methods.count ? object : header->type;
+}
+
+uint32_t vm_selector_number(vm_context vm, object_id selector) {
+	/**
+	 * Get the number of a selector, numbering it if it's new. Numbers start
+	 * at 1, and 0 is returned if the selector couldn't be numbered.
+	 */
+	
+	object_id *found = vm_map_find(&vm->selector_numbers, selector);
+	
+	if (found) {
+		return GET_OBJID_VAL(*found);
+	}
+	
+	if (!vm_map_put(vm, &vm->selector_numbers, selector, MAKE_OBJID(OCLS_SINT, vm->selector_count + 1))) {
+		return 0;
+	}
+	
+	return ++vm->selector_count;
+}
+
+void vm_method_link(vm_context vm, object_id method) {
+	/**
+	 * Number the selectors of a method's send sites ahead of time, so that
+	 * sends never have to look the numbers up
+	 */
+	
+	objt_method *header = (objt_method *) vm_lookup(vm, method);
+	
+	if (!header || header->header.type != OID_METHOD) {
+		return;
+	}
+	
+	for (size_t i = 0; i < header->code_size && header->code[i] < VM_OP_COUNT; i += 1 + vm_op_operands[header->code[i]]) {
+		const uint8_t *ip = header->code + i + 1;
+		
+		if (header->code[i] == VM_OP_SEND && vm_read16(ip + 3) < header->cache_count && vm_read16(ip) < header->literal_count) {
+			header->caches[vm_read16(ip + 3)].selector = vm_selector_number(vm, header->literals[vm_read16(ip)]);
+		}
+	}
+}
+
+static bool vm_verify_name(vm_context vm, objt_method *method, const uint8_t *ip) {
+	/**
+	 * Check that an operand is a literal holding a string, as the names of
+	 * fields, globals and selectors are
+	 */
+	
+	return vm_read16(ip) < method->literal_count && vm_tolcstring(vm, method->literals[vm_read16(ip)], (char[8]) {0}, NULL);
+}
+
+static bool vm_verify_env(vm_context vm, objt_method *method, const object_id *outer, size_t outer_count, const uint8_t *ip) {
+	/**
+	 * Check that the environment a PUSH_ENV or STORE_ENV goes up to exists,
+	 * along with every one on the way there, and has the variable
+	 */
+	
+	if (ip[0] > outer_count) {
+		return false;
+	}
+	
+	for (size_t i = 0; i <= ip[0]; i++) {
+		objt_method *level = i ? (objt_method *) vm_lookup(vm, outer[i - 1]) : method;
+		
+		if (!level || level->header.type != OID_METHOD || !level->env_slot) {
+			return false;
+		}
+		
+		if (i == ip[0] && ip[1] >= level->env_size) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool vm_method_verify(vm_context vm, object_id method, const object_id *outer, size_t outer_count) {
+	/**
+	 * Check that a method which didn't come from the compiler can't reach
+	 * outside of what it was given. Every instruction has to be whole and
+	 * not quickened, operands have to name literals, caches, slots and
+	 * environments that exist, jumps have to land on instructions, and the
+	 * stack has to be as deep on every path to an instruction, within
+	 * stack_size, and never run off the end of the code.
+	 * 
+	 * @param outer Methods of the blocks this method's blocks are made in,
+	 * innermost first, for checking captured variables
+	 */
+	
+	objt_method *header = (objt_method *) vm_lookup(vm, method);
+	
+	if (!header || header->header.type != OID_METHOD || !header->code_size) {
+		return false;
+	}
+	
+	const uint8_t *code = header->code;
+	size_t size = header->code_size;
+	size_t frame = 1 + header->arg_count + header->temp_count;
+	size_t env_end = header->env_slot ? header->env_slot + VM_ENV_HEADER + header->env_size : 0;
+	size_t records = frame; // Block records are at the end of the frame
+	int32_t *depths = DgMemoryAllocate(sizeof *depths * size);
+	uint32_t *pending = DgMemoryAllocate(sizeof *pending * size);
+	size_t pending_count = 0;
+	bool ok = false;
+	
+	if (!depths || !pending) {
+		goto done;
+	}
+	
+	// Depth of the stack before each instruction, -1 if it hasn't been
+	// reached yet and -2 if no instruction starts there
+	for (size_t i = 0; i < size; i++) {
+		depths[i] = -2;
+	}
+	
+	for (size_t i = 0; i < size; i += 1 + vm_op_operands[code[i]]) {
+		const uint8_t *ip = code + i + 1;
+		
+		if (code[i] >= VM_OP_ADD_SINT || i + 1 + vm_op_operands[code[i]] > size) {
+			goto done;
+		}
+		
+		depths[i] = -1;
+		
+		switch (code[i]) {
+			case VM_OP_PUSH_LITERAL: {
+				if (vm_read16(ip) >= header->literal_count) {
+					goto done;
+				}
+				
+				break;
+			}
+			
+			case VM_OP_PUSH_FIELD:
+			case VM_OP_STORE_FIELD:
+			case VM_OP_PUSH_GLOBAL:
+			case VM_OP_STORE_GLOBAL: {
+				if (!vm_verify_name(vm, header, ip)) {
+					goto done;
+				}
+				
+				break;
+			}
+			
+			case VM_OP_PUSH_BLOCK: {
+				object_hd *block = vm_read16(ip) < header->literal_count ? vm_lookup(vm, header->literals[vm_read16(ip)]) : NULL;
+				size_t record = vm_read16(ip + 2);
+				
+				if (!block || block->type != OID_METHOD || record <= header->arg_count || record < env_end || record + VM_SBLOCK_SIZE > frame) {
+					goto done;
+				}
+				
+				records = (record < records) ? record : records;
+				break;
+			}
+			
+			case VM_OP_SEND: {
+				if (!vm_verify_name(vm, header, ip) || vm_read16(ip + 3) >= header->cache_count) {
+					goto done;
+				}
+				
+				break;
+			}
+			
+			case VM_OP_PUSH_ENV:
+			case VM_OP_STORE_ENV: {
+				if (!vm_verify_env(vm, header, outer, outer_count, ip)) {
+					goto done;
+				}
+				
+				break;
+			}
+		}
+	}
+	
+	// Slots can't be the environment or block records, which are only
+	// reached through their own instructions
+	for (size_t i = 0; i < size; i += 1 + vm_op_operands[code[i]]) {
+		if (code[i] != VM_OP_PUSH_SLOT && code[i] != VM_OP_STORE_SLOT) {
+			continue;
+		}
+		
+		size_t slot = code[i + 1];
+		
+		if (slot >= records || (slot >= header->env_slot && slot < env_end)) {
+			goto done;
+		}
+	}
+	
+	depths[0] = 0;
+	pending[pending_count++] = 0;
+	
+	while (pending_count) {
+		size_t i = pending[--pending_count];
+		const uint8_t *ip = code + i + 1;
+		int64_t next = i + 1 + vm_op_operands[code[i]];
+		int64_t successors[2] = {next, 0};
+		size_t successor_count = 1;
+		int32_t pops = 0, pushes = 0;
+		
+		switch (code[i]) {
+			case VM_OP_NOP: {
+				break;
+			}
+			
+			case VM_OP_POP: {
+				pops = 1;
+				break;
+			}
+			
+			case VM_OP_DUP: {
+				pops = 1;
+				pushes = 2;
+				break;
+			}
+			
+			case VM_OP_STORE_SLOT:
+			case VM_OP_STORE_FIELD:
+			case VM_OP_STORE_GLOBAL:
+			case VM_OP_STORE_ENV: {
+				pops = 1;
+				pushes = 1;
+				break;
+			}
+			
+			case VM_OP_SEND: {
+				pops = 1 + ip[2];
+				pushes = 1;
+				break;
+			}
+			
+			case VM_OP_RETURN: {
+				pops = 1;
+				successor_count = 0;
+				break;
+			}
+			
+			case VM_OP_JUMP: {
+				successors[0] = next + (int16_t) vm_read16(ip);
+				break;
+			}
+			
+			case VM_OP_JUMP_IF_FALSE:
+			case VM_OP_JUMP_IF_TRUE: {
+				pops = 1;
+				successors[1] = next + (int16_t) vm_read16(ip);
+				successor_count = 2;
+				break;
+			}
+			
+			default: {
+				pushes = 1;
+				break;
+			}
+		}
+		
+		int32_t depth = depths[i] - pops + pushes;
+		
+		if (depths[i] < pops || depth > header->stack_size) {
+			goto done;
+		}
+		
+		for (size_t j = 0; j < successor_count; j++) {
+			if (successors[j] < 0 || successors[j] >= (int64_t) size || depths[successors[j]] == -2) {
+				goto done;
+			}
+			
+			if (depths[successors[j]] == -1) {
+				depths[successors[j]] = depth;
+				pending[pending_count++] = successors[j];
+			}
+			else if (depths[successors[j]] != depth) {
+				goto done;
+			}
+		}
+	}
+	
+	ok = true;
+
+done:
+	DgMemoryFree(depths);
+	DgMemoryFree(pending);
+	
+	return ok;
+}
+
+static object_id vm_find_method_slow(vm_context vm, object_id key, object_id selector) {
+	/**
+	 * Find a method by walking the prototype chain
+	 */
+	
+	objt_object *header;
+	
+	for (object_id object = key; (header = vm_lookup_object(vm, object)); object = header->header.type) {
+		object_id *found = vm_map_find(&header->methods, selector);
+		
+		if (found) {
+			return *found;
+		}
+	}
+	
+	return OID_NIL;
+}
+
+static bool vm_dispatch_row(vm_context vm, object_id key, objt_object *header) {
+	/**
+	 * Make the dispatch row of a key, in the first place where it doesn't
+	 * overlap any other row
+	 */
+	
+	vm_dispatch_entry *row = NULL;
+	size_t count = 0, capacity = 0;
+	uint32_t highest = 0, lowest = UINT32_MAX;
+	bool ok = false;
+	objt_object *object;
+	
+	// What the key understands, with the nearest definition of each selector
+	for (object_id id = key; (object = vm_lookup_object(vm, id)); id = object->header.type) {
+		for (uint32_t i = 0; i < object->methods.capacity; i++) {
+			object_id selector = object->methods.pairs[2 * i];
+			
+			if (selector == OID_NIL || selector == VM_MAP_DELETED) {
+				continue;
+			}
+			
+			uint32_t number = vm_selector_number(vm, selector);
+			bool seen = false;
+			
+			if (!number) {
+				goto done;
+			}
+			
+			for (size_t j = 0; j < count && !seen; j++) {
+				seen = (row[j].key == number);
+			}
+			
+			if (seen) {
+				continue;
+			}
+			
+			if (count >= capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				vm_dispatch_entry *grown = DgMemoryReallocate(row, sizeof *row * capacity);
+				
+				if (!grown) {
+					goto done;
+				}
+				
+				row = grown;
+			}
+			
+			// The key field holds the selector number until it's placed
+			row[count++] = (vm_dispatch_entry) {number, object->methods.pairs[2 * i + 1]};
+			highest = (number > highest) ? number : highest;
+			lowest = (number < lowest) ? number : lowest;
+		}
+	}
+	
+	if (vm->dispatch_key_count >= vm->dispatch_key_capacity) {
+		size_t new_capacity = vm->dispatch_key_capacity ? vm->dispatch_key_capacity * 2 : 64;
+		object_id *keys = DgMemoryReallocate(vm->dispatch_keys, sizeof *keys * new_capacity);
+		
+		if (!keys) {
+			goto done;
+		}
+		
+		vm->dispatch_keys = keys;
+		vm->dispatch_key_capacity = new_capacity;
+	}
+	
+	// The entry of the lowest selector can't go before the first free one
+	size_t start = (count && vm->dispatch_free > lowest) ? vm->dispatch_free - lowest : 0;
+	
+	for (bool fits = false; !fits; start += !fits) {
+		fits = true;
+		
+		for (size_t i = 0; i < count && fits; i++) {
+			size_t at = start + row[i].key;
+			fits = (at >= vm->dispatch_capacity || vm->dispatch[at].key == OID_NIL);
+		}
+	}
+	
+	if (start + highest >= vm->dispatch_capacity) {
+		size_t new_capacity = vm->dispatch_capacity ? vm->dispatch_capacity : 1024;
+		
+		while (start + highest >= new_capacity) {
+			new_capacity *= 2;
+		}
+		
+		vm_dispatch_entry *table = DgMemoryReallocate(vm->dispatch, sizeof *table * new_capacity);
+		
+		if (!table) {
+			goto done;
+		}
+		
+		memset(table + vm->dispatch_capacity, 0, sizeof *table * (new_capacity - vm->dispatch_capacity));
+		vm->dispatch = table;
+		vm->dispatch_capacity = new_capacity;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		vm->dispatch[start + row[i].key] = (vm_dispatch_entry) {key, row[i].method};
+	}
+	
+	while (vm->dispatch_free < vm->dispatch_capacity && vm->dispatch[vm->dispatch_free].key != OID_NIL) {
+		vm->dispatch_free++;
+	}
+	
+	header->row = start;
+	header->row_size = highest + 1;
+	vm->dispatch_keys[vm->dispatch_key_count++] = key;
+	ok = true;
+
+done:
+	DgMemoryFree(row);
+	
+	return ok;
+}
+
+static object_id vm_find_method_from(vm_context vm, object_id key, object_id selector, uint32_t number) {
+	/**
+	 * Find the method for a selector and its number in the row of a dispatch
+	 * key, making the row first if it's stale
+	 */
+	
+	objt_object *header = vm_lookup_object(vm, key);
+	
+	if (!header) {
+		return OID_NIL;
+	}
+	
+	if (!header->row_size && !vm_dispatch_row(vm, key, header)) {
+		return vm_find_method_slow(vm, key, selector);
+	}
+	
+	size_t at = header->row + number;
+	
+	return (number && number < header->row_size && vm->dispatch[at].key == key) ? vm->dispatch[at].method : OID_NIL;
+}
+
+object_id vm_find_method(vm_context vm, object_id object, object_id selector) {
+	uint32_t number = vm_selector_number(vm, selector);
+	object_id key = vm_dispatch_key(vm, object);
+	
+	return number ? vm_find_method_from(vm, key, selector, number) : vm_find_method_slow(vm, key, selector);
+}
+
+bool vm_responds_to(vm_context vm, object_id object, object_id selector) {
+	return vm_find_method(vm, object, selector) != OID_NIL;
+}
+
+void vm_describe(vm_context vm, object_id object, char *buffer, size_t size) {
+	/**
+	 * Write a short human readable description of an object, for logs
+	 */
+	
+	char aux[8];
+	
+	switch (GET_OBJID_CLS(object)) {
+		case OCLS_SINT: {
+			snprintf(buffer, size, "%lld", (long long) OBJID_SEXT(object));
+			return;
+		}
+		
+		case OCLS_FLOAT: {
+			snprintf(buffer, size, "%g", OBJ_ID2DOUBLE(object));
+			return;
+		}
+		
+		case OCLS_SSTR: {
+			snprintf(buffer, size, "%s", vm_tocstring(vm, object, aux));
+			return;
+		}
+		
+		case OCLS_BOOL: {
+			snprintf(buffer, size, "%s", (object == OID_TRUE) ? "true" : "false");
+			return;
+		}
+		
+		case OCLS_SBLOCK: {
+			snprintf(buffer, size, "a Block");
+			return;
+		}
+		
+		default: {
+			break;
+		}
+	}
+	
+	object_hd *header = vm_lookup(vm, object);
+	
+	if (!header) {
+		snprintf(buffer, size, "nil");
+	}
+	else if (header->type == OID_LONG_STRING) {
+		snprintf(buffer, size, "%s", ((objt_string *) header)->data);
+	}
+	else if (header->type == OID_METHOD) {
+		snprintf(buffer, size, "a Method #%s", vm_tocstring(vm, ((objt_method *) header)->selector, aux) ?: "");
+	}
+	else if (header->type == OID_NATIVE) {
+		snprintf(buffer, size, "a Native #%s", ((objt_native *) header)->name);
+	}
+	else {
+		// Script objects usually know their own name through their prototype
+		object_id name = vm_get_field(vm, object, vm_intern(vm, "name"));
+		const char *cname = vm_tocstring(vm, name, aux);
+		
+		if (cname && GET_OBJID_CLS(header->type) == OCLS_ID) {
+			snprintf(buffer, size, "%s#%llu", cname, (unsigned long long) GET_OBJID_VAL(object));
+		}
+		else {
+			snprintf(buffer, size, "object#%llu", (unsigned long long) GET_OBJID_VAL(object));
+		}
+	}
+}
+
+#define VM_SINT_MIN (-(1ll << 60))
+#define VM_SINT_MAX ((1ll << 60) - 1)
+
+static inline bool vm_is_number(object_id object) {
+	return GET_OBJID_CLS(object) == OCLS_SINT || GET_OBJID_CLS(object) == OCLS_FLOAT;
+}
+
+static inline double vm_number_to_double(object_id object) {
+	return (GET_OBJID_CLS(object) == OCLS_SINT) ? (double) OBJID_SEXT(object) : OBJ_ID2DOUBLE(object);
+}
+
+static inline object_id vm_make_integer(int64_t value) {
+	/**
+	 * Make an integer object, becoming a float if it doesn't fit
+	 */
+	
+	if (value < VM_SINT_MIN || value > VM_SINT_MAX) {
+		return OBJ_DOUBLE2ID((double) value);
+	}
+	
+	return MAKE_OBJID(OCLS_SINT, value);
+}
+
+static bool vm_fold_integers(object_id selector, int64_t a, int64_t b, object_id *result) {
+	int64_t c;
+	
+	switch (selector) {
+		case MAKE_SSTR1('+'): {
+			if (__builtin_add_overflow(a, b, &c)) {
+				*result = OBJ_DOUBLE2ID((double) a + (double) b);
+				return true;
+			}
+			
+			*result = vm_make_integer(c);
+			return true;
+		}
+		
+		case MAKE_SSTR1('-'): {
+			if (__builtin_sub_overflow(a, b, &c)) {
+				*result = OBJ_DOUBLE2ID((double) a - (double) b);
+				return true;
+			}
+			
+			*result = vm_make_integer(c);
+			return true;
+		}
+		
+		case MAKE_SSTR1('*'): {
+			if (__builtin_mul_overflow(a, b, &c)) {
+				*result = OBJ_DOUBLE2ID((double) a * (double) b);
+				return true;
+			}
+			
+			*result = vm_make_integer(c);
+			return true;
+		}
+		
+		case MAKE_SSTR1('/'): {
+			*result = OBJ_DOUBLE2ID((double) a / (double) b);
+			return true;
+		}
+		
+		case MAKE_SSTR2('/', '/'): {
+			if (b == 0) {
+				return false;
+			}
+			
+			*result = vm_make_integer(a / b);
+			return true;
+		}
+		
+		case MAKE_SSTR1('%'): {
+			if (b == 0) {
+				return false;
+			}
+			
+			*result = vm_make_integer(a % b);
+			return true;
+		}
+		
+		case MAKE_SSTR1('<'): *result = (a < b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR1('>'): *result = (a > b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR2('<', '='): *result = (a <= b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR2('>', '='): *result = (a >= b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR1('='): *result = (a == b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR2('~', '='): *result = (a != b) ? OID_TRUE : OID_FALSE; return true;
+		
+		default: {
+			return false;
+		}
+	}
+}
+
+static bool vm_fold_floats(object_id selector, double a, double b, object_id *result) {
+	switch (selector) {
+		case MAKE_SSTR1('+'): *result = OBJ_DOUBLE2ID(a + b); return true;
+		case MAKE_SSTR1('-'): *result = OBJ_DOUBLE2ID(a - b); return true;
+		case MAKE_SSTR1('*'): *result = OBJ_DOUBLE2ID(a * b); return true;
+		case MAKE_SSTR1('/'): *result = OBJ_DOUBLE2ID(a / b); return true;
+		case MAKE_SSTR1('<'): *result = (a < b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR1('>'): *result = (a > b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR2('<', '='): *result = (a <= b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR2('>', '='): *result = (a >= b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR1('='): *result = (a == b) ? OID_TRUE : OID_FALSE; return true;
+		case MAKE_SSTR2('~', '='): *result = (a != b) ? OID_TRUE : OID_FALSE; return true;
+		default: return false;
+	}
+}
+
+bool vm_fold_binary(vm_context vm, object_id a, object_id selector, object_id b, object_id *result) {
+	/**
+	 * Evaluate a binary message between two immutable values if it has a
+	 * built in meaning. This is used both by the native methods and by the
+	 * compiler to fold constants, so both always agree.
+	 * 
+	 * @return true if the result could be computed, false otherwise
+	 */
+	
+	uint64_t ca = GET_OBJID_CLS(a), cb = GET_OBJID_CLS(b);
+	
+	if (ca == OCLS_SINT && cb == OCLS_SINT) {
+		return vm_fold_integers(selector, OBJID_SEXT(a), OBJID_SEXT(b), result);
+	}
+	
+	if (vm_is_number(a) && vm_is_number(b)) {
+		return vm_fold_floats(selector, vm_number_to_double(a), vm_number_to_double(b), result);
+	}
+	
+	if (selector == MAKE_SSTR1(',')) {
+		char aux_a[8], aux_b[8];
+		size_t len_a, len_b;
+		const char *str_a = vm_tolcstring(vm, a, aux_a, &len_a);
+		const char *str_b = vm_tolcstring(vm, b, aux_b, &len_b);
+		
+		if (!str_a || !str_b) {
+			return false;
+		}
+		
+		if (len_a + len_b <= 7) {
+			object_id content = (a & 0x00ffffffffffffff) | (GET_OBJID_VAL(b & 0x00ffffffffffffff) << (8 * len_a));
+			*result = MAKE_OBJID(OCLS_SSTR, ((len_a + len_b) << 56) | content);
+			return true;
+		}
+		
+		char *buffer = DgMemoryAllocate(len_a + len_b);
+		
+		if (!buffer) {
+			return false;
+		}
+		
+		memcpy(buffer, str_a, len_a);
+		memcpy(buffer + len_a, str_b, len_b);
+		*result = vm_tolstring(vm, buffer, len_a + len_b);
+		DgMemoryFree(buffer);
+		
+		return *result != OID_NIL;
+	}
+	
+	return false;
+}
+
+void vm_error(vm_context vm, const char *format, ...) {
+	/**
+	 * Report an error in script code and unwind to the native code that
+	 * started running it
+	 */
+	
+	char message[512];
+	va_list args;
+	
+	va_start(args, format);
+	vsnprintf(message, sizeof message, format, args);
+	va_end(args);
+	
+	vm_task *task = &vm->task;
+	
+	if (task->frame_count) {
+		objt_method *method = task->frames[task->frame_count - 1].method;
+		char aux[8];
+		const char *source = vm_tocstring(vm, method->source, aux);
+		DgLog(DG_LOG_ERROR, "%s (in %s near line %u)", message, source ? source : "?", method->line);
+	}
+	else {
+		DgLog(DG_LOG_ERROR, "%s", message);
+	}
+	
+	vm->failed = true;
+}
+
+static void vm_not_understood(vm_context vm, object_id object, object_id selector) {
+	char desc[64], aux[8];
+	vm_describe(vm, object, desc, sizeof desc);
+	vm_error(vm, "%s does not understand #%s", desc, vm_tocstring(vm, selector, aux) ?: "?");
+}
+
+static bool vm_push_frame(vm_context vm, object_id method_id, objt_method *method, object_id *base, size_t args, object_id outer, bool entry) {
+	/**
+	 * Start a new frame for a method whose receiver and arguments are already
+	 * on the stack at `base`. `outer` is the environment of the block being
+	 * run, if any.
+	 */
+	
+	vm_task *task = &vm->task;
+	
+	if (method->arg_count != args) {
+		vm_error(vm, "Method #%s expects %u arguments but was given %zu", vm_tocstring(vm, method->selector, (char[8]) {0}) ?: "<block>", method->arg_count, args);
+		return false;
+	}
+	
+	if (task->frame_count >= VM_TASK_FRAMES || base + 1 + args + method->temp_count + method->stack_size > task->stack + VM_TASK_STACK_SIZE) {
+		vm_error(vm, "Stack overflow");
+		return false;
+	}
+	
+	object_id *temps = base + 1 + args;
+	
+	for (size_t i = 0; i < method->temp_count; i++) {
+		temps[i] = OID_NIL;
+	}
+	
+	if (method->env_slot) {
+		base[method->env_slot + VM_ENV_PARENT] = outer;
+		base[method->env_slot + VM_ENV_SIZE] = MAKE_OBJID(OCLS_SINT, method->env_size);
+	}
+	
+	vm_frame *frame = &task->frames[task->frame_count];
+	frame->method = method;
+	frame->method_id = method_id;
+	frame->ip = method->code;
+	frame->base = base;
+	frame->entry = entry;
+	
+	// The profiler looks at the frames from a signal handler, so the frame
+	// has to be filled in before it's counted
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	task->frame_count++;
+	
+	task->sp = temps + method->temp_count;
+	
+	return true;
+}
+
+static void vm_switch_task(vm_context vm, vm_task *next) {
+	/**
+	 * Make another task the one scripts run on. The profiler can look at the
+	 * task at any time, so it must never see the frames of one task with the
+	 * frame count of the other.
+	 */
+	
+	vm_task task = *next;
+	
+	vm->task.frame_count = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	vm->task.stack = task.stack;
+	vm->task.sp = task.sp;
+	vm->task.frames = task.frames;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	vm->task.frame_count = task.frame_count;
+}
+
+static bool vm_suspend(vm_context vm) {
+	/**
+	 * Park the send running on the current task, which ran out of budget, and
+	 * switch to an empty task. This only works if nothing but bytecode has
+	 * run since the send from native code, since native frames can't be
+	 * parked.
+	 */
+	
+	vm_task *task = &vm->task;
+	
+	if (!vm->suspend || vm->suspended_count >= VM_MAX_SUSPENDED || !task->frame_count || !task->frames[0].entry) {
+		return false;
+	}
+	
+	for (size_t i = 1; i < task->frame_count; i++) {
+		if (task->frames[i].entry) {
+			return false;
+		}
+	}
+	
+	object_id *held = DgMemoryAllocate(sizeof *held * ((task->sp - task->stack) + task->frame_count));
+	
+	if (!held || (!vm->spare.stack && !vm_task_init(&vm->spare))) {
+		vm_task_free(&vm->spare);
+		DgMemoryFree(held);
+		return false;
+	}
+	
+	size_t held_count = 0;
+	
+	for (object_id *slot = task->stack; slot < task->sp; slot++) {
+		object_hd *header = (GET_OBJID_CLS(*slot) == OCLS_ID) ? vm_lookup(vm, *slot) : NULL;
+		
+		if (header) {
+			header->refs++;
+			held[held_count++] = *slot;
+		}
+	}
+	
+	// Methods that are being run could be replaced while the send is parked
+	for (size_t i = 0; i < task->frame_count; i++) {
+		task->frames[i].method->header.refs++;
+		held[held_count++] = task->frames[i].method_id;
+	}
+	
+	if (!vm->resuming) {
+		objt_method *method = task->frames[task->frame_count - 1].method;
+		char aux[8];
+		const char *source = vm_tocstring(vm, method->source, aux);
+		DgLog(DG_LOG_WARNING, "Script ran for %u steps without returning (in %s near line %u), suspending it until the next frame", vm->budget, source ? source : "?", method->line);
+	}
+	
+	vm->suspended[vm->suspended_count++] = (vm_suspended) {*task, held, held_count};
+	vm_switch_task(vm, &vm->spare);
+	vm->spare = (vm_task) {0};
+	
+	return true;
+}
+
+static object_id vm_run(vm_context vm) {
+	/**
+	 * Run bytecode starting from the top frame until an entry frame returns
+	 */
+	
+	vm_task *task = &vm->task;
+	vm_frame *frame = &task->frames[task->frame_count - 1];
+	objt_method *method = frame->method;
+	const uint8_t *ip = frame->ip;
+	object_id *base = frame->base;
+	object_id *sp = task->sp;
+	
+	#define VM_RELOAD_FRAME() do { \
+		frame = &task->frames[task->frame_count - 1]; \
+		method = frame->method; \
+		ip = frame->ip; \
+		base = frame->base; \
+	} while (0)
+	
+	// Sends and backward jumps count against the budget. Without a budget
+	// the count just wraps around.
+	#define VM_STEP() (--vm->budget_left == 0 && vm->budget)
+	
+	// Quickened arithmetic, computed the same way as the native methods
+	#define VM_QUICK(op, cls, fold, selector, convert) \
+		case op: { \
+			object_id a = sp[-2], b = sp[-1]; \
+			\
+			if (GET_OBJID_CLS(a) != (cls) || GET_OBJID_CLS(b) != (cls)) { \
+				goto unquicken; \
+			} \
+			\
+			fold(selector, convert(a), convert(b), &sp[-2]); \
+			sp--; \
+			ip += VM_SEND_SIZE - 1; \
+			break; \
+		}
+	
+	while (true) {
+		switch (*ip++) {
+			case VM_OP_NOP: {
+				break;
+			}
+			
+			case VM_OP_PUSH_NIL: {
+				*sp++ = OID_NIL;
+				break;
+			}
+			
+			case VM_OP_PUSH_TRUE: {
+				*sp++ = OID_TRUE;
+				break;
+			}
+			
+			case VM_OP_PUSH_FALSE: {
+				*sp++ = OID_FALSE;
+				break;
+			}
+			
+			case VM_OP_PUSH_SELF: {
+				*sp++ = base[0];
+				break;
+			}
+			
+			case VM_OP_PUSH_LITERAL: {
+				*sp++ = method->literals[vm_read16(ip)];
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_PUSH_SLOT: {
+				*sp++ = base[*ip++];
+				break;
+			}
+			
+			case VM_OP_STORE_SLOT: {
+				base[*ip++] = sp[-1];
+				break;
+			}
+			
+			case VM_OP_PUSH_FIELD: {
+				*sp++ = vm_get_field(vm, base[0], method->literals[vm_read16(ip)]);
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_STORE_FIELD: {
+				if (!vm_set_field(vm, base[0], method->literals[vm_read16(ip)], sp[-1])) {
+					frame->ip = ip;
+					vm_error(vm, "Can't set fields on this object");
+					goto unwind;
+				}
+				
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_PUSH_GLOBAL: {
+				*sp++ = vm_get_global(vm, method->literals[vm_read16(ip)]);
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_STORE_GLOBAL: {
+				vm_set_global(vm, method->literals[vm_read16(ip)], sp[-1]);
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_PUSH_BLOCK: {
+				// The record lives in the frame, see vm_promote()
+				object_id *record = base + vm_read16(ip + 2);
+				record[VM_SBLOCK_FORWARD] = OID_NIL;
+				record[VM_SBLOCK_METHOD] = method->literals[vm_read16(ip)];
+				record[VM_SBLOCK_SELF] = base[0];
+				record[VM_SBLOCK_ENV] = method->env_slot ? MAKE_OBJID(OCLS_SENV, base + method->env_slot - task->stack) : OID_NIL;
+				*sp++ = MAKE_OBJID(OCLS_SBLOCK, record - task->stack);
+				ip += 4;
+				break;
+			}
+			
+			case VM_OP_PUSH_ENV: {
+				object_id env = MAKE_OBJID(OCLS_SENV, base + method->env_slot - task->stack);
+				
+				for (size_t i = ip[0]; i > 0; i--) {
+					env = vm_env_data(vm, env)[VM_ENV_PARENT];
+				}
+				
+				*sp++ = vm_env_data(vm, env)[VM_ENV_HEADER + ip[1]];
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_STORE_ENV: {
+				object_id env = MAKE_OBJID(OCLS_SENV, base + method->env_slot - task->stack);
+				
+				for (size_t i = ip[0]; i > 0; i--) {
+					env = vm_env_data(vm, env)[VM_ENV_PARENT];
+				}
+				
+				object_id *data = vm_env_data(vm, env);
+				object_id *slot = &data[VM_ENV_HEADER + ip[1]];
+				
+				if (data >= task->stack && data < task->stack + VM_TASK_STACK_SIZE) {
+					// Blocks from this frame can't be kept in an outer frame
+					*slot = ip[0] ? vm_promote(vm, sp[-1]) : sp[-1];
+				}
+				else {
+					object_id value = vm_accquire(vm, sp[-1]);
+					vm_release(vm, *slot);
+					*slot = value;
+				}
+				
+				ip += 2;
+				break;
+			}
+			
+			case VM_OP_POP: {
+				sp--;
+				break;
+			}
+			
+			case VM_OP_DUP: {
+				sp[0] = sp[-1];
+				sp++;
+				break;
+			}
+			
+			case VM_OP_SEND: {
+				if (VM_STEP()) {
+					ip--;
+					goto preempt;
+				}
+				
+				object_id selector = method->literals[vm_read16(ip)];
+				size_t argc = ip[2];
+				vm_icache *cache = &method->caches[vm_read16(ip + 3)];
+				object_id *args = sp - argc;
+				object_id receiver = args[-1];
+				object_id key = vm_dispatch_key(vm, receiver);
+				object_id target;
+				
+				ip += 5;
+				
+				if (cache->key == key && cache->epoch == vm->epoch) {
+					target = cache->method;
+				}
+				else {
+					cache->selector = cache->selector ? cache->selector : vm_selector_number(vm, selector);
+					target = vm_find_method_from(vm, key, selector, cache->selector);
+					cache->key = key;
+					cache->method = target;
+					cache->epoch = vm->epoch;
+				}
+				
+				frame->ip = ip;
+				task->sp = sp;
+				
+				object_hd *header = vm_lookup(vm, target);
+				
+				if (!header) {
+					vm_not_understood(vm, receiver, selector);
+					goto unwind;
+				}
+				
+				if (header->type == OID_NATIVE) {
+					objt_native *native = (objt_native *) header;
+					
+					if (native->folds && argc == 1) {
+						vm_quicken(vm, (uint8_t *) ip - VM_SEND_SIZE, selector, receiver, args[0]);
+					}
+					
+					object_id result = native->function(vm, receiver, selector, argc, args);
+					
+					if (vm->failed) {
+						goto unwind;
+					}
+					
+					sp = args;
+					sp[-1] = result;
+				}
+				else {
+					if (!vm_push_frame(vm, target, (objt_method *) header, args - 1, argc, OID_NIL, false)) {
+						goto unwind;
+					}
+					
+					sp = task->sp;
+					VM_RELOAD_FRAME();
+				}
+				
+				break;
+			}
+			
+			case VM_OP_RETURN: {
+				object_id result = sp[-1];
+				bool entry = frame->entry;
+				
+				// Blocks made by this frame need to be moved before it goes
+				if (GET_OBJID_CLS(result) >= OCLS_SBLOCK && task->stack + GET_OBJID_VAL(result) >= base) {
+					result = vm_promote(vm, result);
+				}
+				
+				// Pop the frame before its receiver is replaced, for the profiler
+				task->frame_count--;
+				__atomic_signal_fence(__ATOMIC_RELEASE);
+				base[0] = result;
+				sp = base + 1;
+				
+				if (entry) {
+					task->sp = base;
+					return result;
+				}
+				
+				VM_RELOAD_FRAME();
+				break;
+			}
+			
+			case VM_OP_JUMP: {
+				int16_t offset = vm_read16(ip);
+				ip += 2 + offset;
+				
+				if (offset < 0 && VM_STEP()) {
+					goto preempt;
+				}
+				
+				break;
+			}
+			
+			case VM_OP_JUMP_IF_FALSE: {
+				int16_t offset = vm_read16(ip);
+				object_id condition = *--sp;
+				
+				ip += 2;
+				
+				if (IS_OBJ_FALSEY(condition)) {
+					ip += offset;
+					
+					if (offset < 0 && VM_STEP()) {
+						goto preempt;
+					}
+				}
+				
+				break;
+			}
+			
+			case VM_OP_JUMP_IF_TRUE: {
+				int16_t offset = vm_read16(ip);
+				object_id condition = *--sp;
+				
+				ip += 2;
+				
+				if (!IS_OBJ_FALSEY(condition)) {
+					ip += offset;
+					
+					if (offset < 0 && VM_STEP()) {
+						goto preempt;
+					}
+				}
+				
+				break;
+			}
+			
+			VM_QUICK(VM_OP_ADD_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR1('+'), OBJID_SEXT)
+			VM_QUICK(VM_OP_SUB_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR1('-'), OBJID_SEXT)
+			VM_QUICK(VM_OP_MUL_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR1('*'), OBJID_SEXT)
+			VM_QUICK(VM_OP_LT_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR1('<'), OBJID_SEXT)
+			VM_QUICK(VM_OP_GT_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR1('>'), OBJID_SEXT)
+			VM_QUICK(VM_OP_LE_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR2('<', '='), OBJID_SEXT)
+			VM_QUICK(VM_OP_GE_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR2('>', '='), OBJID_SEXT)
+			VM_QUICK(VM_OP_EQ_SINT, OCLS_SINT, vm_fold_integers, MAKE_SSTR1('='), OBJID_SEXT)
+			VM_QUICK(VM_OP_ADD_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR1('+'), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_SUB_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR1('-'), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_MUL_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR1('*'), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_DIV_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR1('/'), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_LT_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR1('<'), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_GT_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR1('>'), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_LE_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR2('<', '='), OBJ_ID2DOUBLE)
+			VM_QUICK(VM_OP_GE_FLOAT, OCLS_FLOAT, vm_fold_floats, MAKE_SSTR2('>', '='), OBJ_ID2DOUBLE)
+			
+			default: {
+				frame->ip = ip;
+				vm_error(vm, "Invalid opcode 0x%02x", ip[-1]);
+				goto unwind;
+			}
+		}
+		
+		continue;
+		
+		unquicken:
+		// The operands aren't what the instruction was quickened for, so turn
+		// it back into a send and run that instead
+		*(uint8_t *) --ip = VM_OP_SEND;
+	}
+	
+	preempt:
+	// Out of budget, so finish the send later if it can be parked and give
+	// up on it otherwise. Either way nothing after this frame runs now.
+	frame->ip = ip;
+	task->sp = sp;
+	
+	if (vm_suspend(vm)) {
+		return OID_NIL;
+	}
+	
+	vm_error(vm, "Script ran for %u steps without returning, stopping it", vm->budget);
+	
+	unwind:
+	// Drop frames up to and including the entry frame
+	while (task->frame_count) {
+		bool entry = task->frames[--task->frame_count].entry;
+		task->sp = task->frames[task->frame_count].base;
+		
+		if (entry) {
+			break;
+		}
+	}
+	
+	return OID_NIL;
+	
+	#undef VM_RELOAD_FRAME
+	#undef VM_STEP
+	#undef VM_QUICK
+}
+
+static object_id vm_invoke(vm_context vm, object_id method, object_id self, size_t args, object_id *ids, object_id outer) {
+	/**
+	 * Call a method (compiled or native) from native code, giving it `outer`
+	 * as the environment of its block
+	 */
+	
+	vm_task *task = &vm->task;
+	bool outermost = (task->frame_count == 0);
+	object_hd *header = vm_lookup(vm, method);
+	object_id result = OID_NIL;
+	
+	if (!header) {
+		return OID_NIL;
+	}
+	
+	if (outermost) {
+		vm->budget_left = vm->budget ? vm->budget : UINT32_MAX;
+	}
+	
+	if (header->type == OID_NATIVE) {
+		objt_native *native = (objt_native *) header;
+		result = native->function(vm, self, vm_intern(vm, native->name), args, ids);
+	}
+	else if (header->type == OID_METHOD) {
+		object_id *base = task->sp;
+		
+		if (base + 1 + args > task->stack + VM_TASK_STACK_SIZE) {
+			vm_error(vm, "Stack overflow");
+		}
+		else {
+			base[0] = self;
+			
+			if (args) {
+				memcpy(base + 1, ids, sizeof *ids * args);
+			}
+			
+			if (vm_push_frame(vm, method, (objt_method *) header, base, args, outer, true)) {
+				result = vm_run(vm);
+			}
+		}
+	}
+	
+	if (outermost) {
+		vm->failed = false;
+	}
+	
+	return result;
+}
+
+object_id vm_call(vm_context vm, object_id method, object_id self, size_t args, object_id *ids) {
+	/**
+	 * Call a method (compiled or native) with the given receiver and
+	 * arguments, from native code
+	 */
+	
+	return vm_invoke(vm, method, self, args, ids, OID_NIL);
+}
+
+bool vm_block_parts(vm_context vm, object_id block, object_id *method, object_id *self, object_id *env) {
+	/**
+	 * Get the compiled method, receiver and environment of a block, whether
+	 * it is still on the stack or not
+	 */
+	
+	object_id code, receiver, outer;
+	
+	if (GET_OBJID_CLS(block) == OCLS_SBLOCK) {
+		object_id *record = vm->task.stack + GET_OBJID_VAL(block);
+		code = record[VM_SBLOCK_METHOD];
+		receiver = record[VM_SBLOCK_SELF];
+		outer = record[VM_SBLOCK_ENV];
+	}
+	else {
+		object_hd *header = vm_lookup(vm, block);
+		
+		if (!header || header->type != OID_BLOCK) {
+			return false;
+		}
+		
+		objt_block *closure = (objt_block *) header;
+		code = closure->method;
+		receiver = closure->self;
+		outer = closure->env;
+	}
+	
+	if (method) {
+		*method = code;
+	}
+	
+	if (self) {
+		*self = receiver;
+	}
+	
+	if (env) {
+		*env = outer;
+	}
+	
+	return true;
+}
+
+object_id vm_block_call(vm_context vm, object_id block, size_t args, object_id *ids) {
+	/**
+	 * Evaluate a block with the given arguments
+	 */
+	
+	object_id method, self, env;
+	
+	if (!vm_block_parts(vm, block, &method, &self, &env)) {
+		vm_error(vm, "Not a block");
+		return OID_NIL;
+	}
+	
+	return vm_invoke(vm, method, self, args, ids, env);
+}
+
+void vm_set_budget(vm_context vm, uint32_t steps) {
+	/**
+	 * Limit how long a send from native code can run, so that a runaway
+	 * script can't hang the engine. Every send and backward jump is a step.
+	 * A send that runs out of steps is stopped with an error and returns nil,
+	 * unless suspending is allowed (see vm_set_suspend()).
+	 *
+	 * @param vm VM
+	 * @param steps Steps each send can take, or 0 for no limit
+	 */
+	
+	vm->budget = steps;
+}
+
+void vm_set_suspend(vm_context vm, bool suspend) {
+	/**
+	 * Allow or stop allowing sends from native code that run out of budget
+	 * to be suspended instead of stopped, if only bytecode is running (see
+	 * vm_resume()). A suspended send returns nil right away, so this should
+	 * only be allowed around sends whose answer nothing waits for.
+	 */
+	
+	vm->suspend = suspend;
+}
+
+size_t vm_resume(vm_context vm) {
+	/**
+	 * Continue the sends that were suspended for running out of budget, in
+	 * the order they were suspended, each with a new budget. Sends that run
+	 * out again are suspended again. This must be called from native code
+	 * while no script is running.
+	 *
+	 * @return The number of sends that were continued
+	 */
+	
+	size_t count = vm->suspended_count;
+	
+	if (vm->task.frame_count) {
+		return 0;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		vm_suspended parked = vm->suspended[0];
+		memmove(vm->suspended, vm->suspended + 1, sizeof *vm->suspended * --vm->suspended_count);
+		
+		// Keep the empty task around for the next send that is suspended
+		if (vm->spare.stack) {
+			vm_task_free(&vm->task);
+		}
+		else {
+			vm->spare = vm->task;
+		}
+		
+		vm_switch_task(vm, &parked.task);
+		
+		for (size_t j = 0; j < parked.held_count; j++) {
+			vm_release(vm, parked.held[j]);
+		}
+		
+		DgMemoryFree(parked.held);
+		
+		vm->budget_left = vm->budget ? vm->budget : UINT32_MAX;
+		vm->resuming = true;
+		vm_run(vm);
+		vm->resuming = false;
+		vm->failed = false;
+	}
+	
+	return count;
+}
+
+object_id vm_msg_send(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids) {
+	/**
+	 * Send a message to an object from native code
+	 */
+	
+	object_id method = vm_find_method(vm, object, selector);
+	
+	if (!method) {
+		vm_not_understood(vm, object, selector);
+		
+		if (vm->task.frame_count == 0) {
+			vm->failed = false;
+		}
+		
+		return OID_NIL;
+	}
+	
+	return vm_call(vm, method, object, args, ids);
+}
+
+// A receiver of a broadcast and where it was in the list
+typedef struct {
+	object_id key;
+	size_t index;
+} vm_broadcast_entry;
+
+static int vm_broadcast_compare(const void *a, const void *b) {
+	const vm_broadcast_entry *x = a, *y = b;
+	
+	if (x->key != y->key) {
+		return (x->key < y->key) ? -1 : 1;
+	}
+	
+	return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+size_t vm_broadcast(vm_context vm, const object_id *objects, size_t count, object_id selector, size_t args, object_id *ids) {
+	/**
+	 * Send the same message to many objects from native code. Receivers are
+	 * grouped by where method lookup starts for them, so the method is looked
+	 * up once per group when the group is reached, and then called on each of
+	 * its receivers in a row. Receivers are in list order within a group.
+	 * If a receiver defines methods, the rest of its group has the method
+	 * looked up again one by one. Those that don't understand the message are
+	 * skipped. Returns how many receivers the message was sent to.
+	 */
+	
+	if (!count) {
+		return 0;
+	}
+	
+	vm_broadcast_entry *entries = DgMemoryAllocate(sizeof *entries * count);
+	
+	if (!entries) {
+		vm_error(vm, "Out of memory");
+		
+		if (vm->task.frame_count == 0) {
+			vm->failed = false;
+		}
+		
+		return 0;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		entries[i].key = vm_dispatch_key(vm, objects[i]);
+		entries[i].index = i;
+	}
+	
+	qsort(entries, count, sizeof *entries, vm_broadcast_compare);
+	
+	uint32_t number = vm_selector_number(vm, selector);
+	size_t sent = 0;
+	
+	for (size_t start = 0, end; start < count && !vm->failed; start = end) {
+		object_id key = entries[start].key;
+		object_id method = number ? vm_find_method_from(vm, key, selector, number) : vm_find_method_slow(vm, key, selector);
+		uint32_t epoch = vm->epoch;
+		
+		for (end = start; end < count && entries[end].key == key; end++) {}
+		
+		for (size_t i = start; i < end && !vm->failed; i++) {
+			object_id receiver = objects[entries[i].index];
+			
+			// Defining methods can change the method, and where lookup starts
+			// for receivers that defined some of their own
+			if (epoch != vm->epoch) {
+				object_id now = vm_dispatch_key(vm, receiver);
+				method = number ? vm_find_method_from(vm, now, selector, number) : vm_find_method_slow(vm, now, selector);
+			}
+			
+			if (method != OID_NIL) {
+				vm_call(vm, method, receiver, args, ids);
+				sent++;
+			}
+		}
+	}
+	
+	DgMemoryFree(entries);
+	
+	return sent;
+}
+
+size_t vm_broadcast_in_order(vm_context vm, const object_id *objects, size_t count, object_id selector, size_t args, object_id *ids) {
+	/**
+	 * Like vm_broadcast(), but send to the receivers strictly in list order,
+	 * so that the order doesn't depend on how prototypes are numbered. The
+	 * method is looked up again whenever lookup starts somewhere else than
+	 * for the receiver before, or methods were defined since.
+	 */
+	
+	uint32_t number = vm_selector_number(vm, selector);
+	uint32_t epoch = vm->epoch;
+	object_id key = OID_NIL;
+	object_id method = OID_NIL;
+	size_t sent = 0;
+	
+	for (size_t i = 0; i < count && !vm->failed; i++) {
+		object_id next = vm_dispatch_key(vm, objects[i]);
+		
+		if (i == 0 || next != key || epoch != vm->epoch) {
+			key = next;
+			epoch = vm->epoch;
+			method = number ? vm_find_method_from(vm, key, selector, number) : vm_find_method_slow(vm, key, selector);
+		}
+		
+		if (method != OID_NIL) {
+			vm_call(vm, method, objects[i], args, ids);
+			sent++;
+		}
+	}
+	
+	return sent;
 }
@@ -1,6 +1,8 @@
+#pragma once
+
 #include <common.h>
 
-typedef void *vm_context;
+typedef struct vm_state *vm_context;
 typedef uint64_t object_id;
 
 // The first level of "un-indirection": common small immutable objects have
@@ -15,6 +17,11 @@ typedef uint64_t object_id;
 #define OCLS_BOOL   0b100
 #define OCLS_PRIM   0b101
 
+// References into the task stack, see vm_promote(). These never end up in
+// the heap.
+#define OCLS_SBLOCK 0b110 // Block allocated in the frame that created it
+#define OCLS_SENV   0b111 // Captured variables of a frame
+
 // Primitive object types are actually allocated, but don't follow the typical
 // object format. They are used for things like strings, integers and classes
 // which need some backing code in the implementation.
@@ -22,26 +29,53 @@ typedef uint64_t object_id;
 // set to something like MAKE_OBJID(OCLS_PRIM, OCLS_CLASS)
 #define OCLS_STRING 0b1000 // Object is a LongString
 #define OCLS_CLASS  0b1001 // Object is a Class
+#define OCLS_PACKED 0b1010 // Object is a PackedArray
+#define OCLS_ARRAY  0b1011 // Object is an Array
+#define OCLS_DICT   0b1100 // Object is a Dictionary
+#define OCLS_METHOD 0b1101 // Object is a compiled Method
+#define OCLS_BLOCK  0b1110 // Object is a Block
+#define OCLS_NATIVE 0b1111 // Object is a method implemented in C
+#define OCLS_COUNT  0b10000
 
-#define GET_OBJID_CLS(x) (x >> 61)
-#define GET_OBJID_VAL(x) (x & 0x1fffffffffffffff)
-#define MAKE_OBJID(t, v) ((t << 61) | (v & 0x1fffffffffffffff))
-#define OBJID_SEXT(x) ((int64_t)(((x >> 60) & 1) ? (0xe000000000000000 | x) : x))
+#define GET_OBJID_CLS(x) ((uint64_t)(x) >> 61)
+#define GET_OBJID_VAL(x) ((uint64_t)(x) & 0x1fffffffffffffff)
+#define MAKE_OBJID(t, v) (((uint64_t)(t) << 61) | ((uint64_t)(v) & 0x1fffffffffffffff))
+#define OBJID_SEXT(x) ((int64_t)((((uint64_t)(x) >> 60) & 1) ? (0xe000000000000000 | (uint64_t)(x)) : GET_OBJID_VAL(x)))
 
-#define SSTR_SIZE(x) ((x >> 56) & 0b11111)
-#define MAKE_SSTR1(c0) MAKE_OBJID(OCLS_SSTR, (1 << 56) | c0)
-#define MAKE_SSTR2(c0, c1) MAKE_OBJID(OCLS_SSTR, (2 << 56) | (c1 << 8) | c0)
+#define SSTR_SIZE(x) (((uint64_t)(x) >> 56) & 0b11111)
+#define MAKE_SSTR1(c0) MAKE_OBJID(OCLS_SSTR, (1ull << 56) | (uint64_t)(c0))
+#define MAKE_SSTR2(c0, c1) MAKE_OBJID(OCLS_SSTR, (2ull << 56) | ((uint64_t)(c1) << 8) | (uint64_t)(c0))
 
 #define RAW_CAST(t, v) (*(t *)(&(v)))
-#define OBJ_DOUBLE2ID(x) MAKE_OBJID(OCLS_FLOAT, RAW_CAST(uint64_t, x) >> 3)
-#define OBJ_ID2DOUBLE(x) RAW_CAST(double, x << 3)
+#define OBJ_DOUBLE2ID(x) vm_double2id(x)
+#define OBJ_ID2DOUBLE(x) vm_id2double(x)
+
+static inline object_id vm_double2id(double x) {
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof bits);
+	return MAKE_OBJID(OCLS_FLOAT, bits >> 3);
+}
+
+static inline double vm_id2double(object_id x) {
+	uint64_t bits = x << 3;
+	double d;
+	memcpy(&d, &bits, sizeof d);
+	return d;
+}
 
 #define OID_NIL 0
 #define OID_FALSE MAKE_OBJID(OCLS_BOOL, 0)
 #define OID_TRUE MAKE_OBJID(OCLS_BOOL, 1)
-#define OID_LONG_STRING MAKE_OBJID(OCLS_PRIM, 1) // Long string type
+#define OID_TYPE(t) MAKE_OBJID(OCLS_PRIM, t)
+#define OID_LONG_STRING OID_TYPE(OCLS_STRING) // Long string type
+#define OID_PACKED_ARRAY OID_TYPE(OCLS_PACKED) // Packed array type
+#define OID_ARRAY OID_TYPE(OCLS_ARRAY)
+#define OID_DICT OID_TYPE(OCLS_DICT)
+#define OID_METHOD OID_TYPE(OCLS_METHOD)
+#define OID_BLOCK OID_TYPE(OCLS_BLOCK)
+#define OID_NATIVE OID_TYPE(OCLS_NATIVE)
 
-#define IS_OBJ_FALSEY(x) (x == OID_NIL || x == OID_FALSE || x == MAKE_OBJID(OCLS_SINT, 0))
+#define IS_OBJ_FALSEY(x) ((x) == OID_NIL || (x) == OID_FALSE || (x) == MAKE_OBJID(OCLS_SINT, 0))
 
 #define VMSTK_RESERVED 256
 
@@ -57,18 +91,50 @@ typedef struct {
 	size_t refs;
 } object_hd;
 
-// The object table efficently maps object IDs to object structure pointers
+// The object table efficently maps object IDs to object structure pointers.
+// Slot zero is never used since its ID is the same as nil. Objects whose
+// refcount drops to zero are not freed right away: they go on the zero count
+// table and are only freed by vm_collect() if nothing has retained them
+// since, which means values that only live on the stack don't need counting.
 typedef struct {
 	object_hd **objects;
 	size_t capacity;
 	size_t count;
+	
+	uint32_t *free;
+	size_t free_count;
+	size_t free_capacity;
+	
+	object_id *zct;
+	size_t zct_count;
+	size_t zct_capacity;
 } object_table;
 
+// Hash map from object IDs to object IDs, used for fields, method
+// dictionaries and globals. Keys are compared by ID only, which works for
+// strings since they are all interned. Nil can't be used as a key.
+typedef struct {
+	object_id *pairs;
+	uint32_t count;
+	uint32_t used; // Including deleted entries
+	uint32_t capacity;
+} vm_map;
+
+#define VM_MAP_DELETED MAKE_OBJID(OCLS_PRIM, 0)
+
+static inline uint64_t vm_hash_id(object_id object) {
+	uint64_t hash = object * 0x9e3779b97f4a7c15;
+	return hash ^ (hash >> 32);
+}
+
 // Long strings are just strings. Just like shorts strings, they are immutable
-// and may contain embedded zeros.
+// and may contain embedded zeros. Every long string is interned, so two
+// strings are equal exactly when their IDs are. A terminating zero is always
+// stored after the data for convenience.
 typedef struct {
 	object_hd header;
 	size_t length;
+	uint64_t hash;
 	char data[0];
 } objt_string;
 
@@ -87,5 +153,379 @@ typedef struct {
 
 typedef struct {
 	object_hd header;
-	object_id *pairs;
+	vm_map map;
 } objt_dict;
+
+// Arrays of plain (non-object) elements, like vertices or samples. The data is
+// kept unboxed so it can be handed to native code without conversion. While
+// an array is pinned its data must not move, so it can't be resized.
+typedef struct {
+	object_hd header;
+	size_t stride;
+	size_t length;
+	size_t capacity;
+	uint32_t pins;
+	uint8_t data[0];
+} objt_packed;
+
+// Objects created by scripts. The type in the header is the prototype, which
+// is where fields and methods are looked up when the object doesn't have them
+// itself. The root prototype has nil as its type.
+typedef struct {
+	object_hd header;
+	vm_map fields;
+	vm_map methods;
+	uint32_t row;       // Where its dispatch row starts, if it's a dispatch key
+	uint32_t row_size;  // Highest selector number in the row plus one, 0 if it has no row
+	uint32_t writes;    // Bumped whenever its fields change, see vm_touch()
+} objt_object;
+
+typedef object_id (*vm_native)(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids);
+
+typedef struct {
+	object_hd header;
+	vm_native function;
+	const char *name;
+	bool folds; // Gives the same result as vm_fold_binary() for two numbers
+} objt_native;
+
+// Inline cache for a send site: the dispatch key seen last time and the
+// method it resolved to. It's only valid if the epoch matches the VM's. The
+// number of the site's selector is filled in when the method is linked.
+typedef struct {
+	object_id key;
+	object_id method;
+	uint32_t epoch;
+	uint32_t selector;
+} vm_icache;
+
+// A compiled method, also used for the body of blocks. The code, literals and
+// caches are allocated along with the method.
+typedef struct {
+	object_hd header;
+	object_id selector; // nil for plain blocks
+	object_id source;   // Name of the script it came from
+	const uint8_t *code;
+	object_id *literals;
+	vm_icache *caches;
+	uint32_t code_size;
+	uint16_t literal_count;
+	uint16_t cache_count;
+	uint16_t arg_count;
+	uint16_t temp_count;
+	uint16_t stack_size;
+	uint16_t line;
+	uint16_t env_slot; // First slot of the frame's environment, or 0 if none
+	uint16_t env_size; // Number of captured variables in the environment
+} objt_method;
+
+typedef struct {
+	object_hd header;
+	object_id method;
+	object_id self;
+	object_id env;
+} objt_block;
+
+// Blocks are created in slots of their frame and only copied to the heap if
+// they could outlive it. The record in the frame is:
+#define VM_SBLOCK_FORWARD 0 // Heap copy once the block has been promoted
+#define VM_SBLOCK_METHOD 1
+#define VM_SBLOCK_SELF 2
+#define VM_SBLOCK_ENV 3
+#define VM_SBLOCK_SIZE 4
+
+// Variables captured by blocks are kept together in an environment, which
+// starts out in the slots of its frame and moves to the heap (as an Array
+// with the same layout) when a block using it is promoted.
+#define VM_ENV_FORWARD 0 // Heap copy once the environment has been promoted
+#define VM_ENV_PARENT 1  // Environment of the block's creator
+#define VM_ENV_SIZE 2    // Number of variables
+#define VM_ENV_HEADER 3
+
+// Bytecode instruction set. Operands follow the opcode and are little endian.
+// Slot 0 of a frame is the receiver, followed by the arguments and then the
+// temporaries.
+enum {
+	VM_OP_NOP,
+	VM_OP_PUSH_NIL,
+	VM_OP_PUSH_TRUE,
+	VM_OP_PUSH_FALSE,
+	VM_OP_PUSH_SELF,
+	VM_OP_PUSH_LITERAL,  // u16 literal
+	VM_OP_PUSH_SLOT,     // u8 slot
+	VM_OP_STORE_SLOT,    // u8 slot (value stays on the stack)
+	VM_OP_PUSH_FIELD,    // u16 literal name
+	VM_OP_STORE_FIELD,   // u16 literal name
+	VM_OP_PUSH_GLOBAL,   // u16 literal name
+	VM_OP_STORE_GLOBAL,  // u16 literal name
+	VM_OP_PUSH_BLOCK,    // u16 literal method, u16 slot for the block record
+	VM_OP_POP,
+	VM_OP_DUP,
+	VM_OP_SEND,          // u16 literal selector, u8 argument count, u16 cache
+	VM_OP_RETURN,
+	VM_OP_JUMP,          // s16 offset from the next instruction
+	VM_OP_JUMP_IF_FALSE, // s16 offset, pops the condition
+	VM_OP_JUMP_IF_TRUE,  // s16 offset, pops the condition
+	VM_OP_PUSH_ENV,      // u8 depth, u8 index of captured variable
+	VM_OP_STORE_ENV,     // u8 depth, u8 index (value stays on the stack)
+	
+	// Quickened sends of arithmetic, with the same operands as SEND. These
+	// are never compiled: the interpreter swaps one in for a send that saw
+	// two integers or two floats, and swaps the send back when it doesn't.
+	VM_OP_ADD_SINT,
+	VM_OP_SUB_SINT,
+	VM_OP_MUL_SINT,
+	VM_OP_LT_SINT,
+	VM_OP_GT_SINT,
+	VM_OP_LE_SINT,
+	VM_OP_GE_SINT,
+	VM_OP_EQ_SINT,
+	VM_OP_ADD_FLOAT,
+	VM_OP_SUB_FLOAT,
+	VM_OP_MUL_FLOAT,
+	VM_OP_DIV_FLOAT,
+	VM_OP_LT_FLOAT,
+	VM_OP_GT_FLOAT,
+	VM_OP_LE_FLOAT,
+	VM_OP_GE_FLOAT,
+	
+	VM_OP_COUNT,
+};
+
+#define VM_SEND_SIZE 6
+
+typedef struct {
+	objt_method *method;
+	object_id method_id; // Held while the frame is suspended
+	const uint8_t *ip;
+	object_id *base;
+	bool entry; // Returning from this frame returns to native code
+} vm_frame;
+
+#define VM_TASK_STACK_SIZE (64 * 1024)
+#define VM_TASK_FRAMES 4096
+
+// The stacks script code runs on. Frames never move since the stack is never
+// reallocated.
+typedef struct {
+	object_id *stack;
+	object_id *sp;
+	vm_frame *frames;
+	size_t frame_count;
+} vm_task;
+
+// A send from native code that ran out of budget, parked on its own stack
+// until vm_resume(). What its stack refers to is held while it's parked,
+// since nothing on a stack is counted.
+typedef struct {
+	vm_task task;
+	object_id *held;
+	size_t held_count;
+} vm_suspended;
+
+#define VM_MAX_SUSPENDED 16
+
+// Entry of the dispatch table. Rows of different keys overlap, so an entry
+// only belongs to the row of its key.
+typedef struct {
+	object_id key;
+	object_id method;
+} vm_dispatch_entry;
+
+typedef struct vm_state {
+	object_table table;
+	
+	// Interned long strings, by content hash
+	object_id *strings;
+	size_t string_count;
+	size_t string_capacity;
+	
+	vm_map globals;
+	uint32_t globals_epoch; // Bumped whenever a global is given a new value
+	
+	// Prototypes for values that aren't script objects, indexed by their
+	// inline class or primitive type. Index 0 is the prototype for nil.
+	object_id protos[OCLS_COUNT];
+	object_id root;
+	
+	vm_task task;
+	vm_task spare; // Unused stack for the next suspended send, if any
+	
+	// Steps (sends and backward jumps) each send from native code can take
+	// before it is suspended or stopped, or 0 for no limit
+	uint32_t budget;
+	uint32_t budget_left;
+	bool suspend; // Sends that run out can be suspended right now
+	bool resuming; // Running a send that was suspended before
+	vm_suspended suspended[VM_MAX_SUSPENDED];
+	size_t suspended_count;
+	
+	// Bumped whenever any method dictionary changes, invalidating caches
+	uint32_t epoch;
+	
+	// Selectors are numbered densely in the order they are first seen
+	vm_map selector_numbers;
+	uint32_t selector_count;
+	
+	// Row displacement dispatch table. Each dispatch key has a row of every
+	// method it understands, own or inherited, indexed by selector number.
+	// The rows are interleaved wherever they fit. Defining a method takes
+	// out the rows of the keys that inherit from it, which are made again
+	// lazily.
+	vm_dispatch_entry *dispatch;
+	size_t dispatch_capacity;
+	size_t dispatch_free; // Every entry before this one is in use
+	object_id *dispatch_keys; // Keys that have a row
+	size_t dispatch_key_count;
+	size_t dispatch_key_capacity;
+	
+	bool quickened; // Some code has quickened instructions
+	
+	void *host; // For natives the host defines, like the Universe
+	
+	bool failed;
+} vm_state;
+
+vm_context vm_create(void);
+void vm_destroy(vm_context vm);
+
+object_id vm_alloc(vm_context vm, object_id type, size_t size);
+bool vm_reserve(vm_context vm, size_t count);
+object_hd *vm_lookup(vm_context vm, object_id object);
+object_id vm_accquire(vm_context vm, object_id object);
+object_id vm_promote(vm_context vm, object_id object);
+object_id vm_release(vm_context vm, object_id object);
+void vm_collect(vm_context vm);
+
+void vm_map_init(vm_map *map);
+void vm_map_free(vm_context vm, vm_map *map);
+object_id *vm_map_find(vm_map *map, object_id key);
+bool vm_map_put(vm_context vm, vm_map *map, object_id key, object_id value);
+bool vm_map_remove(vm_context vm, vm_map *map, object_id key);
+
+const char *vm_tolcstring(vm_context vm, object_id object, char aux[8], size_t *size);
+const char *vm_tocstring(vm_context vm, object_id object, char aux[8]);
+object_id vm_tolstring(vm_context vm, const char *string, size_t size);
+object_id vm_intern(vm_context vm, const char *string);
+uint64_t vm_hash_bytes(const void *data, size_t size);
+void vm_describe(vm_context vm, object_id object, char *buffer, size_t size);
+
+object_id vm_packed_new(vm_context vm, size_t stride, size_t length);
+bool vm_packed_resize(vm_context vm, object_id array, size_t length);
+void *vm_packed_data(vm_context vm, object_id array, size_t *stride, size_t *length);
+void *vm_pin(vm_context vm, object_id array);
+void vm_unpin(vm_context vm, object_id array);
+
+object_id vm_array_new(vm_context vm, size_t capacity);
+bool vm_array_push(vm_context vm, object_id array, object_id value);
+
+object_id vm_object_new(vm_context vm, object_id proto);
+object_id vm_make_proto(vm_context vm, const char *name, object_id parent);
+object_id vm_get_field(vm_context vm, object_id object, object_id name);
+bool vm_set_field(vm_context vm, object_id object, object_id name, object_id value);
+void vm_touch(vm_context vm, object_id object);
+uint32_t vm_writes(vm_context vm, object_id object);
+object_id vm_get_global(vm_context vm, object_id name);
+bool vm_set_global(vm_context vm, object_id name, object_id value);
+
+object_id vm_method_new(vm_context vm, size_t code_size, size_t literal_count, size_t cache_count);
+void vm_method_link(vm_context vm, object_id method);
+bool vm_method_verify(vm_context vm, object_id method, const object_id *outer, size_t outer_count);
+uint32_t vm_selector_number(vm_context vm, object_id selector);
+bool vm_define_method(vm_context vm, object_id object, object_id selector, object_id method);
+object_id vm_define_native(vm_context vm, object_id object, const char *selector, vm_native function);
+object_id vm_find_method(vm_context vm, object_id object, object_id selector);
+bool vm_responds_to(vm_context vm, object_id object, object_id selector);
+
+void vm_error(vm_context vm, const char *format, ...);
+bool vm_fold_binary(vm_context vm, object_id a, object_id selector, object_id b, object_id *result);
+void vm_unquicken(uint8_t *code, size_t size);
+
+object_id vm_msg_send(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids);
+object_id vm_call(vm_context vm, object_id method, object_id self, size_t args, object_id *ids);
+size_t vm_broadcast(vm_context vm, const object_id *objects, size_t count, object_id selector, size_t args, object_id *ids);
+size_t vm_broadcast_in_order(vm_context vm, const object_id *objects, size_t count, object_id selector, size_t args, object_id *ids);
+bool vm_block_parts(vm_context vm, object_id block, object_id *method, object_id *self, object_id *env);
+object_id vm_block_call(vm_context vm, object_id block, size_t args, object_id *ids);
+void vm_set_budget(vm_context vm, uint32_t steps);
+void vm_set_suspend(vm_context vm, bool suspend);
+size_t vm_resume(vm_context vm);
+
+bool vm_profile_start(vm_context vm, unsigned rate);
+void vm_profile_collect(vm_context vm);
+bool vm_profile_stop(vm_context vm, const char *path);
+
+void *vm_image_save(vm_context vm, const void *host, size_t host_size, size_t *size);
+vm_context vm_image_load(const void *data, size_t size, void (*install)(vm_context vm), const void **host, size_t *host_size);
+
+// Writes values in the pack format (see vm_pack.c) to a stream. Everything
+// written with one packer shares its tables, so a string or object is only
+// written out once however often it comes up.
+typedef struct {
+	vm_context vm;
+	DgMemoryStream *stream;
+	vm_map strings; // Strings written so far, to their numbers
+	vm_map objects; // Other heap objects written so far, to their numbers
+	vm_map globals; // Script objects that are globals, to their names
+	uint32_t string_count;
+	uint32_t object_count;
+	uint32_t depth;
+	bool globals_found;
+	uint32_t globals_epoch; // The VM's when the globals were found
+	
+	// If set, objects it answers true for are written as the number it gives
+	// instead, for whoever unpacks them to find again
+	bool (*external)(void *context, object_id object, uint64_t *number);
+	void *context;
+	
+	const char *error; // Why something couldn't be packed, or NULL
+} vm_packer;
+
+typedef struct {
+	vm_context vm;
+	const uint8_t *at;
+	const uint8_t *end;
+	object_id *strings;
+	size_t string_count;
+	size_t string_capacity;
+	object_id *objects;
+	size_t object_count;
+	size_t object_capacity;
+	uint32_t depth;
+	
+	// Finds what an external number stands for, or answers nil to fail
+	object_id (*external)(void *context, uint64_t number);
+	void *context;
+	
+	const char *error; // Why the data couldn't be unpacked, or NULL
+} vm_unpacker;
+
+void vm_packer_init(vm_packer *this, vm_context vm, DgMemoryStream *stream);
+void vm_packer_free(vm_packer *this);
+void vm_packer_reset(vm_packer *this);
+void vm_pack_uint(vm_packer *this, uint64_t value);
+void vm_pack_int(vm_packer *this, int64_t value);
+bool vm_pack_value(vm_packer *this, object_id value);
+bool vm_pack_object(vm_packer *this, object_id object);
+void vm_unpacker_init(vm_unpacker *this, vm_context vm, const void *data, size_t size);
+void vm_unpacker_free(vm_unpacker *this);
+uint64_t vm_unpack_uint(vm_unpacker *this);
+int64_t vm_unpack_int(vm_unpacker *this);
+object_id vm_unpack_value(vm_unpacker *this);
+bool vm_unpack_object(vm_unpacker *this, object_id object);
+object_id vm_pack_bytes(vm_context vm, DgMemoryStream *stream);
+
+// Hashes values by what they hold rather than by ID, so that the same state
+// hashes the same in two VMs however their objects were numbered
+typedef struct {
+	vm_context vm;
+	uint32_t depth;
+	bool deep; // Something was hashed that can change without a field being set
+	
+	// If set, objects it answers true for hash as the number it gives
+	bool (*external)(void *context, object_id object, uint64_t *number);
+	void *context;
+} vm_hasher;
+
+uint64_t vm_hash_value(vm_hasher *this, object_id value);
+uint64_t vm_hash_object(vm_hasher *this, object_id object);
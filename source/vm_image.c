@@ -0,0 +1,606 @@
+/**
+ * Images of the whole VM heap
+ *
+ * An image holds every object in the object table along with the globals,
+ * the interned strings, the prototypes and the selector numbers, so that a
+ * VM can be made again exactly as it was without running any scripts.
+ *
+ * Objects keep their IDs, so references between them need no fixing up.
+ * The only pointers in the heap are the ones a method has into its own
+ * allocation, which are set again when it's loaded, and the functions of
+ * natives, which are matched by name against a fresh VM's natives at the
+ * same IDs. Images are only meant to be read by the same build that wrote
+ * them, on the same kind of machine.
+ *
+ * The host can keep its own data in the image, like what it knows about
+ * the objects in the heap.
+ *
+ *     vm_image_header
+ *     globals, strings and selector numbers (vm_image_map or ID arrays)
+ *     vm_image_object for each slot of the object table, then its data
+ *     the host's data
+ *
+ * Everything is padded to 8 bytes.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "common.h"
+#include "vm.h"
+
+#define VM_IMAGE_MAGIC 0x474d494e // "NIMG"
+
+// Bump whenever the layout of any object or the bytecode changes
+#define VM_IMAGE_VERSION 2
+
+// Type of the records for free slots, since nil is the type of the root
+#define VM_IMAGE_FREE OID_TYPE(0)
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t opcode_count;
+	uint64_t object_count; // Slots in the object table, including slot zero
+	uint64_t string_capacity;
+	uint64_t string_count;
+	object_id protos[OCLS_COUNT];
+	object_id root;
+	uint32_t epoch;
+	uint32_t selector_count;
+	uint64_t host_size;
+} vm_image_header;
+
+typedef struct {
+	uint32_t count;
+	uint32_t used;
+	uint32_t capacity;
+	uint32_t reserved;
+} vm_image_map;
+
+typedef struct {
+	object_id type;
+	uint64_t refs;
+	uint64_t size;  // Bytes of data that follow, not counting padding
+} vm_image_object;
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	bool failed;
+} vm_image_writer;
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+} vm_image_reader;
+
+static void vm_image_write(vm_image_writer *this, const void *data, size_t size) {
+	if (this->failed || !size) {
+		return;
+	}
+	
+	if (this->size + size > this->capacity) {
+		size_t new_capacity = this->capacity ? this->capacity : 4096;
+		
+		while (new_capacity < this->size + size) {
+			new_capacity *= 2;
+		}
+		
+		uint8_t *new_data = DgMemoryReallocate(this->data, new_capacity);
+		
+		if (!new_data) {
+			this->failed = true;
+			return;
+		}
+		
+		this->data = new_data;
+		this->capacity = new_capacity;
+	}
+	
+	memcpy(this->data + this->size, data, size);
+	this->size += size;
+}
+
+static void vm_image_pad(vm_image_writer *this) {
+	static const uint8_t zeros[8];
+	
+	vm_image_write(this, zeros, -this->size & 7);
+}
+
+static const void *vm_image_read(vm_image_reader *this, size_t size) {
+	/**
+	 * Take the next `size` bytes of the image, or NULL if there aren't
+	 * enough left
+	 */
+	
+	size_t padded = (size + 7) & ~(size_t) 7;
+	
+	if (padded < size || padded > this->size - this->offset) {
+		return NULL;
+	}
+	
+	const void *data = this->data + this->offset;
+	this->offset += padded;
+	
+	return data;
+}
+
+static size_t vm_image_map_size(const vm_map *map) {
+	return sizeof(vm_image_map) + sizeof(object_id) * 2 * map->capacity;
+}
+
+static void vm_image_write_map(vm_image_writer *this, const vm_map *map) {
+	vm_image_map record = {map->count, map->used, map->capacity, 0};
+	
+	vm_image_write(this, &record, sizeof record);
+	vm_image_write(this, map->pairs, sizeof(object_id) * 2 * map->capacity);
+}
+
+static bool vm_image_read_map(vm_image_reader *this, vm_map *map) {
+	/**
+	 * Read a map written by vm_image_write_map(). The pairs are hashed by ID,
+	 * so they can be copied as they are.
+	 */
+	
+	const vm_image_map *record = vm_image_read(this, sizeof *record);
+	
+	vm_map_init(map);
+	
+	if (!record || (record->capacity & (record->capacity - 1)) || record->used > record->capacity || record->count > record->used) {
+		return false;
+	}
+	
+	if (!record->capacity) {
+		return true;
+	}
+	
+	const object_id *pairs = vm_image_read(this, sizeof(object_id) * 2 * record->capacity);
+	map->pairs = pairs ? DgMemoryAllocate(sizeof(object_id) * 2 * record->capacity) : NULL;
+	
+	if (!map->pairs) {
+		return false;
+	}
+	
+	memcpy(map->pairs, pairs, sizeof(object_id) * 2 * record->capacity);
+	map->count = record->count;
+	map->used = record->used;
+	map->capacity = record->capacity;
+	
+	return true;
+}
+
+static size_t vm_image_base_size(object_id type) {
+	/**
+	 * Get the size of the structure of an object that is stored as it is, or
+	 * 0 for one that needs more than a copy
+	 */
+	
+	switch (type) {
+		case OID_LONG_STRING: return sizeof(objt_string);
+		case OID_ARRAY: return sizeof(objt_array);
+		case OID_PACKED_ARRAY: return sizeof(objt_packed);
+		case OID_METHOD: return sizeof(objt_method);
+		case OID_BLOCK: return sizeof(objt_block);
+		case OID_TYPE(OCLS_CLASS): return sizeof(objt_class);
+		default: return 0;
+	}
+}
+
+static size_t vm_image_object_size(object_hd *header) {
+	/**
+	 * Get the size of the whole allocation of an object that is stored as it
+	 * is
+	 */
+	
+	switch (header->type) {
+		case OID_LONG_STRING: {
+			return sizeof(objt_string) + ((objt_string *) header)->length + 1;
+		}
+		
+		case OID_ARRAY: {
+			return sizeof(objt_array) + sizeof(object_id) * ((objt_array *) header)->capacity;
+		}
+		
+		case OID_PACKED_ARRAY: {
+			objt_packed *packed = (objt_packed *) header;
+			return sizeof(objt_packed) + packed->stride * packed->capacity;
+		}
+		
+		case OID_METHOD: {
+			objt_method *method = (objt_method *) header;
+			return sizeof(objt_method) + sizeof(vm_icache) * method->cache_count + sizeof(object_id) * method->literal_count + method->code_size;
+		}
+		
+		default: {
+			return vm_image_base_size(header->type);
+		}
+	}
+}
+
+void *vm_image_save(vm_context vm, const void *host, size_t host_size, size_t *size) {
+	/**
+	 * Write the whole heap of a VM to an image. Garbage is collected first,
+	 * so this can't be called while a script is running or while any send is
+	 * suspended. References the host holds stay counted in the image.
+	 *
+	 * @param vm VM to save
+	 * @param host Data the host keeps with the image, or NULL
+	 * @param host_size Size of the host's data
+	 * @param size Set to the size of the returned data
+	 * @return Image to write, to be freed with DgMemoryFree, or NULL on error
+	 */
+	
+	if (vm->task.frame_count || vm->suspended_count) {
+		return NULL;
+	}
+	
+	vm_collect(vm);
+	
+	vm_image_writer writer;
+	vm_image_writer *this = &writer;
+	
+	memset(this, 0, sizeof *this);
+	
+	vm_image_header header;
+	memset(&header, 0, sizeof header);
+	header.magic = VM_IMAGE_MAGIC;
+	header.version = VM_IMAGE_VERSION;
+	header.opcode_count = VM_OP_COUNT;
+	header.object_count = vm->table.count;
+	header.string_capacity = vm->string_capacity;
+	header.string_count = vm->string_count;
+	memcpy(header.protos, vm->protos, sizeof header.protos);
+	header.root = vm->root;
+	header.epoch = vm->epoch;
+	header.selector_count = vm->selector_count;
+	header.host_size = host_size;
+	
+	vm_image_write(this, &header, sizeof header);
+	vm_image_write_map(this, &vm->globals);
+	vm_image_write_map(this, &vm->selector_numbers);
+	vm_image_write(this, vm->strings, sizeof *vm->strings * vm->string_capacity);
+	
+	for (size_t i = 1; i < vm->table.count; i++) {
+		object_hd *object = vm->table.objects[i];
+		vm_image_object record = {VM_IMAGE_FREE, 0, 0};
+		
+		if (!object) {
+			vm_image_write(this, &record, sizeof record);
+			continue;
+		}
+		
+		record.type = object->type;
+		record.refs = object->refs;
+		
+		if (GET_OBJID_CLS(object->type) == OCLS_ID) {
+			objt_object *script = (objt_object *) object;
+			record.size = vm_image_map_size(&script->fields) + vm_image_map_size(&script->methods);
+			vm_image_write(this, &record, sizeof record);
+			vm_image_write_map(this, &script->fields);
+			vm_image_write_map(this, &script->methods);
+		}
+		else if (object->type == OID_DICT) {
+			objt_dict *dict = (objt_dict *) object;
+			record.size = vm_image_map_size(&dict->map);
+			vm_image_write(this, &record, sizeof record);
+			vm_image_write_map(this, &dict->map);
+		}
+		else if (object->type == OID_NATIVE) {
+			// Only the name is kept, to find the function again
+			objt_native *native = (objt_native *) object;
+			uint8_t folds = native->folds;
+			record.size = strlen(native->name) + 2;
+			vm_image_write(this, &record, sizeof record);
+			vm_image_write(this, &folds, 1);
+			vm_image_write(this, native->name, record.size - 1);
+			vm_image_pad(this);
+		}
+		else {
+			record.size = vm_image_object_size(object) - sizeof *object;
+			vm_image_write(this, &record, sizeof record);
+			
+			size_t start = this->size;
+			vm_image_write(this, object + 1, record.size);
+			vm_image_pad(this);
+			
+			if (this->failed) {
+				break;
+			}
+			
+			// Where the object would start, so offsets into it can be used
+			uint8_t *copy = this->data + start - sizeof *object;
+			
+			// Quickened code depends on the natives being the same as now
+			if (object->type == OID_METHOD) {
+				objt_method *method = (objt_method *) object;
+				vm_unquicken(copy + (method->code - (const uint8_t *) object), method->code_size);
+			}
+			else if (object->type == OID_PACKED_ARRAY) {
+				memset(copy + offsetof(objt_packed, pins), 0, sizeof(uint32_t));
+			}
+		}
+	}
+	
+	vm_image_write(this, host, host_size);
+	vm_image_pad(this);
+	
+	if (this->failed) {
+		DgMemoryFree(this->data);
+		return NULL;
+	}
+	
+	*size = this->size;
+	
+	return this->data;
+}
+
+static bool vm_image_load_object(vm_context vm, vm_image_reader *this, size_t index, objt_native **natives) {
+	/**
+	 * Make the object in one slot of the object table from its record
+	 */
+	
+	const vm_image_object *record = vm_image_read(this, sizeof *record);
+	
+	if (!record) {
+		return false;
+	}
+	
+	if (record->type == VM_IMAGE_FREE) {
+		return record->size == 0;
+	}
+	
+	const uint8_t *data = vm_image_read(this, record->size);
+	
+	if (!data) {
+		return false;
+	}
+	
+	vm_image_reader part = {data, record->size, 0};
+	object_hd *header;
+	
+	if (GET_OBJID_CLS(record->type) == OCLS_ID) {
+		objt_object *script = DgMemoryAllocate(sizeof *script);
+		
+		if (!script) {
+			return false;
+		}
+		
+		memset(script, 0, sizeof *script);
+		vm->table.objects[index] = &script->header;
+		
+		if (!vm_image_read_map(&part, &script->fields) || !vm_image_read_map(&part, &script->methods) || part.offset != part.size) {
+			return false;
+		}
+		
+		header = &script->header;
+	}
+	else if (record->type == OID_DICT) {
+		objt_dict *dict = DgMemoryAllocate(sizeof *dict);
+		
+		if (!dict) {
+			return false;
+		}
+		
+		memset(dict, 0, sizeof *dict);
+		vm->table.objects[index] = &dict->header;
+		
+		if (!vm_image_read_map(&part, &dict->map) || part.offset != part.size) {
+			return false;
+		}
+		
+		header = &dict->header;
+	}
+	else if (record->type == OID_NATIVE) {
+		// The fresh VM must have made the same native in the same slot
+		objt_native *native = natives[index];
+		
+		if (!native || record->size < 2 || data[record->size - 1] != '\0' || strcmp(native->name, (const char *) data + 1)) {
+			DgLog(DG_LOG_ERROR, "Image has a native (%.*s) that this build doesn't", (int) (record->size >= 2 ? record->size - 2 : 0), data + 1);
+			return false;
+		}
+		
+		natives[index] = NULL;
+		native->folds = data[0];
+		vm->table.objects[index] = &native->header;
+		header = &native->header;
+	}
+	else {
+		size_t base = vm_image_base_size(record->type);
+		
+		if (!base || sizeof *header + record->size < base) {
+			return false;
+		}
+		
+		header = DgMemoryAllocate(sizeof *header + record->size);
+		
+		if (!header) {
+			return false;
+		}
+		
+		memcpy(header + 1, data, record->size);
+		header->type = record->type;
+		vm->table.objects[index] = header;
+		
+		// The sizes in the object itself must agree with the record
+		if (vm_image_object_size(header) != sizeof *header + record->size) {
+			DgMemoryFree(header);
+			vm->table.objects[index] = NULL;
+			return false;
+		}
+		
+		if (header->type == OID_METHOD) {
+			objt_method *method = (objt_method *) header;
+			method->caches = (vm_icache *) (method + 1);
+			method->literals = (object_id *) (method->caches + method->cache_count);
+			method->code = (const uint8_t *) (method->literals + method->literal_count);
+		}
+	}
+	
+	header->type = record->type;
+	header->refs = record->refs;
+	
+	return true;
+}
+
+vm_context vm_image_load(const void *data, size_t size, void (*install)(vm_context vm), const void **host, size_t *host_size) {
+	/**
+	 * Make a VM from an image written by vm_image_save(). Natives are matched
+	 * against the ones a fresh VM has, so `install` has to define the host's
+	 * natives just like they were defined for the VM that was saved.
+	 *
+	 * @param data Image data
+	 * @param size Size of the image
+	 * @param install Defines the host's natives on a fresh VM, or NULL
+	 * @param host Set to the host's data, which points into `data`
+	 * @param host_size Set to the size of the host's data
+	 * @return The new VM, or NULL if the image isn't valid for this build
+	 */
+	
+	vm_image_reader reader = {data, size, 0};
+	vm_image_reader *this = &reader;
+	const vm_image_header *header = vm_image_read(this, sizeof *header);
+	
+	if (!header || header->magic != VM_IMAGE_MAGIC || header->version != VM_IMAGE_VERSION || header->opcode_count != VM_OP_COUNT) {
+		return NULL;
+	}
+	
+	if (header->object_count < 1 || header->object_count > UINT32_MAX || (header->string_capacity & (header->string_capacity - 1)) || header->string_count > header->string_capacity) {
+		return NULL;
+	}
+	
+	vm_context vm = vm_create();
+	
+	if (!vm) {
+		return NULL;
+	}
+	
+	if (install) {
+		install(vm);
+	}
+	
+	// Keep the fresh natives to take their functions, and throw out the rest
+	// of the fresh heap
+	size_t fresh_count = vm->table.count;
+	size_t capacity = (header->object_count > fresh_count) ? header->object_count : fresh_count;
+	objt_native **natives = DgMemoryAllocate(sizeof *natives * header->object_count);
+	object_hd **objects = DgMemoryReallocate(vm->table.objects, sizeof *objects * capacity);
+	
+	if (!natives || !objects) {
+		DgMemoryFree(natives);
+		vm_destroy(vm);
+		return NULL;
+	}
+	
+	memset(natives, 0, sizeof *natives * header->object_count);
+	vm->table.objects = objects;
+	vm->table.capacity = capacity;
+	
+	for (size_t i = 1; i < fresh_count; i++) {
+		object_hd *object = vm->table.objects[i];
+		vm->table.objects[i] = NULL;
+		
+		if (object && object->type == OID_NATIVE && i < header->object_count) {
+			natives[i] = (objt_native *) object;
+			continue;
+		}
+		
+		if (object && GET_OBJID_CLS(object->type) == OCLS_ID) {
+			DgMemoryFree(((objt_object *) object)->fields.pairs);
+			DgMemoryFree(((objt_object *) object)->methods.pairs);
+		}
+		else if (object && object->type == OID_DICT) {
+			DgMemoryFree(((objt_dict *) object)->map.pairs);
+		}
+		
+		DgMemoryFree(object);
+	}
+	
+	memset(vm->table.objects, 0, sizeof *objects * capacity);
+	vm->table.count = header->object_count;
+	vm->table.free_count = 0;
+	vm->table.zct_count = 0;
+	
+	DgMemoryFree(vm->globals.pairs);
+	DgMemoryFree(vm->selector_numbers.pairs);
+	DgMemoryFree(vm->strings);
+	vm->strings = NULL;
+	vm->string_count = 0;
+	vm->string_capacity = 0;
+	
+	bool ok = vm_image_read_map(this, &vm->globals) && vm_image_read_map(this, &vm->selector_numbers);
+	
+	const object_id *strings = ok ? vm_image_read(this, sizeof *strings * header->string_capacity) : NULL;
+	vm->strings = (strings && header->string_capacity) ? DgMemoryAllocate(sizeof *strings * header->string_capacity) : NULL;
+	ok = strings && (vm->strings || !header->string_capacity);
+	
+	if (ok && vm->strings) {
+		memcpy(vm->strings, strings, sizeof *strings * header->string_capacity);
+		vm->string_count = header->string_count;
+		vm->string_capacity = header->string_capacity;
+	}
+	
+	for (size_t i = 1; ok && i < header->object_count; i++) {
+		ok = vm_image_load_object(vm, this, i, natives);
+		
+		// Free slots are used again before the table grows
+		if (ok && !vm->table.objects[i]) {
+			if (vm->table.free_count >= vm->table.free_capacity) {
+				size_t new_capacity = vm->table.free_capacity ? (2 * vm->table.free_capacity) : 64;
+				uint32_t *new_free = DgMemoryReallocate(vm->table.free, sizeof *new_free * new_capacity);
+				ok = new_free != NULL;
+				vm->table.free = new_free ? new_free : vm->table.free;
+				vm->table.free_capacity = new_free ? new_capacity : vm->table.free_capacity;
+			}
+			
+			if (ok) {
+				vm->table.free[vm->table.free_count++] = i;
+			}
+		}
+	}
+	
+	// Natives the image doesn't have were replaced before it was saved
+	for (size_t i = 1; i < header->object_count; i++) {
+		DgMemoryFree(natives[i]);
+	}
+	
+	DgMemoryFree(natives);
+	
+	*host = ok ? vm_image_read(this, header->host_size) : NULL;
+	*host_size = header->host_size;
+	
+	if (!ok || !*host || this->offset != this->size) {
+		DgLog(DG_LOG_ERROR, "Image is damaged or from another build");
+		vm_destroy(vm);
+		return NULL;
+	}
+	
+	memcpy(vm->protos, header->protos, sizeof vm->protos);
+	vm->root = header->root;
+	vm->selector_count = header->selector_count;
+	
+	// Every cache and dispatch row from before is stale
+	vm->epoch = header->epoch + 1;
+	vm->dispatch_free = 0;
+	vm->dispatch_key_count = 0;
+	
+	if (vm->dispatch) {
+		memset(vm->dispatch, 0, sizeof *vm->dispatch * vm->dispatch_capacity);
+	}
+	
+	for (size_t i = 1; i < vm->table.count; i++) {
+		object_hd *object = vm->table.objects[i];
+		
+		if (object && GET_OBJID_CLS(object->type) == OCLS_ID) {
+			((objt_object *) object)->row_size = 0;
+		}
+	}
+	
+	if (!vm->epoch) {
+		vm->epoch = 1;
+	}
+	
+	return vm;
+}
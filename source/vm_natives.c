@@ -0,0 +1,820 @@
+/**
+ * Built in prototypes and their native methods
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+#define VM_NATIVE(name) static object_id name(vm_context vm, object_id object, object_id selector, size_t args, object_id *ids)
+#define VM_BOOL(x) ((x) ? OID_TRUE : OID_FALSE)
+
+static object_id vm_native_error(vm_context vm, const char *message) {
+	vm_error(vm, "%s", message);
+	return OID_NIL;
+}
+
+// Object
+
+VM_NATIVE(vm_object_sub) {
+	return vm_object_new(vm, object);
+}
+
+VM_NATIVE(vm_object_method) {
+	/**
+	 * Install a block written with a method header as a method on the
+	 * receiver, for example `Main method: [tick: time | ...]`
+	 */
+	
+	object_id method;
+	
+	if (!vm_block_parts(vm, ids[0], &method, NULL, NULL)) {
+		return vm_native_error(vm, "method: expects a block");
+	}
+	
+	objt_method *compiled = (objt_method *) vm_lookup(vm, method);
+	
+	if (compiled->selector == OID_NIL) {
+		return vm_native_error(vm, "method: expects a block with a method header, like [name | ...]");
+	}
+	
+	if (!vm_define_method(vm, object, compiled->selector, method)) {
+		return vm_native_error(vm, "method: can only add methods to script objects");
+	}
+	
+	return object;
+}
+
+VM_NATIVE(vm_object_identical) {
+	return VM_BOOL(object == ids[0]);
+}
+
+VM_NATIVE(vm_object_not_identical) {
+	return VM_BOOL(object != ids[0]);
+}
+
+VM_NATIVE(vm_object_is_nil) {
+	return VM_BOOL(object == OID_NIL);
+}
+
+VM_NATIVE(vm_object_not_nil) {
+	return VM_BOOL(object != OID_NIL);
+}
+
+VM_NATIVE(vm_object_yourself) {
+	return object;
+}
+
+VM_NATIVE(vm_object_responds_to) {
+	return VM_BOOL(vm_responds_to(vm, object, ids[0]));
+}
+
+VM_NATIVE(vm_object_proto) {
+	object_hd *header = vm_lookup(vm, object);
+	
+	if (!header || GET_OBJID_CLS(header->type) != OCLS_ID) {
+		return OID_NIL;
+	}
+	
+	return header->type;
+}
+
+VM_NATIVE(vm_object_print_string) {
+	char buffer[256];
+	vm_describe(vm, object, buffer, sizeof buffer);
+	return vm_tolstring(vm, buffer, strlen(buffer));
+}
+
+VM_NATIVE(vm_object_log) {
+	char buffer[256];
+	vm_describe(vm, object, buffer, sizeof buffer);
+	DgLog(DG_LOG_INFO, "%s", buffer);
+	return object;
+}
+
+// Numbers
+
+VM_NATIVE(vm_number_binary) {
+	/**
+	 * Arithmetic and comparisons, which the compiler folds the same way
+	 */
+	
+	object_id result;
+	
+	if (!vm_fold_binary(vm, object, selector, ids[0], &result)) {
+		char aux[8];
+		char message[64];
+		snprintf(message, sizeof message, "Invalid operands for #%s", vm_tocstring(vm, selector, aux));
+		return vm_native_error(vm, message);
+	}
+	
+	return result;
+}
+
+static void vm_native_folds(vm_context vm, object_id native) {
+	/**
+	 * Let sends that find this native be quickened
+	 */
+	
+	objt_native *header = (objt_native *) vm_lookup(vm, native);
+	
+	if (header) {
+		header->folds = true;
+	}
+}
+
+VM_NATIVE(vm_number_equal) {
+	object_id result;
+	
+	if (vm_fold_binary(vm, object, selector, ids[0], &result)) {
+		return result;
+	}
+	
+	return VM_BOOL(selector == MAKE_SSTR1('=') ? (object == ids[0]) : (object != ids[0]));
+}
+
+static bool vm_native_number(vm_context vm, object_id object, object_id selector, bool integer) {
+	/**
+	 * Check that a native of the number prototypes was sent to a number, and
+	 * not to one of the prototypes themselves
+	 */
+	
+	if (GET_OBJID_CLS(object) == OCLS_SINT || (GET_OBJID_CLS(object) == OCLS_FLOAT && !integer)) {
+		return true;
+	}
+	
+	char aux[8];
+	char message[64];
+	snprintf(message, sizeof message, "#%s can only be sent to %s", vm_tocstring(vm, selector, aux), integer ? "integers" : "numbers");
+	vm_native_error(vm, message);
+	
+	return false;
+}
+
+static double vm_as_double(object_id object) {
+	return (GET_OBJID_CLS(object) == OCLS_SINT) ? (double) OBJID_SEXT(object) : OBJ_ID2DOUBLE(object);
+}
+
+VM_NATIVE(vm_number_negated) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(object) == OCLS_SINT) {
+		return MAKE_OBJID(OCLS_SINT, -OBJID_SEXT(object));
+	}
+	
+	return OBJ_DOUBLE2ID(-OBJ_ID2DOUBLE(object));
+}
+
+VM_NATIVE(vm_number_abs) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(object) == OCLS_SINT) {
+		int64_t value = OBJID_SEXT(object);
+		return MAKE_OBJID(OCLS_SINT, value < 0 ? -value : value);
+	}
+	
+	return OBJ_DOUBLE2ID(fabs(OBJ_ID2DOUBLE(object)));
+}
+
+VM_NATIVE(vm_number_as_float) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	return OBJ_DOUBLE2ID(vm_as_double(object));
+}
+
+VM_NATIVE(vm_number_as_integer) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(object) == OCLS_SINT) {
+		return object;
+	}
+	
+	return MAKE_OBJID(OCLS_SINT, (int64_t) OBJ_ID2DOUBLE(object));
+}
+
+VM_NATIVE(vm_number_max) {
+	object_id greater;
+	
+	if (!vm_fold_binary(vm, object, MAKE_SSTR1('>'), ids[0], &greater)) {
+		return vm_native_error(vm, "max: expects a number");
+	}
+	
+	return (greater == OID_TRUE) ? object : ids[0];
+}
+
+VM_NATIVE(vm_number_min) {
+	object_id less;
+	
+	if (!vm_fold_binary(vm, object, MAKE_SSTR1('<'), ids[0], &less)) {
+		return vm_native_error(vm, "min: expects a number");
+	}
+	
+	return (less == OID_TRUE) ? object : ids[0];
+}
+
+VM_NATIVE(vm_number_sqrt) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	return OBJ_DOUBLE2ID(sqrt(vm_as_double(object)));
+}
+
+VM_NATIVE(vm_number_sin) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	return OBJ_DOUBLE2ID(sin(vm_as_double(object)));
+}
+
+VM_NATIVE(vm_number_cos) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	return OBJ_DOUBLE2ID(cos(vm_as_double(object)));
+}
+
+VM_NATIVE(vm_number_floor) {
+	if (!vm_native_number(vm, object, selector, false)) {
+		return OID_NIL;
+	}
+	
+	return MAKE_OBJID(OCLS_SINT, (int64_t) floor(vm_as_double(object)));
+}
+
+VM_NATIVE(vm_integer_to_do) {
+	if (!vm_native_number(vm, object, selector, true)) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(ids[0]) != OCLS_SINT) {
+		return vm_native_error(vm, "to:do: expects an integer limit");
+	}
+	
+	int64_t end = OBJID_SEXT(ids[0]);
+	
+	for (int64_t i = OBJID_SEXT(object); i <= end && !vm->failed; i++) {
+		object_id index = MAKE_OBJID(OCLS_SINT, i);
+		vm_block_call(vm, ids[1], 1, &index);
+	}
+	
+	return object;
+}
+
+VM_NATIVE(vm_integer_times_repeat) {
+	if (!vm_native_number(vm, object, selector, true)) {
+		return OID_NIL;
+	}
+	
+	for (int64_t i = OBJID_SEXT(object); i > 0 && !vm->failed; i--) {
+		vm_block_call(vm, ids[0], 0, NULL);
+	}
+	
+	return object;
+}
+
+// Booleans
+
+VM_NATIVE(vm_bool_not) {
+	return VM_BOOL(object != OID_TRUE);
+}
+
+VM_NATIVE(vm_bool_and) {
+	return VM_BOOL(object == OID_TRUE && !IS_OBJ_FALSEY(ids[0]));
+}
+
+VM_NATIVE(vm_bool_or) {
+	return VM_BOOL(object == OID_TRUE || !IS_OBJ_FALSEY(ids[0]));
+}
+
+VM_NATIVE(vm_bool_and_block) {
+	return (object == OID_TRUE) ? vm_block_call(vm, ids[0], 0, NULL) : OID_FALSE;
+}
+
+VM_NATIVE(vm_bool_or_block) {
+	return (object == OID_TRUE) ? OID_TRUE : vm_block_call(vm, ids[0], 0, NULL);
+}
+
+VM_NATIVE(vm_bool_if_true) {
+	return (object == OID_TRUE) ? vm_block_call(vm, ids[0], 0, NULL) : OID_NIL;
+}
+
+VM_NATIVE(vm_bool_if_false) {
+	return (object != OID_TRUE) ? vm_block_call(vm, ids[0], 0, NULL) : OID_NIL;
+}
+
+VM_NATIVE(vm_bool_if_true_if_false) {
+	return vm_block_call(vm, ids[(object == OID_TRUE) ? 0 : 1], 0, NULL);
+}
+
+VM_NATIVE(vm_bool_if_false_if_true) {
+	return vm_block_call(vm, ids[(object == OID_TRUE) ? 1 : 0], 0, NULL);
+}
+
+// Strings
+
+VM_NATIVE(vm_string_size) {
+	char aux[8];
+	size_t size;
+	
+	if (!vm_tolcstring(vm, object, aux, &size)) {
+		return vm_native_error(vm, "#size can only be sent to strings");
+	}
+	
+	return MAKE_OBJID(OCLS_SINT, size);
+}
+
+VM_NATIVE(vm_string_print_string) {
+	return object;
+}
+
+// Blocks
+
+VM_NATIVE(vm_block_value) {
+	return vm_block_call(vm, object, args, ids);
+}
+
+VM_NATIVE(vm_block_num_args) {
+	object_id block;
+	
+	if (!vm_block_parts(vm, object, &block, NULL, NULL)) {
+		return vm_native_error(vm, "#numArgs can only be sent to blocks");
+	}
+	
+	objt_method *method = (objt_method *) vm_lookup(vm, block);
+	return MAKE_OBJID(OCLS_SINT, method->arg_count);
+}
+
+VM_NATIVE(vm_block_while_true) {
+	while (!IS_OBJ_FALSEY(vm_block_call(vm, object, 0, NULL)) && !vm->failed) {
+		vm_block_call(vm, ids[0], 0, NULL);
+	}
+	
+	return OID_NIL;
+}
+
+VM_NATIVE(vm_block_while_false) {
+	while (IS_OBJ_FALSEY(vm_block_call(vm, object, 0, NULL)) && !vm->failed) {
+		vm_block_call(vm, ids[0], 0, NULL);
+	}
+	
+	return OID_NIL;
+}
+
+// Arrays
+
+VM_NATIVE(vm_array_new_native) {
+	size_t capacity = (args && GET_OBJID_CLS(ids[0]) == OCLS_SINT) ? OBJID_SEXT(ids[0]) : 0;
+	return vm_array_new(vm, capacity);
+}
+
+static objt_array *vm_native_array(vm_context vm, object_id object) {
+	objt_array *array = (objt_array *) vm_lookup(vm, object);
+	return (array && array->header.type == OID_ARRAY) ? array : NULL;
+}
+
+static bool vm_native_index(vm_context vm, object_id index, size_t length, size_t *out) {
+	/**
+	 * Convert a one based index from script code to a zero based one
+	 */
+	
+	if (GET_OBJID_CLS(index) != OCLS_SINT || OBJID_SEXT(index) < 1 || (size_t) OBJID_SEXT(index) > length) {
+		vm_native_error(vm, "Index out of range");
+		return false;
+	}
+	
+	*out = OBJID_SEXT(index) - 1;
+	
+	return true;
+}
+
+VM_NATIVE(vm_array_at) {
+	objt_array *array = vm_native_array(vm, object);
+	size_t i;
+	
+	if (!array) {
+		return vm_native_error(vm, "at: sent to something that isn't an array");
+	}
+	
+	if (!vm_native_index(vm, ids[0], array->length, &i)) {
+		return OID_NIL;
+	}
+	
+	return array->data[i];
+}
+
+VM_NATIVE(vm_array_at_put) {
+	objt_array *array = vm_native_array(vm, object);
+	size_t i;
+	
+	if (!array) {
+		return vm_native_error(vm, "at:put: sent to something that isn't an array");
+	}
+	
+	if (!vm_native_index(vm, ids[0], array->length, &i)) {
+		return OID_NIL;
+	}
+	
+	object_id value = vm_accquire(vm, ids[1]);
+	vm_release(vm, array->data[i]);
+	array->data[i] = value;
+	
+	return value;
+}
+
+VM_NATIVE(vm_array_add) {
+	if (!vm_array_push(vm, object, ids[0])) {
+		return vm_native_error(vm, "add: failed");
+	}
+	
+	return ids[0];
+}
+
+VM_NATIVE(vm_array_size) {
+	objt_array *array = vm_native_array(vm, object);
+	return MAKE_OBJID(OCLS_SINT, array ? array->length : 0);
+}
+
+VM_NATIVE(vm_array_do) {
+	objt_array *array = vm_native_array(vm, object);
+	
+	// The array can change while iterating, so look it up every time
+	for (size_t i = 0; array && i < array->length && !vm->failed; i++) {
+		object_id element = array->data[i];
+		vm_block_call(vm, ids[0], 1, &element);
+		array = vm_native_array(vm, object);
+	}
+	
+	return object;
+}
+
+// Dictionaries
+
+VM_NATIVE(vm_dict_new) {
+	object_id dict = vm_alloc(vm, OID_DICT, sizeof(objt_dict));
+	objt_dict *header = (objt_dict *) vm_lookup(vm, dict);
+	
+	if (!header) {
+		return OID_NIL;
+	}
+	
+	vm_map_init(&header->map);
+	
+	return dict;
+}
+
+static objt_dict *vm_native_dict(vm_context vm, object_id object) {
+	objt_dict *dict = (objt_dict *) vm_lookup(vm, object);
+	
+	if (!dict || dict->header.type != OID_DICT) {
+		vm_native_error(vm, "Not a dictionary");
+		return NULL;
+	}
+	
+	return dict;
+}
+
+VM_NATIVE(vm_dict_at) {
+	objt_dict *dict = vm_native_dict(vm, object);
+	object_id *value = dict ? vm_map_find(&dict->map, ids[0]) : NULL;
+	return value ? *value : OID_NIL;
+}
+
+VM_NATIVE(vm_dict_at_put) {
+	objt_dict *dict = vm_native_dict(vm, object);
+	
+	if (!dict || !vm_map_put(vm, &dict->map, ids[0], ids[1])) {
+		return vm_native_error(vm, "at:put: failed");
+	}
+	
+	return ids[1];
+}
+
+VM_NATIVE(vm_dict_remove_key) {
+	objt_dict *dict = vm_native_dict(vm, object);
+	
+	if (dict) {
+		vm_map_remove(vm, &dict->map, ids[0]);
+	}
+	
+	return object;
+}
+
+VM_NATIVE(vm_dict_includes_key) {
+	objt_dict *dict = vm_native_dict(vm, object);
+	return VM_BOOL(dict && vm_map_find(&dict->map, ids[0]));
+}
+
+VM_NATIVE(vm_dict_size) {
+	objt_dict *dict = vm_native_dict(vm, object);
+	return MAKE_OBJID(OCLS_SINT, dict ? dict->map.count : 0);
+}
+
+// Packed arrays
+
+VM_NATIVE(vm_packed_new_native) {
+	if (GET_OBJID_CLS(ids[0]) != OCLS_SINT || GET_OBJID_CLS(ids[1]) != OCLS_SINT) {
+		return vm_native_error(vm, "newWithStride:length: expects integers");
+	}
+	
+	if (OBJID_SEXT(ids[0]) <= 0 || OBJID_SEXT(ids[1]) < 0) {
+		return vm_native_error(vm, "newWithStride:length: expects a positive stride and a length that isn't negative");
+	}
+	
+	return vm_packed_new(vm, OBJID_SEXT(ids[0]), OBJID_SEXT(ids[1]));
+}
+
+VM_NATIVE(vm_packed_size) {
+	size_t length = 0;
+	vm_packed_data(vm, object, NULL, &length);
+	return MAKE_OBJID(OCLS_SINT, length);
+}
+
+static uint8_t *vm_native_packed_at(vm_context vm, object_id object, object_id selector, object_id index, size_t size, bool write) {
+	/**
+	 * Find where a value of `size` bytes is in the data of a packed array,
+	 * by a one based index counted in values of that size, so the data can
+	 * be read as bytes or floats whatever its stride. A pinned array can be
+	 * read by native code at any time, so it can't be written.
+	 */
+	
+	objt_packed *packed = (objt_packed *) vm_lookup(vm, object);
+	size_t i;
+	
+	if (!packed || packed->header.type != OID_PACKED_ARRAY) {
+		char aux[8];
+		char message[64];
+		snprintf(message, sizeof message, "#%s can only be sent to PackedArrays", vm_tocstring(vm, selector, aux));
+		vm_native_error(vm, message);
+		return NULL;
+	}
+	
+	if (write && packed->pins) {
+		vm_native_error(vm, "A PackedArray can't be changed while it's pinned");
+		return NULL;
+	}
+	
+	if (!vm_native_index(vm, index, packed->stride * packed->length / size, &i)) {
+		return NULL;
+	}
+	
+	return packed->data + i * size;
+}
+
+VM_NATIVE(vm_packed_byte_at) {
+	uint8_t *at = vm_native_packed_at(vm, object, selector, ids[0], 1, false);
+	return at ? MAKE_OBJID(OCLS_SINT, *at) : OID_NIL;
+}
+
+VM_NATIVE(vm_packed_byte_at_put) {
+	uint8_t *at = vm_native_packed_at(vm, object, selector, ids[0], 1, true);
+	
+	if (!at) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(ids[1]) != OCLS_SINT || OBJID_SEXT(ids[1]) < 0 || OBJID_SEXT(ids[1]) > 255) {
+		return vm_native_error(vm, "byteAt:put: expects an integer from 0 to 255");
+	}
+	
+	*at = OBJID_SEXT(ids[1]);
+	
+	return ids[1];
+}
+
+VM_NATIVE(vm_packed_float_at) {
+	uint8_t *at = vm_native_packed_at(vm, object, selector, ids[0], sizeof(float), false);
+	float value;
+	
+	if (!at) {
+		return OID_NIL;
+	}
+	
+	memcpy(&value, at, sizeof value);
+	
+	return OBJ_DOUBLE2ID(value);
+}
+
+VM_NATIVE(vm_packed_float_at_put) {
+	uint8_t *at = vm_native_packed_at(vm, object, selector, ids[0], sizeof(float), true);
+	
+	if (!at) {
+		return OID_NIL;
+	}
+	
+	if (GET_OBJID_CLS(ids[1]) != OCLS_SINT && GET_OBJID_CLS(ids[1]) != OCLS_FLOAT) {
+		return vm_native_error(vm, "floatAt:put: expects a number");
+	}
+	
+	float value = vm_as_double(ids[1]);
+	memcpy(at, &value, sizeof value);
+	
+	return ids[1];
+}
+
+// Packing
+
+VM_NATIVE(vm_object_packed) {
+	/**
+	 * Answer the receiver and everything it refers to in the pack format, as
+	 * a PackedArray of bytes
+	 */
+	
+	DgMemoryStream *stream = DgMemoryStreamCreate();
+	vm_packer packer;
+	
+	if (!stream) {
+		return vm_native_error(vm, "Out of memory");
+	}
+	
+	vm_packer_init(&packer, vm, stream);
+	
+	object_id bytes = vm_pack_value(&packer, object) ? vm_pack_bytes(vm, stream) : OID_NIL;
+	
+	if (packer.error) {
+		vm_error(vm, "%s", packer.error);
+	}
+	
+	vm_packer_free(&packer);
+	DgMemoryStreamFree(stream);
+	
+	return bytes;
+}
+
+VM_NATIVE(vm_packed_unpacked) {
+	/**
+	 * Answer the value packed in an array of bytes, made from new objects
+	 */
+	
+	size_t stride, length;
+	const void *data = vm_packed_data(vm, object, &stride, &length);
+	vm_unpacker unpacker;
+	
+	if (!data || stride != 1) {
+		return vm_native_error(vm, "unpacked expects a PackedArray of bytes");
+	}
+	
+	vm_unpacker_init(&unpacker, vm, data, length);
+	
+	object_id value = vm_unpack_value(&unpacker);
+	
+	if (!unpacker.error && unpacker.at != unpacker.end) {
+		unpacker.error = "Packed data has more after the value";
+	}
+	
+	if (unpacker.error) {
+		vm_error(vm, "%s", unpacker.error);
+		value = OID_NIL;
+	}
+	
+	vm_unpacker_free(&unpacker);
+	
+	return value;
+}
+
+object_id vm_make_proto(vm_context vm, const char *name, object_id parent) {
+	/**
+	 * Create a prototype with a name field and register it as a global
+	 */
+	
+	object_id proto = vm_object_new(vm, parent);
+	object_id name_id = vm_intern(vm, name);
+	
+	vm_set_field(vm, proto, vm_intern(vm, "name"), name_id);
+	vm_set_global(vm, name_id, proto);
+	
+	return proto;
+}
+
+void vm_install_natives(vm_context vm) {
+	/**
+	 * Create the built in prototypes and register them as globals
+	 */
+	
+	object_id root = vm_make_proto(vm, "Object", OID_NIL);
+	vm->root = root;
+	
+	vm_define_native(vm, root, "sub", vm_object_sub);
+	vm_define_native(vm, root, "new", vm_object_sub);
+	vm_define_native(vm, root, "method:", vm_object_method);
+	vm_define_native(vm, root, "==", vm_object_identical);
+	vm_define_native(vm, root, "=", vm_object_identical);
+	vm_define_native(vm, root, "~~", vm_object_not_identical);
+	vm_define_native(vm, root, "~=", vm_object_not_identical);
+	vm_define_native(vm, root, "isNil", vm_object_is_nil);
+	vm_define_native(vm, root, "notNil", vm_object_not_nil);
+	vm_define_native(vm, root, "yourself", vm_object_yourself);
+	vm_define_native(vm, root, "respondsTo:", vm_object_responds_to);
+	vm_define_native(vm, root, "proto", vm_object_proto);
+	vm_define_native(vm, root, "printString", vm_object_print_string);
+	vm_define_native(vm, root, "log", vm_object_log);
+	
+	vm->protos[0] = vm_make_proto(vm, "Nil", root);
+	
+	object_id integer = vm_make_proto(vm, "Integer", root);
+	object_id number = vm_make_proto(vm, "Float", root);
+	vm->protos[OCLS_SINT] = integer;
+	vm->protos[OCLS_FLOAT] = number;
+	
+	static const char *binary[] = {"+", "-", "*", "/", "//", "%", "<", ">", "<=", ">="};
+	
+	object_id numbers[] = {integer, number};
+	
+	for (size_t i = 0; i < 2; i++) {
+		for (size_t j = 0; j < sizeof binary / sizeof *binary; j++) {
+			vm_native_folds(vm, vm_define_native(vm, numbers[i], binary[j], vm_number_binary));
+		}
+		
+		vm_native_folds(vm, vm_define_native(vm, numbers[i], "=", vm_number_equal));
+		vm_native_folds(vm, vm_define_native(vm, numbers[i], "~=", vm_number_equal));
+		vm_define_native(vm, numbers[i], "negated", vm_number_negated);
+		vm_define_native(vm, numbers[i], "abs", vm_number_abs);
+		vm_define_native(vm, numbers[i], "asFloat", vm_number_as_float);
+		vm_define_native(vm, numbers[i], "asInteger", vm_number_as_integer);
+		vm_define_native(vm, numbers[i], "max:", vm_number_max);
+		vm_define_native(vm, numbers[i], "min:", vm_number_min);
+		vm_define_native(vm, numbers[i], "sqrt", vm_number_sqrt);
+		vm_define_native(vm, numbers[i], "sin", vm_number_sin);
+		vm_define_native(vm, numbers[i], "cos", vm_number_cos);
+		vm_define_native(vm, numbers[i], "floor", vm_number_floor);
+	}
+	
+	vm_define_native(vm, integer, "to:do:", vm_integer_to_do);
+	vm_define_native(vm, integer, "timesRepeat:", vm_integer_times_repeat);
+	
+	object_id boolean = vm_make_proto(vm, "Boolean", root);
+	vm->protos[OCLS_BOOL] = boolean;
+	vm_define_native(vm, boolean, "not", vm_bool_not);
+	vm_define_native(vm, boolean, "&", vm_bool_and);
+	vm_define_native(vm, boolean, "|", vm_bool_or);
+	vm_define_native(vm, boolean, "and:", vm_bool_and_block);
+	vm_define_native(vm, boolean, "or:", vm_bool_or_block);
+	vm_define_native(vm, boolean, "ifTrue:", vm_bool_if_true);
+	vm_define_native(vm, boolean, "ifFalse:", vm_bool_if_false);
+	vm_define_native(vm, boolean, "ifTrue:ifFalse:", vm_bool_if_true_if_false);
+	vm_define_native(vm, boolean, "ifFalse:ifTrue:", vm_bool_if_false_if_true);
+	
+	object_id string = vm_make_proto(vm, "String", root);
+	vm->protos[OCLS_SSTR] = string;
+	vm->protos[OCLS_STRING] = string;
+	vm_define_native(vm, string, ",", vm_number_binary);
+	vm_define_native(vm, string, "size", vm_string_size);
+	vm_define_native(vm, string, "printString", vm_string_print_string);
+	
+	object_id block = vm_make_proto(vm, "Block", root);
+	vm->protos[OCLS_BLOCK] = block;
+	vm->protos[OCLS_SBLOCK] = block;
+	vm_define_native(vm, block, "value", vm_block_value);
+	vm_define_native(vm, block, "value:", vm_block_value);
+	vm_define_native(vm, block, "value:value:", vm_block_value);
+	vm_define_native(vm, block, "value:value:value:", vm_block_value);
+	vm_define_native(vm, block, "numArgs", vm_block_num_args);
+	vm_define_native(vm, block, "whileTrue:", vm_block_while_true);
+	vm_define_native(vm, block, "whileFalse:", vm_block_while_false);
+	
+	object_id array = vm_make_proto(vm, "Array", root);
+	vm->protos[OCLS_ARRAY] = array;
+	vm_define_native(vm, array, "new", vm_array_new_native);
+	vm_define_native(vm, array, "new:", vm_array_new_native);
+	vm_define_native(vm, array, "at:", vm_array_at);
+	vm_define_native(vm, array, "at:put:", vm_array_at_put);
+	vm_define_native(vm, array, "add:", vm_array_add);
+	vm_define_native(vm, array, "size", vm_array_size);
+	vm_define_native(vm, array, "do:", vm_array_do);
+	
+	object_id dict = vm_make_proto(vm, "Dictionary", root);
+	vm->protos[OCLS_DICT] = dict;
+	vm_define_native(vm, dict, "new", vm_dict_new);
+	vm_define_native(vm, dict, "at:", vm_dict_at);
+	vm_define_native(vm, dict, "at:put:", vm_dict_at_put);
+	vm_define_native(vm, dict, "removeKey:", vm_dict_remove_key);
+	vm_define_native(vm, dict, "includesKey:", vm_dict_includes_key);
+	vm_define_native(vm, dict, "size", vm_dict_size);
+	
+	object_id packed = vm_make_proto(vm, "PackedArray", root);
+	vm->protos[OCLS_PACKED] = packed;
+	vm_define_native(vm, packed, "newWithStride:length:", vm_packed_new_native);
+	vm_define_native(vm, packed, "size", vm_packed_size);
+	vm_define_native(vm, packed, "byteAt:", vm_packed_byte_at);
+	vm_define_native(vm, packed, "byteAt:put:", vm_packed_byte_at_put);
+	vm_define_native(vm, packed, "floatAt:", vm_packed_float_at);
+	vm_define_native(vm, packed, "floatAt:put:", vm_packed_float_at_put);
+	
+	vm->protos[OCLS_METHOD] = vm_make_proto(vm, "Method", root);
+	vm->protos[OCLS_NATIVE] = vm->protos[OCLS_METHOD];
+	
+	vm_define_native(vm, root, "packed", vm_object_packed);
+	vm_define_native(vm, packed, "unpacked", vm_packed_unpacked);
+}
@@ -0,0 +1,741 @@
+/**
+ * Packing values into a compact binary format
+ *
+ * The pack format is for saving state and sending it over the network. It
+ * only holds data: numbers, strings, arrays, dictionaries, packed arrays and
+ * script objects with their fields. Script objects that are globals, like
+ * prototypes, are written by name, so no methods are packed and whoever
+ * unpacks needs the same scripts loaded. Each value is a tag byte followed
+ * by:
+ *
+ *     nil, false, true  nothing
+ *     integer           the value, zigzag encoded
+ *     float             its bits, byte swapped so the zeros of round numbers
+ *                       come first and are dropped by the varint
+ *     string            size, then the bytes
+ *     string ref        number of a string written before
+ *     array             length, then each element
+ *     dictionary        count, then each key and value
+ *     packed array      stride, length, then the data
+ *     object            prototype, number of fields, then each name and value
+ *     global            name of the global, as a string
+ *     ref               number of a heap object written before
+ *     external          number the packer's external callback gave
+ *
+ * Numbers are varints: 7 bits per byte, low bits first, with the top bit set
+ * on every byte but the last. Strings, and heap objects other than strings,
+ * are numbered in the order they are first written, which the unpacker
+ * follows, so something referred to twice is written once and cycles come
+ * out right. A writer that knows what it's writing, like the Universe, puts
+ * its own numbers around values with vm_pack_uint() rather than building a
+ * Dictionary to pack.
+ */
+
+#include <string.h>
+
+#include "common.h"
+#include "vm.h"
+
+enum {
+	VM_PACK_NIL,
+	VM_PACK_FALSE,
+	VM_PACK_TRUE,
+	VM_PACK_INTEGER,
+	VM_PACK_FLOAT,
+	VM_PACK_STRING,
+	VM_PACK_STRING_REF,
+	VM_PACK_ARRAY,
+	VM_PACK_DICT,
+	VM_PACK_PACKED,
+	VM_PACK_OBJECT,
+	VM_PACK_GLOBAL,
+	VM_PACK_REF,
+	VM_PACK_EXTERNAL,
+};
+
+// Values can't be nested deeper than this either way, so that bad data can't
+// run the stack out
+#define VM_PACK_MAX_DEPTH 1000
+
+// Packing
+
+void vm_packer_init(vm_packer *this, vm_context vm, DgMemoryStream *stream) {
+	memset(this, 0, sizeof *this);
+	this->vm = vm;
+	this->stream = stream;
+	vm_map_init(&this->strings);
+	vm_map_init(&this->objects);
+	vm_map_init(&this->globals);
+}
+
+void vm_packer_free(vm_packer *this) {
+	vm_map_free(this->vm, &this->strings);
+	vm_map_free(this->vm, &this->objects);
+	vm_map_free(this->vm, &this->globals);
+}
+
+void vm_packer_reset(vm_packer *this) {
+	/**
+	 * Forget the strings and objects written so far, so that what's written
+	 * next can be unpacked on its own. The globals found are kept until a
+	 * global is set.
+	 */
+	
+	vm_map_free(this->vm, &this->strings);
+	vm_map_free(this->vm, &this->objects);
+	this->string_count = 0;
+	this->object_count = 0;
+	this->error = NULL;
+}
+
+static size_t vm_pack_varint(uint8_t *bytes, uint64_t value) {
+	size_t size = 0;
+	
+	while (value >= 0x80) {
+		bytes[size++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	
+	bytes[size++] = value;
+	
+	return size;
+}
+
+static uint64_t vm_pack_zigzag(int64_t value) {
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static void vm_pack_tag(vm_packer *this, uint8_t tag) {
+	DgMemoryStreamWrite(this->stream, 1, &tag);
+}
+
+static void vm_pack_tagged(vm_packer *this, uint8_t tag, uint64_t value) {
+	uint8_t bytes[11];
+	
+	bytes[0] = tag;
+	DgMemoryStreamWrite(this->stream, 1 + vm_pack_varint(bytes + 1, value), bytes);
+}
+
+void vm_pack_uint(vm_packer *this, uint64_t value) {
+	uint8_t bytes[10];
+	
+	DgMemoryStreamWrite(this->stream, vm_pack_varint(bytes, value), bytes);
+}
+
+void vm_pack_int(vm_packer *this, int64_t value) {
+	vm_pack_uint(this, vm_pack_zigzag(value));
+}
+
+static bool vm_pack_fail(vm_packer *this, const char *error) {
+	if (!this->error) {
+		this->error = error;
+	}
+	
+	return false;
+}
+
+static bool vm_pack_string(vm_packer *this, object_id string) {
+	object_id *number = vm_map_find(&this->strings, string);
+	
+	if (number) {
+		vm_pack_tagged(this, VM_PACK_STRING_REF, GET_OBJID_VAL(*number));
+		return true;
+	}
+	
+	char aux[8];
+	size_t size;
+	const char *data = vm_tolcstring(this->vm, string, aux, &size);
+	
+	if (!data || !vm_map_put(this->vm, &this->strings, string, MAKE_OBJID(OCLS_SINT, this->string_count))) {
+		return vm_pack_fail(this, "Out of memory");
+	}
+	
+	this->string_count++;
+	vm_pack_tagged(this, VM_PACK_STRING, size);
+	DgMemoryStreamWrite(this->stream, size, data);
+	
+	return true;
+}
+
+static bool vm_pack_remember(vm_packer *this, object_id object) {
+	/**
+	 * Give a heap object the next number, for later references to it
+	 */
+	
+	if (!vm_map_put(this->vm, &this->objects, object, MAKE_OBJID(OCLS_SINT, this->object_count))) {
+		return vm_pack_fail(this, "Out of memory");
+	}
+	
+	this->object_count++;
+	
+	if (this->depth >= VM_PACK_MAX_DEPTH) {
+		return vm_pack_fail(this, "Too deeply nested to pack");
+	}
+	
+	return true;
+}
+
+static bool vm_pack_find_globals(vm_packer *this) {
+	/**
+	 * Map every script object that is the value of a global to its name. The
+	 * first name found wins when one has several. Objects that stopped being
+	 * globals since it was last done are dropped.
+	 */
+	
+	vm_map *globals = &this->vm->globals;
+	
+	vm_map_free(this->vm, &this->globals);
+	
+	for (uint32_t i = 0; i < globals->capacity; i++) {
+		object_id name = globals->pairs[2 * i];
+		object_id value = globals->pairs[2 * i + 1];
+		object_hd *header = vm_lookup(this->vm, value);
+		
+		if (name == OID_NIL || name == VM_MAP_DELETED || !header || GET_OBJID_CLS(header->type) != OCLS_ID) {
+			continue;
+		}
+		
+		if (!vm_map_find(&this->globals, value) && !vm_map_put(this->vm, &this->globals, value, name)) {
+			return vm_pack_fail(this, "Out of memory");
+		}
+	}
+	
+	this->globals_found = true;
+	this->globals_epoch = this->vm->globals_epoch;
+	
+	return true;
+}
+
+static bool vm_pack_heap(vm_packer *this, object_hd *header) {
+	bool ok = true;
+	
+	switch (header->type) {
+		case OID_ARRAY: {
+			objt_array *array = (objt_array *) header;
+			
+			vm_pack_tagged(this, VM_PACK_ARRAY, array->length);
+			
+			for (size_t i = 0; ok && i < array->length; i++) {
+				ok = vm_pack_value(this, array->data[i]);
+			}
+			
+			break;
+		}
+		case OID_DICT: {
+			vm_map *map = &((objt_dict *) header)->map;
+			
+			vm_pack_tagged(this, VM_PACK_DICT, map->count);
+			
+			for (uint32_t i = 0; ok && i < map->capacity; i++) {
+				object_id key = map->pairs[2 * i];
+				
+				if (key != OID_NIL && key != VM_MAP_DELETED) {
+					ok = vm_pack_value(this, key) && vm_pack_value(this, map->pairs[2 * i + 1]);
+				}
+			}
+			
+			break;
+		}
+		case OID_PACKED_ARRAY: {
+			objt_packed *packed = (objt_packed *) header;
+			
+			vm_pack_tagged(this, VM_PACK_PACKED, packed->stride);
+			vm_pack_uint(this, packed->length);
+			DgMemoryStreamWrite(this->stream, packed->stride * packed->length, packed->data);
+			break;
+		}
+		default: {
+			return vm_pack_fail(this, "Methods and blocks can't be packed");
+		}
+	}
+	
+	return ok;
+}
+
+bool vm_pack_value(vm_packer *this, object_id value) {
+	/**
+	 * Write a value and everything it refers to
+	 *
+	 * @return false if something in it can't be packed, with the reason in
+	 * the packer's error
+	 */
+	
+	switch (GET_OBJID_CLS(value)) {
+		case OCLS_SINT: {
+			vm_pack_tagged(this, VM_PACK_INTEGER, vm_pack_zigzag(OBJID_SEXT(value)));
+			return true;
+		}
+		case OCLS_FLOAT: {
+			vm_pack_tagged(this, VM_PACK_FLOAT, __builtin_bswap64(GET_OBJID_VAL(value) << 3));
+			return true;
+		}
+		case OCLS_SSTR: {
+			return vm_pack_string(this, value);
+		}
+		case OCLS_BOOL: {
+			vm_pack_tag(this, (value == OID_TRUE) ? VM_PACK_TRUE : VM_PACK_FALSE);
+			return true;
+		}
+		case OCLS_ID: {
+			break;
+		}
+		default: {
+			return vm_pack_fail(this, "Blocks can't be packed");
+		}
+	}
+	
+	if (value == OID_NIL) {
+		vm_pack_tag(this, VM_PACK_NIL);
+		return true;
+	}
+	
+	object_hd *header = vm_lookup(this->vm, value);
+	uint64_t number;
+	
+	if (!header) {
+		return vm_pack_fail(this, "Not an object");
+	}
+	
+	if (header->type == OID_LONG_STRING) {
+		return vm_pack_string(this, value);
+	}
+	
+	if (this->external && this->external(this->context, value, &number)) {
+		vm_pack_tagged(this, VM_PACK_EXTERNAL, number);
+		return true;
+	}
+	
+	object_id *seen = vm_map_find(&this->objects, value);
+	
+	if (seen) {
+		vm_pack_tagged(this, VM_PACK_REF, GET_OBJID_VAL(*seen));
+		return true;
+	}
+	
+	if (GET_OBJID_CLS(header->type) == OCLS_ID) {
+		if ((!this->globals_found || this->globals_epoch != this->vm->globals_epoch) && !vm_pack_find_globals(this)) {
+			return false;
+		}
+		
+		object_id *name = vm_map_find(&this->globals, value);
+		
+		if (name) {
+			vm_pack_tag(this, VM_PACK_GLOBAL);
+			return vm_pack_string(this, *name);
+		}
+		
+		return vm_pack_object(this, value);
+	}
+	
+	if (!vm_pack_remember(this, value)) {
+		return false;
+	}
+	
+	this->depth++;
+	bool ok = vm_pack_heap(this, header);
+	this->depth--;
+	
+	return ok;
+}
+
+bool vm_pack_object(vm_packer *this, object_id object) {
+	/**
+	 * Write a script object's prototype and fields, even if it's a global or
+	 * the external callback would take it. This is for writing the objects
+	 * that the external numbers stand for.
+	 */
+	
+	object_hd *header = vm_lookup(this->vm, object);
+	
+	if (!header || GET_OBJID_CLS(header->type) != OCLS_ID) {
+		return vm_pack_fail(this, "Not a script object");
+	}
+	
+	objt_object *data = (objt_object *) header;
+	vm_map *fields = &data->fields;
+	
+	if (data->methods.count) {
+		return vm_pack_fail(this, "Objects with methods of their own can only be packed if they are globals");
+	}
+	
+	if (!vm_pack_remember(this, object)) {
+		return false;
+	}
+	
+	this->depth++;
+	vm_pack_tag(this, VM_PACK_OBJECT);
+	
+	bool ok = vm_pack_value(this, header->type);
+	
+	vm_pack_uint(this, fields->count);
+	
+	for (uint32_t i = 0; ok && i < fields->capacity; i++) {
+		object_id name = fields->pairs[2 * i];
+		
+		if (name != OID_NIL && name != VM_MAP_DELETED) {
+			ok = vm_pack_string(this, name) && vm_pack_value(this, fields->pairs[2 * i + 1]);
+		}
+	}
+	
+	this->depth--;
+	
+	return ok;
+}
+
+object_id vm_pack_bytes(vm_context vm, DgMemoryStream *stream) {
+	/**
+	 * Copy what was written to a stream since it was last rewound into a new
+	 * PackedArray of bytes, and rewind it
+	 *
+	 * @return The array, or nil if there isn't enough memory
+	 */
+	
+	const uint8_t *end = DgMemoryStreamGetHeadPointer(stream);
+	DgMemoryStreamRewind(stream);
+	const uint8_t *start = DgMemoryStreamGetHeadPointer(stream);
+	
+	object_id array = vm_packed_new(vm, 1, end - start);
+	uint8_t *data = vm_packed_data(vm, array, NULL, NULL);
+	
+	if (data) {
+		memcpy(data, start, end - start);
+	}
+	
+	return array;
+}
+
+// Unpacking
+
+void vm_unpacker_init(vm_unpacker *this, vm_context vm, const void *data, size_t size) {
+	memset(this, 0, sizeof *this);
+	this->vm = vm;
+	this->at = data;
+	this->end = this->at + size;
+}
+
+void vm_unpacker_free(vm_unpacker *this) {
+	DgMemoryFree(this->strings);
+	DgMemoryFree(this->objects);
+}
+
+static object_id vm_unpack_fail(vm_unpacker *this, const char *error) {
+	/**
+	 * Stop unpacking. Everything read after this is nil or zero.
+	 */
+	
+	if (!this->error) {
+		this->error = error;
+	}
+	
+	this->at = this->end;
+	
+	return OID_NIL;
+}
+
+static size_t vm_unpack_left(vm_unpacker *this) {
+	return this->end - this->at;
+}
+
+uint64_t vm_unpack_uint(vm_unpacker *this) {
+	uint64_t value = 0;
+	
+	for (unsigned shift = 0; shift < 64 && this->at < this->end; shift += 7) {
+		uint8_t byte = *this->at++;
+		
+		value |= (uint64_t) (byte & 0x7f) << shift;
+		
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+	
+	vm_unpack_fail(this, "Packed data is cut short");
+	
+	return 0;
+}
+
+int64_t vm_unpack_int(vm_unpacker *this) {
+	uint64_t value = vm_unpack_uint(this);
+	
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static bool vm_unpack_push(object_id **list, size_t *count, size_t *capacity, object_id value) {
+	if (*count == *capacity) {
+		size_t new_capacity = *capacity ? 2 * *capacity : 64;
+		object_id *new_list = DgMemoryReallocate(*list, sizeof *new_list * new_capacity);
+		
+		if (!new_list) {
+			return false;
+		}
+		
+		*list = new_list;
+		*capacity = new_capacity;
+	}
+	
+	(*list)[(*count)++] = value;
+	
+	return true;
+}
+
+static bool vm_unpack_remember(vm_unpacker *this, object_id object) {
+	if (object == OID_NIL || !vm_unpack_push(&this->objects, &this->object_count, &this->object_capacity, object)) {
+		vm_unpack_fail(this, "Out of memory");
+		return false;
+	}
+	
+	if (this->depth >= VM_PACK_MAX_DEPTH) {
+		vm_unpack_fail(this, "Packed data is too deeply nested");
+		return false;
+	}
+	
+	return true;
+}
+
+static object_id vm_unpack_string(vm_unpacker *this) {
+	uint64_t size = vm_unpack_uint(this);
+	
+	if (size > vm_unpack_left(this)) {
+		return vm_unpack_fail(this, "Packed data is cut short");
+	}
+	
+	object_id string = vm_tolstring(this->vm, (const char *) this->at, size);
+	
+	if (string == OID_NIL || !vm_unpack_push(&this->strings, &this->string_count, &this->string_capacity, string)) {
+		return vm_unpack_fail(this, "Out of memory");
+	}
+	
+	this->at += size;
+	
+	return string;
+}
+
+static bool vm_unpack_is_string(vm_unpacker *this, object_id value) {
+	object_hd *header = vm_lookup(this->vm, value);
+	
+	return GET_OBJID_CLS(value) == OCLS_SSTR || (header && header->type == OID_LONG_STRING);
+}
+
+static bool vm_unpack_fields(vm_unpacker *this, object_id object) {
+	/**
+	 * Read the prototype and fields of an object into it, replacing the ones
+	 * it had
+	 */
+	
+	objt_object *header = (objt_object *) vm_lookup(this->vm, object);
+	object_id proto = vm_unpack_value(this);
+	
+	// The prototype chain must not loop back to the object
+	for (object_id at = proto; at != OID_NIL && !this->error; ) {
+		object_hd *link = vm_lookup(this->vm, at);
+		
+		if (at == object || !link || GET_OBJID_CLS(link->type) != OCLS_ID) {
+			vm_unpack_fail(this, "Packed object has a bad prototype");
+		}
+		else {
+			at = link->type;
+		}
+	}
+	
+	uint64_t count = vm_unpack_uint(this);
+	
+	if (this->error || count > vm_unpack_left(this) / 2) {
+		vm_unpack_fail(this, "Packed data is cut short");
+		return false;
+	}
+	
+	vm_accquire(this->vm, proto);
+	vm_release(this->vm, header->header.type);
+	header->header.type = proto;
+	header->writes++;
+	vm_map_free(this->vm, &header->fields);
+	
+	for (uint64_t i = 0; i < count && !this->error; i++) {
+		object_id name = vm_unpack_value(this);
+		object_id value = vm_unpack_value(this);
+		
+		if (!this->error && !vm_unpack_is_string(this, name)) {
+			vm_unpack_fail(this, "Packed field name isn't a string");
+		}
+		else if (!this->error && !vm_map_put(this->vm, &header->fields, name, value)) {
+			vm_unpack_fail(this, "Out of memory");
+		}
+	}
+	
+	return !this->error;
+}
+
+static object_id vm_unpack_heap(vm_unpacker *this, uint8_t tag) {
+	vm_context vm = this->vm;
+	object_id object = OID_NIL;
+	uint64_t count = 0, stride = 0;
+	
+	switch (tag) {
+		case VM_PACK_ARRAY: {
+			count = vm_unpack_uint(this);
+			object = (count <= vm_unpack_left(this)) ? vm_array_new(vm, count) : OID_NIL;
+			break;
+		}
+		case VM_PACK_DICT: {
+			count = vm_unpack_uint(this);
+			object = (count <= vm_unpack_left(this) / 2) ? vm_alloc(vm, OID_DICT, sizeof(objt_dict)) : OID_NIL;
+			break;
+		}
+		case VM_PACK_PACKED: {
+			stride = vm_unpack_uint(this);
+			count = vm_unpack_uint(this);
+			object = (stride && count <= vm_unpack_left(this) / stride) ? vm_packed_new(vm, stride, count) : OID_NIL;
+			break;
+		}
+		case VM_PACK_OBJECT: {
+			object = vm_object_new(vm, OID_NIL);
+			break;
+		}
+	}
+	
+	if (this->error) {
+		return OID_NIL;
+	}
+	
+	if (!vm_unpack_remember(this, object)) {
+		return OID_NIL;
+	}
+	
+	this->depth++;
+	
+	switch (tag) {
+		case VM_PACK_ARRAY: {
+			for (uint64_t i = 0; i < count && !this->error; i++) {
+				object_id value = vm_unpack_value(this);
+				
+				if (!this->error && !vm_array_push(vm, object, value)) {
+					vm_unpack_fail(this, "Out of memory");
+				}
+			}
+			
+			break;
+		}
+		case VM_PACK_DICT: {
+			vm_map *map = &((objt_dict *) vm_lookup(vm, object))->map;
+			
+			vm_map_init(map);
+			
+			for (uint64_t i = 0; i < count && !this->error; i++) {
+				object_id key = vm_unpack_value(this);
+				object_id value = vm_unpack_value(this);
+				
+				if (!this->error && !vm_map_put(vm, map, key, value)) {
+					vm_unpack_fail(this, "Packed dictionary has a nil key");
+				}
+			}
+			
+			break;
+		}
+		case VM_PACK_PACKED: {
+			memcpy(vm_packed_data(vm, object, NULL, NULL), this->at, stride * count);
+			this->at += stride * count;
+			break;
+		}
+		case VM_PACK_OBJECT: {
+			vm_unpack_fields(this, object);
+			break;
+		}
+	}
+	
+	this->depth--;
+	
+	return this->error ? OID_NIL : object;
+}
+
+object_id vm_unpack_value(vm_unpacker *this) {
+	/**
+	 * Read the next value, making new objects for it
+	 *
+	 * @return The value, or nil with the reason in the unpacker's error if the
+	 * data isn't valid
+	 */
+	
+	if (this->at == this->end) {
+		return vm_unpack_fail(this, "Packed data is cut short");
+	}
+	
+	uint8_t tag = *this->at++;
+	uint64_t number;
+	
+	switch (tag) {
+		case VM_PACK_NIL: {
+			return OID_NIL;
+		}
+		case VM_PACK_FALSE: {
+			return OID_FALSE;
+		}
+		case VM_PACK_TRUE: {
+			return OID_TRUE;
+		}
+		case VM_PACK_INTEGER: {
+			return MAKE_OBJID(OCLS_SINT, vm_unpack_int(this));
+		}
+		case VM_PACK_FLOAT: {
+			return MAKE_OBJID(OCLS_FLOAT, __builtin_bswap64(vm_unpack_uint(this)) >> 3);
+		}
+		case VM_PACK_STRING: {
+			return vm_unpack_string(this);
+		}
+		case VM_PACK_STRING_REF: {
+			number = vm_unpack_uint(this);
+			return (number < this->string_count) ? this->strings[number] : vm_unpack_fail(this, "Packed data refers to a string it doesn't have");
+		}
+		case VM_PACK_REF: {
+			number = vm_unpack_uint(this);
+			return (number < this->object_count) ? this->objects[number] : vm_unpack_fail(this, "Packed data refers to an object it doesn't have");
+		}
+		case VM_PACK_EXTERNAL: {
+			number = vm_unpack_uint(this);
+			object_id value = (this->external && !this->error) ? this->external(this->context, number) : OID_NIL;
+			return (value != OID_NIL) ? value : vm_unpack_fail(this, "Packed data refers to an object outside it that isn't there");
+		}
+		case VM_PACK_GLOBAL: {
+			object_id value = vm_get_global(this->vm, vm_unpack_value(this));
+			return (value != OID_NIL) ? value : vm_unpack_fail(this, "Packed data refers to a global that isn't there");
+		}
+		case VM_PACK_ARRAY:
+		case VM_PACK_DICT:
+		case VM_PACK_PACKED:
+		case VM_PACK_OBJECT: {
+			return vm_unpack_heap(this, tag);
+		}
+		default: {
+			return vm_unpack_fail(this, "Packed data isn't valid");
+		}
+	}
+}
+
+bool vm_unpack_object(vm_unpacker *this, object_id object) {
+	/**
+	 * Read an object written with vm_pack_object() into an existing script
+	 * object, replacing its prototype and fields, so that references to it
+	 * stay good
+	 */
+	
+	object_hd *header = vm_lookup(this->vm, object);
+	
+	if (!header || GET_OBJID_CLS(header->type) != OCLS_ID) {
+		vm_unpack_fail(this, "Not a script object");
+		return false;
+	}
+	
+	if (this->at == this->end || *this->at++ != VM_PACK_OBJECT) {
+		vm_unpack_fail(this, "Packed data isn't an object");
+		return false;
+	}
+	
+	if (!vm_unpack_remember(this, object)) {
+		return false;
+	}
+	
+	this->depth++;
+	bool ok = vm_unpack_fields(this, object);
+	this->depth--;
+	
+	return ok;
+}
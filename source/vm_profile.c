@@ -0,0 +1,418 @@
+/**
+ * Sampling profiler for script code
+ *
+ * A SIGPROF timer interrupts the thread running scripts at a fixed rate of
+ * its CPU time, and the handler copies the chain of bytecode frames into a
+ * ring of samples. Nothing else is safe to do from a signal handler, so the
+ * frames are only named and counted later by vm_profile_collect(), which
+ * has to run while no script is running and before vm_collect() could free
+ * the methods that were sampled.
+ *
+ * The output is in the "collapsed stack" format that flame graph tools read:
+ * one line per distinct stack, with frames from outermost to innermost
+ * separated by semicolons, followed by the number of samples.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+#include "common.h"
+#include "vm.h"
+
+#define VM_PROFILE_DEPTH 48
+#define VM_PROFILE_SAMPLES 1024
+
+typedef struct {
+	uint32_t depth;  // Frames kept, innermost last
+	bool truncated;  // Outer frames were left out
+	objt_method *methods[VM_PROFILE_DEPTH];
+	object_id receivers[VM_PROFILE_DEPTH];
+} vm_profile_sample;
+
+typedef struct {
+	char *stack;
+	uint64_t hash;
+	size_t count;
+} vm_profile_entry;
+
+// The timer and the signal are per process, so there is only one profiler
+static struct {
+	vm_context vm;
+	
+	// Filled by the signal handler and drained by vm_profile_collect()
+	vm_profile_sample samples[VM_PROFILE_SAMPLES];
+	size_t head;
+	size_t tail;
+	size_t dropped;
+	
+	// Counts for each distinct stack, open addressed by hash
+	vm_profile_entry *entries;
+	size_t entry_count;
+	size_t entry_capacity;
+	
+	struct sigaction previous;
+#ifdef __linux__
+	timer_t timer;
+#endif
+} gVmProfile;
+
+static void vm_profile_signal(int signal) {
+	/**
+	 * Take a sample of the frames that are running. This interrupts the
+	 * script thread, so the frames can't change while they are copied, and
+	 * vm_push_frame() only counts a frame once it's filled in.
+	 */
+	
+	vm_context vm = gVmProfile.vm;
+	size_t head = gVmProfile.head;
+	
+	if (!vm) {
+		return;
+	}
+	
+	if (head - __atomic_load_n(&gVmProfile.tail, __ATOMIC_ACQUIRE) >= VM_PROFILE_SAMPLES) {
+		gVmProfile.dropped++;
+		return;
+	}
+	
+	vm_profile_sample *sample = &gVmProfile.samples[head % VM_PROFILE_SAMPLES];
+	size_t count = vm->task.frame_count;
+	size_t first = (count > VM_PROFILE_DEPTH) ? count - VM_PROFILE_DEPTH : 0;
+	
+	__atomic_signal_fence(__ATOMIC_ACQUIRE);
+	
+	for (size_t i = first; i < count; i++) {
+		sample->methods[i - first] = vm->task.frames[i].method;
+		sample->receivers[i - first] = vm->task.frames[i].base[0];
+	}
+	
+	sample->depth = count - first;
+	sample->truncated = (first != 0);
+	
+	__atomic_store_n(&gVmProfile.head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool vm_profile_start(vm_context vm, unsigned rate) {
+	/**
+	 * Start sampling the scripts running in a VM. This must be called from
+	 * the thread that runs scripts, since only its CPU time is sampled.
+	 *
+	 * @param vm VM to profile
+	 * @param rate Samples per second of CPU time
+	 * @return If profiling started; it fails if a VM is already being profiled
+	 */
+	
+	if (gVmProfile.vm || !rate) {
+		return false;
+	}
+	
+	gVmProfile.head = 0;
+	gVmProfile.tail = 0;
+	gVmProfile.dropped = 0;
+	
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = vm_profile_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	
+	if (sigaction(SIGPROF, &action, &gVmProfile.previous)) {
+		return false;
+	}
+	
+	gVmProfile.vm = vm;
+	
+	long interval = (rate >= 1000000) ? 1000 : 1000000000L / rate;
+
+#ifdef __linux__
+	// Deliver the signal to this thread and count only its CPU time, so that
+	// samples are never taken in the middle of the renderer or driver threads
+	struct sigevent event;
+	memset(&event, 0, sizeof event);
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = syscall(SYS_gettid);
+	
+	clockid_t clock;
+	struct itimerspec timer = {{0, interval}, {0, interval}};
+	
+	if (pthread_getcpuclockid(pthread_self(), &clock) || timer_create(clock, &event, &gVmProfile.timer)) {
+		goto fail;
+	}
+	
+	if (timer_settime(gVmProfile.timer, 0, &timer, NULL)) {
+		timer_delete(gVmProfile.timer);
+		goto fail;
+	}
+#else
+	struct itimerval timer = {{0, interval / 1000}, {0, interval / 1000}};
+	
+	if (setitimer(ITIMER_PROF, &timer, NULL)) {
+		goto fail;
+	}
+#endif
+
+	return true;
+
+fail:
+	gVmProfile.vm = NULL;
+	sigaction(SIGPROF, &gVmProfile.previous, NULL);
+	return false;
+}
+
+static const char *vm_profile_owner(vm_context vm, objt_method *method, object_id receiver, char *buffer, size_t size) {
+	/**
+	 * Find the name of the object a sampled method was defined on, by
+	 * walking the prototype chain from the receiver. For blocks and methods
+	 * that were replaced since, this is the receiver's name.
+	 */
+	
+	uint64_t cls = GET_OBJID_CLS(receiver);
+	object_hd *header = vm_lookup(vm, receiver);
+	object_id start = receiver, owner = OID_NIL;
+	
+	if (cls != OCLS_ID) {
+		start = vm->protos[cls];
+	}
+	else if (!header) {
+		start = vm->protos[0];
+	}
+	else if (GET_OBJID_CLS(header->type) == OCLS_PRIM) {
+		start = vm->protos[GET_OBJID_VAL(header->type)];
+	}
+	
+	for (object_id object = start; method->selector != OID_NIL && (header = vm_lookup(vm, object)) && GET_OBJID_CLS(header->type) == OCLS_ID; object = header->type) {
+		object_id *found = vm_map_find(&((objt_object *) header)->methods, method->selector);
+		
+		if (found) {
+			owner = (vm_lookup(vm, *found) == &method->header) ? object : OID_NIL;
+			break;
+		}
+	}
+	
+	owner = (owner != OID_NIL) ? owner : start;
+	
+	// Prototypes made in scripts are usually only named by the global they
+	// are stored in, and would otherwise show up with their parent's name
+	object_id name_key = vm_intern(vm, "name");
+	object_id name = OID_NIL;
+	objt_object *object = (objt_object *) vm_lookup(vm, owner);
+	object_id *field = (object && GET_OBJID_CLS(object->header.type) == OCLS_ID) ? vm_map_find(&object->fields, name_key) : NULL;
+	
+	if (field) {
+		name = *field;
+	}
+	
+	for (uint32_t i = 0; name == OID_NIL && i < vm->globals.capacity; i++) {
+		object_id key = vm->globals.pairs[2 * i];
+		
+		if (key != OID_NIL && key != VM_MAP_DELETED && vm->globals.pairs[2 * i + 1] == owner) {
+			name = key;
+		}
+	}
+	
+	if (name == OID_NIL) {
+		name = vm_get_field(vm, owner, name_key);
+	}
+	
+	const char *string = vm_tocstring(vm, name, buffer);
+	
+	if (string && string != buffer) {
+		snprintf(buffer, size, "%s", string);
+	}
+	
+	return string ? buffer : "?";
+}
+
+static size_t vm_profile_label(vm_context vm, objt_method *method, object_id receiver, char *buffer, size_t size) {
+	/**
+	 * Write the label for a frame, like "Main>>tick:" or "Main>>[]@12" for
+	 * a block, without the characters the output format uses
+	 */
+	
+	char owner[64], aux[8];
+	const char *selector = vm_tocstring(vm, method->selector, aux);
+	int length;
+	
+	vm_profile_owner(vm, method, receiver, owner, sizeof owner);
+	
+	if (selector) {
+		length = snprintf(buffer, size, "%s>>%s", owner, selector);
+	}
+	else {
+		length = snprintf(buffer, size, "%s>>[]@%u", owner, method->line);
+	}
+	
+	length = (length < 0) ? 0 : ((size_t) length >= size) ? (int) size - 1 : length;
+	
+	for (int i = 0; i < length; i++) {
+		if (buffer[i] == ';' || buffer[i] == ' ' || buffer[i] == '\n') {
+			buffer[i] = '_';
+		}
+	}
+	
+	return length;
+}
+
+static bool vm_profile_count(const char *stack, size_t length) {
+	/**
+	 * Add one sample to the count of a stack
+	 */
+	
+	if (gVmProfile.entry_count * 2 >= gVmProfile.entry_capacity) {
+		size_t capacity = gVmProfile.entry_capacity ? gVmProfile.entry_capacity * 2 : 256;
+		vm_profile_entry *entries = DgMemoryAllocate(sizeof *entries * capacity);
+		
+		if (!entries) {
+			return false;
+		}
+		
+		memset(entries, 0, sizeof *entries * capacity);
+		
+		for (size_t i = 0; i < gVmProfile.entry_capacity; i++) {
+			vm_profile_entry *entry = &gVmProfile.entries[i];
+			
+			if (entry->stack) {
+				size_t at = entry->hash & (capacity - 1);
+				
+				while (entries[at].stack) {
+					at = (at + 1) & (capacity - 1);
+				}
+				
+				entries[at] = *entry;
+			}
+		}
+		
+		DgMemoryFree(gVmProfile.entries);
+		gVmProfile.entries = entries;
+		gVmProfile.entry_capacity = capacity;
+	}
+	
+	uint64_t hash = vm_hash_bytes(stack, length);
+	size_t at = hash & (gVmProfile.entry_capacity - 1);
+	vm_profile_entry *entry;
+	
+	while ((entry = &gVmProfile.entries[at])->stack) {
+		if (entry->hash == hash && !strcmp(entry->stack, stack)) {
+			entry->count++;
+			return true;
+		}
+		
+		at = (at + 1) & (gVmProfile.entry_capacity - 1);
+	}
+	
+	entry->stack = DgMemoryAllocate(length + 1);
+	
+	if (!entry->stack) {
+		return false;
+	}
+	
+	memcpy(entry->stack, stack, length + 1);
+	entry->hash = hash;
+	entry->count = 1;
+	gVmProfile.entry_count++;
+	
+	return true;
+}
+
+void vm_profile_collect(vm_context vm) {
+	/**
+	 * Count the samples taken since the last call. Call this regularly, like
+	 * once a frame, from the script thread while no script is running and
+	 * before vm_collect().
+	 */
+	
+	if (gVmProfile.vm != vm) {
+		return;
+	}
+	
+	size_t head = __atomic_load_n(&gVmProfile.head, __ATOMIC_ACQUIRE);
+	char stack[4096];
+	
+	for (; gVmProfile.tail != head; __atomic_store_n(&gVmProfile.tail, gVmProfile.tail + 1, __ATOMIC_RELEASE)) {
+		vm_profile_sample *sample = &gVmProfile.samples[gVmProfile.tail % VM_PROFILE_SAMPLES];
+		size_t length = snprintf(stack, sizeof stack, "%s", sample->depth ? (sample->truncated ? "..." : "") : "(engine)");
+		
+		for (uint32_t i = 0; i < sample->depth && length < sizeof stack - 2; i++) {
+			if (length) {
+				stack[length++] = ';';
+			}
+			
+			length += vm_profile_label(vm, sample->methods[i], sample->receivers[i], stack + length, sizeof stack - length);
+		}
+		
+		vm_profile_count(stack, length);
+	}
+}
+
+bool vm_profile_stop(vm_context vm, const char *path) {
+	/**
+	 * Stop profiling and write the counts of every stack that was sampled
+	 *
+	 * @param vm VM being profiled
+	 * @param path File to write the collapsed stacks to, or NULL to discard them
+	 * @return If the profile was written
+	 */
+	
+	if (gVmProfile.vm != vm) {
+		return false;
+	}
+
+#ifdef __linux__
+	timer_delete(gVmProfile.timer);
+#else
+	setitimer(ITIMER_PROF, &(struct itimerval) {{0, 0}, {0, 0}}, NULL);
+#endif
+
+	vm_profile_collect(vm);
+	
+	gVmProfile.vm = NULL;
+	sigaction(SIGPROF, &gVmProfile.previous, NULL);
+	
+	FILE *file = path ? fopen(path, "w") : NULL;
+	size_t total = 0;
+	
+	for (size_t i = 0; i < gVmProfile.entry_capacity; i++) {
+		vm_profile_entry *entry = &gVmProfile.entries[i];
+		
+		if (entry->stack) {
+			if (file) {
+				fprintf(file, "%s %zu\n", entry->stack, entry->count);
+			}
+			
+			total += entry->count;
+			DgMemoryFree(entry->stack);
+		}
+	}
+	
+	DgMemoryFree(gVmProfile.entries);
+	gVmProfile.entries = NULL;
+	gVmProfile.entry_count = 0;
+	gVmProfile.entry_capacity = 0;
+	
+	if (gVmProfile.dropped) {
+		DgLog(DG_LOG_WARNING, "Profiler dropped %zu samples, collect them more often", gVmProfile.dropped);
+	}
+	
+	if (path && (!file || fclose(file))) {
+		DgLog(DG_LOG_ERROR, "Failed to write profile: %s", path);
+		return false;
+	}
+	
+	if (path) {
+		DgLog(DG_LOG_INFO, "Wrote %zu profile samples to %s", total, path);
+	}
+	
+	return path != NULL;
+}